@@ -27,6 +27,7 @@
 #include <monkey/mk_socket.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_reload.h>
 #include <monkey/mk_http.h>
 #include <monkey/mk_socket.h>
 #include <monkey/mk_kernel.h>
@@ -23,6 +23,7 @@
 #define MK_CLOCK_H
 
 #include <time.h>
+#include <stdint.h>
 #include <monkey/mk_core.h>
 
 extern time_t log_current_utime;
@@ -38,6 +39,15 @@ pthread_t mk_clock_tid;
 #define HEADER_TIME_BUFFER_SIZE 64
 #define LOG_TIME_BUFFER_SIZE 30
 
+/* Monotonic clock in nanoseconds, used to measure request latencies */
+static inline uint64_t mk_clock_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
 void *mk_clock_worker_init(void *args);
 void mk_clock_set_time(void);
 void mk_clock_sequential_init();
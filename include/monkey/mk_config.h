@@ -106,9 +106,8 @@ struct mk_server_config
 
     struct mk_list *index_files;
 
-    /* configured host quantity */
-    int nhosts;
-    struct mk_list hosts;
+    /* virtual hosts and mime types, see mk_reload.h */
+    struct mk_config_gen *gen;
 
     mode_t open_flags;
     struct mk_list plugins;
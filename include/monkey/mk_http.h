@@ -172,6 +172,8 @@ static inline int mk_http_status_completed(struct mk_http_session *cs,
     return 0;
 }
 
+void mk_http_error_pages_init();
+void mk_http_error_pages_free();
 int mk_http_error(int http_status, struct mk_http_session *cs,
                       struct mk_http_request *sr);
 
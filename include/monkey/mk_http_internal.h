@@ -160,11 +160,18 @@ struct mk_http_request
     /* Static file information */
     struct file_info file_info;
 
+    /* Monotonic time (nsec) when the request was completely parsed */
+    uint64_t init_ns;
+
+    /* Monotonic time (nsec) when the first response byte was written */
+    uint64_t first_byte_ns;
+
     /* Vhost */
     int vhost_fdt_id;
     unsigned int vhost_fdt_hash;
     int vhost_fdt_enabled;
 
+    struct mk_config_gen *gen;        /* configuration in use */
     struct host       *host_conf;     /* root vhost config */
     struct host_alias *host_alias;    /* specific vhost matched */
 
@@ -0,0 +1,122 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_LATENCY_H
+#define MK_LATENCY_H
+
+#include <stdint.h>
+
+/*
+ * Request latency histograms
+ * ==========================
+ * Every worker owns a set of log-linear histograms (HDR style): values
+ * are grouped by their most significant bit and each group is split in
+ * linear sub-buckets, so the relative error is bounded (~6% with 5 sub
+ * bucket bits) while the memory used is constant.
+ *
+ * The owner worker is the only writer, readers (cheetah, stats plugin)
+ * merge the workers histograms on demand using relaxed loads, so there
+ * are no locks nor atomic read-modify-write on the hot path.
+ */
+#define MK_LATENCY_SUB_BITS     5
+#define MK_LATENCY_SUB_COUNT    (1 << MK_LATENCY_SUB_BITS)
+#define MK_LATENCY_SUB_HALF     (MK_LATENCY_SUB_COUNT >> 1)
+#define MK_LATENCY_MAX_BITS     40   /* ~18 minutes in nanoseconds */
+#define MK_LATENCY_MAX_VALUE    ((1ULL << MK_LATENCY_MAX_BITS) - 1)
+#define MK_LATENCY_BUCKETS                                              \
+    ((MK_LATENCY_MAX_BITS - MK_LATENCY_SUB_BITS + 1) * MK_LATENCY_SUB_HALF \
+     + MK_LATENCY_SUB_HALF)
+
+/* Measured intervals */
+#define MK_LATENCY_PARSE        0   /* accept -> request parsed           */
+#define MK_LATENCY_FIRST_BYTE   1   /* request parsed -> first byte sent  */
+#define MK_LATENCY_LAST_BYTE    2   /* request parsed -> last byte sent   */
+#define MK_LATENCY_TYPES        3
+
+struct mk_latency_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[MK_LATENCY_BUCKETS];
+};
+
+struct mk_latency {
+    struct mk_latency_histogram h[MK_LATENCY_TYPES];
+};
+
+/* Summary of a merged histogram, values in nanoseconds */
+struct mk_latency_summary {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+static inline int mk_latency_bucket(uint64_t value)
+{
+    int msb;
+    int shift;
+
+    if (value > MK_LATENCY_MAX_VALUE) {
+        value = MK_LATENCY_MAX_VALUE;
+    }
+
+    if (value < MK_LATENCY_SUB_COUNT) {
+        return value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - MK_LATENCY_SUB_BITS + 1;
+
+    return (shift * MK_LATENCY_SUB_HALF) + (value >> shift);
+}
+
+/* Record a value, must be called only by the histogram owner */
+static inline void mk_latency_add(struct mk_latency_histogram *h,
+                                  uint64_t value)
+{
+    int i;
+
+    i = mk_latency_bucket(value);
+    __atomic_store_n(&h->buckets[i], h->buckets[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+
+    if (h->count == 0 || value < h->min) {
+        __atomic_store_n(&h->min, value, __ATOMIC_RELAXED);
+    }
+    if (value > h->max) {
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+const char *mk_latency_name(int type);
+struct mk_latency *mk_latency_create();
+void mk_latency_destroy(struct mk_latency *lat);
+void mk_latency_record(int type, uint64_t value);
+int mk_latency_merge(int type, struct mk_latency_histogram *out);
+uint64_t mk_latency_percentile(struct mk_latency_histogram *h, double p);
+int mk_latency_summary(int type, struct mk_latency_summary *s);
+
+#endif
@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_METRICS_H
+#define MK_METRICS_H
+
+#include <stdint.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Worker metrics
+ * ==============
+ * Plain event counters owned by each worker. Every worker allocates its
+ * own block aligned and padded to a cache line, so two workers never
+ * write on the same line. Only the owner writes (relaxed stores, no
+ * read-modify-write), readers sum all the workers at scrape time.
+ */
+#define MK_METRICS_STATUS_1XX        0
+#define MK_METRICS_STATUS_2XX        1
+#define MK_METRICS_STATUS_3XX        2
+#define MK_METRICS_STATUS_4XX        3
+#define MK_METRICS_STATUS_5XX        4
+#define MK_METRICS_BYTES_SENT        5
+#define MK_METRICS_PARSER_ERRORS     6
+#define MK_METRICS_TIMEOUTS          7
+#define MK_METRICS_FDT_HITS          8
+#define MK_METRICS_FDT_MISSES        9
+#define MK_METRICS_CACHE_HITS       10   /* GMT date text cache */
+#define MK_METRICS_CACHE_MISSES     11
+#define MK_METRICS_TLS_HANDSHAKES   12
+#define MK_METRICS_COUNTERS         13
+
+struct mk_metrics {
+    uint64_t counter[MK_METRICS_COUNTERS];
+} MK_CACHELINE_ALIGNED;
+
+const char *mk_metrics_name(int id);
+struct mk_metrics *mk_metrics_create();
+void mk_metrics_destroy(struct mk_metrics *metrics);
+void mk_metrics_add(int id, uint64_t value);
+void mk_metrics_status(int status);
+uint64_t mk_metrics_worker(int worker, int id);
+uint64_t mk_metrics_total(int id);
+
+#endif
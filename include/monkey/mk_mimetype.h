@@ -27,23 +27,34 @@
 
 struct mimetype
 {
-    char *name;
-    mk_ptr_t type;
-    mk_ptr_t header_type;
+    char *name;                   /* extension, lower case */
+    int name_len;
+    unsigned int hash;
+    mk_ptr_t type;                /* 'type\r\n' */
+    mk_ptr_t header_type;         /* 'Content-Type: type\r\n' */
+    int compressible;             /* text like content */
     struct mk_list _head;
-    struct rb_node _rb_head;
 };
 
-/* Head for RBT */
-struct mk_list mimetype_list;
-struct rb_root mimetype_rb_head;
-
-extern struct mimetype *mimetype_default;
+/*
+ * Mime types of a configuration generation, see mk_reload.h. The entries
+ * are indexed by extension in an open addressing table, at most half full.
+ */
+struct mk_mimetype_table
+{
+    struct mk_list list;
+    struct mimetype **slots;
+    unsigned int mask;            /* slots - 1, a power of 2 */
+    int n;
+    struct mimetype *def;         /* DefaultMimeType */
+};
 
-int mk_mimetype_add(char *name, const char *type);
-void mk_mimetype_read_config(void);
-struct mimetype *mk_mimetype_find(mk_ptr_t * filename);
+int mk_mimetype_add(struct mk_mimetype_table *table,
+                    char *name, const char *type);
+struct mk_mimetype_table *mk_mimetype_read_config(void);
+struct mimetype *mk_mimetype_find(struct mk_mimetype_table *table,
+                                  mk_ptr_t *filename);
 struct mimetype *mk_mimetype_lookup(char *name);
-void mk_mimetype_free_all();
+void mk_mimetype_free_all(struct mk_mimetype_table *table);
 
 #endif
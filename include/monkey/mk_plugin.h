@@ -99,6 +99,8 @@ struct plugin_api
     int (*socket_read) (int, void *, int);
     int (*socket_send_file) (int, int, off_t *, size_t);
     int (*socket_ip_str) (int, char **, int, unsigned long *);
+    int (*socket_addr_str) (union mk_socket_addr *, char **, int,
+                            unsigned long *);
 
     struct mk_server_config *config;
     struct mk_list *plugins;
@@ -198,6 +200,13 @@ struct plugin_api
                                                     const char *);
     void *(*config_section_get_key) (struct mk_rconf_section *, char *, int);
 
+    /* Virtual hosts */
+    int (*vhost_data_key) ();
+
+    /* Configuration generations, see mk_reload.h */
+    struct mk_config_gen *(*config_gen_acquire) ();
+    void (*config_gen_release) (struct mk_config_gen *);
+
     /* Scheduler */
     struct mk_event_loop *(*sched_loop)();
     int (*sched_remove_client) (int);
@@ -206,6 +215,18 @@ struct plugin_api
     void (*sched_event_free) (struct mk_event *);
     struct mk_sched_worker *(*sched_worker_info)();
 
+    /* Latency histograms */
+    const char *(*latency_name) (int);
+    int (*latency_merge) (int, struct mk_latency_histogram *);
+    uint64_t (*latency_percentile) (struct mk_latency_histogram *, double);
+    int (*latency_summary) (int, struct mk_latency_summary *);
+
+    /* Worker metrics */
+    const char *(*metrics_name) (int);
+    void (*metrics_add) (int, uint64_t);
+    uint64_t (*metrics_worker) (int, int);
+    uint64_t (*metrics_total) (int);
+
     /* worker's functions */
     pthread_t (*worker_spawn) (void (*func) (void *), void *);
     int (*worker_rename) (const char *);
@@ -269,6 +290,15 @@ struct mk_plugin {
     int  (*master_init) (struct mk_server_config *);
     void (*worker_init) ();
 
+    /*
+     * Configuration reload: the virtual hosts of a new generation before
+     * it is published (returning -1 cancels the reload), and the ones of a
+     * generation being released. The hosts loaded on startup are found in
+     * config->gen from init_plugin.
+     */
+    int  (*vhost_init) (struct mk_list *);
+    void (*vhost_exit) (struct mk_list *);
+
     /* Callback references for plugin type */
     struct mk_plugin_network *network;        /* MK_NETWORK_LAYER   */
     struct mk_plugin_stage   *stage;          /* MK_PLUGIN_STAGE    */
@@ -284,7 +314,7 @@ struct mk_plugin {
 };
 
 struct mk_plugin_stage {
-    int (*stage10) (int);
+    int (*stage10) (int, union mk_socket_addr *);
     int (*stage20) (struct mk_http_session *, struct mk_http_request *);
     int (*stage30) (struct mk_plugin *, struct mk_http_session *,
                     struct mk_http_request *, int, struct mk_list *);
@@ -32,6 +32,7 @@ struct mk_plugin_network {
     int (*writev) (int, struct mk_iov *);
     int (*close) (int);
     int (*send_file) (int, int, off_t *, size_t);
+    int (*splice) (int, int, size_t);   /* pipe to socket, optional */
     int buffer_size;
 };
 
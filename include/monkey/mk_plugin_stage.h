@@ -20,7 +20,8 @@
 #ifndef MK_PLUGIN_STAGE_H
 #define MK_PLUGIN_STAGE_H
 
-static inline int mk_plugin_stage_run_10(int socket)
+static inline int mk_plugin_stage_run_10(int socket,
+                                         union mk_socket_addr *addr)
 {
     int ret;
     struct mk_list *head;
@@ -28,7 +29,7 @@ static inline int mk_plugin_stage_run_10(int socket)
 
     mk_list_foreach(head, &mk_config->stage10_handler) {
         stage = mk_list_entry(head, struct mk_plugin_stage, _head);
-        ret = stage->stage10(socket);
+        ret = stage->stage10(socket, addr);
         switch (ret) {
         case MK_PLUGIN_RET_CLOSE_CONX:
             MK_TRACE("return MK_PLUGIN_RET_CLOSE_CONX");
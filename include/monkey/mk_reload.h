@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_RELOAD_H
+#define MK_RELOAD_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_mimetype.h>
+
+/*
+ * Configuration generations
+ * =========================
+ * The virtual hosts (with their handlers and routers) and the mime types
+ * form a generation, which is never modified once it is published in
+ * mk_config->gen. A SIGHUP builds a new one from the files and publishes
+ * it; every request takes the generation current when it starts and keeps
+ * it until it ends, so the requests in flight finish with the old one.
+ *
+ * A retired generation is freed once no request uses it and every worker
+ * moved to a newer one. Each worker publishes the generation it is using
+ * in its own slot (a hazard pointer) and counts its requests in its own
+ * counter, so taking a generation costs no locks nor shared writes.
+ */
+
+struct mk_config_gen_ref {
+    unsigned long n;                    /* requests using the generation */
+} MK_CACHELINE_ALIGNED;
+
+struct mk_config_gen {
+    unsigned int id;
+
+    int nhosts;
+    struct mk_list hosts;
+    struct mk_vhost_index *vhost_index;
+    struct mk_mimetype_table *mimetypes;
+
+    /* one counter per worker, the last one for any other thread */
+    struct mk_config_gen_ref *refs;
+
+    struct mk_list _head;               /* retired generations */
+};
+
+struct mk_config_gen *mk_config_gen_create();
+void mk_config_gen_free(struct mk_config_gen *gen);
+struct mk_config_gen *mk_config_gen_acquire();
+void mk_config_gen_release(struct mk_config_gen *gen);
+struct mk_config_gen *mk_config_gen_get();
+void mk_config_gen_worker_sync();
+
+/* Requests for the reload thread, see mk_reload_signal() */
+#define MK_RELOAD_CONFIG    1           /* SIGHUP */
+#define MK_RELOAD_UPGRADE   2           /* SIGUSR2, see mk_upgrade.h */
+
+int mk_reload_init();
+void mk_reload_signal(char type);
+
+#endif
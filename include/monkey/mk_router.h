@@ -0,0 +1,128 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_ROUTER_H
+#define MK_ROUTER_H
+
+#include <stdint.h>
+#include <regex.h>
+#include <monkey/mk_core.h>
+
+/*
+ * Handlers routing
+ * ================
+ * The [HANDLERS] Match patterns are regular expressions, but most of them
+ * are just literals glued with '.*' and optionally anchored: '^/stats$',
+ * '/.*\.php', '\.cgi$'... Those are compiled into literal pieces, and the
+ * ones with a single anchored piece are indexed per virtual host: exact
+ * names in a hash table, prefixes and suffixes in byte tries walked from
+ * the start and from the end of the URI. A request gets the set of
+ * candidate handlers from the indexes in one pass, and only the candidates
+ * the index cannot decide (unanchored literals and real regular
+ * expressions) are checked one by one, lazily and in configuration order.
+ */
+
+/*
+ * Handlers per virtual host, the candidates bitmap of a request lives in
+ * the worker stack.
+ */
+#define MK_ROUTER_HANDLERS_MAX  1024
+#define MK_ROUTER_WORDS_MAX     (MK_ROUTER_HANDLERS_MAX / 64)
+
+/* Pattern types */
+#define MK_ROUTE_ANY      0     /* matches every URI            */
+#define MK_ROUTE_EXACT    1     /* ^literal$                    */
+#define MK_ROUTE_PREFIX   2     /* ^literal                     */
+#define MK_ROUTE_SUFFIX   3     /* literal$                     */
+#define MK_ROUTE_GLOB     4     /* literals and '.*'            */
+#define MK_ROUTE_REGEX    5     /* anything else, regexec()     */
+
+struct mk_route_pattern {
+    int type;                   /* MK_ROUTE_*                   */
+    int anchor_start;
+    int anchor_end;
+    int n_pieces;
+    char **pieces;              /* lowercase literals           */
+    int *lens;
+    regex_t regex;              /* MK_ROUTE_REGEX only          */
+};
+
+struct mk_route_trie {
+    unsigned char c;
+    int n_children;
+    struct mk_route_trie **children;    /* sorted by 'c'        */
+    int n_ids;
+    int *ids;                   /* handlers ending here         */
+};
+
+struct mk_route_exact {
+    unsigned int hash;
+    int len;
+    char *name;                 /* NULL = empty slot            */
+    int id;
+};
+
+struct mk_router {
+    int n_handlers;
+    int n_words;                /* bitmap words per request     */
+    struct mk_host_handler **handlers;  /* configuration order  */
+
+    /* always candidates: MK_ROUTE_ANY, _GLOB and _REGEX */
+    uint64_t *always;
+
+    unsigned int exact_mask;
+    struct mk_route_exact *exact;
+    struct mk_route_trie *prefix;
+    struct mk_route_trie *suffix;
+};
+
+struct mk_host_handler;
+
+int mk_route_compile(struct mk_route_pattern *pattern, char *str);
+void mk_route_free(struct mk_route_pattern *pattern);
+struct mk_router *mk_router_create(struct mk_list *handlers);
+void mk_router_free(struct mk_router *router);
+void mk_router_candidates(struct mk_router *router, const char *uri, int len,
+                          uint64_t *map);
+int mk_route_match(struct mk_route_pattern *pattern, const char *uri, int len);
+
+/* Next handler set in 'map' from 'id' on, -1 if there are no more */
+static inline int mk_router_next(struct mk_router *router, uint64_t *map,
+                                 int id)
+{
+    int w;
+    uint64_t bits;
+
+    if (id >= router->n_handlers) {
+        return -1;
+    }
+
+    w = id >> 6;
+    bits = map[w] & (~0ULL << (id & 63));
+    while (!bits) {
+        if (++w >= router->n_words) {
+            return -1;
+        }
+        bits = map[w];
+    }
+
+    return (w << 6) + __builtin_ctzll(bits);
+}
+
+#endif
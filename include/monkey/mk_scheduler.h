@@ -20,6 +20,8 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_stream.h>
+#include <monkey/mk_latency.h>
+#include <monkey/mk_metrics.h>
 
 #ifndef MK_SCHEDULER_H
 #define MK_SCHEDULER_H
@@ -29,6 +31,7 @@
 
 #define MK_SCHED_SIGNAL_DEADBEEF  0xDEADBEEF
 #define MK_SCHED_SIGNAL_FREE_ALL  0xFFEE0000
+#define MK_SCHED_SIGNAL_DRAIN     0xFFEE0001
 
 /*
  * Scheduler balancing mode:
@@ -50,15 +53,30 @@ extern __thread struct mk_list *cs_incomplete;
 /*
  * Thread-scope structure/variable that holds the Scheduler context for the
  * worker (or thread) in question.
+ *
+ * The balancer reads the connection counters of every worker on each
+ * accept, so they live on their own cache lines: 'accepted_connections'
+ * is written by the accepting thread and 'closed_connections' by the
+ * worker. Reads of them never pull the lines the worker uses for its own
+ * state. Access them through the mk_sched_* counter helpers below.
  */
 struct mk_sched_worker
 {
+    /* Written by the accepting thread */
+    unsigned long long accepted_connections MK_CACHELINE_ALIGNED;
+    unsigned long long over_capacity;
+
+    /* Written by this worker */
+    unsigned long long closed_connections MK_CACHELINE_ALIGNED;
+
     /* The event loop on this scheduler thread */
-    struct mk_event_loop *loop;
+    struct mk_event_loop *loop MK_CACHELINE_ALIGNED;
 
-    unsigned long long accepted_connections;
-    unsigned long long closed_connections;
-    unsigned long long over_capacity;
+    /* Request latency histograms, written only by this worker */
+    struct mk_latency *latency;
+
+    /* Event counters, written only by this worker */
+    struct mk_metrics *metrics;
 
     /*
      * Red-Black tree queue to perform fast lookup over
@@ -98,7 +116,35 @@ struct mk_sched_worker
 
     /* If using REUSEPORT, this points to the list of listeners */
     struct mk_list *listeners;
-};
+} MK_CACHELINE_ALIGNED;
+
+/*
+ * Every counter has a single writer, so a relaxed load/store pair is
+ * enough: no locked read-modify-write, and readers on other threads get
+ * a consistent value.
+ */
+static inline void mk_sched_counter_inc(unsigned long long *counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long mk_sched_counter_get(unsigned long long *c)
+{
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* Connections being served by the worker */
+static inline unsigned long long mk_sched_active(struct mk_sched_worker *s)
+{
+    unsigned long long accepted;
+    unsigned long long closed;
+
+    /* Load 'closed' first so a concurrent close can not underflow */
+    closed   = mk_sched_counter_get(&s->closed_connections);
+    accepted = mk_sched_counter_get(&s->accepted_connections);
+
+    return accepted - closed;
+}
 
 
 /* Every connection in the server is represented by this structure */
@@ -108,6 +154,8 @@ struct mk_sched_conn
     int status;                        /* connection status            */
     char is_timeout_on;                /* registered to timeout queue? */
     time_t arrive_time;                /* arrive time                  */
+    uint64_t arrive_ns;                /* accept time (monotonic nsec) */
+    union mk_socket_addr peer;         /* remote address               */
     struct mk_sched_handler *protocol; /* protocol handler             */
     struct mk_plugin_network *net;     /* I/O network layer            */
     struct mk_channel channel;         /* stream channel               */
@@ -217,6 +265,7 @@ int mk_sched_drop_connection(struct mk_sched_conn *conn,
 
 int mk_sched_check_timeouts(struct mk_sched_worker *sched);
 struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
+                                              union mk_socket_addr *addr,
                                               struct mk_server_listen *listener,
                                               struct mk_sched_worker *sched);
 int mk_sched_remove_client(struct mk_sched_conn *conn,
@@ -281,5 +330,7 @@ static inline void mk_sched_conn_timeout_del(struct mk_sched_conn *conn)
     ch->io->writev(ch->fd, iov)
 #define mk_sched_conn_sendfile(ch, f_fd, f_offs, f_count)   \
     ch->io->send_file(ch->fd, f_fd, f_offs, f_count)
+#define mk_sched_conn_splice(ch, p_fd, p_count) \
+    ch->io->splice(ch->fd, p_fd, p_count)
 
 #endif
@@ -59,6 +59,9 @@ int mk_server_listen_check(struct mk_server_listen *listen, int server_fd);
 
 void mk_server_listen_free();
 struct mk_list *mk_server_listen_init(struct mk_server_config *config);
+int mk_server_listen_export(char **env, int **fds);
+void mk_server_listen_stop();
+int mk_server_listen_stopped();
 unsigned int mk_server_capacity();
 void mk_server_launch_workers(void);
 void mk_server_loop();
@@ -55,6 +55,16 @@
 
 #define TCP_CORKING_PATH  "/proc/sys/net/ipv4/tcp_autocorking"
 
+/*
+ * Remote address of a connection. It's captured once when the connection
+ * is accepted so callers do not need to issue getpeername(2) later.
+ */
+union mk_socket_addr {
+    struct sockaddr     sa;
+    struct sockaddr_in  in4;
+    struct sockaddr_in6 in6;
+};
+
 int mk_socket_set_cork_flag(int fd, int state);
 int mk_socket_set_tcp_fastopen(int sockfd);
 int mk_socket_set_tcp_nodelay(int sockfd);
@@ -71,20 +81,23 @@ int mk_socket_bind(int socket_fd, const struct sockaddr *addr,
 int mk_socket_server(char *port, char *listen_addr,
                      int reuse_port, struct mk_server_config *config);
 int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len);
+int mk_socket_addr_str(union mk_socket_addr *addr, char **buf, int size,
+                       unsigned long *len);
 
 
-static inline int mk_socket_accept(int server_fd)
+static inline int mk_socket_accept(int server_fd, union mk_socket_addr *addr)
 {
     int remote_fd;
-
-    struct sockaddr sock_addr;
-    socklen_t socket_size = sizeof(struct sockaddr);
+    socklen_t socket_size = sizeof(union mk_socket_addr);
 
 #ifdef ACCEPT_GENERIC
-    remote_fd = accept(server_fd, &sock_addr, &socket_size);
-    mk_socket_set_nonblocking(remote_fd);
+    remote_fd = accept(server_fd, &addr->sa, &socket_size);
+    if (remote_fd != -1) {
+        mk_socket_set_nonblocking(remote_fd);
+        fcntl(remote_fd, F_SETFD, FD_CLOEXEC);
+    }
 #else
-    remote_fd = accept4(server_fd, &sock_addr, &socket_size,
+    remote_fd = accept4(server_fd, &addr->sa, &socket_size,
                         SOCK_NONBLOCK | SOCK_CLOEXEC);
 #endif
 
@@ -34,6 +34,7 @@
 #define MK_STREAM_FILE      3  /* opened file          */
 #define MK_STREAM_SOCKET    4  /* socket, scared..     */
 #define MK_STREAM_COPYBUF   5  /* raw data, copy data into a dynamic buffer */
+#define MK_STREAM_PIPE      6  /* data in a pipe, needs io->splice     */
 
 /* Channel return values for write event */
 #define MK_CHANNEL_DONE     1  /* channel consumed all streams */
@@ -64,6 +65,9 @@ struct mk_channel {
     struct mk_event event;
     struct mk_plugin_network *io;
     struct mk_list streams;
+
+    /* Event armed for write on a partial flush, NULL for none */
+    struct mk_event *ev_owner;
 };
 
 /*
@@ -202,6 +206,9 @@ static inline void mk_stream_bytes_consumed(struct mk_stream *stream, long bytes
     else if (stream->type == MK_STREAM_COPYBUF) {
         fmt = "[STREAM_CBUF %p] bytes consumed %lu/%lu";
     }
+    else if (stream->type == MK_STREAM_PIPE) {
+        fmt = "[STREAM_PIPE %p] bytes consumed %lu/%lu";
+    }
     else {
         fmt = "[STREAM_UNKW %p] bytes consumed %lu/%lu";
     }
@@ -239,6 +246,9 @@ static inline void mk_channel_debug(struct mk_channel *channel)
         case MK_STREAM_COPYBUF:
             printf("%i) [%p] STREAM COPYBUF: ", i, stream);
             break;
+        case MK_STREAM_PIPE:
+            printf("%i) [%p] STREAM PIPE   : ", i, stream);
+            break;
         }
 #if defined(__APPLE__)
         printf("bytes=%lld/%lu\n", stream->bytes_offset, stream->bytes_total);
@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_UPGRADE_H
+#define MK_UPGRADE_H
+
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+
+/*
+ * Binary upgrade
+ * ==============
+ * On SIGUSR2 the running process executes its binary again (the one found
+ * in the same path, so it can be replaced first) and passes it the
+ * listening sockets through the environment:
+ *
+ *   MONKEY_LISTEN_FDS="fd:worker:port:address;..."
+ *
+ * 'worker' is the index of the worker owning the socket in REUSEPORT mode,
+ * or -1 for the sockets of the balancer. The new process uses those
+ * sockets instead of binding new ones, so no connection is refused in
+ * between. Once its workers run it writes a byte on MONKEY_UPGRADE_FD; the
+ * old process then stops accepting, closes the keep-alive connections as
+ * their requests end and exits when the last one is gone. If the new
+ * process fails to start, the old one keeps serving.
+ */
+#define MK_UPGRADE_ENV_FDS          "MONKEY_LISTEN_FDS"
+#define MK_UPGRADE_ENV_READY        "MONKEY_UPGRADE_FD"
+
+/* Seconds the new process has to start serving */
+#define MK_UPGRADE_READY_TIMEOUT    30
+
+/* Seconds the old process waits for its connections before exiting */
+#define MK_UPGRADE_DRAIN_TIMEOUT    120
+
+/* Set once the old process stops accepting connections */
+extern int mk_upgrade_draining;
+
+void mk_upgrade_set_argv(char **argv);
+int mk_upgrade_inherited();
+int mk_upgrade_listener_fd(int worker, struct mk_config_listener *listen);
+void mk_upgrade_ready();
+void mk_upgrade_start();
+
+#endif
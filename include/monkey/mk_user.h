@@ -25,9 +25,19 @@
 /* User home string */
 #define MK_USER_HOME '~'
 
+/* Home directories cache per worker: entries and seconds */
+#define MK_USER_CACHE_SIZE     64       /* power of 2 */
+#define MK_USER_CACHE_TTL      60
+#define MK_USER_CACHE_NEG_TTL  10       /* unknown users */
+#define MK_USER_PW_BUF_MAX     1048576  /* getpwnam_r() buffer, bytes */
+
+/* Longer user names are not accepted */
+#define MK_USER_NAME_MAX       64
+
 /* user.c */
 int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr);
 int mk_user_set_uidgid(void);
 int mk_user_undo_uidgid(void);
+void mk_user_worker_exit(void);
 
 #endif
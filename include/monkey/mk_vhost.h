@@ -23,25 +23,34 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_http.h>
+#include <monkey/mk_router.h>
+#include <monkey/mk_mimetype.h>
 
-#include <regex.h>
-
-/* Custom error page */
+/*
+ * Custom error page, read once with the virtual host. The body is shared
+ * by the requests and never modified; if the file could not be read it
+ * is NULL and the default page is used.
+ */
 struct error_page {
     short int status;
     char *file;
     char *real_path;
+    mk_ptr_t body;
+    mk_ptr_t content_type;        /* 'Content-Type: ...\r\n', not owned */
     struct mk_list _head;
 };
 
+/* Larger custom error pages are not loaded */
+#define MK_VHOST_ERROR_PAGE_MAX  (1024 * 1024)
+
 struct mk_handler_param {
     mk_ptr_t p;
     struct mk_list _head;
 };
 
 struct mk_host_handler {
-    /* we only support a regex match for now */
-    regex_t match;
+    /* Match pattern, see mk_router.h */
+    struct mk_route_pattern match;
 
     /* plugin handler */
     char *name;
@@ -52,6 +61,9 @@ struct mk_host_handler {
     struct mk_list _head;
 };
 
+/* Max number of plugins keeping their own data in a struct host */
+#define MK_VHOST_DATA_KEYS  8
+
 struct host
 {
     char *file;                   /* configuration file */
@@ -68,6 +80,13 @@ struct host
 
     /* content handlers */
     struct mk_list handlers;
+    struct mk_router *router;     /* handlers by URI */
+
+    /* plugins private data, see mk_vhost_data_key() */
+    void *data[MK_VHOST_DATA_KEYS];
+
+    /* File Descriptor Table of each worker, created on first use */
+    struct vhost_fdt_host **fdt;
 
     /* link node */
     struct mk_list _head;
@@ -81,6 +100,30 @@ struct host_alias
     struct mk_list _head;
 };
 
+/*
+ * Server names index: a hash table for the exact names and another one
+ * for the '*.example.com' wildcards, keyed by the part after '*.' hashed
+ * from the last byte backwards, so all the domain suffixes of a Host are
+ * hashed in a single right to left pass.
+ */
+struct mk_vhost_name {
+    unsigned int hash;
+    unsigned int len;
+    const char *name;             /* lowercase, wildcards without '*.' */
+    struct host *host;
+    struct host_alias *alias;
+};
+
+struct mk_vhost_table {
+    unsigned int mask;
+    struct mk_vhost_name *names;  /* open addressing, name NULL = empty */
+};
+
+struct mk_vhost_index {
+    struct mk_vhost_table exact;
+    struct mk_vhost_table wildcard;
+};
+
 
 #define VHOST_FDT_HASHTABLE_SIZE   64
 #define VHOST_FDT_HASHTABLE_CHAINS  8
@@ -97,23 +140,26 @@ struct vhost_fdt_hash_table {
 };
 
 struct vhost_fdt_host {
-    struct host *host;
     struct vhost_fdt_hash_table hash_table[VHOST_FDT_HASHTABLE_SIZE];
-    struct mk_list _head;
 };
 
 //pthread_key_t mk_vhost_fdt_key;
 pthread_mutex_t mk_vhost_fdt_mutex;
 
 struct host *mk_vhost_read(char *path);
-int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias);
-void mk_vhost_set_single(char *path);
-void mk_vhost_init(char *path);
-int mk_vhost_fdt_worker_init();
-int mk_vhost_fdt_worker_exit();
+int mk_vhost_data_key();
+struct mk_vhost_index *mk_vhost_index_create(struct mk_list *hosts);
+void mk_vhost_index_free(struct mk_vhost_index *index);
+int mk_vhost_get(struct mk_vhost_index *index, mk_ptr_t host,
+                 struct host **vhost, struct host_alias **alias);
+int mk_vhost_set_single(char *path, struct mk_list *hosts);
+int mk_vhost_init(char *path, struct mk_list *hosts);
 int mk_vhost_open(struct mk_http_request *sr);
 int mk_vhost_close(struct mk_http_request *sr);
-void mk_vhost_free_all();
-int mk_vhost_map_handlers();
+void mk_vhost_free_all(struct mk_list *hosts);
+int mk_vhost_map_handlers(struct mk_list *hosts);
+void mk_vhost_error_pages_load(struct mk_list *hosts,
+                               struct mk_mimetype_table *mimetypes);
+struct error_page *mk_vhost_error_page(struct host *host, int status);
 
 #endif
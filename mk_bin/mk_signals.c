@@ -19,6 +19,7 @@
 
 #include <monkey/monkey.h>
 #include <monkey/mk_core.h>
+#include <monkey/mk_reload.h>
 
 #include <string.h>
 #include <signal.h>
@@ -39,6 +40,7 @@ static void mk_signal_exit()
     signal(SIGTERM, SIG_IGN);
     signal(SIGINT,  SIG_IGN);
     signal(SIGHUP,  SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
 
     mk_user_undo_uidgid();
     mk_utils_remove_pid(mk_config->pid_file_path);
@@ -56,14 +58,12 @@ static void mk_signal_handler(int signo, siginfo_t *si, void *context UNUSED_PAR
         mk_signal_exit();
         break;
     case SIGHUP:
-        /*
-         * TODO:
-         * we should implement the httpd config reload here (not in SIGUSR2).
-         * Daemon processes “overload” this signal with a mechanism to instruct them to
-         * reload their configuration files. Sending SIGHUP to Apache, for example,
-         * instructs it to reread httpd.conf.
-         */
-        mk_signal_exit();
+        /* Read again the virtual hosts and mime types, see mk_reload.c */
+        mk_reload_signal(MK_RELOAD_CONFIG);
+        break;
+    case SIGUSR2:
+        /* Execute the binary again, see mk_upgrade.h */
+        mk_reload_signal(MK_RELOAD_UPGRADE);
         break;
     case SIGBUS:
     case SIGSEGV:
@@ -99,6 +99,7 @@ void mk_signal_init()
     sigaction(SIGSEGV, &act, NULL);
     sigaction(SIGBUS,  &act, NULL);
     sigaction(SIGHUP,  &act, NULL);
+    sigaction(SIGUSR2, &act, NULL);
     sigaction(SIGINT,  &act, NULL);
     sigaction(SIGTERM, &act, NULL);
 }
@@ -18,6 +18,7 @@
  */
 
 #include <monkey/monkey.h>
+#include <monkey/mk_upgrade.h>
 #include "mk_signals.h"
 
 #include <getopt.h>
@@ -291,12 +292,19 @@ int main(int argc, char **argv)
     }
 
 
-    /* Running Monkey as daemon */
-    if (mk_config->is_daemon == MK_TRUE) {
+    /* Binary upgrade: keep the command line, see mk_upgrade.h */
+    mk_upgrade_set_argv(argv);
+
+    /*
+     * Running Monkey as daemon. When replacing a running daemon we are
+     * already detached from the terminal.
+     */
+    if (mk_config->is_daemon == MK_TRUE && mk_upgrade_inherited() == MK_FALSE) {
         mk_utils_set_daemon();
     }
 
     if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT &&
+        mk_upgrade_inherited() == MK_FALSE &&
         mk_config_listen_check_busy(mk_config) == MK_TRUE &&
         allow_shared_sockets == MK_FALSE) {
         mk_warn("Some Listen interface is busy, re-try using -T. Aborting.");
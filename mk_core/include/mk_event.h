@@ -103,6 +103,24 @@ static inline void MK_EVENT_INIT(struct mk_event *ev, int fd, void *data,
 int mk_event_initialize();
 struct mk_event_loop *mk_event_loop_create(int size);
 void mk_event_loop_destroy(struct mk_event_loop *loop);
+
+/*
+ * Registration contract
+ * ---------------------
+ * 'data' always points to a struct mk_event (usually the first member of
+ * the owner), set up with MK_EVENT_INIT() or zeroed before its first use.
+ *
+ *  - mk_event_add() registers the fd if the event mask is empty, otherwise
+ *    it replaces the mask of the registered fd. The event is marked
+ *    MK_EVENT_REGISTERED.
+ *  - mk_event_del() removes a registered event from the loop and resets
+ *    it (status MK_EVENT_NONE, empty mask), so a later mk_event_add()
+ *    registers it again. Deleting an event that is not registered does
+ *    nothing and returns -1, so it is safe to call it twice.
+ *  - Delete the event before closing its fd: an fd shared with another
+ *    process (e.g. inherited across exec()) stays in the loop after
+ *    close().
+ */
 int mk_event_add(struct mk_event_loop *loop, int fd,
                  int type, uint32_t mask, void *data);
 int mk_event_del(struct mk_event_loop *loop, struct mk_event *event);
@@ -138,6 +138,18 @@
 #define MK_NET_HOSTMIN(addr,net) net == 31 ? MK_NET_NETWORK(addr,net) : (MK_NET_NETWORK(addr,net) + 0x01000000)
 #define MK_NET_HOSTMAX(addr,net) net == 31 ? MK_NET_BROADCAST(addr,net) : (MK_NET_BROADCAST(addr,net) - 0x01000000)
 
+/*
+ * Data written by different threads must not share a cache line, otherwise
+ * every write invalidates the line on the other cores (false sharing).
+ */
+#define MK_CACHELINE_SIZE  64
+
+#ifdef __GNUC__
+ #define MK_CACHELINE_ALIGNED __attribute__ ((aligned (MK_CACHELINE_SIZE)))
+#else
+ #define MK_CACHELINE_ALIGNED
+#endif
+
 #if __GNUC__ >= 4
  #define MK_EXPORT __attribute__ ((visibility ("default")))
 #else
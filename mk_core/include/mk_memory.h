@@ -21,6 +21,8 @@
 #define MK_MEM_H
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
 
 #ifdef MALLOC_JEMALLOC
 #include <jemalloc/jemalloc.h>
@@ -73,6 +75,28 @@ void *mk_mem_malloc_z(const size_t size)
     return buf;
 }
 
+/* Memory aligned to 'align' bytes, it must be released with mk_mem_free() */
+static inline ALLOCSZ_ATTR(2)
+void *mk_mem_malloc_aligned(const size_t align, const size_t size)
+{
+    int ret;
+    void *aux;
+
+#ifdef MALLOC_JEMALLOC
+    ret = je_posix_memalign(&aux, align, size);
+#else
+    ret = posix_memalign(&aux, align, size);
+#endif
+
+    if (mk_unlikely(ret != 0)) {
+        errno = ret;
+        perror("posix_memalign");
+        return NULL;
+    }
+
+    return aux;
+}
+
 static inline ALLOCSZ_ATTR(2)
 void *mk_mem_realloc(void *ptr, const size_t size)
 {
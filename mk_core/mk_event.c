@@ -74,7 +74,7 @@ void mk_event_loop_destroy(struct mk_event_loop *loop)
     mk_mem_free(loop);
 }
 
-/* Register or modify an event */
+/* Register or modify an event, see the contract in mk_event.h */
 int mk_event_add(struct mk_event_loop *loop, int fd,
                  int type, uint32_t mask, void *data)
 {
@@ -87,7 +87,7 @@ int mk_event_add(struct mk_event_loop *loop, int fd,
 #endif
 
     event = (struct mk_event *) data;
-    if (event->status & ~MK_EVENT_NONE) {
+    if (event->status & ~(MK_EVENT_NONE | MK_EVENT_REGISTERED)) {
         return -1;
     }
 
@@ -97,10 +97,11 @@ int mk_event_add(struct mk_event_loop *loop, int fd,
         return -1;
     }
 
+    event->status = MK_EVENT_REGISTERED;
     return 0;
 }
 
-/* Remove an event */
+/* Remove a registered event, a no-op (-1) for any other */
 int mk_event_del(struct mk_event_loop *loop, struct mk_event *event)
 {
     int ret;
@@ -118,7 +119,9 @@ int mk_event_del(struct mk_event_loop *loop, struct mk_event *event)
         return -1;
     }
 
+    /* a later mk_event_add() registers it again from scratch */
     event->status = MK_EVENT_NONE;
+    event->mask   = MK_EVENT_EMPTY;
     return 0;
 }
 
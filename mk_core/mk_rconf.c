@@ -29,7 +29,6 @@ static void mk_config_error(const char *path, int line, const char *msg)
 {
     mk_err("File %s", path);
     mk_err("Error in line %i: %s", line, msg);
-    exit(EXIT_FAILURE);
 }
 
 /* Raise a warning */
@@ -82,7 +81,11 @@ static void mk_rconf_section_entry_add(struct mk_rconf *conf,
     mk_list_add(&new->_head, &section->entries);
 }
 
-struct mk_rconf *mk_rconf_create(const char *path)
+/*
+ * Parse a configuration file, on a syntax error 'error' is set and NULL is
+ * returned.
+ */
+static struct mk_rconf *mk_rconf_read(const char *path, int *error)
 {
     int i;
     int len;
@@ -158,6 +161,7 @@ struct mk_rconf *mk_rconf_create(const char *path)
             }
             else {
                 mk_config_error(path, line, "Bad header definition");
+                goto error;
             }
         }
 
@@ -181,6 +185,7 @@ struct mk_rconf *mk_rconf_create(const char *path)
         if (strncmp(buf, indent, indent_len) != 0 ||
             isblank(buf[indent_len]) != 0) {
             mk_config_error(path, line, "Invalid indentation level");
+            goto error;
         }
 
         if (buf[indent_len] == '#' || indent_len == len) {
@@ -194,6 +199,9 @@ struct mk_rconf *mk_rconf_create(const char *path)
 
         if (!key || !val || i < 0) {
             mk_config_error(path, line, "Each key must have a value");
+            mk_mem_free(key);
+            mk_mem_free(val);
+            goto error;
         }
 
         /* Trim strings */
@@ -233,6 +241,38 @@ struct mk_rconf *mk_rconf_create(const char *path)
     fclose(f);
     if (indent) mk_mem_free(indent);
     return conf;
+
+ error:
+    *error = MK_TRUE;
+    fclose(f);
+    if (indent) mk_mem_free(indent);
+    mk_rconf_free(conf);
+    return NULL;
+}
+
+/* Read a configuration file, a syntax error aborts the program */
+struct mk_rconf *mk_rconf_create(const char *path)
+{
+    int error = MK_FALSE;
+    struct mk_rconf *conf;
+
+    conf = mk_rconf_read(path, &error);
+    if (error == MK_TRUE) {
+        exit(EXIT_FAILURE);
+    }
+
+    return conf;
+}
+
+/*
+ * Same as mk_rconf_create() but a syntax error just returns NULL, for the
+ * files read again while the server is running.
+ */
+struct mk_rconf *mk_rconf_open(const char *path)
+{
+    int error = MK_FALSE;
+
+    return mk_rconf_read(path, &error);
 }
 
 void mk_rconf_free(struct mk_rconf *conf)
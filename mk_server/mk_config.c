@@ -22,6 +22,7 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_mimetype.h>
+#include <monkey/mk_reload.h>
 #include <monkey/mk_info.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_server.h>
@@ -86,8 +87,12 @@ void mk_config_listeners_free()
 
 void mk_config_free_all()
 {
-    mk_vhost_free_all();
-    mk_mimetype_free_all();
+    if (mk_config->gen) {
+        mk_config_gen_free(mk_config->gen);
+        mk_config->gen = NULL;
+    }
+    mk_mem_free(mk_config->default_mimetype);
+    mk_http_error_pages_free();
 
     if (mk_config->config) {
         mk_rconf_free(mk_config->config);
@@ -438,12 +443,12 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
     mk_config->server_capacity = mk_server_capacity();
 
 
-    if (!mk_config->one_shot) {
-        mk_vhost_init(path_conf);
-    }
-    else {
-        mk_vhost_set_single(mk_config->one_shot);
+    /* Virtual hosts and mime types */
+    mk_config->gen = mk_config_gen_create();
+    if (!mk_config->gen) {
+        exit(EXIT_FAILURE);
     }
+    mk_config->gen->id = 1;
 
     /* Server Signature */
     if (mk_config->hideversion == MK_FALSE) {
@@ -461,6 +466,9 @@ static void mk_config_read_files(char *path_conf, char *file_conf)
                    "Server: %s\r\n", mk_config->server_signature);
     mk_config->server_signature_header_len = len;
 
+    /* Built-in error pages carry the signature */
+    mk_http_error_pages_init();
+
     mk_mem_free(tmp);
 }
 
@@ -472,9 +480,6 @@ void mk_config_start_configure(void)
     mk_config_set_init_values();
     mk_config_read_files(mk_config->path_config, mk_config->server_conf_file);
 
-    /* Load mimes */
-    mk_mimetype_read_config();
-
     mk_ptr_reset(&mk_config->server_software);
 
     /* Basic server information */
@@ -552,8 +557,7 @@ void mk_config_set_init_values(void)
     mk_config->resume = MK_TRUE;
     mk_config->standard_port = 80;
     mk_config->symlink = MK_FALSE;
-    mk_config->nhosts = 0;
-    mk_list_init(&mk_config->hosts);
+    mk_config->gen = NULL;
     mk_config->user = NULL;
     mk_config->open_flags = O_RDONLY | O_NONBLOCK;
     mk_config->index_files = NULL;
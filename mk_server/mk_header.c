@@ -109,6 +109,7 @@ static const struct header_status_response status_response[] = {
     status_entry(MK_CLIENT_UNSUPPORTED_MEDIA, MK_RH_CLIENT_UNSUPPORTED_MEDIA),
     status_entry(MK_CLIENT_REQUESTED_RANGE_NOT_SATISF,
                  MK_RH_CLIENT_REQUESTED_RANGE_NOT_SATISF),
+    status_entry(MK_CLIENT_TOO_MANY_REQUESTS, MK_RH_CLIENT_TOO_MANY_REQUESTS),
 
     /* Server side errors */
     status_entry(MK_SERVER_INTERNAL_ERROR, MK_RH_SERVER_INTERNAL_ERROR),
@@ -122,6 +123,17 @@ static const struct header_status_response status_response[] = {
 static const int status_response_len =
     (sizeof(status_response)/(sizeof(status_response[0])));
 
+/* Register when the first byte of the response hits the socket */
+static void mk_header_cb_consumed(struct mk_stream *stream, long bytes)
+{
+    struct mk_http_request *sr = stream->data;
+    (void) bytes;
+
+    if (sr->first_byte_ns == 0) {
+        sr->first_byte_ns = mk_clock_ns();
+    }
+}
+
 static void mk_header_cb_finished(struct mk_stream *stream)
 {
     struct mk_iov *iov = stream->buffer;
@@ -373,8 +385,8 @@ int mk_header_prepare(struct mk_http_session *cs,
                   MK_STREAM_IOV, cs->channel,
                   iov,
                   -1,
-                  NULL,
-                  mk_header_cb_finished, NULL, NULL);
+                  sr,
+                  mk_header_cb_finished, mk_header_cb_consumed, NULL);
 
     if (sr->headers._extra_rows) {
         mk_stream_set(&sr->headers_extra_stream,
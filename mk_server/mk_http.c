@@ -39,6 +39,8 @@
 #include <monkey/mk_header.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_reload.h>
+#include <monkey/mk_upgrade.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_plugin_stage.h>
 
@@ -59,7 +61,11 @@ const mk_ptr_t mk_http_protocol_null_p = { NULL, 0 };
 void mk_http_request_init(struct mk_http_session *session,
                           struct mk_http_request *request)
 {
-    struct mk_list *host_list = &mk_config->hosts;
+    struct mk_list *host_list;
+
+    /* The request keeps this configuration until it ends */
+    request->gen = mk_config_gen_acquire();
+    host_list = &request->gen->hosts;
 
     request->port = 0;
     request->status = MK_TRUE;
@@ -82,6 +88,9 @@ void mk_http_request_init(struct mk_http_session *session,
     request->uri_processed.data = NULL;
     request->real_path.data = NULL;
     request->handler_data = NULL;
+    request->stage30_handler = NULL;
+    request->init_ns = 0;
+    request->first_byte_ns = 0;
 
     /* Response Headers */
     mk_header_response_reset(&request->headers);
@@ -111,7 +120,7 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
 {
     int status = 0;
     char *temp;
-    struct mk_list *hosts = &mk_config->hosts;
+    struct mk_list *hosts = &sr->gen->hosts;
     struct mk_list *alias;
     struct mk_http_header *header;
 
@@ -130,6 +139,13 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         sr->uri_processed.len  = sr->uri.len;
     }
 
+    /*
+     * The routing does not need it, but the handlers can use the path as
+     * a string. The request line is parsed already, this overwrites the
+     * space or the '?' after the URI.
+     */
+    sr->uri_processed.data[sr->uri_processed.len] = '\0';
+
     /* Always assign the default vhost' */
     sr->host_conf = mk_list_entry_first(hosts, struct host, _head);
 
@@ -186,7 +202,8 @@ static int mk_http_request_prepare(struct mk_http_session *cs,
         }
 
         /* Match the virtual host */
-        mk_vhost_get(sr->host, &sr->host_conf, &sr->host_alias);
+        mk_vhost_get(sr->gen->vhost_index, sr->host,
+                     &sr->host_conf, &sr->host_alias);
 
         /* Check if this virtual host have some redirection */
         if (sr->host_conf->header_redirect.data) {
@@ -235,7 +252,6 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
 {
     struct mk_http_request *sr;
     struct mk_list *sr_list = &cs->request_list;
-    struct mk_list *host_list = &mk_config->hosts;
 
     /*
      * If the connection is too premature, we need to allocate a temporal session_request
@@ -254,9 +270,11 @@ static void mk_request_premature_close(int http_status, struct mk_http_session *
     /* Raise error */
     if (http_status > 0) {
         if (!sr->host_conf) {
-            sr->host_conf = mk_list_entry_first(host_list, struct host, _head);
+            sr->host_conf = mk_list_entry_first(&sr->gen->hosts,
+                                                struct host, _head);
         }
         mk_http_error(http_status, cs, sr);
+        mk_metrics_status(sr->headers.status);
 
         /* STAGE_40, request has ended */
         mk_plugin_stage_run_40(cs, sr);
@@ -350,30 +368,72 @@ int mk_http_handler_read(struct mk_sched_conn *conn, struct mk_http_session *cs)
     return total_bytes;
 }
 
-/* Build error page */
-static mk_ptr_t *mk_http_error_page(char *title, mk_ptr_t *message,
-                                    char *signature)
-{
-    char *temp;
-    mk_ptr_t *p;
+/*
+ * Built-in error pages. They are rendered once with the server signature
+ * and shared by every request, so they do not carry anything from the
+ * request itself.
+ */
+struct mk_http_error_default {
+    int status;
+    char *title;
+    char *message;
+    mk_ptr_t page;
+};
+
+static struct mk_http_error_default mk_http_error_defaults[] = {
+    {MK_CLIENT_FORBIDDEN, "Forbidden",
+     "You do not have permission to access the requested URL.", {NULL, 0}},
+    {MK_CLIENT_NOT_FOUND, "Not Found",
+     "The requested URL was not found on this server.", {NULL, 0}},
+    {MK_CLIENT_METHOD_NOT_ALLOWED, "Method Not Allowed",
+     "The requested method is not allowed for this URL.", {NULL, 0}},
+    {MK_CLIENT_REQUEST_ENTITY_TOO_LARGE, "Entity too large",
+     "The request entity is too large.", {NULL, 0}},
+    {MK_CLIENT_TOO_MANY_REQUESTS, "Too Many Requests",
+     "Too many requests, try again later.", {NULL, 0}},
+    {MK_SERVER_INTERNAL_ERROR, "Internal Server Error",
+     "The server could not complete the request.", {NULL, 0}},
+    {MK_SERVER_NOT_IMPLEMENTED, "Method Not Implemented",
+     "The requested method is not implemented by this server.", {NULL, 0}},
+    {0, NULL, NULL, {NULL, 0}}
+};
 
-    p = mk_mem_malloc(sizeof(mk_ptr_t));
-    p->data = NULL;
+static const mk_ptr_t mk_http_error_content_type =
+    mk_ptr_init("Content-Type: text/html\r\n");
 
-    if (message) {
-        temp = mk_ptr_to_buf(*message);
+/* Render the built-in pages, once the server signature is set */
+void mk_http_error_pages_init()
+{
+    struct mk_http_error_default *e;
+
+    for (e = mk_http_error_defaults; e->status; e++) {
+        e->page.data = NULL;
+        mk_string_build(&e->page.data, &e->page.len,
+                        MK_REQUEST_DEFAULT_PAGE, e->title, e->message,
+                        mk_config->server_signature);
     }
-    else {
-        temp = "";
+}
+
+void mk_http_error_pages_free()
+{
+    struct mk_http_error_default *e;
+
+    for (e = mk_http_error_defaults; e->status; e++) {
+        mk_ptr_free(&e->page);
     }
+}
 
-    mk_string_build(&p->data, &p->len,
-                    MK_REQUEST_DEFAULT_PAGE, title, temp, signature);
+static inline mk_ptr_t *mk_http_error_page(int http_status)
+{
+    struct mk_http_error_default *e;
 
-    if (message) {
-        mk_mem_free(temp);
+    for (e = mk_http_error_defaults; e->status; e++) {
+        if (e->status == http_status) {
+            return e->page.data ? &e->page : NULL;
+        }
     }
-    return p;
+
+    return NULL;
 }
 
 int mk_http_method_check(mk_ptr_t method)
@@ -688,15 +748,78 @@ static inline void mk_http_cb_file_on_consume(struct mk_stream *stream, long byt
 }
 #endif
 
-int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
+/*
+ * Plugin Stage 30: look for handlers for this request. It returns -1 if no
+ * handler took care of the request.
+ */
+static int mk_http_stage30(struct mk_http_session *cs,
+                           struct mk_http_request *sr)
 {
+    int id;
     int ret;
-    struct mimetype *mime;
-    struct mk_list *head;
-    struct mk_list *handlers;
+    uint64_t map[MK_ROUTER_WORDS_MAX];
     struct mk_plugin *plugin;
+    struct mk_router *router;
     struct mk_host_handler *h_handler;
 
+    if (sr->stage30_blocked == MK_TRUE) {
+        return -1;
+    }
+
+    router = sr->host_conf->router;
+    if (!router || router->n_handlers == 0) {
+        return -1;
+    }
+
+    mk_router_candidates(router, sr->uri_processed.data, sr->uri_processed.len,
+                         map);
+
+    /* Candidates in configuration order */
+    for (id = mk_router_next(router, map, 0); id >= 0;
+         id = mk_router_next(router, map, id + 1)) {
+        h_handler = router->handlers[id];
+        plugin = h_handler->handler;
+        if (h_handler->match.type >= MK_ROUTE_GLOB &&
+            !mk_route_match(&h_handler->match, sr->uri_processed.data,
+                            sr->uri_processed.len)) {
+            continue;
+        }
+
+        sr->stage30_handler = h_handler->handler;
+        ret = plugin->stage->stage30(plugin, cs, sr,
+                                     h_handler->n_params,
+                                     &h_handler->params);
+
+        MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
+
+        /* Only a plugin that continues the work keeps the request */
+        if (ret != MK_PLUGIN_RET_CONTINUE) {
+            sr->stage30_handler = NULL;
+        }
+
+        switch (ret) {
+        case MK_PLUGIN_RET_CONTINUE:
+            return MK_PLUGIN_RET_CONTINUE;
+        case MK_PLUGIN_RET_CLOSE_CONX:
+            if (sr->headers.status > 0) {
+                return mk_http_error(sr->headers.status, cs, sr);
+            }
+            else {
+                return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
+            }
+        case MK_PLUGIN_RET_END:
+            return MK_EXIT_OK;
+        }
+    }
+
+    return -1;
+}
+
+int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
+{
+    int ret;
+    struct mimetype *mime;
+
     MK_TRACE("[FD %i] HTTP Protocol Init, session %p", cs->socket, sr);
 
     /* Request to root path of the virtualhost in question */
@@ -844,38 +967,9 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
     }
 
     /* Plugin Stage 30: look for handlers for this request */
-    if (sr->stage30_blocked == MK_FALSE) {
-        sr->uri_processed.data[sr->uri_processed.len] = '\0';
-
-        handlers = &sr->host_conf->handlers;
-        mk_list_foreach(head, handlers) {
-            h_handler = mk_list_entry(head, struct mk_host_handler, _head);
-            if (regexec(&h_handler->match,
-                        sr->uri_processed.data, 0, NULL, 0) != 0) {
-                continue;
-            }
-
-            plugin = h_handler->handler;
-            sr->stage30_handler = h_handler->handler;
-            ret = plugin->stage->stage30(plugin, cs, sr,
-                                         h_handler->n_params,
-                                         &h_handler->params);
-
-            MK_TRACE("[FD %i] STAGE_30 returned %i", cs->socket, ret);
-            switch (ret) {
-            case MK_PLUGIN_RET_CONTINUE:
-                return MK_PLUGIN_RET_CONTINUE;
-            case MK_PLUGIN_RET_CLOSE_CONX:
-                if (sr->headers.status > 0) {
-                    return mk_http_error(sr->headers.status, cs, sr);
-                }
-                else {
-                    return mk_http_error(MK_CLIENT_FORBIDDEN, cs, sr);
-                }
-            case MK_PLUGIN_RET_END:
-                return MK_EXIT_OK;
-            }
-        }
+    ret = mk_http_stage30(cs, sr);
+    if (ret != -1) {
+        return ret;
     }
 
     /*
@@ -920,9 +1014,9 @@ int mk_http_init(struct mk_http_session *cs, struct mk_http_request *sr)
     }
 
     /* Matching MimeType  */
-    mime = mk_mimetype_find(&sr->real_path);
+    mime = mk_mimetype_find(sr->gen->mimetypes, &sr->real_path);
     if (!mime) {
-        mime = mimetype_default;
+        mime = sr->gen->mimetypes->def;
     }
 
     if (sr->file_info.is_directory == MK_TRUE) {
@@ -1073,6 +1167,12 @@ int mk_http_keepalive_check(struct mk_http_session *cs,
         return -1;
     }
 
+    /* A new process took over, see mk_upgrade.h */
+    if (mk_unlikely(__atomic_load_n(&mk_upgrade_draining, __ATOMIC_RELAXED))) {
+        cs->close_now = MK_TRUE;
+        return -1;
+    }
+
     return 0;
 }
 
@@ -1133,24 +1233,12 @@ int mk_http_request_end(struct mk_http_session *cs)
     return -1;
 }
 
-void cb_stream_page_finished(struct mk_stream *stream)
-{
-    mk_ptr_t *page = stream->buffer;
-
-    mk_ptr_free(page);
-    mk_mem_free(page);
-}
-
 /* Enqueue an error response. This function always returns MK_EXIT_OK */
 int mk_http_error(int http_status, struct mk_http_session *cs,
                   struct mk_http_request *sr) {
-    int ret, fd;
     size_t count;
-    mk_ptr_t message;
     mk_ptr_t *page = NULL;
-    struct error_page *entry;
-    struct mk_list *head;
-    struct file_info finfo;
+    struct error_page *entry = NULL;
 
     mk_header_set_http_status(sr, http_status);
 
@@ -1160,91 +1248,24 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
      */
     if (http_status != MK_CLIENT_LENGTH_REQUIRED &&
         http_status != MK_CLIENT_BAD_REQUEST &&
-        http_status != MK_CLIENT_REQUEST_ENTITY_TOO_LARGE) {
-
+        http_status != MK_CLIENT_REQUEST_ENTITY_TOO_LARGE &&
+        sr->host_conf) {
         /* Lookup a customized error page */
-        mk_list_foreach(head, &sr->host_conf->error_pages) {
-            entry = mk_list_entry(head, struct error_page, _head);
-            if (entry->status != http_status) {
-                continue;
-            }
-
-            /* validate error file */
-            ret = mk_file_get_info(entry->real_path, &finfo, MK_FILE_READ);
-            if (ret == -1) {
-                break;
-            }
-
-            /* open file */
-            fd = open(entry->real_path, mk_config->open_flags);
-            if (fd == -1) {
-                break;
-            }
-
-            /* Outgoing headers */
-            sr->headers.content_length = finfo.size;
-            sr->headers.real_length    = finfo.size;
-            mk_header_prepare(cs, sr);
-
-            /* Stream setup */
-            sr->file_stream.type         = MK_STREAM_FILE;
-            sr->file_stream.fd           = fd;
-            sr->file_stream.bytes_total  = finfo.size;
-            sr->file_stream.bytes_offset = 0;
-
-            mk_stream_set(&sr->file_stream,
-                          MK_STREAM_FILE,
-                          cs->channel,
-                          NULL,
-                          finfo.size,
-                          NULL,
-                          NULL,
-                          NULL,
-                          NULL);
-
-            return MK_EXIT_OK;
-        }
+        entry = mk_vhost_error_page(sr->host_conf, http_status);
     }
 
-    mk_ptr_reset(&message);
-
-    switch (http_status) {
-    case MK_CLIENT_FORBIDDEN:
-        page = mk_http_error_page("Forbidden",
-                                  &sr->uri,
-                                  mk_config->server_signature);
-        break;
-    case MK_CLIENT_NOT_FOUND:
-        mk_string_build(&message.data, &message.len,
-                        "The requested URL was not found on this server.");
-        page = mk_http_error_page("Not Found",
-                                  &message,
-                                  mk_config->server_signature);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
-        mk_string_build(&message.data, &message.len,
-                        "The request entity is too large.");
-        page = mk_http_error_page("Entity too large",
-                                  &message,
-                                  mk_config->server_signature);
-        mk_ptr_free(&message);
-        break;
-    case MK_CLIENT_METHOD_NOT_ALLOWED:
-        page = mk_http_error_page("Method Not Allowed",
-                                  &sr->uri,
-                                  mk_config->server_signature);
-        break;
-    case MK_SERVER_NOT_IMPLEMENTED:
-        page = mk_http_error_page("Method Not Implemented",
-                                  &sr->uri,
-                                  mk_config->server_signature);
-        break;
-    case MK_SERVER_INTERNAL_ERROR:
-        page = mk_http_error_page("Internal Server Error",
-                                  &sr->uri,
-                                  mk_config->server_signature);
-        break;
+    if (entry) {
+        page = &entry->body;
+        sr->headers.content_type = entry->content_type;
+    }
+    else {
+        page = mk_http_error_page(http_status);
+        if (page) {
+            sr->headers.content_type = mk_http_error_content_type;
+        }
+        else {
+            mk_ptr_reset(&sr->headers.content_type);
+        }
     }
 
     if (page && sr->method != MK_METHOD_HEAD) {
@@ -1259,28 +1280,20 @@ int mk_http_error(int http_status, struct mk_http_session *cs,
     sr->headers.pconnections_left = 0;
     sr->headers.last_modified = -1;
 
-    if (!page) {
-        mk_ptr_reset(&sr->headers.content_type);
-    }
-    else {
-        mk_ptr_set(&sr->headers.content_type, "Content-Type: text/html\r\n");
-    }
-
     mk_header_prepare(cs, sr);
-    if (page) {
-        if (sr->method != MK_METHOD_HEAD) {
-            mk_stream_set(&sr->page_stream,
-                          MK_STREAM_PTR,
-                          cs->channel,
-                          page,
-                          -1,
-                          NULL,
-                          cb_stream_page_finished, NULL, NULL);
-        }
-        else {
-            mk_ptr_free(page);
-            mk_mem_free(page);
-        }
+
+    /*
+     * The page is shared, the stream only reads it. An empty page gets no
+     * stream: a zero bytes write is taken as a channel error.
+     */
+    if (page && page->len > 0 && sr->method != MK_METHOD_HEAD) {
+        mk_stream_set(&sr->page_stream,
+                      MK_STREAM_PTR,
+                      cs->channel,
+                      page,
+                      -1,
+                      NULL,
+                      NULL, NULL, NULL);
     }
 
     mk_channel_write(cs->channel, &count);
@@ -1303,6 +1316,12 @@ void mk_http_session_remove(struct mk_http_session *cs)
         return;
     }
 
+    /*
+     * Streams not sent yet notify their owners while the requests they
+     * belong to still exist.
+     */
+    mk_channel_clean(cs->channel);
+
     /* On session remove, make sure to cleanup any handler */
     mk_list_foreach_safe(head, tmp, &cs->request_list) {
         sr = mk_list_entry(head, struct mk_http_request, _head);
@@ -1403,6 +1422,12 @@ void mk_http_request_free(struct mk_http_request *sr)
     if (sr->real_path.data != sr->real_path_static) {
         mk_ptr_free(&sr->real_path);
     }
+
+    /* Last, the host may be released with the configuration */
+    if (sr->gen) {
+        mk_config_gen_release(sr->gen);
+        sr->gen = NULL;
+    }
 }
 
 void mk_http_request_free_list(struct mk_http_session *cs)
@@ -1502,6 +1527,13 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
                                 cs->body, cs->body_length);
         if (status == MK_HTTP_PARSER_OK) {
             MK_TRACE("[FD %i] HTTP_PARSER_OK", socket);
+            sr->init_ns = mk_clock_ns();
+
+            /* Keep-alive requests would account the idle time */
+            if (cs->counter_connections == 0) {
+                mk_latency_record(MK_LATENCY_PARSE,
+                                  sr->init_ns - conn->arrive_ns);
+            }
             if (mk_http_status_completed(cs, conn) == -1) {
                 mk_http_session_remove(cs);
                 return -1;
@@ -1514,6 +1546,7 @@ int mk_http_sched_read(struct mk_sched_conn *conn,
                 mk_channel_write(cs->channel, &count);
             }
             mk_http_session_remove(cs);
+            mk_metrics_add(MK_METRICS_PARSER_ERRORS, 1);
             MK_TRACE("[FD %i] HTTP_PARSER_ERROR", socket);
             return -1;
         }
@@ -1549,12 +1582,32 @@ int mk_http_sched_done(struct mk_sched_conn *conn,
                        struct mk_sched_worker *worker)
 {
     (void) worker;
+    uint64_t now;
     struct mk_http_session *cs;
     struct mk_http_request *sr;
 
     cs = mk_http_session_get(conn);
     sr = mk_list_entry_first(&cs->request_list, struct mk_http_request, _head);
 
+    /*
+     * The channel may drain while a plugin is still producing the
+     * response, the request ends when the plugin says so.
+     */
+    if (sr->stage30_handler) {
+        return 0;
+    }
+
+    /* The whole response has been written */
+    if (sr->init_ns > 0) {
+        now = mk_clock_ns();
+        if (sr->first_byte_ns > 0) {
+            mk_latency_record(MK_LATENCY_FIRST_BYTE,
+                              sr->first_byte_ns - sr->init_ns);
+        }
+        mk_latency_record(MK_LATENCY_LAST_BYTE, now - sr->init_ns);
+    }
+    mk_metrics_status(sr->headers.status);
+
     mk_plugin_stage_run_40(cs, sr);
 
     return mk_http_request_end(cs);
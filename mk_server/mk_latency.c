@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_latency.h>
+
+static const char *mk_latency_names[MK_LATENCY_TYPES] = {
+    "parse",
+    "first_byte",
+    "last_byte"
+};
+
+const char *mk_latency_name(int type)
+{
+    if (type < 0 || type >= MK_LATENCY_TYPES) {
+        return NULL;
+    }
+
+    return mk_latency_names[type];
+}
+
+struct mk_latency *mk_latency_create()
+{
+    return mk_mem_malloc_z(sizeof(struct mk_latency));
+}
+
+void mk_latency_destroy(struct mk_latency *lat)
+{
+    mk_mem_free(lat);
+}
+
+/* Record a value on the histogram of the calling worker */
+void mk_latency_record(int type, uint64_t value)
+{
+    struct mk_latency *lat;
+
+    if (mk_unlikely(!worker_sched_node)) {
+        return;
+    }
+
+    lat = worker_sched_node->latency;
+    if (mk_unlikely(!lat)) {
+        return;
+    }
+
+    mk_latency_add(&lat->h[type], value);
+}
+
+/*
+ * Merge the histograms of all workers for the given type. The workers
+ * keep writing while we read, so the result is a close snapshot, not an
+ * exact one.
+ */
+int mk_latency_merge(int type, struct mk_latency_histogram *out)
+{
+    int i;
+    int b;
+    uint64_t min;
+    uint64_t max;
+    uint64_t count;
+    struct mk_latency *lat;
+    struct mk_latency_histogram *h;
+
+    if (type < 0 || type >= MK_LATENCY_TYPES) {
+        return -1;
+    }
+
+    memset(out, '\0', sizeof(struct mk_latency_histogram));
+
+    for (i = 0; i < mk_config->workers; i++) {
+        lat = __atomic_load_n(&sched_list[i].latency, __ATOMIC_ACQUIRE);
+        if (!lat) {
+            continue;
+        }
+
+        h = &lat->h[type];
+        count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+        if (count == 0) {
+            continue;
+        }
+
+        min = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+        max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (out->count == 0 || min < out->min) {
+            out->min = min;
+        }
+        if (max > out->max) {
+            out->max = max;
+        }
+
+        out->count += count;
+        out->sum   += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+
+        for (b = 0; b < MK_LATENCY_BUCKETS; b++) {
+            out->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+
+    return 0;
+}
+
+/* Highest value that falls in the given bucket */
+static uint64_t mk_latency_bucket_value(int i)
+{
+    int shift;
+    uint64_t sub;
+
+    if (i < MK_LATENCY_SUB_COUNT) {
+        return i;
+    }
+
+    shift = (i / MK_LATENCY_SUB_HALF) - 1;
+    sub = i - (shift * MK_LATENCY_SUB_HALF);
+
+    return ((sub + 1) << shift) - 1;
+}
+
+/* Value at the given percentile (0 - 100) */
+uint64_t mk_latency_percentile(struct mk_latency_histogram *h, double p)
+{
+    int i;
+    uint64_t rank;
+    uint64_t total = 0;
+    uint64_t value;
+
+    if (h->count == 0) {
+        return 0;
+    }
+
+    /* The buckets are read live, use their own total as reference */
+    for (i = 0; i < MK_LATENCY_BUCKETS; i++) {
+        total += h->buckets[i];
+    }
+
+    rank = (uint64_t) ((p / 100.0) * total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    total = 0;
+    for (i = 0; i < MK_LATENCY_BUCKETS; i++) {
+        total += h->buckets[i];
+        if (total >= rank) {
+            value = mk_latency_bucket_value(i);
+            if (value > h->max) {
+                value = h->max;
+            }
+            return value;
+        }
+    }
+
+    return h->max;
+}
+
+int mk_latency_summary(int type, struct mk_latency_summary *s)
+{
+    int ret;
+    struct mk_latency_histogram *h;
+
+    h = mk_mem_malloc(sizeof(struct mk_latency_histogram));
+    if (!h) {
+        return -1;
+    }
+
+    ret = mk_latency_merge(type, h);
+    if (ret != 0) {
+        mk_mem_free(h);
+        return -1;
+    }
+
+    s->count = h->count;
+    s->min   = h->min;
+    s->max   = h->max;
+    s->mean  = h->count > 0 ? h->sum / h->count : 0;
+    s->p50   = mk_latency_percentile(h, 50.0);
+    s->p90   = mk_latency_percentile(h, 90.0);
+    s->p99   = mk_latency_percentile(h, 99.0);
+    s->p999  = mk_latency_percentile(h, 99.9);
+
+    mk_mem_free(h);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_config.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_metrics.h>
+
+static const char *mk_metrics_names[MK_METRICS_COUNTERS] = {
+    "status_1xx",
+    "status_2xx",
+    "status_3xx",
+    "status_4xx",
+    "status_5xx",
+    "bytes_sent",
+    "parser_errors",
+    "timeouts",
+    "fdt_hits",
+    "fdt_misses",
+    "cache_hits",
+    "cache_misses",
+    "tls_handshakes"
+};
+
+const char *mk_metrics_name(int id)
+{
+    if (id < 0 || id >= MK_METRICS_COUNTERS) {
+        return NULL;
+    }
+
+    return mk_metrics_names[id];
+}
+
+struct mk_metrics *mk_metrics_create()
+{
+    struct mk_metrics *metrics;
+
+    metrics = mk_mem_malloc_aligned(MK_CACHELINE_SIZE,
+                                    sizeof(struct mk_metrics));
+    if (!metrics) {
+        return NULL;
+    }
+
+    memset(metrics, '\0', sizeof(struct mk_metrics));
+    return metrics;
+}
+
+void mk_metrics_destroy(struct mk_metrics *metrics)
+{
+    mk_mem_free(metrics);
+}
+
+/* Increment a counter of the calling worker */
+void mk_metrics_add(int id, uint64_t value)
+{
+    struct mk_metrics *metrics;
+
+    if (mk_unlikely(!worker_sched_node)) {
+        return;
+    }
+
+    metrics = worker_sched_node->metrics;
+    if (mk_unlikely(!metrics)) {
+        return;
+    }
+
+    __atomic_store_n(&metrics->counter[id], metrics->counter[id] + value,
+                     __ATOMIC_RELAXED);
+}
+
+/* Account a finished request by its HTTP status class */
+void mk_metrics_status(int status)
+{
+    int class;
+
+    class = status / 100;
+    if (class < 1 || class > 5) {
+        return;
+    }
+
+    mk_metrics_add(MK_METRICS_STATUS_1XX + (class - 1), 1);
+}
+
+uint64_t mk_metrics_worker(int worker, int id)
+{
+    struct mk_metrics *metrics;
+
+    if (worker < 0 || worker >= mk_config->workers ||
+        id < 0 || id >= MK_METRICS_COUNTERS) {
+        return 0;
+    }
+
+    metrics = __atomic_load_n(&sched_list[worker].metrics, __ATOMIC_ACQUIRE);
+    if (!metrics) {
+        return 0;
+    }
+
+    return __atomic_load_n(&metrics->counter[id], __ATOMIC_RELAXED);
+}
+
+/* Sum of a counter over all workers, a close snapshot */
+uint64_t mk_metrics_total(int id)
+{
+    int i;
+    uint64_t total = 0;
+
+    for (i = 0; i < mk_config->workers; i++) {
+        total += mk_metrics_worker(i, id);
+    }
+
+    return total;
+}
@@ -32,89 +32,176 @@
 #include <monkey/mk_config.h>
 #include <monkey/mk_core.h>
 #include <monkey/mk_http.h>
+#include <monkey/mk_reload.h>
 
-struct mimetype *mimetype_default;
+/* Case insensitive FNV-1a, extensions are few and short */
+static inline unsigned int mk_mimetype_hash(const char *name, int len)
+{
+    int i;
+    unsigned char c;
+    unsigned int hash = 2166136261u;
+
+    for (i = 0; i < len; i++) {
+        c = name[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash ^= c;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
 
 /* Match mime type for requested resource */
-inline struct mimetype *mk_mimetype_lookup(char *name)
+static inline
+struct mimetype *mk_mimetype_table_lookup(struct mk_mimetype_table *table,
+                                          const char *name, int len)
+{
+    unsigned int i;
+    unsigned int hash;
+    struct mimetype *entry;
+
+    if (!table->slots) {
+        return NULL;
+    }
+
+    hash = mk_mimetype_hash(name, len);
+    for (i = hash & table->mask; (entry = table->slots[i]);
+         i = (i + 1) & table->mask) {
+        if (entry->hash == hash && entry->name_len == len &&
+            strncasecmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Lookup on the configuration generation used by the caller */
+struct mimetype *mk_mimetype_lookup(char *name)
+{
+    return mk_mimetype_table_lookup(mk_config_gen_get()->mimetypes,
+                                    name, strlen(name));
+}
+
+/* Worth compressing: text, scripts and the like */
+static int mk_mimetype_compressible(const char *type)
+{
+    if (strncasecmp(type, "text/", 5) == 0 ||
+        strcasestr(type, "+xml") || strcasestr(type, "+json") ||
+        strcasestr(type, "javascript") ||
+        strcasecmp(type, "application/json") == 0 ||
+        strcasecmp(type, "application/xml") == 0) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+static void mk_mimetype_slot_set(struct mimetype **slots, unsigned int mask,
+                                 struct mimetype *mime)
+{
+    unsigned int i;
+
+    for (i = mime->hash & mask; slots[i]; i = (i + 1) & mask);
+    slots[i] = mime;
+}
+
+/* Double the table size */
+static int mk_mimetype_grow(struct mk_mimetype_table *table)
 {
-    int cmp;
-  	struct rb_node *node = mimetype_rb_head.rb_node;
-
-  	while (node) {
-  		struct mimetype *entry = container_of(node, struct mimetype, _rb_head);
-
-        cmp = strcmp(name, entry->name);
-		if (cmp < 0)
-  			node = node->rb_left;
-		else if (cmp > 0)
-  			node = node->rb_right;
-		else {
-  			return entry;
+    unsigned int i;
+    unsigned int size;
+    struct mimetype **slots;
+
+    size = table->slots ? (table->mask + 1) * 2 : 64;
+    slots = mk_mem_malloc_z(sizeof(struct mimetype *) * size);
+    if (!slots) {
+        return -1;
+    }
+
+    if (table->slots) {
+        for (i = 0; i <= table->mask; i++) {
+            if (table->slots[i]) {
+                mk_mimetype_slot_set(slots, size - 1, table->slots[i]);
+            }
         }
-	}
-	return NULL;
+        mk_mem_free(table->slots);
+    }
+
+    table->slots = slots;
+    table->mask = size - 1;
+    return 0;
+}
+
+static int mk_mimetype_set_type(struct mimetype *mime, const char *type)
+{
+    unsigned long len;
+
+    mime->type.data = NULL;
+    mk_string_build(&mime->type.data, &len, "%s\r\n", type);
+    mime->type.len = len;
+
+    mime->header_type.data = NULL;
+    mk_string_build(&mime->header_type.data, &len,
+                    "Content-Type: %s\r\n", type);
+    mime->header_type.len = len;
+
+    mime->compressible = mk_mimetype_compressible(type);
+
+    if (!mime->type.data || !mime->header_type.data) {
+        return -1;
+    }
+    return 0;
 }
 
-int mk_mimetype_add(char *name, const char *type)
+int mk_mimetype_add(struct mk_mimetype_table *table,
+                    char *name, const char *type)
 {
-    int cmp;
-    int len = strlen(type) + 3;
+    int len = strlen(name);
     char *p;
     struct mimetype *new_mime;
-    struct rb_node **new;
-    struct rb_node *parent = NULL;
 
-    /* make sure we register the extension in lower case */
-    p = name;
-    for ( ; *p; ++p) *p = tolower(*p);
+    if (mk_mimetype_table_lookup(table, name, len)) {
+        return -1;
+    }
+
+    if ((unsigned int) (table->n + 1) * 2 > (table->slots ? table->mask + 1 : 0) &&
+        mk_mimetype_grow(table) != 0) {
+        return -1;
+    }
 
     new_mime = mk_mem_malloc_z(sizeof(struct mimetype));
     new_mime->name = mk_string_dup(name);
-    new_mime->type.data = mk_mem_malloc(len);
-    new_mime->type.len = len - 1;
-    new_mime->header_type.data = mk_mem_malloc(len + 32);
-    new_mime->header_type.len = snprintf(new_mime->header_type.data,
-                                         len + 32,
-                                         "Content-Type: %s\r\n",
-                                         type);
-    strcpy(new_mime->type.data, type);
-    strcat(new_mime->type.data, MK_CRLF);
-    new_mime->type.data[len-1] = '\0';
-
-    /* Red-Black tree insert routine */
-    new = &(mimetype_rb_head.rb_node);
-
-    /* Figure out where to put new node */
-    while (*new) {
-        struct mimetype *this = container_of(*new, struct mimetype, _rb_head);
-
-        parent = *new;
-        cmp = strcmp(new_mime->name, this->name);
-        if (cmp < 0) {
-            new = &((*new)->rb_left);
-        }
-        else if (cmp > 0) {
-            new = &((*new)->rb_right);
-        }
-        else {
-            mk_mem_free(new_mime);
-            return -1;
-        }
+    new_mime->name_len = len;
+
+    /* make sure we register the extension in lower case */
+    for (p = new_mime->name; *p; ++p) *p = tolower(*p);
+    new_mime->hash = mk_mimetype_hash(new_mime->name, len);
+
+    if (mk_mimetype_set_type(new_mime, type) != 0) {
+        mk_mem_free(new_mime->type.data);
+        mk_mem_free(new_mime->header_type.data);
+        mk_mem_free(new_mime->name);
+        mk_mem_free(new_mime);
+        return -1;
     }
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&new_mime->_rb_head, parent, new);
-    rb_insert_color(&new_mime->_rb_head, &mimetype_rb_head);
+    mk_mimetype_slot_set(table->slots, table->mask, new_mime);
+    table->n++;
 
     /* Add to linked list head */
-    mk_list_add(&new_mime->_head, &mimetype_list);
+    mk_list_add(&new_mime->_head, &table->list);
 
     return 0;
 }
 
-/* Load the two mime arrays into memory */
-void mk_mimetype_read_config()
+/*
+ * Load the mime types into a new table, it returns NULL if the file is not
+ * valid.
+ */
+struct mk_mimetype_table *mk_mimetype_read_config()
 {
     char path[MK_MAX_PATH];
     struct mk_rconf *cnf;
@@ -122,11 +209,23 @@ void mk_mimetype_read_config()
     struct mk_rconf_entry *entry;
     struct mk_list *head;
     struct file_info f_info;
+    struct mk_mimetype_table *table;
+    unsigned long len;
     int ret;
 
     /* Initialize the heads */
-    mk_list_init(&mimetype_list);
-    mimetype_rb_head = RB_ROOT;
+    table = mk_mem_malloc_z(sizeof(struct mk_mimetype_table));
+    mk_list_init(&table->list);
+
+    /* Set default mime type, DefaultMimeType ends with CRLF */
+    table->def = mk_mem_malloc_z(sizeof(struct mimetype));
+    table->def->name = MIMETYPE_DEFAULT_NAME;
+    mk_ptr_set(&table->def->type, mk_config->default_mimetype);
+    mk_string_build(&table->def->header_type.data, &len,
+                    "Content-Type: %s", mk_config->default_mimetype);
+    table->def->header_type.len = len;
+    table->def->compressible =
+        mk_mimetype_compressible(mk_config->default_mimetype);
 
     /* Read mime types configuration file */
     snprintf(path, MK_MAX_PATH, "%s/%s",
@@ -137,17 +236,17 @@ void mk_mimetype_read_config()
     if (ret == -1 || f_info.is_file == MK_FALSE)
         snprintf(path, MK_MAX_PATH, "%s", mk_config->mimes_conf_file);
 
-    cnf = mk_rconf_create(path);
+    cnf = mk_rconf_open(path);
     if (!cnf) {
         mk_warn("No mimetypes loaded");
-        return;
+        return table;
     }
 
     /* Get MimeTypes tag */
     section = mk_rconf_section_get(cnf, "MIMETYPES");
     if (!section) {
         mk_err("Error: Invalid mime type file");
-        exit(EXIT_FAILURE);
+        goto error;
     }
 
     mk_list_foreach(head, &section->entries) {
@@ -156,45 +255,50 @@ void mk_mimetype_read_config()
             continue;
         }
 
-        if (mk_mimetype_add(entry->key, entry->val) != 0) {
+        if (mk_mimetype_add(table, entry->key, entry->val) != 0) {
             mk_err("Error loading Mime Types");
-            exit(EXIT_FAILURE);
+            goto error;
         }
     }
 
-    /* Set default mime type */
-    mimetype_default = mk_mem_malloc_z(sizeof(struct mimetype));
-    mimetype_default->name = MIMETYPE_DEFAULT_TYPE;
-    mk_ptr_set(&mimetype_default->type, mk_config->default_mimetype);
+    mk_rconf_free(cnf);
+    return table;
 
+ error:
     mk_rconf_free(cnf);
+    mk_mimetype_free_all(table);
+    return NULL;
 }
 
-struct mimetype *mk_mimetype_find(mk_ptr_t *filename)
+struct mimetype *mk_mimetype_find(struct mk_mimetype_table *table,
+                                  mk_ptr_t *filename)
 {
-    int j, len;
-
-    j = len = filename->len;
+    int j;
 
-    /* looking for extension */
+    /* looking for extension, in the last path component */
+    j = filename->len - 1;
     while (j >= 0 && filename->data[j] != '.') {
+        if (filename->data[j] == '/') {
+            return NULL;
+        }
         j--;
     }
 
-    if (j <= 0) {
+    if (j <= 0 || j == (int) filename->len - 1) {
         return NULL;
     }
 
-    return mk_mimetype_lookup(filename->data + j + 1);
+    return mk_mimetype_table_lookup(table, filename->data + j + 1,
+                                    filename->len - j - 1);
 }
 
-void mk_mimetype_free_all()
+void mk_mimetype_free_all(struct mk_mimetype_table *table)
 {
     struct mk_list *head;
     struct mk_list *tmp;
     struct mimetype *mime;
 
-    mk_list_foreach_safe(head, tmp, &mimetype_list) {
+    mk_list_foreach_safe(head, tmp, &table->list) {
         mime = mk_list_entry(head, struct mimetype, _head);
         mk_ptr_free(&mime->type);
         mk_mem_free(mime->name);
@@ -202,6 +306,8 @@ void mk_mimetype_free_all()
         mk_mem_free(mime);
     }
 
-    mk_mem_free(mimetype_default->type.data);
-    mk_mem_free(mimetype_default);
+    mk_mem_free(table->slots);
+    mk_mem_free(table->def->header_type.data);
+    mk_mem_free(table->def);
+    mk_mem_free(table);
 }
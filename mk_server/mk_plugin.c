@@ -24,6 +24,7 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_mimetype.h>
 #include <monkey/mk_vhost.h>
+#include <monkey/mk_reload.h>
 #include <monkey/mk_static_plugins.h>
 #include <monkey/mk_plugin_stage.h>
 #include <monkey/mk_core.h>
@@ -317,6 +318,7 @@ void mk_plugin_api_init()
     api->socket_set_nonblocking = mk_socket_set_nonblocking;
     api->socket_create = mk_socket_create;
     api->socket_ip_str = mk_socket_ip_str;
+    api->socket_addr_str = mk_socket_addr_str;
 
     /* Config Callbacks */
     api->config_create = mk_rconf_create;
@@ -324,6 +326,11 @@ void mk_plugin_api_init()
     api->config_section_get = mk_rconf_section_get;
     api->config_section_get_key = mk_rconf_section_get_key;
 
+    /* Virtual hosts */
+    api->vhost_data_key = mk_vhost_data_key;
+    api->config_gen_acquire = mk_config_gen_acquire;
+    api->config_gen_release = mk_config_gen_release;
+
     /* Scheduler and Event callbacks */
     api->sched_loop           = mk_sched_loop;
     api->sched_get_connection = mk_sched_get_connection;
@@ -331,6 +338,18 @@ void mk_plugin_api_init()
     api->sched_remove_client  = mk_plugin_sched_remove_client;
     api->sched_worker_info    = mk_plugin_sched_get_thread_conf;
 
+    /* Latency histograms */
+    api->latency_name       = mk_latency_name;
+    api->latency_merge      = mk_latency_merge;
+    api->latency_percentile = mk_latency_percentile;
+    api->latency_summary    = mk_latency_summary;
+
+    /* Worker metrics */
+    api->metrics_name   = mk_metrics_name;
+    api->metrics_add    = mk_metrics_add;
+    api->metrics_worker = mk_metrics_worker;
+    api->metrics_total  = mk_metrics_total;
+
     /* Worker functions */
     api->worker_spawn = mk_utils_worker_spawn;
     api->worker_rename = mk_utils_worker_rename;
@@ -457,7 +476,9 @@ void mk_plugin_load_all()
 
     /* Look for plugins thread key data */
     mk_plugin_preworker_calls();
-    mk_vhost_map_handlers();
+    if (mk_vhost_map_handlers(&mk_config->gen->hosts) < 0) {
+        exit(EXIT_FAILURE);
+    }
     mk_mem_free(path);
     mk_rconf_free(cnf);
 }
@@ -575,12 +596,27 @@ int mk_plugin_http_request_end(struct mk_http_session *cs, int close)
     }
 
     sr = mk_list_entry_last(&cs->request_list, struct mk_http_request, _head);
-    mk_plugin_stage_run_40(cs, sr);
+    sr->stage30_handler = NULL;
 
     if (close == MK_TRUE) {
         cs->close_now = MK_TRUE;
     }
 
+    /*
+     * If the client have not received the whole response yet, the
+     * scheduler finish the request once the channel gets drained.
+     */
+    if (mk_channel_is_empty(cs->channel) != 0) {
+        ret = mk_channel_flush(cs->channel);
+        if (!(ret & MK_CHANNEL_ERROR) &&
+            mk_channel_is_empty(cs->channel) != 0) {
+            return 0;
+        }
+    }
+
+    mk_metrics_status(sr->headers.status);
+    mk_plugin_stage_run_40(cs, sr);
+
     /* Let's check if we should ask to finalize the connection or not */
     ret = mk_http_request_end(cs);
     MK_TRACE("[FD %i] HTTP session end = %i", cs->socket, ret);
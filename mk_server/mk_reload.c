@@ -0,0 +1,372 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_reload.h>
+#include <monkey/mk_upgrade.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_plugin.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_utils.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Generation used by a worker, see mk_config_gen_pin() */
+struct mk_config_gen_slot {
+    struct mk_config_gen *gen;
+} MK_CACHELINE_ALIGNED;
+
+static struct mk_config_gen_slot *gen_slots;
+static struct mk_list gen_retired;
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* SIGHUP, SIGUSR2 -> reload thread */
+static int reload_fd[2] = {-1, -1};
+
+/*
+ * Read the virtual hosts and the mime types into a new generation, it
+ * returns NULL if some file is not valid. The handlers are not mapped yet,
+ * the plugins may not be loaded.
+ */
+struct mk_config_gen *mk_config_gen_create()
+{
+    int n;
+    size_t size;
+    struct mk_config_gen *gen;
+
+    gen = mk_mem_malloc_z(sizeof(struct mk_config_gen));
+    if (!gen) {
+        return NULL;
+    }
+    mk_list_init(&gen->hosts);
+
+    size = sizeof(struct mk_config_gen_ref) * (mk_config->workers + 1);
+    gen->refs = mk_mem_malloc_aligned(MK_CACHELINE_SIZE, size);
+    if (!gen->refs) {
+        mk_mem_free(gen);
+        return NULL;
+    }
+    memset(gen->refs, '\0', size);
+
+    if (mk_config->one_shot) {
+        n = mk_vhost_set_single(mk_config->one_shot, &gen->hosts);
+    }
+    else {
+        n = mk_vhost_init(mk_config->serverconf, &gen->hosts);
+    }
+    if (n <= 0) {
+        goto error;
+    }
+    gen->nhosts = n;
+
+    gen->mimetypes = mk_mimetype_read_config();
+    if (!gen->mimetypes) {
+        goto error;
+    }
+    mk_vhost_error_pages_load(&gen->hosts, gen->mimetypes);
+
+    gen->vhost_index = mk_vhost_index_create(&gen->hosts);
+    return gen;
+
+ error:
+    mk_config_gen_free(gen);
+    return NULL;
+}
+
+void mk_config_gen_free(struct mk_config_gen *gen)
+{
+    struct mk_list *head;
+    struct mk_plugin *p;
+
+    /* Let the plugins release what they attached to the hosts */
+    mk_list_foreach(head, &mk_config->plugins) {
+        p = mk_list_entry(head, struct mk_plugin, _head);
+        if (p->vhost_exit) {
+            p->vhost_exit(&gen->hosts);
+        }
+    }
+
+    mk_vhost_index_free(gen->vhost_index);
+    mk_vhost_free_all(&gen->hosts);
+    if (gen->mimetypes) {
+        mk_mimetype_free_all(gen->mimetypes);
+    }
+    mk_mem_free(gen->refs);
+    mk_mem_free(gen);
+}
+
+/*
+ * Publish in the worker slot the current generation. If a reload happens
+ * meanwhile it may not see the slot, so the generation is checked again
+ * once published.
+ */
+static inline
+struct mk_config_gen *mk_config_gen_pin(struct mk_config_gen_slot *slot)
+{
+    struct mk_config_gen *gen;
+    struct mk_config_gen *check;
+
+    gen = __atomic_load_n(&mk_config->gen, __ATOMIC_SEQ_CST);
+    if (mk_likely(gen == slot->gen)) {
+        return gen;
+    }
+
+    do {
+        __atomic_store_n(&slot->gen, gen, __ATOMIC_SEQ_CST);
+        check = gen;
+        gen = __atomic_load_n(&mk_config->gen, __ATOMIC_SEQ_CST);
+    } while (gen != check);
+
+    return gen;
+}
+
+/* Take the current generation, it must be released by the same thread */
+struct mk_config_gen *mk_config_gen_acquire()
+{
+    struct mk_config_gen *gen;
+    struct mk_sched_worker *sched = mk_sched_get_thread_conf();
+
+    if (mk_likely(sched != NULL)) {
+        gen = mk_config_gen_pin(&gen_slots[sched->idx]);
+        __atomic_add_fetch(&gen->refs[sched->idx].n, 1, __ATOMIC_SEQ_CST);
+        return gen;
+    }
+
+    /* Other threads: the reload thread frees generations under the lock */
+    pthread_mutex_lock(&gen_lock);
+    gen = mk_config->gen;
+    __atomic_add_fetch(&gen->refs[mk_config->workers].n, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&gen_lock);
+
+    return gen;
+}
+
+void mk_config_gen_release(struct mk_config_gen *gen)
+{
+    int id;
+    struct mk_sched_worker *sched = mk_sched_get_thread_conf();
+
+    id = sched ? sched->idx : mk_config->workers;
+    __atomic_sub_fetch(&gen->refs[id].n, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * The current generation for a lookup without a request at hand. For a
+ * worker it stays valid until it takes another generation, other threads
+ * must not keep it.
+ */
+struct mk_config_gen *mk_config_gen_get()
+{
+    struct mk_sched_worker *sched = mk_sched_get_thread_conf();
+
+    if (sched && gen_slots) {
+        return mk_config_gen_pin(&gen_slots[sched->idx]);
+    }
+
+    return __atomic_load_n(&mk_config->gen, __ATOMIC_SEQ_CST);
+}
+
+/* An idle worker lets the old generation go, called on its timeouts check */
+void mk_config_gen_worker_sync()
+{
+    struct mk_sched_worker *sched = mk_sched_get_thread_conf();
+
+    if (sched && gen_slots) {
+        mk_config_gen_pin(&gen_slots[sched->idx]);
+    }
+}
+
+static int mk_config_gen_in_use(struct mk_config_gen *gen)
+{
+    int i;
+
+    for (i = 0; i < mk_config->workers; i++) {
+        if (__atomic_load_n(&gen_slots[i].gen, __ATOMIC_SEQ_CST) == gen) {
+            return MK_TRUE;
+        }
+    }
+
+    for (i = 0; i <= mk_config->workers; i++) {
+        if (__atomic_load_n(&gen->refs[i].n, __ATOMIC_SEQ_CST) > 0) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/* Free the retired generations nobody uses, returns how many are left */
+static int mk_reload_collect()
+{
+    int n = 0;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_config_gen *gen;
+
+    pthread_mutex_lock(&gen_lock);
+    mk_list_foreach_safe(head, tmp, &gen_retired) {
+        gen = mk_list_entry(head, struct mk_config_gen, _head);
+        if (mk_config_gen_in_use(gen) == MK_TRUE) {
+            n++;
+            continue;
+        }
+
+        MK_TRACE("Release configuration generation %u", gen->id);
+        mk_list_del(&gen->_head);
+        mk_config_gen_free(gen);
+    }
+    pthread_mutex_unlock(&gen_lock);
+
+    return n;
+}
+
+/*
+ * Build a generation from the files and publish it. The virtual hosts and
+ * the mime types are read again; the rest of monkey.conf, the listeners
+ * and the plugins are kept.
+ */
+static int mk_reload_config()
+{
+    struct mk_list *head;
+    struct mk_plugin *p;
+    struct mk_config_gen *gen;
+    struct mk_config_gen *old;
+
+    gen = mk_config_gen_create();
+    if (!gen) {
+        goto error;
+    }
+
+    if (mk_vhost_map_handlers(&gen->hosts) < 0) {
+        mk_config_gen_free(gen);
+        goto error;
+    }
+
+    mk_list_foreach(head, &mk_config->plugins) {
+        p = mk_list_entry(head, struct mk_plugin, _head);
+        if (p->vhost_init && p->vhost_init(&gen->hosts) != 0) {
+            mk_err("Plugin '%s' rejected the new virtual hosts", p->shortname);
+            mk_config_gen_free(gen);
+            goto error;
+        }
+    }
+
+    pthread_mutex_lock(&gen_lock);
+    old = mk_config->gen;
+    gen->id = old->id + 1;
+    __atomic_store_n(&mk_config->gen, gen, __ATOMIC_SEQ_CST);
+    mk_list_add(&old->_head, &gen_retired);
+    pthread_mutex_unlock(&gen_lock);
+
+    mk_info("Configuration reloaded: %i virtual hosts (generation %u)",
+            gen->nhosts, gen->id);
+    return 0;
+
+ error:
+    mk_err("Configuration reload failed, the current one is kept");
+    return -1;
+}
+
+static void mk_reload_worker(void *data)
+{
+    int i;
+    int ret;
+    int req;
+    int timeout = -1;
+    char buf[16];
+    struct pollfd pfd;
+    (void) data;
+
+    mk_utils_worker_rename("monkey: reload");
+
+    pfd.fd = reload_fd[0];
+    pfd.events = POLLIN;
+
+    while (1) {
+        ret = poll(&pfd, 1, timeout);
+        if (ret > 0) {
+            /* signals received in a row make a single request */
+            req = 0;
+            while ((ret = read(reload_fd[0], buf, sizeof(buf))) > 0) {
+                for (i = 0; i < ret; i++) {
+                    req |= buf[i];
+                }
+            }
+
+            if (req & MK_RELOAD_CONFIG) {
+                mk_reload_config();
+            }
+            if (req & MK_RELOAD_UPGRADE) {
+                mk_upgrade_start();
+            }
+        }
+
+        /* Check every second until the old generations are released */
+        if (mk_reload_collect() > 0) {
+            timeout = 1000;
+        }
+        else {
+            timeout = -1;
+        }
+    }
+}
+
+/* Called before launching the workers */
+int mk_reload_init()
+{
+    int i;
+    size_t size;
+
+    size = sizeof(struct mk_config_gen_slot) * mk_config->workers;
+    gen_slots = mk_mem_malloc_aligned(MK_CACHELINE_SIZE, size);
+    if (!gen_slots) {
+        return -1;
+    }
+    memset(gen_slots, '\0', size);
+    mk_list_init(&gen_retired);
+
+    if (pipe(reload_fd) == -1) {
+        mk_libc_error("pipe");
+        return -1;
+    }
+
+    for (i = 0; i < 2; i++) {
+        fcntl(reload_fd[i], F_SETFL, fcntl(reload_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(reload_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    mk_utils_worker_spawn(mk_reload_worker, NULL);
+    return 0;
+}
+
+/* Signal handler context: just wake up the reload thread */
+void mk_reload_signal(char type)
+{
+    int ret;
+    int err = errno;
+
+    if (reload_fd[1] != -1) {
+        ret = write(reload_fd[1], &type, 1);
+        (void) ret;
+    }
+    errno = err;
+}
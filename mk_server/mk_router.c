@@ -0,0 +1,491 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_core.h>
+#include <monkey/mk_vhost.h>
+#include <monkey/mk_router.h>
+
+#include <ctype.h>
+
+#define MK_ROUTE_HASH_INIT  2166136261U
+#define MK_ROUTE_HASH_PRIME 16777619U
+
+static inline unsigned int mk_route_hash(const char *s, int len)
+{
+    int i;
+    unsigned int hash = MK_ROUTE_HASH_INIT;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) tolower(s[i])) * MK_ROUTE_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* 'lower' is already lowercase */
+static inline int mk_route_ieq(const char *s, const char *lower, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++) {
+        if (tolower((unsigned char) s[i]) != (unsigned char) lower[i]) {
+            return MK_FALSE;
+        }
+    }
+    return MK_TRUE;
+}
+
+static inline int mk_route_isearch(const char *s, int len,
+                                   const char *lower, int l_len)
+{
+    int i;
+
+    for (i = 0; i + l_len <= len; i++) {
+        if (tolower((unsigned char) s[i]) == (unsigned char) lower[0] &&
+            mk_route_ieq(s + i + 1, lower + 1, l_len - 1)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void mk_route_piece_add(struct mk_route_pattern *pattern,
+                               char *buf, int len)
+{
+    int n = pattern->n_pieces;
+
+    pattern->pieces = mk_mem_realloc(pattern->pieces, sizeof(char *) * (n + 1));
+    pattern->lens = mk_mem_realloc(pattern->lens, sizeof(int) * (n + 1));
+    pattern->pieces[n] = mk_mem_malloc(len + 1);
+    memcpy(pattern->pieces[n], buf, len);
+    pattern->pieces[n][len] = '\0';
+    pattern->lens[n] = len;
+    pattern->n_pieces++;
+}
+
+/*
+ * Break the pattern in literals separated by '.*'. It returns -1 if the
+ * pattern uses anything else from the regular expressions syntax.
+ */
+static int mk_route_split(struct mk_route_pattern *pattern, char *str)
+{
+    int len = 0;
+    int wild = MK_FALSE;          /* '.*' before the current literal */
+    char *p = str;
+    char *buf;
+
+    buf = mk_mem_malloc(strlen(str) + 1);
+
+    if (*p == '^') {
+        pattern->anchor_start = MK_TRUE;
+        p++;
+    }
+
+    while (*p) {
+        if (p[0] == '.' && p[1] == '*') {
+            if (len > 0) {
+                mk_route_piece_add(pattern, buf, len);
+                len = 0;
+            }
+            else if (pattern->n_pieces == 0) {
+                pattern->anchor_start = MK_FALSE;
+            }
+            wild = MK_TRUE;
+            p += 2;
+            continue;
+        }
+
+        if (p[0] == '$' && p[1] == '\0') {
+            pattern->anchor_end = !(wild == MK_TRUE && len == 0);
+            break;
+        }
+
+        if (p[0] == '\\' && p[1] && !isalnum((unsigned char) p[1])) {
+            p++;
+        }
+        else if (strchr(".[]()|*+?{}^$\\", *p)) {
+            mk_mem_free(buf);
+            return -1;
+        }
+
+        buf[len++] = tolower((unsigned char) *p);
+        wild = MK_FALSE;
+        p++;
+    }
+
+    if (len > 0) {
+        mk_route_piece_add(pattern, buf, len);
+    }
+
+    mk_mem_free(buf);
+    return 0;
+}
+
+static void mk_route_pattern_reset(struct mk_route_pattern *pattern)
+{
+    int i;
+
+    for (i = 0; i < pattern->n_pieces; i++) {
+        mk_mem_free(pattern->pieces[i]);
+    }
+    mk_mem_free(pattern->pieces);
+    mk_mem_free(pattern->lens);
+    pattern->pieces = NULL;
+    pattern->lens = NULL;
+    pattern->n_pieces = 0;
+    pattern->anchor_start = MK_FALSE;
+    pattern->anchor_end = MK_FALSE;
+}
+
+/* Compile a Match pattern, it returns -1 if it is not valid */
+int mk_route_compile(struct mk_route_pattern *pattern, char *str)
+{
+    int ret;
+    char tmp[80];
+
+    memset(pattern, '\0', sizeof(struct mk_route_pattern));
+
+    if (mk_route_split(pattern, str) != 0) {
+        mk_route_pattern_reset(pattern);
+        ret = regcomp(&pattern->regex, str, REG_EXTENDED|REG_ICASE|REG_NOSUB);
+        if (ret) {
+            regerror(ret, &pattern->regex, tmp, sizeof(tmp));
+            mk_err("Handler config: Failed to compile regex: %s", tmp);
+            return -1;
+        }
+        pattern->type = MK_ROUTE_REGEX;
+        return 0;
+    }
+
+    /* Every URI starts with a slash */
+    if (pattern->n_pieces == 1 && pattern->lens[0] == 1 &&
+        pattern->pieces[0][0] == '/' && pattern->anchor_end == MK_FALSE) {
+        mk_route_pattern_reset(pattern);
+    }
+
+    if (pattern->n_pieces == 0) {
+        pattern->type = (pattern->anchor_start && pattern->anchor_end) ?
+            MK_ROUTE_EXACT : MK_ROUTE_ANY;
+    }
+    else if (pattern->n_pieces > 1) {
+        pattern->type = MK_ROUTE_GLOB;
+    }
+    else if (pattern->anchor_start && pattern->anchor_end) {
+        pattern->type = MK_ROUTE_EXACT;
+    }
+    else if (pattern->anchor_start) {
+        pattern->type = MK_ROUTE_PREFIX;
+    }
+    else if (pattern->anchor_end) {
+        pattern->type = MK_ROUTE_SUFFIX;
+    }
+    else {
+        pattern->type = MK_ROUTE_GLOB;
+    }
+
+    return 0;
+}
+
+void mk_route_free(struct mk_route_pattern *pattern)
+{
+    if (pattern->type == MK_ROUTE_REGEX) {
+        regfree(&pattern->regex);
+    }
+    mk_route_pattern_reset(pattern);
+}
+
+/* Does the URI match the pattern ? */
+int mk_route_match(struct mk_route_pattern *pattern, const char *uri, int len)
+{
+    int i;
+    int ret;
+    int pos = 0;
+    int l_len;
+    char *lower;
+
+    if (pattern->type == MK_ROUTE_ANY) {
+        return MK_TRUE;
+    }
+
+    if (pattern->type == MK_ROUTE_REGEX) {
+#ifdef REG_STARTEND
+        regmatch_t match;
+
+        match.rm_so = 0;
+        match.rm_eo = len;
+        ret = regexec(&pattern->regex, uri, 1, &match, REG_STARTEND);
+#else
+        char *buf;
+
+        buf = mk_mem_malloc(len + 1);
+        memcpy(buf, uri, len);
+        buf[len] = '\0';
+        ret = regexec(&pattern->regex, buf, 0, NULL, 0);
+        mk_mem_free(buf);
+#endif
+        return (ret == 0);
+    }
+
+    if (pattern->n_pieces == 0) {
+        /* '^$' */
+        return (len == 0);
+    }
+
+    for (i = 0; i < pattern->n_pieces; i++) {
+        lower = pattern->pieces[i];
+        l_len = pattern->lens[i];
+
+        if (i == 0 && pattern->anchor_start) {
+            if (l_len > len || !mk_route_ieq(uri, lower, l_len)) {
+                return MK_FALSE;
+            }
+            if (pattern->n_pieces == 1 && pattern->anchor_end) {
+                return (l_len == len);
+            }
+            pos = l_len;
+            continue;
+        }
+
+        if (i == pattern->n_pieces - 1 && pattern->anchor_end) {
+            return (len - pos >= l_len &&
+                    mk_route_ieq(uri + len - l_len, lower, l_len));
+        }
+
+        ret = mk_route_isearch(uri + pos, len - pos, lower, l_len);
+        if (ret < 0) {
+            return MK_FALSE;
+        }
+        pos += ret + l_len;
+    }
+
+    return MK_TRUE;
+}
+
+static struct mk_route_trie *mk_route_trie_child(struct mk_route_trie *node,
+                                                 unsigned char c, int *pos)
+{
+    int low = 0;
+    int mid;
+    int high = node->n_children - 1;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        if (node->children[mid]->c == c) {
+            *pos = mid;
+            return node->children[mid];
+        }
+        else if (node->children[mid]->c < c) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    *pos = low;
+    return NULL;
+}
+
+/* Insert the literal forward or, if 'reverse' is set, from its end */
+static void mk_route_trie_add(struct mk_route_trie *root,
+                              const char *str, int len, int reverse, int id)
+{
+    int i;
+    int pos;
+    unsigned char c;
+    struct mk_route_trie *node = root;
+    struct mk_route_trie *child;
+
+    for (i = 0; i < len; i++) {
+        c = reverse ? str[len - 1 - i] : str[i];
+        child = mk_route_trie_child(node, c, &pos);
+        if (!child) {
+            child = mk_mem_malloc_z(sizeof(struct mk_route_trie));
+            child->c = c;
+            node->children = mk_mem_realloc(node->children,
+                                            sizeof(struct mk_route_trie *) *
+                                            (node->n_children + 1));
+            memmove(&node->children[pos + 1], &node->children[pos],
+                    sizeof(struct mk_route_trie *) * (node->n_children - pos));
+            node->children[pos] = child;
+            node->n_children++;
+        }
+        node = child;
+    }
+
+    node->ids = mk_mem_realloc(node->ids, sizeof(int) * (node->n_ids + 1));
+    node->ids[node->n_ids++] = id;
+}
+
+static void mk_route_trie_free(struct mk_route_trie *node)
+{
+    int i;
+
+    for (i = 0; i < node->n_children; i++) {
+        mk_route_trie_free(node->children[i]);
+    }
+    mk_mem_free(node->children);
+    mk_mem_free(node->ids);
+    mk_mem_free(node);
+}
+
+static inline void mk_route_trie_walk(struct mk_route_trie *node,
+                                      const char *uri, int len, int reverse,
+                                      uint64_t *map)
+{
+    int i;
+    int j;
+    int pos;
+    unsigned char c;
+
+    for (i = 0; i < len && node->n_children > 0; i++) {
+        c = tolower((unsigned char) (reverse ? uri[len - 1 - i] : uri[i]));
+        node = mk_route_trie_child(node, c, &pos);
+        if (!node) {
+            return;
+        }
+        for (j = 0; j < node->n_ids; j++) {
+            map[node->ids[j] >> 6] |= 1ULL << (node->ids[j] & 63);
+        }
+    }
+}
+
+static void mk_route_exact_add(struct mk_router *router, char *name, int len,
+                               int id)
+{
+    unsigned int i;
+    unsigned int hash;
+    struct mk_route_exact *entry;
+
+    hash = mk_route_hash(name, len);
+    for (i = hash & router->exact_mask; ; i = (i + 1) & router->exact_mask) {
+        entry = &router->exact[i];
+        if (!entry->name) {
+            break;
+        }
+    }
+
+    entry->hash = hash;
+    entry->len  = len;
+    entry->name = name;
+    entry->id   = id;
+}
+
+/* Build the routing indexes for a virtual host handlers list */
+struct mk_router *mk_router_create(struct mk_list *handlers)
+{
+    int id = 0;
+    unsigned int size;
+    struct mk_list *head;
+    struct mk_host_handler *h_handler;
+    struct mk_route_pattern *pattern;
+    struct mk_router *router;
+
+    router = mk_mem_malloc_z(sizeof(struct mk_router));
+    router->n_handlers = mk_list_size(handlers);
+    router->n_words = (router->n_handlers + 63) / 64;
+    if (router->n_words == 0) {
+        router->n_words = 1;
+    }
+
+    router->handlers = mk_mem_malloc_z(sizeof(struct mk_host_handler *) *
+                                       (router->n_handlers + 1));
+    router->always = mk_mem_malloc_z(sizeof(uint64_t) * router->n_words);
+
+    for (size = 8; size < (unsigned int) router->n_handlers * 2; size <<= 1);
+    router->exact_mask = size - 1;
+    router->exact = mk_mem_malloc_z(sizeof(struct mk_route_exact) * size);
+    router->prefix = mk_mem_malloc_z(sizeof(struct mk_route_trie));
+    router->suffix = mk_mem_malloc_z(sizeof(struct mk_route_trie));
+
+    mk_list_foreach(head, handlers) {
+        h_handler = mk_list_entry(head, struct mk_host_handler, _head);
+        pattern = &h_handler->match;
+        router->handlers[id] = h_handler;
+
+        switch (pattern->type) {
+        case MK_ROUTE_EXACT:
+            if (pattern->n_pieces == 0) {
+                /* '^$', no URI is empty */
+                break;
+            }
+            mk_route_exact_add(router, pattern->pieces[0], pattern->lens[0],
+                               id);
+            break;
+        case MK_ROUTE_PREFIX:
+            mk_route_trie_add(router->prefix, pattern->pieces[0],
+                              pattern->lens[0], MK_FALSE, id);
+            break;
+        case MK_ROUTE_SUFFIX:
+            mk_route_trie_add(router->suffix, pattern->pieces[0],
+                              pattern->lens[0], MK_TRUE, id);
+            break;
+        default:
+            router->always[id >> 6] |= 1ULL << (id & 63);
+        }
+        id++;
+    }
+
+    return router;
+}
+
+/* The patterns belong to the handlers, see mk_route_free() */
+void mk_router_free(struct mk_router *router)
+{
+    if (!router) {
+        return;
+    }
+
+    mk_route_trie_free(router->prefix);
+    mk_route_trie_free(router->suffix);
+    mk_mem_free(router->exact);
+    mk_mem_free(router->always);
+    mk_mem_free(router->handlers);
+    mk_mem_free(router);
+}
+
+/*
+ * Set in 'map' the handlers that may match the URI. The ones found in the
+ * indexes match for sure, the 'always' ones must still be checked with
+ * mk_route_match().
+ */
+void mk_router_candidates(struct mk_router *router, const char *uri, int len,
+                          uint64_t *map)
+{
+    unsigned int i;
+    unsigned int hash;
+    struct mk_route_exact *entry;
+
+    memcpy(map, router->always, sizeof(uint64_t) * router->n_words);
+
+    hash = mk_route_hash(uri, len);
+    for (i = hash & router->exact_mask; ; i = (i + 1) & router->exact_mask) {
+        entry = &router->exact[i];
+        if (!entry->name) {
+            break;
+        }
+        if (entry->hash == hash && entry->len == len &&
+            mk_route_ieq(uri, entry->name, len)) {
+            map[entry->id >> 6] |= 1ULL << (entry->id & 63);
+        }
+    }
+
+    mk_route_trie_walk(router->prefix, uri, len, MK_FALSE, map);
+    mk_route_trie_walk(router->suffix, uri, len, MK_TRUE, map);
+}
@@ -23,6 +23,7 @@
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_server.h>
 #include <monkey/mk_cache.h>
+#include <monkey/mk_user.h>
 #include <monkey/mk_config.h>
 #include <monkey/mk_clock.h>
 #include <monkey/mk_plugin.h>
@@ -60,13 +61,13 @@ static inline int _next_target()
     int target = 0;
     unsigned long long tmp = 0, cur = 0;
 
-    cur = sched_list[0].accepted_connections - sched_list[0].closed_connections;
+    cur = mk_sched_active(&sched_list[0]);
     if (cur == 0)
         return 0;
 
     /* Finds the lowest load worker */
     for (i = 1; i < mk_config->workers; i++) {
-        tmp = sched_list[i].accepted_connections - sched_list[i].closed_connections;
+        tmp = mk_sched_active(&sched_list[i]);
         if (tmp < cur) {
             target = i;
             cur = tmp;
@@ -121,8 +122,8 @@ void mk_sched_worker_free()
 
     /* External */
     mk_plugin_exit_worker();
-    mk_vhost_fdt_worker_exit();
     mk_cache_worker_exit();
+    mk_user_worker_exit();
 
     /* Scheduler stuff */
     tid = pthread_self();
@@ -155,6 +156,7 @@ struct mk_sched_handler *mk_sched_handler_cap(char cap)
  * inside the worker/thread context.
  */
 struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
+                                              union mk_socket_addr *addr,
                                               struct mk_server_listen *listener,
                                               struct mk_sched_worker *sched)
 {
@@ -165,7 +167,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     struct mk_event *event;
 
     /* Before to continue, we need to run plugin stage 10 */
-    ret = mk_plugin_stage_run_10(remote_fd);
+    ret = mk_plugin_stage_run_10(remote_fd, addr);
 
     /* Close connection, otherwise continue */
     if (ret == MK_PLUGIN_RET_CLOSE_CONX) {
@@ -196,6 +198,8 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     event->mask         = MK_EVENT_EMPTY;
     event->status       = MK_EVENT_NONE;
     conn->arrive_time   = log_current_utime;
+    conn->arrive_ns     = mk_clock_ns();
+    conn->peer          = *addr;
     conn->protocol      = handler;
     conn->net           = listener->network->network;
     conn->is_timeout_on = MK_FALSE;
@@ -204,6 +208,7 @@ struct mk_sched_conn *mk_sched_add_connection(int remote_fd,
     conn->channel.type = MK_CHANNEL_SOCKET;    /* channel type  */
     conn->channel.fd   = remote_fd;            /* socket conn   */
     conn->channel.io   = conn->net;            /* network layer */
+    conn->channel.ev_owner = &conn->event;     /* armed for write */
     mk_list_init(&conn->channel.streams);
 
     /* Register the entry in the red-black tree queue for fast lookup */
@@ -340,6 +345,10 @@ void *mk_sched_launch_worker_loop(void *thread_conf)
     }
     sched->mem_pagesize = sysconf(_SC_PAGESIZE);
 
+    /* Latency histograms, readers may look at them at any time */
+    __atomic_store_n(&sched->latency, mk_latency_create(), __ATOMIC_RELEASE);
+    __atomic_store_n(&sched->metrics, mk_metrics_create(), __ATOMIC_RELEASE);
+
     /*
      * Create the notification instance and link it to the worker
      * thread-scope list.
@@ -432,7 +441,8 @@ void mk_sched_init()
     int size;
 
     size = sizeof(struct mk_sched_worker) * mk_config->workers;
-    sched_list = mk_mem_malloc_z(size);
+    sched_list = mk_mem_malloc_aligned(MK_CACHELINE_SIZE, size);
+    memset(sched_list, '\0', size);
 }
 
 void mk_sched_set_request_list(struct rb_root *list)
@@ -458,7 +468,7 @@ int mk_sched_remove_client(struct mk_sched_conn *conn,
     /* Invoke plugins in stage 50 */
     mk_plugin_stage_run_50(event->fd);
 
-    sched->closed_connections++;
+    mk_sched_counter_inc(&sched->closed_connections);
 
     /* Unlink from the red-black tree */
     rb_erase(&conn->_rb_head, &sched->rb_queue);
@@ -543,6 +553,7 @@ int mk_sched_check_timeouts(struct mk_sched_worker *sched)
             MK_TRACE("Scheduler, closing fd %i due TIMEOUT",
                      conn->event.fd);
             MK_LT_SCHED(conn->event.fd, "TIMEOUT_CONN_PENDING");
+            mk_metrics_add(MK_METRICS_TIMEOUTS, 1);
             conn->protocol->cb_close(conn, sched, MK_SCHED_CONN_TIMEOUT);
             mk_sched_drop_connection(conn, sched);
         }
@@ -610,8 +621,7 @@ int mk_sched_event_read(struct mk_sched_conn *conn,
     do {
         ret = mk_channel_write(&conn->channel, &count);
         total += count;
-    } while (total <= sched->mem_pagesize &&
-             (ret & ~(MK_CHANNEL_DONE | MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY)));
+    } while (total <= sched->mem_pagesize && ret == MK_CHANNEL_FLUSH);
 
     if (ret == MK_CHANNEL_DONE) {
         if (conn->protocol->cb_done) {
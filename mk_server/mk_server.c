@@ -23,6 +23,8 @@
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_server.h>
+#include <monkey/mk_reload.h>
+#include <monkey/mk_upgrade.h>
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_core.h>
 
@@ -35,6 +37,11 @@
 __thread struct mk_list *server_listen;
 __thread struct mk_server_timeout *server_timeout;
 
+/* Fair balancing mode: listeners of the main thread and its channel */
+static struct mk_list *balancer_listen;
+static struct mk_event balancer_notif;
+static int balancer_channel = -1;
+
 /* Return the number of clients that can be attended  */
 unsigned int mk_server_capacity()
 {
@@ -75,16 +82,17 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
 {
     int ret;
     int client_fd = -1;
+    union mk_socket_addr addr;
     struct mk_sched_conn *conn;
     struct mk_server_listen *listener = data;
 
-    client_fd = mk_socket_accept(listener->server_fd);
+    client_fd = mk_socket_accept(listener->server_fd, &addr);
     if (mk_unlikely(client_fd == -1)) {
         MK_TRACE("[server] Accept connection failed: %s", strerror(errno));
         goto error;
     }
 
-    conn = mk_sched_add_connection(client_fd, listener, sched);
+    conn = mk_sched_add_connection(client_fd, &addr, listener, sched);
     if (mk_unlikely(!conn)) {
         goto error;
     }
@@ -97,7 +105,7 @@ struct mk_sched_conn *mk_server_listen_handler(struct mk_sched_worker *sched,
         goto error;
     }
 
-    sched->accepted_connections++;
+    mk_sched_counter_inc(&sched->accepted_connections);
     MK_TRACE("[server] New connection arrived: FD %i", client_fd);
     return conn;
 
@@ -146,6 +154,7 @@ struct mk_list *mk_server_listen_init(struct mk_server_config *config)
 {
     int i = 0;
     int server_fd;
+    int worker = -1;
     int reuse_port = MK_FALSE;
     struct mk_list *head;
     struct mk_list *listeners;
@@ -154,11 +163,18 @@ struct mk_list *mk_server_listen_init(struct mk_server_config *config)
     struct mk_sched_handler *protocol;
     struct mk_plugin *plugin;
     struct mk_config_listener *listen;
+    struct mk_sched_worker *sched;
 
     if (config == NULL) {
         goto error;
     }
 
+    /* REUSEPORT: every worker has its own sockets */
+    sched = mk_sched_get_thread_conf();
+    if (sched) {
+        worker = sched->idx;
+    }
+
     listeners = malloc(sizeof(struct mk_list));
     mk_list_init(listeners);
 
@@ -169,10 +185,14 @@ struct mk_list *mk_server_listen_init(struct mk_server_config *config)
     mk_list_foreach(head, &config->listeners) {
         listen = mk_list_entry(head, struct mk_config_listener, _head);
 
-        server_fd = mk_socket_server(listen->port,
-                                     listen->address,
-                                     reuse_port,
-                                     config);
+        /* Sockets passed by the process we are replacing */
+        server_fd = mk_upgrade_listener_fd(worker, listen);
+        if (server_fd == -1) {
+            server_fd = mk_socket_server(listen->port,
+                                         listen->address,
+                                         reuse_port,
+                                         config);
+        }
         if (server_fd >= 0) {
             if (mk_socket_set_tcp_defer_accept(server_fd) != 0) {
 #if defined (__linux__)
@@ -239,6 +259,133 @@ error:
     return NULL;
 }
 
+static int mk_server_listen_export_list(struct mk_list *list, int worker,
+                                        char **env, unsigned long *len,
+                                        int *fds, int n)
+{
+    char *tmp;
+    unsigned long tmp_len;
+    struct mk_list *head;
+    struct mk_server_listen *listener;
+
+    if (!list) {
+        return n;
+    }
+
+    mk_list_foreach(head, list) {
+        listener = mk_list_entry(head, struct mk_server_listen, _head);
+        tmp = NULL;
+        mk_string_build(&tmp, &tmp_len, "%s%s%i:%i:%s:%s",
+                        *env ? *env : "", *env ? ";" : "",
+                        listener->server_fd, worker,
+                        listener->listen->port, listener->listen->address);
+        mk_mem_free(*env);
+        *env = tmp;
+        *len = tmp_len;
+        fds[n++] = listener->server_fd;
+    }
+
+    return n;
+}
+
+/*
+ * Describe the listening sockets for the process replacing this one, see
+ * mk_upgrade.h. Returns the number of sockets, their descriptors are set
+ * in 'fds'.
+ */
+int mk_server_listen_export(char **env, int **fds)
+{
+    int i;
+    int n = 0;
+    int max;
+    unsigned long len = 0;
+
+    *env = NULL;
+    max = mk_list_size(&mk_config->listeners) * (mk_config->workers + 1);
+    *fds = mk_mem_malloc(sizeof(int) * max);
+
+    if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+        for (i = 0; i < mk_config->workers; i++) {
+            n = mk_server_listen_export_list(sched_list[i].listeners, i,
+                                             env, &len, *fds, n);
+        }
+    }
+    else {
+        n = mk_server_listen_export_list(balancer_listen, -1,
+                                         env, &len, *fds, n);
+    }
+
+    return n;
+}
+
+/* Stop accepting connections on an event loop, the sockets are closed */
+static void mk_server_listen_close(struct mk_event_loop *evl,
+                                   struct mk_list *list)
+{
+    struct mk_list *head;
+    struct mk_server_listen *listener;
+
+    if (!list) {
+        return;
+    }
+
+    mk_list_foreach(head, list) {
+        listener = mk_list_entry(head, struct mk_server_listen, _head);
+        mk_event_del(evl, &listener->event);
+    }
+    mk_server_listen_exit(list);
+}
+
+/*
+ * Ask the threads owning the listeners to close them. The connections
+ * being served continue, see mk_upgrade_draining.
+ */
+void mk_server_listen_stop()
+{
+    int i;
+    int n;
+    uint64_t val = MK_SCHED_SIGNAL_DRAIN;
+
+    if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+        for (i = 0; i < mk_config->workers; i++) {
+            n = write(sched_list[i].signal_channel_w, &val, sizeof(val));
+            if (n < 0) {
+                mk_libc_error("write");
+            }
+        }
+    }
+    else if (balancer_channel != -1) {
+        n = write(balancer_channel, &val, sizeof(val));
+        if (n < 0) {
+            mk_libc_error("write");
+        }
+    }
+}
+
+/*
+ * Once mk_server_listen_stop() was acknowledged, no more signals may be sent
+ * to the same channels: eventfd(2) would add up the values.
+ */
+int mk_server_listen_stopped()
+{
+    int i;
+
+    if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
+        for (i = 0; i < mk_config->workers; i++) {
+            if (__atomic_load_n(&sched_list[i].listeners, __ATOMIC_ACQUIRE)) {
+                return MK_FALSE;
+            }
+        }
+        return MK_TRUE;
+    }
+
+    if (balancer_channel != -1 &&
+        __atomic_load_n(&balancer_listen, __ATOMIC_ACQUIRE)) {
+        return MK_FALSE;
+    }
+    return MK_TRUE;
+}
+
 /* Here we launch the worker threads to attend clients */
 void mk_server_launch_workers()
 {
@@ -276,6 +423,8 @@ void mk_server_launch_workers()
  */
 void mk_server_loop_balancer()
 {
+    int ret;
+    uint64_t val;
     struct mk_list *head;
     struct mk_list *listeners;
     struct mk_server_listen *listener;
@@ -305,9 +454,27 @@ void mk_server_loop_balancer()
                      listener);
     }
 
+    /* Channel to stop accepting, see mk_server_listen_stop() */
+    ret = mk_event_channel_create(evl, &balancer_channel, &balancer_channel,
+                                  &balancer_notif);
+    if (ret < 0) {
+        balancer_channel = -1;
+    }
+    balancer_listen = listeners;
+    mk_upgrade_ready();
+
     while (1) {
         mk_event_wait(evl);
         mk_event_foreach(event, evl) {
+            if (event->type == MK_EVENT_NOTIFICATION) {
+                ret = read(event->fd, &val, sizeof(val));
+                if (ret > 0 && val == MK_SCHED_SIGNAL_DRAIN) {
+                    mk_server_listen_close(evl, balancer_listen);
+                    __atomic_store_n(&balancer_listen, NULL, __ATOMIC_RELEASE);
+                }
+                continue;
+            }
+
             if (event->mask & MK_EVENT_READ) {
                 /*
                  * Accept connection: determinate which thread may work on this
@@ -325,8 +492,7 @@ void mk_server_loop_balancer()
                         MK_TRACE("Worker Status");
                         MK_TRACE(" WID %i / conx = %llu",
                                  node[i].idx,
-                                 node[i].accepted_connections -
-                                 node[i].closed_connections);
+                                 mk_sched_active(&node[i]));
                     }
 #endif
                 }
@@ -480,9 +646,16 @@ void mk_server_worker_loop()
                         mk_sched_worker_free();
                         return;
                     }
+                    else if (val == MK_SCHED_SIGNAL_DRAIN) {
+                        mk_server_listen_close(evl, sched->listeners);
+                        server_listen = NULL;
+                        __atomic_store_n(&sched->listeners, NULL,
+                                         __ATOMIC_RELEASE);
+                    }
                 }
                 else if (event->fd == timeout_fd) {
                     mk_sched_check_timeouts(sched);
+                    mk_config_gen_worker_sync();
                 }
                 continue;
             }
@@ -516,11 +689,19 @@ void mk_server_loop(void)
      * them so they can start processing connections.
      */
     if (mk_config->scheduler_mode == MK_SCHEDULER_REUSEPORT) {
-        /* Hang here, basically do nothing as threads are doing the job  */
+        /*
+         * Hang here, basically do nothing as threads are doing the job. A
+         * SIGHUP (configuration reload) returns, so wait again.
+         */
         sigset_t mask;
+
+        /* Let the process we replace know it can stop accepting */
+        mk_upgrade_ready();
+
         sigprocmask(0, NULL, &mask);
-        sigsuspend(&mask);
-        return;
+        while (1) {
+            sigsuspend(&mask);
+        }
     }
     else {
         mk_server_loop_balancer();
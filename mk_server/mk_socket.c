@@ -203,10 +203,11 @@ int mk_socket_connect(char *host, int port, int async)
                 break;
             }
             else {
-                printf("%s", strerror(errno));
-                perror("connect");
-                exit(1);
+#ifdef TRACE
+                mk_libc_error("connect");
+#endif
                 close(socket_fd);
+                socket_fd = -1;
                 continue;
             }
         }
@@ -331,36 +332,43 @@ int mk_socket_server(char *port, char *listen_addr,
     return socket_fd;
 }
 
-int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len)
+int mk_socket_addr_str(union mk_socket_addr *addr, char **buf, int size,
+                       unsigned long *len)
 {
-    int ret;
-    struct sockaddr_storage addr;
-    socklen_t s_len = sizeof(addr);
-
-    ret = getpeername(socket_fd, (struct sockaddr *) &addr, &s_len);
-
-    if (mk_unlikely(ret == -1)) {
-        MK_TRACE("[FD %i] Can't get addr for this socket", socket_fd);
-        return -1;
-    }
-
     errno = 0;
 
-    if(addr.ss_family == AF_INET) {
-        if((inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr,
-                      *buf, size)) == NULL) {
+    if (addr->sa.sa_family == AF_INET) {
+        if ((inet_ntop(AF_INET, &addr->in4.sin_addr, *buf, size)) == NULL) {
             mk_warn("mk_socket_ip_str: Can't get the IP text form (%i)", errno);
             return -1;
         }
     }
-    else if(addr.ss_family == AF_INET6) {
-        if((inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr,
-                      *buf, size)) == NULL) {
+    else if (addr->sa.sa_family == AF_INET6) {
+        if ((inet_ntop(AF_INET6, &addr->in6.sin6_addr, *buf, size)) == NULL) {
             mk_warn("mk_socket_ip_str: Can't get the IP text form (%i)", errno);
             return -1;
         }
     }
+    else {
+        return -1;
+    }
 
     *len = strlen(*buf);
     return 0;
 }
+
+int mk_socket_ip_str(int socket_fd, char **buf, int size, unsigned long *len)
+{
+    int ret;
+    union mk_socket_addr addr;
+    socklen_t s_len = sizeof(addr);
+
+    ret = getpeername(socket_fd, &addr.sa, &s_len);
+
+    if (mk_unlikely(ret == -1)) {
+        MK_TRACE("[FD %i] Can't get addr for this socket", socket_fd);
+        return -1;
+    }
+
+    return mk_socket_addr_str(&addr, buf, size, len);
+}
@@ -51,6 +51,7 @@ struct mk_channel *mk_channel_new(int type, int fd)
     channel = mk_mem_malloc(sizeof(struct mk_channel));
     channel->type = type;
     channel->fd   = fd;
+    channel->ev_owner = NULL;
 
     mk_list_init(&channel->streams);
 
@@ -108,6 +109,7 @@ int mk_channel_flush(struct mk_channel *channel)
     int ret = 0;
     size_t count = 0;
     size_t total = 0;
+    struct mk_event *event;
 
     do {
         ret = mk_channel_write(channel, &count);
@@ -125,19 +127,23 @@ int mk_channel_flush(struct mk_channel *channel)
             MK_TRACE("Channel empty");
         }
 #endif
-    } while (total <= 4096 && //sched->mem_pagesize &&
-             (ret & ~(MK_CHANNEL_DONE | MK_CHANNEL_ERROR | MK_CHANNEL_EMPTY)));
+    } while (total <= 4096 && ret == MK_CHANNEL_FLUSH);
 
     if (ret == MK_CHANNEL_DONE) {
         return ret;
     }
     else if (ret & (MK_CHANNEL_FLUSH | MK_CHANNEL_BUSY)) {
-        if (channel->event.mask & ~MK_EVENT_WRITE) {
+        /*
+         * Let the owner of the channel (the connection of a client) write
+         * the rest once the socket becomes writable.
+         */
+        event = channel->ev_owner;
+        if (event && (event->mask & ~MK_EVENT_WRITE)) {
             mk_event_add(mk_sched_loop(),
-                         channel->event.fd,
-                         MK_EVENT_CONNECTION,
+                         event->fd,
+                         event->type,
                          MK_EVENT_WRITE,
-                         (void *) &channel->event);
+                         event);
         }
     }
 
@@ -201,11 +207,17 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
             MK_TRACE("[CH %i] STREAM_PTR, bytes=%lu",
                      channel->fd, stream->bytes_total);
 
+            /* the buffer may be shared, bytes_total tracks the offset */
             ptr = stream->buffer;
-            bytes = mk_sched_conn_write(channel, ptr->data, ptr->len);
-            if (bytes > 0) {
-                /* FIXME OFFSET */
-            }
+            bytes = mk_sched_conn_write(channel,
+                                        ptr->data + ptr->len - stream->bytes_total,
+                                        stream->bytes_total);
+        }
+        else if (stream->type == MK_STREAM_PIPE) {
+            bytes = mk_sched_conn_splice(channel, stream->fd,
+                                         stream->bytes_total);
+            MK_TRACE("[CH %i] STREAM_PIPE %i, bytes=%lu/%lu",
+                     channel->fd, stream->fd, bytes, stream->bytes_total);
         }
         else if (stream->type == MK_STREAM_COPYBUF) {
             bytes = mk_sched_conn_write(channel,
@@ -219,6 +231,7 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
 
         if (bytes > 0) {
             *count = bytes;
+            mk_metrics_add(MK_METRICS_BYTES_SENT, bytes);
             mk_stream_bytes_consumed(stream, bytes);
 
             /* notification callback, optional */
@@ -248,10 +261,16 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
                 return MK_CHANNEL_BUSY;
             }
 
+            if (stream->cb_exception) {
+                stream->cb_exception(stream, errno);
+            }
             mk_stream_release(stream);
             return MK_CHANNEL_ERROR;
         }
         else if (bytes == 0) {
+            if (stream->cb_exception) {
+                stream->cb_exception(stream, 0);
+            }
             mk_stream_release(stream);
             return MK_CHANNEL_ERROR;
         }
@@ -260,7 +279,10 @@ int mk_channel_write(struct mk_channel *channel, size_t *count)
     return MK_CHANNEL_UNKNOWN;
 }
 
-/* Remove any dynamic memory associated */
+/*
+ * Remove any dynamic memory associated, the owners of the streams not
+ * consumed are notified through the exception callback.
+ */
 int mk_channel_clean(struct mk_channel *channel)
 {
     struct mk_list *tmp;
@@ -269,6 +291,9 @@ int mk_channel_clean(struct mk_channel *channel)
 
     mk_list_foreach_safe(head, tmp, &channel->streams) {
         stream = mk_list_entry(head, struct mk_stream, _head);
+        if (stream->cb_exception) {
+            stream->cb_exception(stream, 0);
+        }
         mk_stream_release(stream);
     }
 
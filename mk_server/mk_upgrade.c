@@ -0,0 +1,408 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/monkey.h>
+#include <monkey/mk_upgrade.h>
+#include <monkey/mk_server.h>
+#include <monkey/mk_scheduler.h>
+#include <monkey/mk_utils.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+int mk_upgrade_draining = MK_FALSE;
+
+/* How to execute the binary again */
+static char *upgrade_path;
+static char **upgrade_argv;
+
+/* Sockets received from the process we replace */
+struct mk_upgrade_fd {
+    int fd;
+    int worker;
+    int used;
+    char *port;
+    char *address;
+};
+
+static struct mk_upgrade_fd *inherited;
+static int inherited_n;
+static int inherited_parsed = MK_FALSE;
+static pthread_mutex_t inherited_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Keep the command line for mk_upgrade_start(). The path is made absolute
+ * but symlinks are not resolved: a new release is usually installed by
+ * replacing the file or the link.
+ */
+void mk_upgrade_set_argv(char **argv)
+{
+    ssize_t len;
+    unsigned long size;
+    char cwd[PATH_MAX];
+    char exe[PATH_MAX];
+
+    upgrade_argv = argv;
+
+    if (argv[0][0] == '/') {
+        upgrade_path = mk_string_dup(argv[0]);
+    }
+    else if (strchr(argv[0], '/') && getcwd(cwd, sizeof(cwd))) {
+        mk_string_build(&upgrade_path, &size, "%s/%s", cwd, argv[0]);
+    }
+    else {
+        /* found through $PATH */
+        len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len > 0) {
+            exe[len] = '\0';
+            upgrade_path = mk_string_dup(exe);
+        }
+    }
+}
+
+int mk_upgrade_inherited()
+{
+    if (getenv(MK_UPGRADE_ENV_FDS)) {
+        return MK_TRUE;
+    }
+    return MK_FALSE;
+}
+
+/* Parse MONKEY_LISTEN_FDS, entries are 'fd:worker:port:address' */
+static void mk_upgrade_parse()
+{
+    int n = 0;
+    char *env;
+    char *entry;
+    char *save;
+    char *end;
+    char *port;
+    char *buf;
+    struct mk_upgrade_fd *u;
+
+    inherited_parsed = MK_TRUE;
+
+    env = getenv(MK_UPGRADE_ENV_FDS);
+    if (!env) {
+        return;
+    }
+
+    buf = mk_string_dup(env);
+    for (end = buf; *end; end++) {
+        if (*end == ';') {
+            n++;
+        }
+    }
+    inherited = mk_mem_malloc_z(sizeof(struct mk_upgrade_fd) * (n + 1));
+
+    for (entry = strtok_r(buf, ";", &save); entry;
+         entry = strtok_r(NULL, ";", &save)) {
+        u = &inherited[inherited_n];
+
+        errno = 0;
+        u->fd = strtol(entry, &end, 10);
+        if (errno != 0 || *end != ':') {
+            goto invalid;
+        }
+        u->worker = strtol(end + 1, &end, 10);
+        if (errno != 0 || *end != ':') {
+            goto invalid;
+        }
+        port = end + 1;
+        end = strchr(port, ':');
+        if (!end) {
+            goto invalid;
+        }
+        u->port = mk_string_copy_substr(port, 0, end - port);
+        u->address = mk_string_dup(end + 1);
+
+        /* From now on it is ours, do not leak it to CGI & co */
+        fcntl(u->fd, F_SETFD, FD_CLOEXEC);
+        inherited_n++;
+        continue;
+
+    invalid:
+        mk_warn("Upgrade: invalid entry '%s' in %s", entry, MK_UPGRADE_ENV_FDS);
+    }
+
+    mk_mem_free(buf);
+}
+
+/*
+ * Return the socket passed for the listener of a worker (-1 when not in
+ * REUSEPORT mode), or -1 if there is none.
+ */
+int mk_upgrade_listener_fd(int worker, struct mk_config_listener *listen)
+{
+    int i;
+    int fd = -1;
+    struct mk_upgrade_fd *u;
+
+    pthread_mutex_lock(&inherited_lock);
+    if (inherited_parsed == MK_FALSE) {
+        mk_upgrade_parse();
+    }
+
+    for (i = 0; i < inherited_n; i++) {
+        u = &inherited[i];
+        if (u->used == MK_FALSE && u->worker == worker &&
+            strcmp(u->port, listen->port) == 0 &&
+            strcmp(u->address, listen->address) == 0) {
+            u->used = MK_TRUE;
+            fd = u->fd;
+            MK_TRACE("Upgrade: using inherited socket %i for %s:%s",
+                     fd, listen->address, listen->port);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&inherited_lock);
+
+    return fd;
+}
+
+/*
+ * Called once the new process accepts connections: close the sockets the
+ * current configuration does not use and tell the old process to go.
+ */
+void mk_upgrade_ready()
+{
+    int i;
+    int fd;
+    int ret;
+    char *env;
+    char c = 1;
+    struct mk_upgrade_fd *u;
+
+    pthread_mutex_lock(&inherited_lock);
+    for (i = 0; i < inherited_n; i++) {
+        u = &inherited[i];
+        if (u->used == MK_FALSE) {
+            mk_warn("Upgrade: listener %s:%s (worker %i) is not used anymore",
+                    u->address, u->port, u->worker);
+            close(u->fd);
+        }
+        mk_mem_free(u->port);
+        mk_mem_free(u->address);
+    }
+    mk_mem_free(inherited);
+    inherited = NULL;
+    inherited_n = 0;
+    pthread_mutex_unlock(&inherited_lock);
+
+    env = getenv(MK_UPGRADE_ENV_READY);
+    if (!env) {
+        return;
+    }
+
+    fd = atoi(env);
+    ret = write(fd, &c, 1);
+    if (ret != 1) {
+        mk_libc_error("write");
+    }
+    close(fd);
+    mk_info("Upgrade: serving, the previous process (%i) is draining",
+            getppid());
+}
+
+/* The environment of the new process, without our own variables */
+static char **mk_upgrade_environ(char *fds, int ready_fd)
+{
+    int i;
+    int n = 0;
+    unsigned long len;
+    char **env;
+
+    for (i = 0; environ[i]; i++);
+    env = mk_mem_malloc(sizeof(char *) * (i + 3));
+
+    for (i = 0; environ[i]; i++) {
+        if (strncmp(environ[i], MK_UPGRADE_ENV_FDS "=",
+                    sizeof(MK_UPGRADE_ENV_FDS)) == 0 ||
+            strncmp(environ[i], MK_UPGRADE_ENV_READY "=",
+                    sizeof(MK_UPGRADE_ENV_READY)) == 0) {
+            continue;
+        }
+        env[n++] = environ[i];
+    }
+
+    env[n] = NULL;
+    mk_string_build(&env[n], &len, "%s=%s", MK_UPGRADE_ENV_FDS, fds);
+    n++;
+    env[n] = NULL;
+    mk_string_build(&env[n], &len, "%s=%i", MK_UPGRADE_ENV_READY, ready_fd);
+    n++;
+    env[n] = NULL;
+
+    return env;
+}
+
+/* Wait for the new process, returns 0 once it accepts connections */
+static int mk_upgrade_wait_ready(pid_t pid, int fd)
+{
+    int ret;
+    char c;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    do {
+        ret = poll(&pfd, 1, MK_UPGRADE_READY_TIMEOUT * 1000);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == 0) {
+        mk_err("Upgrade: the new process did not start in %i seconds",
+               MK_UPGRADE_READY_TIMEOUT);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    /* EOF: it exited before serving */
+    ret = read(fd, &c, 1);
+    if (ret != 1) {
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Stop accepting, let the connections finish and exit */
+static void mk_upgrade_drain()
+{
+    int i;
+    int t;
+    unsigned long long active;
+
+    __atomic_store_n(&mk_upgrade_draining, MK_TRUE, __ATOMIC_RELAXED);
+    mk_server_listen_stop();
+    while (mk_server_listen_stopped() == MK_FALSE) {
+        usleep(10000);
+    }
+
+    for (t = 0; t < MK_UPGRADE_DRAIN_TIMEOUT; t++) {
+        active = 0;
+        for (i = 0; i < mk_config->workers; i++) {
+            active += mk_sched_active(&sched_list[i]);
+        }
+        if (active == 0) {
+            break;
+        }
+        sleep(1);
+    }
+
+    if (t == MK_UPGRADE_DRAIN_TIMEOUT) {
+        mk_warn("Upgrade: closing the connections still open");
+    }
+
+    /*
+     * Nothing is left to release for a process going away, and the pid
+     * file belongs to the new process now.
+     */
+    mk_info("Upgrade: done, exiting");
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Execute the binary again passing it the listening sockets. Runs on the
+ * reload thread (SIGUSR2); it only returns if the upgrade failed.
+ */
+void mk_upgrade_start()
+{
+#ifdef __rtems__
+    mk_warn("Upgrade: not supported");
+#else
+    int i;
+    int n;
+    int *fds;
+    int ready[2];
+    char *env_fds;
+    char **env;
+    pid_t pid;
+    sigset_t mask;
+
+    if (!upgrade_path) {
+        mk_err("Upgrade: the path of the binary is unknown");
+        return;
+    }
+
+    n = mk_server_listen_export(&env_fds, &fds);
+    if (n <= 0) {
+        mk_err("Upgrade: there are no listeners to pass");
+        mk_mem_free(fds);
+        return;
+    }
+
+    if (pipe(ready) == -1) {
+        mk_libc_error("pipe");
+        mk_mem_free(env_fds);
+        mk_mem_free(fds);
+        return;
+    }
+    fcntl(ready[0], F_SETFD, FD_CLOEXEC);
+
+    /* Prepare everything, after fork() only async-signal-safe calls */
+    env = mk_upgrade_environ(env_fds, ready[1]);
+    sigemptyset(&mask);
+
+    mk_info("Upgrade: executing %s", upgrade_path);
+
+    pid = fork();
+    if (pid == 0) {
+        for (i = 0; i < n; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+        }
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execve(upgrade_path, upgrade_argv, env);
+        _exit(EXIT_FAILURE);
+    }
+
+    close(ready[1]);
+    if (pid > 0 && mk_upgrade_wait_ready(pid, ready[0]) == 0) {
+        close(ready[0]);
+        mk_upgrade_drain();
+    }
+
+    if (pid == -1) {
+        mk_libc_error("fork");
+    }
+    mk_err("Upgrade: failed, the current process keeps serving");
+
+    close(ready[0]);
+    for (i = 0; env[i]; i++) {
+        if (strncmp(env[i], MK_UPGRADE_ENV_FDS "=",
+                    sizeof(MK_UPGRADE_ENV_FDS)) == 0 ||
+            strncmp(env[i], MK_UPGRADE_ENV_READY "=",
+                    sizeof(MK_UPGRADE_ENV_READY)) == 0) {
+            mk_mem_free(env[i]);
+        }
+    }
+    mk_mem_free(env);
+    mk_mem_free(env_fds);
+    mk_mem_free(fds);
+#endif
+}
@@ -24,32 +24,150 @@
 #include <monkey/mk_core.h>
 #include <monkey/mk_utils.h>
 #include <monkey/mk_config.h>
+#include <monkey/mk_clock.h>
 
 #include <pwd.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <grp.h>
 
+/*
+ * Users home directories, a small table per worker so the name service
+ * (files, LDAP...) is not queried on every request. Unknown users are
+ * remembered too, for a shorter time.
+ */
+struct mk_user_cache_entry {
+    time_t expire;
+    int found;
+    int name_len;
+    int home_len;
+    char name[MK_USER_NAME_MAX];
+    char home[MK_PATH_BASE];
+};
+
+static __thread struct mk_user_cache_entry *user_cache;
+
+/*
+ * Copy the home directory of 'user' in 'home' (MK_MAX_PATH bytes), returns
+ * its length or -1 if the user does not exist.
+ */
+static int mk_user_home(char *user, int len, char *home)
+{
+    int ret;
+    int home_len;
+    long buf_size;
+    char *buf;
+    struct passwd pwd;
+    struct passwd *s_user = NULL;
+    struct mk_user_cache_entry *entry = NULL;
+
+    if (mk_unlikely(!user_cache)) {
+        user_cache = mk_mem_malloc_z(sizeof(struct mk_user_cache_entry) *
+                                     MK_USER_CACHE_SIZE);
+    }
+
+    if (user_cache) {
+        entry = &user_cache[mk_utils_gen_hash(user, len) &
+                            (MK_USER_CACHE_SIZE - 1)];
+        if (entry->name_len == len && entry->expire > log_current_utime &&
+            memcmp(entry->name, user, len) == 0) {
+            if (!entry->found) {
+                return -1;
+            }
+            memcpy(home, entry->home, entry->home_len);
+            return entry->home_len;
+        }
+    }
+
+    /*
+     * Check system user, getpwnam() is not thread safe. The buffer starts
+     * at the size suggested by the system and grows while the entry does
+     * not fit.
+     */
+    buf_size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    if (buf_size <= 0) {
+        buf_size = 1024;
+    }
+
+    while (1) {
+        buf = mk_mem_malloc(buf_size);
+        if (!buf) {
+            return -1;
+        }
+
+        ret = getpwnam_r(user, &pwd, buf, buf_size, &s_user);
+        if (ret != ERANGE || buf_size >= MK_USER_PW_BUF_MAX) {
+            break;
+        }
+        mk_mem_free(buf);
+        buf_size *= 2;
+    }
+
+    /* A failing name service is not remembered, only a missing user */
+    if (ret != 0) {
+        mk_mem_free(buf);
+        return -1;
+    }
+
+    if (!s_user) {
+        home_len = -1;
+    }
+    else {
+        home_len = strlen(s_user->pw_dir);
+        if (home_len >= MK_MAX_PATH) {
+            mk_mem_free(buf);
+            return -1;
+        }
+        memcpy(home, s_user->pw_dir, home_len);
+    }
+    mk_mem_free(buf);
+
+    if (!entry || home_len >= MK_PATH_BASE) {
+        return home_len;
+    }
+
+    memcpy(entry->name, user, len);
+    entry->name_len = len;
+    if (home_len == -1) {
+        entry->found = MK_FALSE;
+        entry->expire = log_current_utime + MK_USER_CACHE_NEG_TTL;
+    }
+    else {
+        entry->found = MK_TRUE;
+        entry->expire = log_current_utime + MK_USER_CACHE_TTL;
+        memcpy(entry->home, home, home_len);
+        entry->home_len = home_len;
+    }
+
+    return home_len;
+}
+
 int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr)
 {
     int limit;
+    int home_len;
+    int dir_len;
+    int uri_len;
+    unsigned long len;
     const int offset = 2; /* The user is defined after the '/~' string, so offset = 2 */
-    const int user_len = 255;
-    char user[user_len], *user_uri;
-    struct passwd *s_user;
+    char user[MK_USER_NAME_MAX];
+    char home[MK_MAX_PATH];
+    char *p;
+    (void) cs;
 
     if (sr->uri_processed.len <= 2) {
         return -1;
     }
 
     limit = mk_string_char_search(sr->uri_processed.data + offset, '/',
-                                  sr->uri_processed.len);
-
+                                  sr->uri_processed.len - offset);
     if (limit == -1) {
         limit = (sr->uri_processed.len) - offset;
     }
 
-    if (limit + offset >= (user_len)) {
+    if (limit == 0 || limit >= MK_USER_NAME_MAX) {
         return -1;
     }
 
@@ -58,36 +176,45 @@ int mk_user_init(struct mk_http_session *cs, struct mk_http_request *sr)
 
     MK_TRACE("user: '%s'", user);
 
-    /* Check system user */
-    if ((s_user = getpwnam(user)) == NULL) {
-        mk_http_error(MK_CLIENT_NOT_FOUND, cs, sr);
+    home_len = mk_user_home(user, limit, home);
+    if (home_len == -1) {
         return -1;
     }
 
-    if (sr->uri_processed.len > (unsigned int) (offset+limit)) {
-        user_uri = mk_mem_malloc(sr->uri_processed.len);
-        if (!user_uri) {
-            return -1;
-        }
-
-        memcpy(user_uri,
-               sr->uri_processed.data + (offset + limit),
-               sr->uri_processed.len - offset - limit);
-        user_uri[sr->uri_processed.len - offset - limit] = '\0';
+    /* home + '/' + UserDir + rest of the URI, in the request buffer if fits */
+    dir_len = strlen(mk_config->user_dir);
+    uri_len = sr->uri_processed.len - offset - limit;
+    len = home_len + 1 + dir_len + uri_len;
 
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s%s", s_user->pw_dir, mk_config->user_dir, user_uri);
-        mk_mem_free(user_uri);
+    if (len < MK_PATH_BASE) {
+        p = sr->real_path_static;
     }
     else {
-        mk_string_build(&sr->real_path.data, &sr->real_path.len,
-                        "%s/%s", s_user->pw_dir, mk_config->user_dir);
+        p = mk_mem_malloc(len + 1);
+        if (!p) {
+            return -1;
+        }
     }
 
+    memcpy(p, home, home_len);
+    p[home_len] = '/';
+    memcpy(p + home_len + 1, mk_config->user_dir, dir_len);
+    memcpy(p + home_len + 1 + dir_len,
+           sr->uri_processed.data + offset + limit, uri_len);
+    p[len] = '\0';
+
+    sr->real_path.data = p;
+    sr->real_path.len = len;
     sr->user_home = MK_TRUE;
     return 0;
 }
 
+void mk_user_worker_exit()
+{
+    mk_mem_free(user_cache);
+    user_cache = NULL;
+}
+
 /* Change process user */
 int mk_user_set_uidgid()
 {
@@ -28,6 +28,7 @@
 #include <monkey/mk_user.h>
 #include <monkey/mk_cache.h>
 #include <monkey/mk_tls.h>
+#include <monkey/mk_metrics.h>
 
 #include <assert.h>
 #include <ctype.h>
@@ -85,10 +86,12 @@ static int mk_utils_gmt_cache_get(char **data, time_t date)
         if (date == gcache[i].time) {
             memcpy(*data, gcache[i].text, 32);
             gcache[i].hits++;
+            mk_metrics_add(MK_METRICS_CACHE_HITS, 1);
             return MK_TRUE;
         }
     }
 
+    mk_metrics_add(MK_METRICS_CACHE_MISSES, 1);
     return MK_FALSE;
 }
 
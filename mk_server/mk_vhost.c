@@ -23,144 +23,79 @@
 #include <monkey/mk_utils.h>
 #include <monkey/mk_http_status.h>
 #include <monkey/mk_info.h>
+#include <monkey/mk_metrics.h>
+#include <monkey/mk_scheduler.h>
 
+#include <ctype.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 
 /* Initialize Virtual Host FDT mutex */
 pthread_mutex_t mk_vhost_fdt_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static __thread struct mk_list *mk_vhost_fdt_key;
-
-static int str_to_regex(char *str, regex_t *reg)
-{
-    int ret;
-    char tmp[80];
-    char *p = str;
-
-    while (*p) {
-        if (*p == ' ') *p = '|';
-        p++;
-    }
-
-    ret = regcomp(reg, str, REG_EXTENDED|REG_ICASE|REG_NOSUB);
-    if (ret) {
-        regerror(ret, reg, tmp, sizeof(tmp));
-        mk_err("Handler config: Failed to compile regex: %s", tmp);
-        return -1;
-    }
-
-    return 0;
-}
+static int mk_vhost_data_keys = 0;
 
 /*
- * This function is triggered upon thread creation (inside the thread
- * context), here we configure per-thread data.
+ * Every virtual host owns a File Descriptor Table (FDT) per worker, which
+ * aims to hold references of 'open and shared' file descriptors under the
+ * Virtual Host context. The table of a worker is created by the worker the
+ * first time it opens a file of the host, so the hosts of a configuration
+ * reload get their tables as any other, and they go away with the host.
  */
-int mk_vhost_fdt_worker_init()
+static struct vhost_fdt_host *mk_vhost_fdt_create()
 {
     int i;
     int j;
-    struct host *h;
-    struct mk_list *list;
-    struct mk_list *head;
     struct vhost_fdt_host *fdt;
     struct vhost_fdt_hash_table *ht;
     struct vhost_fdt_hash_chain *hc;
 
-    if (mk_config->fdt == MK_FALSE) {
-        return -1;
+    fdt = mk_mem_malloc(sizeof(struct vhost_fdt_host));
+    if (!fdt) {
+        return NULL;
     }
 
-    /*
-     * We are under a thread context and the main configuration is
-     * already in place. Now for every existent virtual host we are
-     * going to create the File Descriptor Table (FDT) which aims to
-     * hold references of 'open and shared' file descriptors under
-     * the Virtual Host context.
-     */
-
-    /*
-     * Under an initialization context we need to protect this critical
-     * section
-     */
-    pthread_mutex_lock(&mk_vhost_fdt_mutex);
-
-    /*
-     * Initialize the thread FDT/Hosts list and create an entry per
-     * existent virtual host
-     */
-    list = mk_mem_malloc_z(sizeof(struct mk_list));
-    mk_list_init(list);
-
-    mk_list_foreach(head, &mk_config->hosts) {
-        h = mk_list_entry(head, struct host, _head);
-
-        fdt = mk_mem_malloc(sizeof(struct vhost_fdt_host));
-        fdt->host = h;
-
-        /* Initialize hash table */
-        for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
-            ht = &fdt->hash_table[i];
-            ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
-
-            /* for each chain under the hash table, set the fd */
-            for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
-                hc = &ht->chain[j];
-                hc->fd      = -1;
-                hc->hash    =  0;
-                hc->readers =  0;
-            }
+    /* Initialize hash table */
+    for (i = 0; i < VHOST_FDT_HASHTABLE_SIZE; i++) {
+        ht = &fdt->hash_table[i];
+        ht->av_slots = VHOST_FDT_HASHTABLE_CHAINS;
+
+        /* for each chain under the hash table, set the fd */
+        for (j = 0; j < VHOST_FDT_HASHTABLE_CHAINS; j++) {
+            hc = &ht->chain[j];
+            hc->fd      = -1;
+            hc->hash    =  0;
+            hc->readers =  0;
         }
-        mk_list_add(&fdt->_head, list);
     }
 
-    mk_vhost_fdt_key = list;
-    pthread_mutex_unlock(&mk_vhost_fdt_mutex);
-
-    return 0;
+    return fdt;
 }
 
-int mk_vhost_fdt_worker_exit()
+static inline
+struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct host *host)
 {
-    struct mk_list *head;
-    struct mk_list *tmp;
+    struct mk_sched_worker *sched;
     struct vhost_fdt_host *fdt;
 
-    if (mk_config->fdt == MK_FALSE) {
-        return -1;
-    }
-
-    mk_list_foreach_safe(head, tmp, mk_vhost_fdt_key) {
-        fdt = mk_list_entry(head, struct vhost_fdt_host, _head);
-        mk_list_del(&fdt->_head);
-        mk_mem_free(fdt);
+    sched = mk_sched_get_thread_conf();
+    if (mk_unlikely(!sched || !host->fdt)) {
+        return NULL;
     }
 
-    mk_mem_free(mk_vhost_fdt_key);
-    return 0;
-}
-
-
-static inline
-struct vhost_fdt_hash_table *mk_vhost_fdt_table_lookup(int id, struct host *host)
-{
-    struct mk_list *head;
-    struct mk_list *vhost_list;
-    struct vhost_fdt_host *fdt_host;
-    struct vhost_fdt_hash_table *ht = NULL;
-
-    vhost_list = mk_vhost_fdt_key;
-    mk_list_foreach(head, vhost_list) {
-        fdt_host = mk_list_entry(head, struct vhost_fdt_host, _head);
-        if (fdt_host->host == host) {
-            ht = &fdt_host->hash_table[id];
-            return ht;
+    fdt = host->fdt[sched->idx];
+    if (mk_unlikely(!fdt)) {
+        fdt = mk_vhost_fdt_create();
+        if (!fdt) {
+            return NULL;
         }
+        host->fdt[sched->idx] = fdt;
     }
 
-    return ht;
+    return &fdt->hash_table[id];
 }
 
 static inline
@@ -202,6 +137,7 @@ static inline int mk_vhost_fdt_open(int id, unsigned int hash,
     hc = mk_vhost_fdt_chain_lookup(hash, ht);
     if (hc) {
         /* Increment the readers and return the shared FD */
+        mk_metrics_add(MK_METRICS_FDT_HITS, 1);
         hc->readers++;
         sr->vhost_fdt_id      = id;
         sr->vhost_fdt_hash    = hash;
@@ -214,6 +150,7 @@ static inline int mk_vhost_fdt_open(int id, unsigned int hash,
      * requested file descriptor and hash, we must try to open the file
      * and register the entry in the table.
      */
+    mk_metrics_add(MK_METRICS_FDT_MISSES, 1);
     fd = open(sr->real_path.data, sr->file_info.flags_read_only);
     if (fd == -1) {
         return -1;
@@ -306,9 +243,101 @@ int mk_vhost_close(struct mk_http_request *sr)
     return mk_vhost_fdt_close(sr);
 }
 
+/* Release a virtual host, it may be partially initialized */
+static void mk_vhost_free(struct host *host)
+{
+    int i;
+    struct host_alias *host_alias;
+    struct error_page *ep;
+    struct mk_host_handler *h_handler;
+    struct mk_handler_param *h_param;
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_list *head_param;
+    struct mk_list *tmp_param;
+
+    mk_mem_free(host->file);
+
+    /* Free aliases or servernames */
+    mk_list_foreach_safe(head, tmp, &host->server_names) {
+        host_alias = mk_list_entry(head, struct host_alias, _head);
+        mk_list_del(&host_alias->_head);
+        mk_mem_free(host_alias->name);
+        mk_mem_free(host_alias);
+    }
+
+    /* Free error pages */
+    mk_list_foreach_safe(head, tmp, &host->error_pages) {
+        ep = mk_list_entry(head, struct error_page, _head);
+        mk_list_del(&ep->_head);
+        mk_mem_free(ep->file);
+        mk_mem_free(ep->real_path);
+        mk_ptr_free(&ep->body);
+        mk_mem_free(ep);
+    }
+
+    /* Free handlers */
+    mk_router_free(host->router);
+    mk_list_foreach_safe(head, tmp, &host->handlers) {
+        h_handler = mk_list_entry(head, struct mk_host_handler, _head);
+        mk_list_del(&h_handler->_head);
+        mk_list_foreach_safe(head_param, tmp_param, &h_handler->params) {
+            h_param = mk_list_entry(head_param, struct mk_handler_param, _head);
+            mk_list_del(&h_param->_head);
+            mk_mem_free(h_param->p.data);
+            mk_mem_free(h_param);
+        }
+        mk_route_free(&h_handler->match);
+        mk_mem_free(h_handler->name);
+        mk_mem_free(h_handler);
+    }
+
+    /* File descriptor tables, no request is using the host anymore */
+    if (host->fdt) {
+        for (i = 0; i < mk_config->workers; i++) {
+            mk_mem_free(host->fdt[i]);
+        }
+        mk_mem_free(host->fdt);
+    }
+
+    mk_ptr_free(&host->documentroot);
+    mk_ptr_free(&host->header_redirect);
+
+    /* Free source configuration */
+    if (host->config) mk_rconf_free(host->config);
+    mk_mem_free(host);
+}
+
+static struct host *mk_vhost_alloc()
+{
+    struct host *host;
+
+    host = mk_mem_malloc_z(sizeof(struct host));
+    if (!host) {
+        return NULL;
+    }
+
+    /* Init list for host name aliases */
+    mk_list_init(&host->server_names);
+
+    /* Init list for custom error pages */
+    mk_list_init(&host->error_pages);
+
+    /* Init list for content handlers */
+    mk_list_init(&host->handlers);
+
+    /* Per worker File Descriptor Tables */
+    if (mk_config->fdt == MK_TRUE) {
+        host->fdt = mk_mem_malloc_z(sizeof(struct vhost_fdt_host *) *
+                                    mk_config->workers);
+    }
+
+    return host;
+}
+
 /*
  * Open a virtual host configuration file and return a structure with
- * definitions.
+ * definitions, or NULL if the file is not valid.
  */
 struct host *mk_vhost_read(char *path)
 {
@@ -330,38 +359,30 @@ struct host *mk_vhost_read(char *path)
     struct mk_handler_param *h_param;
 
     /* Read configuration file */
-    cnf = mk_rconf_create(path);
+    cnf = mk_rconf_open(path);
     if (!cnf) {
-        mk_err("Configuration error, aborting.");
-        exit(EXIT_FAILURE);
+        mk_err("Configuration error in %s", path);
+        return NULL;
     }
 
     /* Read 'HOST' section */
     section_host = mk_rconf_section_get(cnf, "HOST");
     if (!section_host) {
         mk_err("Invalid config file %s", path);
+        mk_rconf_free(cnf);
         return NULL;
     }
 
     /* Alloc configuration node */
-    host = mk_mem_malloc_z(sizeof(struct host));
+    host = mk_vhost_alloc();
     host->config = cnf;
     host->file = mk_string_dup(path);
 
-    /* Init list for host name aliases */
-    mk_list_init(&host->server_names);
-
-    /* Init list for custom error pages */
-    mk_list_init(&host->error_pages);
-
-    /* Init list for content handlers */
-    mk_list_init(&host->handlers);
-
     /* Lookup Servername */
     list = mk_rconf_section_get_key(section_host, "Servername", MK_RCONF_LIST);
     if (!list) {
-        mk_err("Hostname does not contain a Servername");
-        exit(EXIT_FAILURE);
+        mk_err("Hostname does not contain a Servername in %s", path);
+        goto error;
     }
 
     mk_list_foreach(head, list) {
@@ -391,10 +412,7 @@ struct host *mk_vhost_read(char *path)
                                                        MK_RCONF_STR);
     if (!host->documentroot.data) {
         mk_err("Missing DocumentRoot entry on %s file", path);
-        mk_rconf_free(cnf);
-        mk_mem_free(host->file);
-        mk_mem_free(host);
-        return NULL;
+        goto error;
     }
 
     host->documentroot.len = strlen(host->documentroot.data);
@@ -408,10 +426,7 @@ struct host *mk_vhost_read(char *path)
     }
 
     if (mk_list_is_empty(&host->server_names) == 0) {
-        mk_rconf_free(cnf);
-        mk_mem_free(host->file);
-        mk_mem_free(host);
-        return NULL;
+        goto error;
     }
 
     /* Check Virtual Host redirection */
@@ -478,22 +493,22 @@ struct host *mk_vhost_read(char *path)
             if (!line) {
                 continue;
             }
-            h_handler = mk_mem_malloc(sizeof(struct mk_host_handler));
+            h_handler = mk_mem_malloc_z(sizeof(struct mk_host_handler));
             if (!h_handler) {
-                exit(EXIT_FAILURE);
+                mk_string_split_free(line);
+                goto error;
             }
             mk_list_init(&h_handler->params);
+            mk_list_add(&h_handler->_head, &host->handlers);
 
             i = 0;
             params = 0;
+            ret = 0;
             mk_list_foreach(head_line, line) {
                 entry = mk_list_entry(head_line, struct mk_string_line, _head);
                 switch (i) {
                 case 0:
-                    ret = str_to_regex(entry->val, &h_handler->match);
-                    if (ret == -1) {
-                        exit(EXIT_FAILURE);
-                    }
+                    ret = mk_route_compile(&h_handler->match, entry->val);
                     break;
                 case 1:
                     h_handler->name = mk_string_dup(entry->val);
@@ -506,23 +521,51 @@ struct host *mk_vhost_read(char *path)
                     mk_list_add(&h_param->_head, &h_handler->params);
                     params++;
                 };
+                if (ret == -1) {
+                    break;
+                }
                 i++;
             }
             h_handler->n_params = params;
+            mk_string_split_free(line);
 
+            if (ret == -1) {
+                goto error;
+            }
             if (i < 2) {
-                mk_err("[Host Handlers] invalid Match value\n");
-                exit(EXIT_FAILURE);
+                mk_err("[Host Handlers] invalid Match value in %s", path);
+                goto error;
             }
-            mk_list_add(&h_handler->_head, &host->handlers);
         }
     }
 
-
     return host;
+
+ error:
+    mk_vhost_free(host);
+    return NULL;
 }
 
-int mk_vhost_map_handlers()
+/*
+ * Reserve a slot of struct host 'data' for a plugin, it returns -1 if all
+ * of them are taken. Called from the plugins init, before the workers
+ * start.
+ */
+int mk_vhost_data_key()
+{
+    if (mk_vhost_data_keys >= MK_VHOST_DATA_KEYS) {
+        return -1;
+    }
+
+    return mk_vhost_data_keys++;
+}
+
+/*
+ * Link the handlers of the hosts to the loaded plugins and build the
+ * routers. It returns the number of handlers, or -1 if some of them is
+ * not a loaded handler plugin.
+ */
+int mk_vhost_map_handlers(struct mk_list *hosts)
 {
     int n = 0;
     struct mk_list *head;
@@ -531,8 +574,14 @@ int mk_vhost_map_handlers()
     struct mk_host_handler *h_handler;
     struct mk_plugin *p;
 
-    mk_list_foreach(head, &mk_config->hosts) {
+    mk_list_foreach(head, hosts) {
         host = mk_list_entry(head, struct host, _head);
+        if (mk_list_size(&host->handlers) > MK_ROUTER_HANDLERS_MAX) {
+            mk_err("[Host Handlers] %s has more than %i handlers",
+                   host->file, MK_ROUTER_HANDLERS_MAX);
+            return -1;
+        }
+
         mk_list_foreach(head_handler, &host->handlers) {
             h_handler = mk_list_entry(head_handler, struct mk_host_handler, _head);
 
@@ -540,36 +589,38 @@ int mk_vhost_map_handlers()
             p = mk_plugin_lookup(h_handler->name);
             if (!p) {
                 mk_err("Plugin '%s' was not loaded", h_handler->name);
-                exit(EXIT_FAILURE);
+                return -1;
             }
 
             if (p->hooks != MK_PLUGIN_STAGE) {
                 mk_err("Plugin '%s' is not a handler", h_handler->name);
-                exit(EXIT_FAILURE);
+                return -1;
             }
 
             h_handler->handler = p;
             n++;
         }
+
+        host->router = mk_router_create(&host->handlers);
     }
 
     return n;
 }
 
-void mk_vhost_set_single(char *path)
+/* Set the only host of the one shot mode, it returns -1 on error */
+int mk_vhost_set_single(char *path, struct mk_list *hosts)
 {
     struct host *host;
     struct host_alias *halias;
     struct stat checkdir;
 
     /* Set the default host */
-    host = mk_mem_malloc_z(sizeof(struct host));
-    mk_list_init(&host->error_pages);
-    mk_list_init(&host->server_names);
+    host = mk_vhost_alloc();
 
     /* Prepare the unique alias */
     halias = mk_mem_malloc_z(sizeof(struct host_alias));
     halias->name = mk_string_dup("127.0.0.1");
+    halias->len = strlen(halias->name);
     mk_list_add(&halias->_head, &host->server_names);
 
     host->documentroot.data = mk_string_dup(path);
@@ -579,17 +630,24 @@ void mk_vhost_set_single(char *path)
     /* Validate document root configured */
     if (stat(host->documentroot.data, &checkdir) == -1) {
         mk_err("Invalid path to DocumentRoot in %s", path);
-        exit(EXIT_FAILURE);
+        mk_vhost_free(host);
+        return -1;
     }
     else if (!(checkdir.st_mode & S_IFDIR)) {
         mk_err("DocumentRoot variable in %s has an invalid directory path", path);
-        exit(EXIT_FAILURE);
+        mk_vhost_free(host);
+        return -1;
     }
-    mk_list_add(&host->_head, &mk_config->hosts);
+    mk_list_add(&host->_head, hosts);
+    return 1;
 }
 
-/* Given a configuration directory, start reading the virtual host entries */
-void mk_vhost_init(char *path)
+/*
+ * Given a configuration directory, read the virtual host entries into the
+ * 'hosts' list, 'default' first. It returns the number of hosts read, or -1
+ * if some of the files is not valid.
+ */
+int mk_vhost_init(char *path, struct mk_list *hosts)
 {
     DIR *dir;
     unsigned long len;
@@ -600,32 +658,33 @@ void mk_vhost_init(char *path)
     struct dirent *ent;
     struct file_info f_info;
     int ret;
+    int n = 0;
 
     /* Read default virtual host file */
     mk_string_build(&sites, &len, "%s/%s/", path, mk_config->sites_conf_dir);
     ret = mk_file_get_info(sites, &f_info, MK_FILE_EXISTS);
     if (ret == -1 || f_info.is_directory == MK_FALSE) {
         mk_mem_free(sites);
-        sites = mk_config->sites_conf_dir;
+        sites = mk_string_dup(mk_config->sites_conf_dir);
     }
 
     mk_string_build(&buf, &len, "%s/default", sites);
 
     p_host = mk_vhost_read(buf);
+    mk_mem_free(buf);
     if (!p_host) {
         mk_err("Error parsing main configuration file 'default'");
+        mk_mem_free(sites);
+        return -1;
     }
-    mk_list_add(&p_host->_head, &mk_config->hosts);
-    mk_config->nhosts++;
-    mk_mem_free(buf);
-    buf = NULL;
-
+    mk_list_add(&p_host->_head, hosts);
+    n++;
 
     /* Read all virtual hosts defined in sites/ */
     if (!(dir = opendir(sites))) {
-        mk_mem_free(sites);
         mk_err("Could not open %s", sites);
-        exit(EXIT_FAILURE);
+        mk_mem_free(sites);
+        return -1;
     }
 
     /* Reading content */
@@ -648,78 +707,346 @@ void mk_vhost_init(char *path)
         p_host = mk_vhost_read(file);
         mk_mem_free(file);
         if (!p_host) {
-            continue;
-        }
-        else {
-            mk_list_add(&p_host->_head, &mk_config->hosts);
-            mk_config->nhosts++;
+            n = -1;
+            break;
         }
+        mk_list_add(&p_host->_head, hosts);
+        n++;
     }
     closedir(dir);
     mk_mem_free(sites);
+
+    return n;
 }
 
+/* Read a custom error page, it returns -1 if it cannot be served */
+static int mk_vhost_error_page_read(struct error_page *ep)
+{
+    int fd;
+    ssize_t bytes;
+    size_t total = 0;
+    struct stat st;
+
+    fd = open(ep->real_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+        st.st_size > MK_VHOST_ERROR_PAGE_MAX) {
+        close(fd);
+        return -1;
+    }
+
+    ep->body.data = mk_mem_malloc(st.st_size + 1);
+    if (!ep->body.data) {
+        close(fd);
+        return -1;
+    }
+
+    while (total < (size_t) st.st_size) {
+        bytes = read(fd, ep->body.data + total, st.st_size - total);
+        if (bytes == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            break;
+        }
+        total += bytes;
+    }
+    close(fd);
+
+    if (total != (size_t) st.st_size) {
+        mk_ptr_free(&ep->body);
+        return -1;
+    }
+
+    ep->body.data[total] = '\0';
+    ep->body.len = total;
+    return 0;
+}
 
-/* Lookup a registered virtual host based on the given 'host' input */
-int mk_vhost_get(mk_ptr_t host, struct host **vhost, struct host_alias **alias)
+/*
+ * Load the custom error pages of the hosts, so an error costs no file
+ * access. A page that cannot be read is reported and the default one is
+ * sent instead; it is read again on the next reload.
+ */
+void mk_vhost_error_pages_load(struct mk_list *hosts,
+                               struct mk_mimetype_table *mimetypes)
 {
-    struct host *entry_host;
-    struct host_alias *entry_alias;
-    struct mk_list *head_vhost, *head_alias;
-
-    mk_list_foreach(head_vhost, &mk_config->hosts) {
-        entry_host = mk_list_entry(head_vhost, struct host, _head);
-        mk_list_foreach(head_alias, &entry_host->server_names) {
-            entry_alias = mk_list_entry(head_alias, struct host_alias, _head);
-            if (entry_alias->len == host.len &&
-                strncmp(entry_alias->name, host.data, host.len) == 0) {
-                *vhost = entry_host;
-                *alias = entry_alias;
-                return 0;
+    mk_ptr_t path;
+    struct host *host;
+    struct error_page *ep;
+    struct mimetype *mime;
+    struct mk_list *head;
+    struct mk_list *head_ep;
+
+    mk_list_foreach(head, hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        mk_list_foreach(head_ep, &host->error_pages) {
+            ep = mk_list_entry(head_ep, struct error_page, _head);
+
+            if (mk_vhost_error_page_read(ep) != 0) {
+                mk_warn("Cannot load error page %i from %s",
+                        ep->status, ep->real_path);
+                continue;
+            }
+
+            path.data = ep->real_path;
+            path.len = strlen(ep->real_path);
+            mime = mk_mimetype_find(mimetypes, &path);
+            if (!mime) {
+                mime = mimetypes->def;
             }
+            ep->content_type = mime->header_type;
+        }
+    }
+}
+
+/* The loaded custom page for a status, or NULL */
+struct error_page *mk_vhost_error_page(struct host *host, int status)
+{
+    struct mk_list *head;
+    struct error_page *ep;
+
+    mk_list_foreach(head, &host->error_pages) {
+        ep = mk_list_entry(head, struct error_page, _head);
+        if (ep->status == status) {
+            return ep->body.data ? ep : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+
+#define MK_VHOST_HASH_INIT  2166136261U
+#define MK_VHOST_HASH_PRIME 16777619U
+
+/* FNV-1a of the lowercase name */
+static inline unsigned int mk_vhost_hash(const char *name, unsigned int len)
+{
+    unsigned int i;
+    unsigned int hash = MK_VHOST_HASH_INIT;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) tolower(name[i])) * MK_VHOST_HASH_PRIME;
+    }
+    return hash;
+}
+
+/* Same, from the last byte to the first one */
+static inline unsigned int mk_vhost_hash_r(const char *name, unsigned int len)
+{
+    unsigned int hash = MK_VHOST_HASH_INIT;
+
+    while (len > 0) {
+        len--;
+        hash = (hash ^ (unsigned char) tolower(name[len])) * MK_VHOST_HASH_PRIME;
+    }
+    return hash;
+}
+
+static struct mk_vhost_name *mk_vhost_table_find(struct mk_vhost_table *table,
+                                                 unsigned int hash,
+                                                 const char *name,
+                                                 unsigned int len)
+{
+    unsigned int i;
+    struct mk_vhost_name *entry;
+
+    for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+        entry = &table->names[i];
+        if (!entry->name) {
+            return NULL;
+        }
+        if (entry->hash == hash && entry->len == len &&
+            strncasecmp(entry->name, name, len) == 0) {
+            return entry;
+        }
+    }
+}
+
+static int mk_vhost_table_add(struct mk_vhost_table *table, unsigned int hash,
+                              const char *name, unsigned int len,
+                              struct host *host, struct host_alias *alias)
+{
+    unsigned int i;
+    struct mk_vhost_name *entry;
+
+    for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+        entry = &table->names[i];
+        if (!entry->name) {
+            break;
+        }
+        if (entry->hash == hash && entry->len == len &&
+            strncasecmp(entry->name, name, len) == 0) {
+            return -1;
         }
     }
 
-    return -1;
+    entry->hash  = hash;
+    entry->len   = len;
+    entry->name  = name;
+    entry->host  = host;
+    entry->alias = alias;
+    return 0;
 }
 
-void mk_vhost_free_all()
+/*
+ * Index the server names of the given hosts. When a name is used by two
+ * hosts the first one keeps it, as it did when the hosts list was
+ * scanned on every request.
+ */
+struct mk_vhost_index *mk_vhost_index_create(struct mk_list *hosts)
 {
+    int ret;
+    unsigned int n = 0;
+    unsigned int size;
     struct host *host;
-    struct host_alias *host_alias;
-    struct error_page *ep;
-    struct mk_list *head_host;
+    struct host_alias *alias;
+    struct host_alias *plain;
+    struct mk_list *head_vhost;
     struct mk_list *head_alias;
-    struct mk_list *head_error;
-    struct mk_list *tmp1, *tmp2;
+    struct mk_vhost_index *index;
 
-    mk_list_foreach_safe(head_host, tmp1, &mk_config->hosts) {
-        host = mk_list_entry(head_host, struct host, _head);
-        mk_list_del(&host->_head);
+    mk_list_foreach(head_vhost, hosts) {
+        host = mk_list_entry(head_vhost, struct host, _head);
+        n += mk_list_size(&host->server_names);
+    }
+
+    /* At most half full, probes stay short */
+    for (size = 16; size < n * 2; size <<= 1);
+
+    index = mk_mem_malloc_z(sizeof(struct mk_vhost_index));
+    index->exact.mask = size - 1;
+    index->exact.names = mk_mem_malloc_z(sizeof(struct mk_vhost_name) * size);
+    index->wildcard.mask = size - 1;
+    index->wildcard.names = mk_mem_malloc_z(sizeof(struct mk_vhost_name) * size);
+
+    mk_list_foreach(head_vhost, hosts) {
+        host = mk_list_entry(head_vhost, struct host, _head);
+
+        /* A wildcard match reports the first name that is not a pattern */
+        plain = NULL;
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct host_alias, _head);
+            if (alias->name[0] != '*') {
+                plain = alias;
+                break;
+            }
+        }
 
-        mk_mem_free(host->file);
+        mk_list_foreach(head_alias, &host->server_names) {
+            alias = mk_list_entry(head_alias, struct host_alias, _head);
+
+            if (alias->len > 2 && alias->name[0] == '*' &&
+                alias->name[1] == '.') {
+                ret = mk_vhost_table_add(&index->wildcard,
+                                         mk_vhost_hash_r(alias->name + 2,
+                                                         alias->len - 2),
+                                         alias->name + 2, alias->len - 2,
+                                         host, plain ? plain : alias);
+            }
+            else {
+                ret = mk_vhost_table_add(&index->exact,
+                                         mk_vhost_hash(alias->name,
+                                                       alias->len),
+                                         alias->name, alias->len,
+                                         host, alias);
+            }
 
-        /* Free aliases or servernames */
-        mk_list_foreach_safe(head_alias, tmp2, &host->server_names) {
-            host_alias = mk_list_entry(head_alias, struct host_alias, _head);
-            mk_list_del(&host_alias->_head);
-            mk_mem_free(host_alias->name);
-            mk_mem_free(host_alias);
+            if (ret != 0) {
+                mk_warn("Virtual host name '%s' is already in use, "
+                        "ignoring it in %s", alias->name,
+                        host->file ? host->file : "default");
+            }
         }
+    }
+
+    return index;
+}
+
+void mk_vhost_index_free(struct mk_vhost_index *index)
+{
+    if (!index) {
+        return;
+    }
+
+    mk_mem_free(index->exact.names);
+    mk_mem_free(index->wildcard.names);
+    mk_mem_free(index);
+}
+
+/*
+ * Lookup a registered virtual host based on the given 'host' input. The
+ * comparison is case insensitive, an exact name is preferred and then the
+ * wildcard with the longest suffix, e.g: for 'a.b.example.com',
+ * '*.b.example.com' wins over '*.example.com'. For a wildcard match the
+ * alias set is the first name of the virtual host that is not a pattern,
+ * or the pattern itself if the host only has patterns.
+ */
+int mk_vhost_get(struct mk_vhost_index *index, mk_ptr_t host,
+                 struct host **vhost, struct host_alias **alias)
+{
+    unsigned int i;
+    unsigned int len;
+    unsigned int hash;
+    struct mk_vhost_name *entry;
+    struct mk_vhost_name *match = NULL;
+
+    /* Fully qualified form: 'example.com.' */
+    len = host.len;
+    if (len > 0 && host.data[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || !index) {
+        return -1;
+    }
+
+    entry = mk_vhost_table_find(&index->exact, mk_vhost_hash(host.data, len),
+                                host.data, len);
+    if (entry) {
+        *vhost = entry->host;
+        *alias = entry->alias;
+        return 0;
+    }
 
-        /* Free error pages */
-        mk_list_foreach_safe(head_error, tmp2, &host->error_pages) {
-            ep = mk_list_entry(head_error, struct error_page, _head);
-            mk_list_del(&ep->_head);
-            mk_mem_free(ep->file);
-            mk_mem_free(ep->real_path);
-            mk_mem_free(ep);
+    /*
+     * Walk the name backwards: when a dot is found, the hash of the labels
+     * on its right is ready to look up '*.<labels>'.
+     */
+    hash = MK_VHOST_HASH_INIT;
+    for (i = len - 1; i > 0; i--) {
+        if (host.data[i] == '.') {
+            entry = mk_vhost_table_find(&index->wildcard, hash,
+                                        host.data + i + 1, len - i - 1);
+            if (entry) {
+                match = entry;
+            }
         }
+        hash = (hash ^ (unsigned char) tolower(host.data[i])) *
+            MK_VHOST_HASH_PRIME;
+    }
+
+    if (!match) {
+        return -1;
+    }
+
+    *vhost = match->host;
+    *alias = match->alias;
+    return 0;
+}
 
-        mk_ptr_free(&host->documentroot);
+void mk_vhost_free_all(struct mk_list *hosts)
+{
+    struct host *host;
+    struct mk_list *head;
+    struct mk_list *tmp;
 
-        /* Free source configuration */
-        if (host->config) mk_rconf_free(host->config);
-        mk_mem_free(host);
+    mk_list_foreach_safe(head, tmp, hosts) {
+        host = mk_list_entry(head, struct host, _head);
+        mk_list_del(&host->_head);
+        mk_vhost_free(host);
     }
 }
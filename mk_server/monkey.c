@@ -23,6 +23,7 @@
 #include <monkey/mk_scheduler.h>
 #include <monkey/mk_plugin.h>
 #include <monkey/mk_clock.h>
+#include <monkey/mk_reload.h>
 
 void mk_server_info()
 {
@@ -112,6 +113,11 @@ int mk_server_setup()
     /* Invoke Plugin PRCTX hooks */
     mk_plugin_core_process();
 
+    /* Configuration reload on SIGHUP */
+    if (mk_reload_init() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     /* Launch monkey http workers */
     MK_TLS_INIT();
     mk_server_launch_workers();
@@ -147,6 +153,11 @@ void mk_exit_all()
         pthread_join(sched_list[i].tid, NULL);
     }
 
+    for (i = 0; i < mk_config->workers; i++) {
+        mk_latency_destroy(sched_list[i].latency);
+        mk_metrics_destroy(sched_list[i].metrics);
+    }
+
     mk_plugin_exit_all();
     mk_config_free_all();
     mk_mem_free(sched_list);
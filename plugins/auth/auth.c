@@ -19,22 +19,175 @@
 
 #include <monkey/mk_api.h>
 
+#include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
 
 #include "auth.h"
 #include "conf.h"
+#include "location.h"
 #include "sha1.h"
 #include "base64.h"
 
+struct auth_config auth_conf;
+pthread_key_t auth_worker_key;
+int auth_vhost_key;
+
+struct mk_list auth_workers;
+pthread_mutex_t auth_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+unsigned int mk_auth_hash(const char *data, size_t len)
+{
+    size_t i;
+    unsigned int hash = 2166136261U;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+/* Compare without leaking the position of the first difference */
+static int mk_auth_equal(const unsigned char *a, const unsigned char *b,
+                         size_t len)
+{
+    size_t i;
+    unsigned char diff = 0;
+
+    for (i = 0; i < len; i++) {
+        diff |= a[i] ^ b[i];
+    }
+
+    return (diff == 0);
+}
+
+/*
+ * Get the current users of a file. The hazard pointer tells the reload
+ * thread this worker is reading them; it is published before checking
+ * the users were not replaced meanwhile, otherwise they could have been
+ * freed already.
+ */
+static struct users_db *mk_auth_users_acquire(struct auth_worker *worker,
+                                              struct users_file *uf)
+{
+    struct users_db *db;
+    struct users_db *cur;
+
+    cur = __atomic_load_n(&uf->db, __ATOMIC_ACQUIRE);
+    do {
+        db = cur;
+        __atomic_store_n(&worker->hazard, db, __ATOMIC_SEQ_CST);
+        cur = __atomic_load_n(&uf->db, __ATOMIC_SEQ_CST);
+    } while (cur != db);
+
+    return db;
+}
+
+static inline void mk_auth_users_release(struct auth_worker *worker)
+{
+    __atomic_store_n(&worker->hazard, NULL, __ATOMIC_RELEASE);
+}
+
+static struct user *mk_auth_user_lookup(struct users_db *db,
+                                        const char *name, int len)
+{
+    unsigned int hash;
+    struct user *entry;
+
+    hash = mk_auth_hash(name, len);
+    entry = db->index[hash & (db->index_size - 1)];
+    for (; entry; entry = entry->next) {
+        if (entry->hash == hash && strncmp(entry->user, name, len) == 0 &&
+            entry->user[len] == '\0') {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Check the password against the user hash, it returns 0 on success */
+static int mk_auth_check_passwd(struct auth_worker *worker,
+                                struct user *entry,
+                                const char *passwd, size_t len)
+{
+    int ret = -1;
+    unsigned char digest[SHA1_DIGEST_LEN];
+#if defined(AUTH_HAVE_CRYPT) || defined(AUTH_HAVE_ARGON2)
+    char *hash;
+    char buf[MK_AUTH_CREDENTIALS_LEN];
+#endif
+    SHA_CTX sha; /* defined in sha1/sha1.h */
+
+    (void) worker;
+
+    if (entry->passwd_type == MK_AUTH_PASSWD_SHA1) {
+        SHA1_Init(&sha);
+        SHA1_Update(&sha, (unsigned char *) passwd, len);
+        SHA1_Final(digest, &sha);
+
+        if (mk_auth_equal(entry->passwd_decoded, digest, SHA1_DIGEST_LEN)) {
+            ret = 0;
+        }
+        return ret;
+    }
+
+#if defined(AUTH_HAVE_CRYPT) || defined(AUTH_HAVE_ARGON2)
+    /* The verifiers want a NUL terminated password */
+    if (len >= sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, passwd, len);
+    buf[len] = '\0';
+
+#ifdef AUTH_HAVE_CRYPT
+    if (entry->passwd_type == MK_AUTH_PASSWD_CRYPT && worker) {
+        hash = crypt_r(buf, entry->passwd_raw, &worker->crypt);
+        if (hash && strlen(hash) == strlen(entry->passwd_raw) &&
+            mk_auth_equal((unsigned char *) hash,
+                          (unsigned char *) entry->passwd_raw,
+                          strlen(hash))) {
+            ret = 0;
+        }
+    }
+#endif
+#ifdef AUTH_HAVE_ARGON2
+    if (entry->passwd_type == MK_AUTH_PASSWD_ARGON2) {
+        hash = entry->passwd_raw;
+        if (strncmp(hash, "$argon2id$", 10) == 0) {
+            ret = argon2_verify(hash, buf, len, Argon2_id);
+        }
+        else if (strncmp(hash, "$argon2i$", 9) == 0) {
+            ret = argon2_verify(hash, buf, len, Argon2_i);
+        }
+        else if (strncmp(hash, "$argon2d$", 9) == 0) {
+            ret = argon2_verify(hash, buf, len, Argon2_d);
+        }
+        ret = (ret == ARGON2_OK) ? 0 : -1;
+    }
+#endif
+
+    memset(buf, '\0', sizeof(buf));
+#endif
+
+    return ret;
+}
+
 static int mk_auth_validate_user(struct users_file *users,
                                  const char *credentials, unsigned int len)
 {
     int sep;
+    int ret = -1;
     size_t auth_len;
     unsigned char *decoded = NULL;
     unsigned char digest[SHA1_DIGEST_LEN];
-    struct mk_list *head;
     struct user *entry;
+    struct users_db *db;
+    struct auth_worker *worker;
+    struct auth_cache_entry *cached = NULL;
 
     SHA_CTX sha; /* defined in sha1/sha1.h */
 
@@ -49,68 +202,115 @@ static int mk_auth_validate_user(struct users_file *users,
         return -1;
     }
 
+    worker = pthread_getspecific(auth_worker_key);
+    if (!worker) {
+        return -1;
+    }
+    db = mk_auth_users_acquire(worker, users);
+
+    /* Credentials verified recently ? */
+    if (worker->cache) {
+        SHA1_Init(&sha);
+        SHA1_Update(&sha, (unsigned char *) credentials, len);
+        SHA1_Final(digest, &sha);
+
+        cached = &worker->cache[(digest[0] | digest[1] << 8 |
+                                 digest[2] << 16 | (unsigned) digest[3] << 24) &
+                                (auth_conf.cache_size - 1)];
+        if (cached->users == users &&
+            cached->generation == db->generation &&
+            cached->expire >= mk_api->time_unix() &&
+            memcmp(cached->digest, digest, SHA1_DIGEST_LEN) == 0) {
+            PLUGIN_TRACE("Credentials cache hit");
+            ret = 0;
+            goto exit;
+        }
+    }
+
     /* Decode credentials: incoming credentials comes in base64 encode */
     decoded = base64_decode((unsigned char *) credentials + auth_header_basic.len,
                             len - auth_header_basic.len,
                             &auth_len);
     if (decoded == NULL) {
         PLUGIN_TRACE("Failed to decode credentials.");
-        goto error;
+        goto exit;
     }
 
     if (auth_len <= 3) {
-        goto error;
+        goto exit;
     }
 
     sep = mk_api->str_search_n((char *) decoded, ":", 1, auth_len);
     if (sep == -1 || sep == 0  || (unsigned int) sep == auth_len - 1) {
-        goto error;
+        goto exit;
     }
 
-    /* Get SHA1 hash */
-    SHA1_Init(&sha);
-    SHA1_Update(&sha, (unsigned char *) decoded + sep + 1, auth_len - (sep + 1));
-    SHA1_Final(digest, &sha);
-
-    mk_list_foreach(head, &users->_users) {
-        entry = mk_list_entry(head, struct user, _head);
-        /* match user */
-        if (strlen(entry->user) != (unsigned int) sep) {
-            continue;
-        }
-        if (strncmp(entry->user, (char *) decoded, sep) != 0) {
-            continue;
-        }
-
-        PLUGIN_TRACE("User match '%s'", entry->user);
-
-        /* match password */
-        if (memcmp(entry->passwd_decoded, digest, SHA1_DIGEST_LEN) == 0) {
-            PLUGIN_TRACE("User '%s' matched password", entry->user);
-            mk_api->mem_free(decoded);
-            return 0;
+    /* match user */
+    entry = mk_auth_user_lookup(db, (char *) decoded, sep);
+    if (!entry) {
+        goto exit;
+    }
+    PLUGIN_TRACE("User match '%s'", entry->user);
+
+    /* match password */
+    if (mk_auth_check_passwd(worker, entry, (char *) decoded + sep + 1,
+                             auth_len - (sep + 1)) == 0) {
+        PLUGIN_TRACE("User '%s' matched password", entry->user);
+        if (cached) {
+            cached->users      = users;
+            cached->generation = db->generation;
+            cached->expire     = mk_api->time_unix() + auth_conf.cache_ttl;
+            memcpy(cached->digest, digest, SHA1_DIGEST_LEN);
         }
+        ret = 0;
+    }
+    else {
         PLUGIN_TRACE("Invalid password");
-        break;
     }
 
-    error:
+    exit:
+    mk_auth_users_release(worker);
     if (decoded) {
+        memset(decoded, '\0', auth_len);
         mk_api->mem_free(decoded);
     }
-    return -1;
+    return ret;
 }
 
-int mk_auth_plugin_init(struct plugin_api **api, char *confdir)
+/* Check the users files every few seconds, see mk_auth_conf_reload() */
+static void mk_auth_reload_worker(void *data)
 {
-    (void) confdir;
+    time_t next = 0;
+    (void) data;
+
+    mk_api->worker_rename("monkey: auth-reload");
 
+    while (1) {
+        if (time(NULL) >= next) {
+            mk_auth_conf_reload();
+            next = time(NULL) + auth_conf.reload_interval;
+        }
+        sleep(1);
+    }
+}
+
+int mk_auth_plugin_init(struct plugin_api **api, char *confdir)
+{
     mk_api = *api;
 
+    pthread_key_create(&auth_worker_key, NULL);
+    mk_auth_conf_read(confdir);
+
+    auth_vhost_key = mk_api->vhost_data_key();
+    if (auth_vhost_key < 0) {
+        mk_err("Auth: no virtual host data slot available");
+        return -1;
+    }
+
     /* Init and load global users list */
-    mk_list_init(&vhosts_list);
+    mk_list_init(&auth_workers);
     mk_list_init(&users_file_list);
-    mk_auth_conf_init_users_list();
+    mk_auth_conf_init_users_list(&mk_api->config->gen->hosts);
 
     /* Set HTTP headers key */
     auth_header_basic.data = MK_AUTH_HEADER_BASIC;
@@ -124,13 +324,38 @@ int mk_auth_plugin_exit()
     return 0;
 }
 
+int mk_auth_master_init(struct mk_server_config *config)
+{
+    (void) config;
+
+    /* Even without users files, a configuration reload may add them */
+    if (auth_conf.reload_interval > 0) {
+        mk_api->worker_spawn(mk_auth_reload_worker, NULL);
+    }
+
+    return 0;
+}
+
 void mk_auth_worker_init()
 {
-    char *user;
+    struct auth_worker *worker;
 
-    /* Init thread buffer for given credentials */
-    user = mk_api->mem_alloc(MK_AUTH_CREDENTIALS_LEN - 1);
-    pthread_setspecific(_mkp_data, (void *) user);
+    /* crypt_r() wants its data zeroed before the first call */
+    worker = mk_api->mem_alloc_z(sizeof(struct auth_worker));
+    if (!worker) {
+        return;
+    }
+
+    if (auth_conf.cache_ttl > 0) {
+        worker->cache = mk_api->mem_alloc_z(sizeof(struct auth_cache_entry) *
+                                            auth_conf.cache_size);
+    }
+
+    pthread_mutex_lock(&auth_workers_lock);
+    mk_list_add(&worker->_head, &auth_workers);
+    pthread_mutex_unlock(&auth_workers_lock);
+
+    pthread_setspecific(auth_worker_key, (void *) worker);
 }
 
 /* Object handler */
@@ -141,53 +366,30 @@ int mk_auth_stage30(struct mk_plugin *plugin,
                     struct mk_list *params)
 {
     int val;
-    short int is_restricted = MK_FALSE;
-    struct mk_list *vh_head;
-    struct mk_list *loc_head;
-    struct vhost *vh_entry = NULL;
+    struct vhost *vh_entry;
     struct location *loc_entry;
     struct mk_http_header *header;
     (void) plugin;
     (void) n_params;
     (void) params;
 
-    PLUGIN_TRACE("[FD %i] Handler received request");
-
-    /* Match auth_vhost with global vhost */
-    mk_list_foreach(vh_head, &vhosts_list) {
-        vh_entry = mk_list_entry(vh_head, struct vhost, _head);
-        if (vh_entry->host == sr->host_conf) {
-            PLUGIN_TRACE("[FD %i] host matched %s",
-                         cs->socket,
-                         mk_api->config->server_signature);
-            break;
-        }
-    }
+    PLUGIN_TRACE("[FD %i] Handler received request", cs->socket);
 
+    vh_entry = sr->host_conf->data[auth_vhost_key];
     if (!vh_entry) {
         return MK_PLUGIN_RET_NOT_ME;
     }
 
-    /* Check vhost locations */
-    mk_list_foreach(loc_head, &vh_entry->locations) {
-        loc_entry = mk_list_entry(loc_head, struct location, _head);
-        if (sr->uri_processed.len < loc_entry->path.len) {
-            continue;
-        }
-        if (strncmp(sr->uri_processed.data,
-                    loc_entry->path.data, loc_entry->path.len) == 0) {
-            is_restricted = MK_TRUE;
-            PLUGIN_TRACE("[FD %i] Location matched %s",
-                         cs->socket,
-                         loc_entry->path.data);
-            break;
-        }
-    }
+    /* Longest location matching the URI */
+    loc_entry = mk_auth_location_match(vh_entry, sr->uri_processed.data,
+                                       sr->uri_processed.len);
 
     /* For non-restricted location do not take any action, just returns */
-    if (is_restricted == MK_FALSE) {
+    if (!loc_entry) {
         return MK_PLUGIN_RET_NOT_ME;
     }
+    PLUGIN_TRACE("[FD %i] Location matched %s",
+                 cs->socket, loc_entry->path.data);
 
     /* Check authorization header */
     header = mk_api->header_get(MK_HEADER_AUTHORIZATION,
@@ -234,9 +436,13 @@ struct mk_plugin mk_plugin_auth = {
     .exit_plugin   = mk_auth_plugin_exit,
 
     /* Init Levels */
-    .master_init   = NULL,
+    .master_init   = mk_auth_master_init,
     .worker_init   = mk_auth_worker_init,
 
+    /* Configuration reload */
+    .vhost_init    = mk_auth_conf_init_users_list,
+    .vhost_exit    = mk_auth_conf_vhost_free,
+
     /* Type */
     .stage         = &mk_plugin_stage_auth
 };
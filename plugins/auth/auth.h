@@ -22,6 +22,14 @@
 
 #include <monkey/mk_api.h>
 
+#ifdef AUTH_HAVE_CRYPT
+#include <crypt.h>
+#endif
+
+#ifdef AUTH_HAVE_ARGON2
+#include <argon2.h>
+#endif
+
 /* Header stuff */
 #define MK_AUTH_HEADER_BASIC     "Basic "
 #define MK_AUTH_HEADER_TITLE     "WWW-Authenticate: Basic realm=\"%s\""
@@ -29,9 +37,21 @@
 /* Credentials length */
 #define MK_AUTH_CREDENTIALS_LEN 256
 
+/* Verified credentials cache defaults: entries per worker and seconds */
+#define MK_AUTH_CACHE_SIZE      1024
+#define MK_AUTH_CACHE_TTL       60
+
+/* Seconds between checks for modified users files */
+#define MK_AUTH_RELOAD_INTERVAL 5
+
+/* Password hash formats */
+#define MK_AUTH_PASSWD_SHA1     0      /* {SHA}base64 */
+#define MK_AUTH_PASSWD_CRYPT    1      /* $2y$..., $6$..., crypt(3) */
+#define MK_AUTH_PASSWD_ARGON2   2      /* $argon2id$... */
+
 /*
- * The plugin hold one struct per virtual host and link to the
- * locations and users file associated:
+ * The plugin hold one struct per virtual host with [AUTH] sections and
+ * link to the locations and users file associated:
  *
  *                    +---------------------------------+
  *      struct vhost  >            vhost (1:N)          |
@@ -46,14 +66,14 @@
  *
  */
 
-/* List of virtual hosts to handle locations */
-struct mk_list vhosts_list;
-
-/* main index for locations under a virtualhost */
+/*
+ * main index for locations under a virtualhost, the struct host keeps a
+ * reference in its data slot 'auth_vhost_key'
+ */
 struct vhost {
     struct host *host;
     struct mk_list locations;
-    struct mk_list _head;
+    struct location_node *root; /* locations by path, see location.c */
 };
 
 /*
@@ -69,17 +89,47 @@ struct location {
     struct mk_list _head;
 };
 
+/* Radix tree node: a piece of path and the location ending there, if any */
+struct location_node {
+    const char *label;
+    int len;
+    struct location *loc;
+
+    int n_children;
+    struct location_node **children; /* sorted by first label byte */
+};
+
 /* Head index for user files list */
 struct mk_list users_file_list;
 
+/*
+ * The users of a file. A reload builds a new one and publishes it with a
+ * single pointer store, workers never see a partially updated list. The
+ * replaced one is kept on the retired list until no worker is using it.
+ */
+struct users_db {
+    unsigned int generation; /* bumped on every reload */
+    struct mk_list _users;   /* list of users */
+    unsigned int index_size;
+    struct user **index;     /* users hashed by name */
+    struct mk_list _head;    /* head for users_file retired list */
+};
+
 /*
  * Represents a users file, each entry represents a physical
  * file and belongs to a node of the users_file_list list
  */
 struct users_file {
-    time_t last_updated;   /* last time this entry was modified */
     char *path;            /* file path */
-    struct mk_list _users; /* list of users */
+    struct users_db *db;   /* current users, see mk_auth_users_acquire() */
+
+    /* what the file looked like on the last check */
+    uint64_t mtime;        /* nanoseconds */
+    off_t size;
+    ino_t ino;
+    int failed;            /* last check or load failed, already warned */
+
+    struct mk_list retired;
     struct mk_list _head;  /* head for main mk_list users_file_list */
 };
 
@@ -91,16 +141,58 @@ struct user {
     char user[128];
     char passwd_raw[256];
     unsigned char *passwd_decoded;
+    int passwd_type;       /* MK_AUTH_PASSWD_* */
+    unsigned int hash;     /* hash of the user name */
 
+    struct user *next;     /* next user in the same index slot */
     struct mk_list _head;
 };
 
+/*
+ * Credentials verified recently: the key is the users file plus the SHA-1
+ * of the whole Authorization header value, so a hit skips the base64
+ * decoding, the user lookup and the password hash (which for bcrypt or
+ * argon2 is expensive on purpose). Entries from before a reload of the
+ * file do not match as the generation changed.
+ */
+struct auth_cache_entry {
+    struct users_file *users;
+    unsigned int generation;
+    unsigned char digest[20];
+    time_t expire;
+};
+
+/* Per worker data */
+struct auth_worker {
+    struct auth_cache_entry *cache;
+    struct users_db *hazard;   /* users_db in use, must not be freed */
+#ifdef AUTH_HAVE_CRYPT
+    struct crypt_data crypt;
+#endif
+    struct mk_list _head;      /* head for auth_workers */
+};
+
+struct auth_config {
+    int cache_ttl;         /* seconds, 0 = cache disabled */
+    unsigned int cache_size;
+    int reload_interval;   /* seconds, 0 = never reload users files */
+};
+
+extern struct auth_config auth_conf;
+extern pthread_key_t auth_worker_key;
+extern int auth_vhost_key;
+
+/* All the workers, the reload thread checks their hazard pointers */
+extern struct mk_list auth_workers;
+extern pthread_mutex_t auth_workers_lock;
+
 struct mk_list users_file_list;
 
-/* Thread key */
 mk_ptr_t auth_header_request;
 mk_ptr_t auth_header_basic;
 
 #define SHA1_DIGEST_LEN 20
 
+unsigned int mk_auth_hash(const char *data, size_t len);
+
 #endif
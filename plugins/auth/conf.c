@@ -18,57 +18,239 @@
  */
 
 #include <monkey/mk_api.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "base64.h"
 #include "auth.h"
 #include "conf.h"
+#include "location.h"
 
-/*
- * Register a users file into the main list, if the users
- * file already exists it just return the node in question,
- * otherwise add the node to the list and return the node
- * created.
- */
-static struct users_file *mk_auth_conf_add_users(char *users_path)
+/* The users files may be added by a configuration reload */
+static pthread_mutex_t users_file_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read an optional numeric key, 'def' if it is not set */
+static long mk_auth_conf_num(struct mk_rconf_section *section, char *key,
+                             long def)
 {
+    char *tmp;
+
+    tmp = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!tmp) {
+        return def;
+    }
+    mk_api->mem_free(tmp);
+
+    return (long) mk_api->config_section_get_key(section, key, MK_RCONF_NUM);
+}
+
+/* Plugin settings, auth.conf is optional */
+int mk_auth_conf_read(char *confdir)
+{
+    long num;
+    unsigned long len;
+    char *path = NULL;
     struct file_info finfo;
-    struct mk_list *head;
-    struct users_file *entry;
-    struct user *cred;
-    int i, sep, len;
-    int offset = 0;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+
+    auth_conf.cache_ttl  = MK_AUTH_CACHE_TTL;
+    auth_conf.cache_size = MK_AUTH_CACHE_SIZE;
+    auth_conf.reload_interval = MK_AUTH_RELOAD_INTERVAL;
+
+    mk_api->str_build(&path, &len, "%s/auth.conf", confdir);
+    if (mk_api->file_get_info(path, &finfo, MK_FILE_READ) != 0) {
+        mk_api->mem_free(path);
+        return 0;
+    }
+
+    conf = mk_api->config_create(path);
+    mk_api->mem_free(path);
+    if (!conf) {
+        return -1;
+    }
+
+    section = mk_api->config_section_get(conf, "AUTH");
+    if (section) {
+        num = mk_auth_conf_num(section, "CacheTTL", MK_AUTH_CACHE_TTL);
+        auth_conf.cache_ttl = (num > 0) ? num : 0;
+
+        /* A power of two number of entries */
+        num = mk_auth_conf_num(section, "CacheSize", MK_AUTH_CACHE_SIZE);
+        if (num <= 0) {
+            auth_conf.cache_ttl = 0;
+        }
+        else {
+            for (auth_conf.cache_size = 1;
+                 auth_conf.cache_size < num && auth_conf.cache_size < (1U << 24);
+                 auth_conf.cache_size <<= 1);
+        }
+
+        num = mk_auth_conf_num(section, "ReloadInterval",
+                               MK_AUTH_RELOAD_INTERVAL);
+        auth_conf.reload_interval = (num > 0) ? num : 0;
+    }
+
+    mk_api->config_free(conf);
+    return 0;
+}
+
+/* Parse the password hash of a users file entry */
+static int mk_auth_conf_passwd(struct user *cred, char *passwd, int len)
+{
+    int type = MK_AUTH_PASSWD_SHA1;
     size_t decoded_len;
-    char *buf;
 
-    mk_list_foreach(head, &users_file_list) {
-        entry = mk_list_entry(head, struct users_file, _head);
-        if (strcmp(entry->path, users_path) == 0) {
-            return entry;
+    cred->passwd_decoded = NULL;
+
+    if (len > 5 && strncmp(passwd, "{SHA}", 5) == 0) {
+        passwd += 5;
+        len -= 5;
+    }
+    else if (len > 6 && strncmp(passwd, "{SHA1}", 6) == 0) {
+        /* as written by mk_passwd */
+        passwd += 6;
+        len -= 6;
+    }
+    else if (*passwd == '$') {
+        if (strncmp(passwd, "$argon2", 7) == 0) {
+#ifdef AUTH_HAVE_ARGON2
+            type = MK_AUTH_PASSWD_ARGON2;
+#else
+            mk_warn("Auth: argon2 support is not built in");
+            return -1;
+#endif
+        }
+        else {
+#ifdef AUTH_HAVE_CRYPT
+            type = MK_AUTH_PASSWD_CRYPT;
+#else
+            mk_warn("Auth: crypt(3) support is not built in");
+            return -1;
+#endif
+        }
+    }
+    else {
+        return -1;
+    }
+
+    if (len >= (int) sizeof(cred->passwd_raw)) {
+        mk_warn("Auth: password hash too long");
+        return -1;
+    }
+    memcpy(cred->passwd_raw, passwd, len);
+    cred->passwd_raw[len] = '\0';
+
+    /* The type comes from the prefix, "{SHA}$..." is not a crypt hash */
+    cred->passwd_type = type;
+    if (type != MK_AUTH_PASSWD_SHA1) {
+        return 0;
+    }
+
+    /* SHA-1, base64 encoded */
+    cred->passwd_decoded = base64_decode((unsigned char *) cred->passwd_raw,
+                                         len, &decoded_len);
+    if (!cred->passwd_decoded) {
+        return -1;
+    }
+    if (decoded_len != SHA1_DIGEST_LEN) {
+        mk_api->mem_free(cred->passwd_decoded);
+        cred->passwd_decoded = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Modification time in nanoseconds, seconds only where stat lacks st_mtim */
+static inline uint64_t mk_auth_conf_mtime(struct stat *st)
+{
+#ifdef AUTH_HAVE_STAT_MTIM
+    return ((uint64_t) st->st_mtim.tv_sec * 1000000000) + st->st_mtim.tv_nsec;
+#else
+    return (uint64_t) st->st_mtime * 1000000000;
+#endif
+}
+
+/* Add the user to the database, the first entry of a name wins */
+static int mk_auth_conf_index_add(struct users_db *db, struct user *cred)
+{
+    struct user **slot;
+
+    slot = &db->index[cred->hash & (db->index_size - 1)];
+    for (; *slot; slot = &(*slot)->next) {
+        if (strcmp((*slot)->user, cred->user) == 0) {
+            return -1;
         }
     }
 
-    if (mk_api->file_get_info(users_path, &finfo, MK_FILE_READ) != 0) {
+    cred->next = NULL;
+    *slot = cred;
+    mk_list_add(&cred->_head, &db->_users);
+    return 0;
+}
+
+void mk_auth_conf_users_free(struct users_db *db)
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct user *cred;
+
+    mk_list_foreach_safe(head, tmp, &db->_users) {
+        cred = mk_list_entry(head, struct user, _head);
+        mk_list_del(&cred->_head);
+        mk_api->mem_free(cred->passwd_decoded);
+        memset(cred, '\0', sizeof(struct user));
+        mk_api->mem_free(cred);
+    }
+
+    mk_api->mem_free(db->index);
+    mk_api->mem_free(db);
+}
+
+/* An empty users database with room for 'size' index slots */
+static struct users_db *mk_auth_conf_users_new(unsigned int size)
+{
+    struct users_db *db;
+
+    db = mk_api->mem_alloc_z(sizeof(struct users_db));
+    db->index_size = size;
+    db->index      = mk_api->mem_alloc_z(sizeof(struct user *) * size);
+    mk_list_init(&db->_users);
+
+    return db;
+}
+
+/* Read a users file: one 'user:hash' entry per line */
+struct users_db *mk_auth_conf_users_load(char *users_path)
+{
+    int n;
+    int sep;
+    int len;
+    unsigned int size;
+    char *p;
+    char *end;
+    char *buf;
+    struct stat st;
+    struct users_db *db;
+    struct user *cred;
+
+    if (stat(users_path, &st) != 0) {
         mk_warn("Auth: Invalid users file '%s'", users_path);
         return NULL;
     }
 
-    if (finfo.is_directory == MK_TRUE) {
+    if (S_ISDIR(st.st_mode)) {
         mk_warn("Auth: Not a credentials file '%s'", users_path);
         return NULL;
     }
 
-    if (finfo.read_access == MK_FALSE) {
+    if (access(users_path, R_OK) != 0) {
         mk_warn("Auth: Could not read file '%s'", users_path);
         return NULL;
     }
 
-    /* We did not find the path in our list, let's create a new node */
-    entry  = mk_api->mem_alloc(sizeof(struct users_file));
-    entry->last_updated = finfo.last_modification;
-    entry->path = users_path;
-
-    /* Read file and add users to the list */
-    mk_list_init(&entry->_users);
-
     /* Read credentials file */
     buf = mk_api->file_to_buffer(users_path);
     if (!buf) {
@@ -76,66 +258,217 @@ static struct users_file *mk_auth_conf_add_users(char *users_path)
         return NULL;
     }
 
-    /* Read users list buffer lines */
-    len = strlen(buf);
-    for (i = 0; i < len; i++) {
-        if (buf[i] == '\n' || (i) == len -1) {
-            sep = mk_api->str_search(buf + offset, ":", 1);
+    /* Size the index for the number of lines */
+    for (n = 1, p = buf; *p; p++) {
+        if (*p == '\n') {
+            n++;
+        }
+    }
+    for (size = 16; size < (unsigned int) n * 2; size <<= 1);
 
-            if (sep >= (int)sizeof(cred->user)) {
-                mk_warn("Auth: username too long");
-                offset = i + 1;
-                continue;
-            }
-            if (i - offset - sep - 1 - 5 >= (int)sizeof(cred->passwd_raw)) {
-                mk_warn("Auth: password hash too long");
-                offset = i + 1;
-                continue;
-            }
+    db = mk_auth_conf_users_new(size);
 
-            cred = mk_api->mem_alloc(sizeof(struct user));
+    for (p = buf; *p; p = end) {
+        end = strchr(p, '\n');
+        if (end) {
+            len = end - p;
+            end++;
+        }
+        else {
+            len = strlen(p);
+            end = p + len;
+        }
 
-            /* Copy username */
-            strncpy(cred->user, buf + offset, sep);
-            cred->user[sep] = '\0';
+        while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == ' ')) {
+            len--;
+        }
+        if (len == 0 || *p == '#') {
+            continue;
+        }
 
-            /* Copy raw password */
-            offset += sep + 1 + 5;
-            strncpy(cred->passwd_raw,
-                    buf + offset,
-                    i - (offset));
-            cred->passwd_raw[i - offset] = '\0';
+        for (sep = 0; sep < len && p[sep] != ':'; sep++);
+        if (sep == 0 || sep == len) {
+            mk_warn("Auth: invalid line in '%s'", users_path);
+            continue;
+        }
 
-            /* Decode raw password */
-            cred->passwd_decoded = base64_decode((unsigned char *)(cred->passwd_raw),
-                                                 strlen(cred->passwd_raw),
-                                                 &decoded_len);
+        if (sep >= (int) sizeof(cred->user)) {
+            mk_warn("Auth: username too long");
+            continue;
+        }
 
-            offset = i + 1;
+        cred = mk_api->mem_alloc(sizeof(struct user));
 
-            if (!cred->passwd_decoded) {
-                mk_warn("Auth: invalid user '%s' in '%s'",
-                        cred->user, users_path);
-                mk_api->mem_free(cred);
-                continue;
-            }
-            mk_list_add(&cred->_head, &entry->_users);
+        /* Copy username */
+        memcpy(cred->user, p, sep);
+        cred->user[sep] = '\0';
+        cred->hash = mk_auth_hash(cred->user, sep);
+
+        /* Password hash */
+        if (mk_auth_conf_passwd(cred, p + sep + 1, len - sep - 1) != 0) {
+            mk_warn("Auth: invalid user '%s' in '%s'",
+                    cred->user, users_path);
+            mk_api->mem_free(cred);
+            continue;
+        }
+
+        if (mk_auth_conf_index_add(db, cred) != 0) {
+            mk_warn("Auth: duplicated user '%s' in '%s'",
+                    cred->user, users_path);
+            mk_api->mem_free(cred->passwd_decoded);
+            mk_api->mem_free(cred);
         }
     }
+
+    memset(buf, '\0', strlen(buf));
     mk_api->mem_free(buf);
 
+    return db;
+}
+
+/*
+ * Register a users file into the main list, if the users
+ * file already exists it just return the node in question,
+ * otherwise add the node to the list and return the node
+ * created. A file that cannot be loaded is registered with no
+ * users, so its locations deny every request until a reload
+ * reads it.
+ */
+static struct users_file *mk_auth_conf_add_users(char *users_path)
+{
+    struct mk_list *head;
+    struct stat st;
+    struct users_file *entry;
+    struct users_db *db;
+
+    mk_list_foreach(head, &users_file_list) {
+        entry = mk_list_entry(head, struct users_file, _head);
+        if (strcmp(entry->path, users_path) == 0) {
+            return entry;
+        }
+    }
+
+    /* Before reading it, so a change while loading is not missed */
+    if (stat(users_path, &st) != 0) {
+        memset(&st, '\0', sizeof(st));
+    }
+
+    /* We did not find the path in our list, let's create a new node */
+    entry = mk_api->mem_alloc_z(sizeof(struct users_file));
+    entry->path = users_path;
+
+    db = mk_auth_conf_users_load(users_path);
+    if (db) {
+        entry->mtime = mk_auth_conf_mtime(&st);
+        entry->size = st.st_size;
+        entry->ino = st.st_ino;
+    }
+    else {
+        mk_warn("Auth: no users from '%s', access denied until it loads",
+                users_path);
+        db = mk_auth_conf_users_new(16);
+    }
+    entry->db = db;
+    mk_list_init(&entry->retired);
+
     /* Link node to global list */
     mk_list_add(&entry->_head, &users_file_list);
 
     return entry;
 }
 
+/* Is any worker still reading the users? */
+static int mk_auth_conf_users_in_use(struct users_db *db)
+{
+    int ret = MK_FALSE;
+    struct mk_list *head;
+    struct auth_worker *worker;
+
+    pthread_mutex_lock(&auth_workers_lock);
+    mk_list_foreach(head, &auth_workers) {
+        worker = mk_list_entry(head, struct auth_worker, _head);
+        if (__atomic_load_n(&worker->hazard, __ATOMIC_SEQ_CST) == db) {
+            ret = MK_TRUE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&auth_workers_lock);
+
+    return ret;
+}
+
+/*
+ * Check every users file and load again the ones modified since the last
+ * check. A file that cannot be read or parsed keeps the users loaded
+ * before. Called from the reload thread only.
+ */
+void mk_auth_conf_reload()
+{
+    uint64_t mtime;
+    struct stat st;
+    struct mk_list *head;
+    struct mk_list *r_head;
+    struct mk_list *r_tmp;
+    struct users_file *uf;
+    struct users_db *db;
+    struct users_db *old;
+
+    pthread_mutex_lock(&users_file_lock);
+    mk_list_foreach(head, &users_file_list) {
+        uf = mk_list_entry(head, struct users_file, _head);
+
+        /* Release what the workers are done with */
+        mk_list_foreach_safe(r_head, r_tmp, &uf->retired) {
+            db = mk_list_entry(r_head, struct users_db, _head);
+            if (mk_auth_conf_users_in_use(db) == MK_FALSE) {
+                mk_list_del(&db->_head);
+                mk_auth_conf_users_free(db);
+            }
+        }
+
+        if (stat(uf->path, &st) != 0) {
+            if (uf->failed == MK_FALSE) {
+                mk_warn("Auth: cannot check users file '%s', "
+                        "keeping the users loaded", uf->path);
+                uf->failed = MK_TRUE;
+            }
+            continue;
+        }
+        uf->failed = MK_FALSE;
+
+        mtime = mk_auth_conf_mtime(&st);
+        if (mtime == uf->mtime && st.st_size == uf->size &&
+            st.st_ino == uf->ino) {
+            continue;
+        }
+        uf->mtime = mtime;
+        uf->size = st.st_size;
+        uf->ino = st.st_ino;
+
+        db = mk_auth_conf_users_load(uf->path);
+        if (!db) {
+            mk_warn("Auth: cannot reload users file '%s', "
+                    "keeping the users loaded", uf->path);
+            continue;
+        }
+
+        old = uf->db;
+        db->generation = old->generation + 1;
+        __atomic_store_n(&uf->db, db, __ATOMIC_SEQ_CST);
+        mk_list_add(&old->_head, &uf->retired);
+
+        mk_info("Auth: reloaded users file '%s'", uf->path);
+    }
+    pthread_mutex_unlock(&users_file_lock);
+}
+
 /*
  * Read all vhost configuration nodes and looks for users files under an [AUTH]
  * section, if present, it add that file to the unique list. It parse all user's
- * files mentioned to avoid duplicated lists in memory.
+ * files mentioned to avoid duplicated lists in memory. Called on startup and
+ * for the hosts of a configuration reload.
  */
-int mk_auth_conf_init_users_list()
+int mk_auth_conf_init_users_list(struct mk_list *hosts)
 {
     /* Section data */
     char *location;
@@ -146,7 +479,6 @@ int mk_auth_conf_init_users_list()
 
     /* vhost configuration */
     struct mk_list *head_hosts;
-    struct mk_list *hosts = &mk_api->config->hosts;
     struct mk_list *head_sections;
     struct host *entry_host;
     struct mk_rconf_section *section;
@@ -165,7 +497,7 @@ int mk_auth_conf_init_users_list()
             continue;
         }
 
-        auth_vhost = mk_api->mem_alloc(sizeof(struct vhost));
+        auth_vhost = mk_api->mem_alloc_z(sizeof(struct vhost));
         auth_vhost->host = entry_host;        /* link virtual host entry */
         mk_list_init(&auth_vhost->locations); /* init locations list */
 
@@ -193,11 +525,22 @@ int mk_auth_conf_init_users_list()
                 users_path = mk_api->config_section_get_key(section,
                                                             "Users",
                                                             MK_RCONF_STR);
+                if (!location || !users_path) {
+                    mk_warn("Auth: [AUTH] section requires Location and Users");
+                    mk_api->mem_free(location);
+                    mk_api->mem_free(title);
+                    mk_api->mem_free(users_path);
+                    continue;
+                }
 
                 /* get or create users file entry */
+                pthread_mutex_lock(&users_file_lock);
                 uf = mk_auth_conf_add_users(users_path);
-                if (!uf) {
-                    continue;
+                pthread_mutex_unlock(&users_file_lock);
+
+                /* A new entry keeps the path */
+                if (uf->path != users_path) {
+                    mk_api->mem_free(users_path);
                 }
 
                 /* Location node */
@@ -212,22 +555,40 @@ int mk_auth_conf_init_users_list()
 
                 loc->users = uf;
 
+                /* Index the location by path */
+                if (mk_auth_location_add(auth_vhost, loc) != 0) {
+                    mk_warn("Auth: duplicated location '%s'", location);
+                    mk_api->mem_free(loc->auth_http_header.data);
+                    mk_api->mem_free(loc);
+                    mk_api->mem_free(location);
+                    mk_api->mem_free(title);
+                    continue;
+                }
+
                 /* Add new location to auth_vhost node */
                 mk_list_add(&loc->_head, &auth_vhost->locations);
             }
         }
 
-        /* Link auth_vhost node to global list vhosts_list */
-        mk_list_add(&auth_vhost->_head, &vhosts_list);
+        /* Link auth_vhost node to the virtual host */
+        if (mk_list_is_empty(&auth_vhost->locations) == 0) {
+            mk_api->mem_free(auth_vhost);
+            continue;
+        }
+        entry_host->data[auth_vhost_key] = auth_vhost;
     }
 
 #ifdef TRACE
-    struct mk_list *vh_head, *loc_head;
+    struct mk_list *loc_head;
     struct vhost *vh_entry;
     struct location *loc_entry;
 
-    mk_list_foreach(vh_head, &vhosts_list) {
-        vh_entry = mk_list_entry(vh_head, struct vhost, _head);
+    mk_list_foreach(head_hosts, hosts) {
+        entry_host = mk_list_entry(head_hosts, struct host, _head);
+        vh_entry = entry_host->data[auth_vhost_key];
+        if (!vh_entry) {
+            continue;
+        }
         PLUGIN_TRACE("Auth VHost: %p", vh_entry->host);
 
         mk_list_foreach(loc_head, &vh_entry->locations) {
@@ -242,3 +603,34 @@ int mk_auth_conf_init_users_list()
 
     return 0;
 }
+
+/* Release the locations of the hosts of a configuration generation */
+void mk_auth_conf_vhost_free(struct mk_list *hosts)
+{
+    struct mk_list *head;
+    struct mk_list *tmp;
+    struct mk_list *head_hosts;
+    struct host *entry_host;
+    struct location *loc;
+    struct vhost *auth_vhost;
+
+    mk_list_foreach(head_hosts, hosts) {
+        entry_host = mk_list_entry(head_hosts, struct host, _head);
+        auth_vhost = entry_host->data[auth_vhost_key];
+        if (!auth_vhost) {
+            continue;
+        }
+
+        mk_auth_location_free(auth_vhost->root);
+        mk_list_foreach_safe(head, tmp, &auth_vhost->locations) {
+            loc = mk_list_entry(head, struct location, _head);
+            mk_list_del(&loc->_head);
+            mk_api->mem_free(loc->path.data);
+            mk_api->mem_free(loc->title.data);
+            mk_api->mem_free(loc->auth_http_header.data);
+            mk_api->mem_free(loc);
+        }
+        mk_api->mem_free(auth_vhost);
+        entry_host->data[auth_vhost_key] = NULL;
+    }
+}
@@ -20,6 +20,11 @@
 #ifndef MK_AUTH_CONF_H
 #define MK_AUTH_CONF_H
 
-int mk_auth_conf_init_users_list();
+int mk_auth_conf_read(char *confdir);
+int mk_auth_conf_init_users_list(struct mk_list *hosts);
+void mk_auth_conf_vhost_free(struct mk_list *hosts);
+struct users_db *mk_auth_conf_users_load(char *users_path);
+void mk_auth_conf_users_free(struct users_db *db);
+void mk_auth_conf_reload();
 
 #endif
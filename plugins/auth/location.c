@@ -0,0 +1,215 @@
+ /* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "auth.h"
+#include "location.h"
+
+/*
+ * The locations of a virtual host are kept in a radix tree: every node is
+ * labeled with a piece of path and the children of a node are sorted by
+ * the first byte of their label, so matching a URI walks it once whatever
+ * the number of locations is. The labels point into the location paths,
+ * which are released after the tree.
+ */
+
+static struct location_node *mk_auth_location_node(const char *label,
+                                                   int len,
+                                                   struct location *loc)
+{
+    struct location_node *node;
+
+    node = mk_api->mem_alloc_z(sizeof(struct location_node));
+    if (!node) {
+        return NULL;
+    }
+
+    node->label = label;
+    node->len = len;
+    node->loc = loc;
+    return node;
+}
+
+/* Find the child starting with 'c', or where it should be inserted */
+static struct location_node *mk_auth_location_child(struct location_node *node,
+                                                    unsigned char c, int *pos)
+{
+    int low = 0;
+    int mid;
+    int high = node->n_children - 1;
+    unsigned char first;
+
+    while (low <= high) {
+        mid = (low + high) / 2;
+        first = node->children[mid]->label[0];
+        if (first == c) {
+            *pos = mid;
+            return node->children[mid];
+        }
+        else if (first < c) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+
+    *pos = low;
+    return NULL;
+}
+
+static int mk_auth_location_child_add(struct location_node *node,
+                                      struct location_node *child, int pos)
+{
+    struct location_node **children;
+
+    children = mk_api->mem_realloc(node->children,
+                                   sizeof(struct location_node *) *
+                                   (node->n_children + 1));
+    if (!children) {
+        return -1;
+    }
+
+    memmove(&children[pos + 1], &children[pos],
+            sizeof(struct location_node *) * (node->n_children - pos));
+    children[pos] = child;
+    node->children = children;
+    node->n_children++;
+    return 0;
+}
+
+/* Register a location, it fails if the same path was already added */
+int mk_auth_location_add(struct vhost *vh, struct location *loc)
+{
+    int k;
+    int pos;
+    int len;
+    const char *path;
+    struct location_node *node;
+    struct location_node *child;
+    struct location_node *split;
+
+    if (!vh->root) {
+        vh->root = mk_auth_location_node("", 0, NULL);
+        if (!vh->root) {
+            return -1;
+        }
+    }
+
+    node = vh->root;
+    path = loc->path.data;
+    len = loc->path.len;
+
+    while (len > 0) {
+        child = mk_auth_location_child(node, path[0], &pos);
+        if (!child) {
+            child = mk_auth_location_node(path, len, loc);
+            if (!child) {
+                return -1;
+            }
+            if (mk_auth_location_child_add(node, child, pos) != 0) {
+                mk_api->mem_free(child);
+                return -1;
+            }
+            return 0;
+        }
+
+        for (k = 0; k < child->len && k < len && child->label[k] == path[k];
+             k++);
+
+        /* The path diverges inside the label: split the node */
+        if (k < child->len) {
+            split = mk_auth_location_node(child->label, k, NULL);
+            if (!split) {
+                return -1;
+            }
+            split->children = mk_api->mem_alloc(sizeof(struct location_node *));
+            if (!split->children) {
+                mk_api->mem_free(split);
+                return -1;
+            }
+            child->label += k;
+            child->len -= k;
+            split->children[0] = child;
+            split->n_children = 1;
+            node->children[pos] = split;
+            child = split;
+        }
+
+        node = child;
+        path += k;
+        len -= k;
+    }
+
+    if (node->loc) {
+        return -1;
+    }
+
+    node->loc = loc;
+    return 0;
+}
+
+/* Longest location which is a prefix of the URI */
+struct location *mk_auth_location_match(struct vhost *vh,
+                                        const char *uri, int len)
+{
+    int pos;
+    struct location *match;
+    struct location_node *node;
+    struct location_node *child;
+
+    node = vh->root;
+    if (!node) {
+        return NULL;
+    }
+
+    match = node->loc;
+    while (len > 0) {
+        child = mk_auth_location_child(node, uri[0], &pos);
+        if (!child || child->len > len ||
+            memcmp(child->label, uri, child->len) != 0) {
+            break;
+        }
+
+        uri += child->len;
+        len -= child->len;
+        node = child;
+        if (node->loc) {
+            match = node->loc;
+        }
+    }
+
+    return match;
+}
+
+void mk_auth_location_free(struct location_node *node)
+{
+    int i;
+
+    if (!node) {
+        return;
+    }
+
+    for (i = 0; i < node->n_children; i++) {
+        mk_auth_location_free(node->children[i]);
+    }
+    mk_api->mem_free(node->children);
+    mk_api->mem_free(node);
+}
@@ -26,6 +26,10 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 
+int cgi_max_children;
+static int cgi_n_executors = CGI_EXEC_DEFAULT;
+static int cgi_children;
+
 void cgi_finish(struct cgi_request *r)
 {
     /*
@@ -34,7 +38,26 @@ void cgi_finish(struct cgi_request *r)
      */
     mk_api->ev_del(mk_api->sched_loop(), (struct mk_event *) r);
     close(r->fd);
-    if (r->chunked && r->active == MK_TRUE) {
+
+    /* The channel must not reference our relay anymore */
+    if (r->relay_pending == MK_TRUE) {
+        mk_stream_unlink(&r->relay_stream);
+        r->relay_pending = MK_FALSE;
+    }
+    if (r->relay[0] != -1) {
+        close(r->relay[0]);
+        close(r->relay[1]);
+    }
+
+    /*
+     * The program ended before its headers, or could not be started at
+     * all: the executors only tell when the pipe is already gone.
+     */
+    if (r->active == MK_TRUE && !r->status_done) {
+        mk_api->http_request_error(MK_SERVER_INTERNAL_ERROR, r->cs, r->sr);
+        r->hangup = MK_TRUE;
+    }
+    else if (r->chunked && r->active == MK_TRUE) {
         PLUGIN_TRACE("CGI sending Chunked EOF");
         channel_write(r->sr->session, "0\r\n\r\n", 5);
     }
@@ -43,6 +66,12 @@ void cgi_finish(struct cgi_request *r)
     if (r->child > 0) {
         kill(r->child, SIGKILL);
         r->child = 0;
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+    }
+    else if (r->spawn) {
+        /* The executor has not answered yet, cgi_spawn_done() does it */
+        r->spawn->r = NULL;
+        r->spawn = NULL;
     }
 
     /* Invalidte our socket handler */
@@ -53,6 +82,34 @@ void cgi_finish(struct cgi_request *r)
     cgi_req_del(r);
 }
 
+/*
+ * The executor answered the spawn request with the pid of the child, or
+ * -1: then the pipe just reports the end of the output.
+ */
+void cgi_spawn_done(struct cgi_spawn *spawn, pid_t pid)
+{
+    struct cgi_request *r = spawn->r;
+
+    PLUGIN_TRACE("spawn done, pid=%i", pid);
+
+    if (r && pid > 0) {
+        r->spawn = NULL;
+        r->child = pid;
+    }
+    else {
+        if (r) {
+            r->spawn = NULL;
+        }
+        else if (pid > 0) {
+            /* The request is gone */
+            kill(pid, SIGKILL);
+        }
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+    }
+
+    mk_api->mem_free(spawn);
+}
+
 int swrite(const int fd, const void *buf, const size_t count)
 {
     ssize_t pos = count, ret = 0;
@@ -100,7 +157,8 @@ static int do_cgi(const char *const __restrict__ file,
                   char *mimetype)
 {
     int ret;
-    int devnull;
+    int err = 403;
+    pid_t pid;
     const int socket = cs->socket;
     struct file_info finfo;
     struct cgi_request *r = NULL;
@@ -212,73 +270,74 @@ static int do_cgi(const char *const __restrict__ file,
     /* Must be NULL-terminated */
     env[envpos] = NULL;
 
+    /* Concurrency limit */
+    if (cgi_max_children > 0 &&
+        __atomic_add_fetch(&cgi_children, 1, __ATOMIC_RELAXED) >
+        cgi_max_children) {
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+        return MK_SERVER_SERVICE_UNAV;
+    }
+    else if (cgi_max_children == 0) {
+        __atomic_add_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+    }
+
     /* pipes, from monkey's POV */
-    if (pipe(writepipe) || pipe(readpipe)) {
+    if (pipe2(writepipe, O_CLOEXEC) == -1) {
         mk_err("Failed to create pipe");
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
         return 403;
     }
-
-    pid_t pid = vfork();
-    if (pid < 0) {
-        mk_err("Failed to fork");
+    if (pipe2(readpipe, O_CLOEXEC) == -1) {
+        mk_err("Failed to create pipe");
+        close(writepipe[0]);
+        close(writepipe[1]);
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
         return 403;
     }
 
-    /* Child */
-    if (pid == 0) {
+    r = cgi_req_create(readpipe[0], socket, sr, cs);
+    if (!r) {
+        close(writepipe[0]);
         close(writepipe[1]);
         close(readpipe[0]);
-
-        /* Our stdin is the read end of monkey's writing */
-        if (dup2(writepipe[0], 0) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
-        close(writepipe[0]);
-
-        /* Our stdout is the write end of monkey's reading */
-        if (dup2(readpipe[1], 1) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
-        }
         close(readpipe[1]);
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+        return 403;
+    }
 
-        /* Our stderr goes to /dev/null */
-        devnull = open("/dev/null", O_WRONLY);
-        if (devnull == -1) {
-            perror("open");
-            _exit(1);
+    /* An executor forks the program for us, the pid comes later */
+    pid = -1;
+    if (cgi_exec_available() == MK_TRUE) {
+        ret = cgi_exec_spawn(r, file, interpreter, env,
+                             writepipe[0], readpipe[1]);
+        if (ret == 0) {
+            pid = 0;
         }
-
-        if (dup2(devnull, 2) < 0) {
-            mk_err("dup2 failed");
-            _exit(1);
+        else if (errno == EAGAIN) {
+            err = MK_SERVER_SERVICE_UNAV;
         }
-        close(devnull);
-
-        char *argv[3] = { NULL };
-
-        char *tmp = mk_api->str_dup(file);
-        if (chdir(dirname(tmp)))
-            _exit(1);
-
-        char *tmp2 = mk_api->str_dup(file);
-        argv[0] = basename(tmp2);
-
-        /* Restore signals for the child */
-        signal(SIGPIPE, SIG_DFL);
-        signal(SIGCHLD, SIG_DFL);
+    }
 
-        if (!interpreter) {
-            execve(file, argv, env);
+    /* No executors (disabled or dead), do it ourselves */
+    if (pid < 0 && cgi_exec_available() == MK_FALSE) {
+        pid = vfork();
+        if (pid == 0) {
+            close(writepipe[1]);
+            close(readpipe[0]);
+            cgi_exec_child(file, interpreter, env, writepipe[0], readpipe[1]);
         }
-        else {
-            argv[0] = basename(interpreter);
-            argv[1] = (char *) file;
-            execve(interpreter, argv, env);
-        }
-        /* Exec failed, return */
-        _exit(1);
+        r->child = pid;
+    }
+
+    if (pid < 0) {
+        mk_err("Failed to fork");
+        close(writepipe[0]);
+        close(writepipe[1]);
+        close(readpipe[0]);
+        close(readpipe[1]);
+        mk_api->mem_free(r);
+        __atomic_sub_fetch(&cgi_children, 1, __ATOMIC_RELAXED);
+        return err;
     }
 
     /* Yay me */
@@ -298,12 +357,6 @@ static int do_cgi(const char *const __restrict__ file,
         close(writepipe[1]);
     }
 
-    r = cgi_req_create(readpipe[0], socket, sr, cs);
-    if (!r) {
-        return 403;
-    }
-    r->child = pid;
-
     /*
      * Hang up?: by default Monkey assumes the CGI scripts generate
      * content dynamically (no Content-Length header), so for such HTTP/1.0
@@ -348,10 +401,58 @@ static int do_cgi(const char *const __restrict__ file,
     return 200;
 }
 
+static void mk_cgi_config(char *path)
+{
+    long num;
+    char *tmp;
+    char *file = NULL;
+    unsigned long len;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+
+    mk_api->str_build(&file, &len, "%scgi.conf", path);
+    conf = mk_api->config_create(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return;
+    }
+
+    section = mk_api->config_section_get(conf, "CGI");
+    if (!section) {
+        mk_api->config_free(conf);
+        return;
+    }
+
+    /* Executors (zero is valid) */
+    tmp = mk_api->config_section_get_key(section, "Executors", MK_RCONF_STR);
+    if (tmp) {
+        mk_api->mem_free(tmp);
+        num = (long) mk_api->config_section_get_key(section, "Executors",
+                                                    MK_RCONF_NUM);
+        if (num < 0) {
+            mk_warn("[cgi] Invalid Executors value");
+        }
+        else {
+            cgi_n_executors = num;
+        }
+    }
+
+    /* MaxChildren */
+    num = (long) mk_api->config_section_get_key(section, "MaxChildren",
+                                                MK_RCONF_NUM);
+    if (num < 0) {
+        mk_warn("[cgi] Invalid MaxChildren value");
+    }
+    else {
+        cgi_max_children = num;
+    }
+
+    mk_api->config_free(conf);
+}
+
 int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
 {
     struct rlimit lim;
-    (void) confdir;
 
     mk_api = *api;
     mk_list_init(&cgi_global_matches);
@@ -369,6 +470,12 @@ int mk_cgi_plugin_init(struct plugin_api **api, char *confdir)
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_IGN);
 
+    /* The executors inherit the signal setup */
+    mk_cgi_config(confdir);
+    if (cgi_exec_init(cgi_n_executors) == -1) {
+        mk_warn("[cgi] could not start the executors, forking from workers");
+    }
+
     return 0;
 }
 
@@ -459,6 +566,8 @@ void mk_cgi_worker_init()
 
     mk_list_init(list);
     pthread_setspecific(cgi_request_list, (void *) list);
+
+    cgi_exec_worker_init();
 }
 
 
@@ -34,6 +34,46 @@ enum {
     SHORTLEN = 64
 };
 
+/* Executors forked at startup if the configuration does not say */
+#define CGI_EXEC_DEFAULT    2
+
+/* Largest spawn request: program, interpreter and environment */
+#define CGI_EXEC_MSG_MAX    32768
+#define CGI_ENV_MAX         32
+
+/* Bytes moved from the CGI pipe per splice() call (default pipe size) */
+#define CGI_RELAY_SIZE      65536
+
+/*
+ * Executor process: it receives spawn requests from the workers over a
+ * unix socket, the pipes of the CGI program travel as SCM_RIGHTS.
+ */
+struct cgi_executor {
+    pid_t pid;
+    int *fds;                   /* one socket per worker        */
+};
+
+/* Spawn request waiting for the pid of the child */
+struct cgi_spawn {
+    struct cgi_request *r;      /* NULL once the request is gone */
+    struct mk_list _head;
+};
+
+/* Socket of a worker to an executor */
+struct cgi_exec_conn {
+    struct mk_event event;      /* pid replies                  */
+    pid_t pid;                  /* executor                     */
+    int fd;                     /* -1 once the executor is gone */
+    struct mk_list spawns;      /* struct cgi_spawn, in order   */
+};
+
+struct cgi_exec_worker {
+    unsigned int next;          /* round robin                  */
+    struct cgi_exec_conn conns[];
+};
+
+extern int cgi_max_children;
+
 regex_t match_regex;
 
 struct cgi_request **requests_by_socket;
@@ -79,9 +119,15 @@ struct cgi_request {
     int   hangup;       /* Should close connection when done ? */
     int   active;       /* Active session ?  */
     pid_t child;        /* child process ID  */
+    struct cgi_spawn *spawn;    /* waiting for the child pid */
     unsigned char status_done;
     unsigned char all_headers_done;
     unsigned char chunked;
+
+    /* Body relay through splice(), see cgi_relay_init() */
+    int   relay[2];
+    int   relay_pending;        /* relay_stream queued in the channel */
+    struct mk_stream relay_stream;
 };
 
 /* Global list per worker */
@@ -126,6 +172,17 @@ static inline struct cgi_request *cgi_req_get_by_fd(int fd)
     return NULL;
 }
 
+int cgi_relay_init(struct cgi_request *r);
 int cb_cgi_read(void *data);
 
+int cgi_exec_init(int n);
+void cgi_exec_worker_init();
+int cgi_exec_available();
+int cgi_exec_spawn(struct cgi_request *r,
+                   const char *file, const char *interpreter,
+                   char **env, int fd_in, int fd_out);
+void cgi_spawn_done(struct cgi_spawn *spawn, pid_t pid);
+void cgi_exec_child(const char *file, const char *interpreter,
+                    char **env, int fd_in, int fd_out);
+
 #endif
@@ -117,6 +117,7 @@ int process_cgi_data(struct cgi_request *r)
         r->in_len -= len;
 
         r->all_headers_done = 1;
+        cgi_relay_init(r);
         if (r->in_len == 0) {
             return MK_PLUGIN_RET_EVENT_OWNED;
         }
@@ -142,6 +143,93 @@ int process_cgi_data(struct cgi_request *r)
     return MK_PLUGIN_RET_EVENT_OWNED;
 }
 
+/*
+ * Once the headers are out, the body does not need to pass through
+ * in_buf: it is spliced from the CGI pipe into a relay pipe and the
+ * network layer splices it from there to the client socket. Reading
+ * from the CGI program is paused while the relay holds data, so a slow
+ * client holds the program back instead of growing the channel.
+ *
+ * The network layer must support it (TLS does not), otherwise the
+ * output keeps being copied through in_buf.
+ */
+int cgi_relay_init(struct cgi_request *r)
+{
+    if (!r->cs->channel->io->splice) {
+        return -1;
+    }
+
+    if (pipe2(r->relay, O_CLOEXEC) == -1) {
+        mk_libc_error("pipe2");
+        r->relay[0] = -1;
+        r->relay[1] = -1;
+        return -1;
+    }
+
+    PLUGIN_TRACE("FD=%i relay pipe %i/%i", r->fd, r->relay[0], r->relay[1]);
+    return 0;
+}
+
+/* The client took the relayed data, resume reading the CGI output */
+static void cb_relay_finished(struct mk_stream *stream)
+{
+    struct cgi_request *r = stream->data;
+
+    r->relay_pending = MK_FALSE;
+    mk_api->ev_add(mk_api->sched_loop(), r->fd,
+                   MK_EVENT_CUSTOM, MK_EVENT_READ, r);
+}
+
+/* The client is gone, the hangup callback will finish the request */
+static void cb_relay_exception(struct mk_stream *stream, int err)
+{
+    struct cgi_request *r = stream->data;
+    (void) err;
+
+    r->relay_pending = MK_FALSE;
+}
+
+static int cgi_relay_read(struct cgi_request *r)
+{
+    int len;
+    ssize_t n;
+    char tmp[16];
+    struct mk_channel *channel = r->cs->channel;
+
+    n = splice(r->fd, NULL, r->relay[1], NULL, CGI_RELAY_SIZE,
+               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    PLUGIN_TRACE("FD=%i CGI SPLICE=%zd", r->fd, n);
+    if (n == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    else if (n <= 0) {
+        cgi_finish(r);
+        return MK_PLUGIN_RET_EVENT_CLOSE;
+    }
+
+    if (r->chunked) {
+        len = snprintf(tmp, sizeof(tmp), "%zx\r\n", n);
+        mk_stream_set(NULL, MK_STREAM_COPYBUF, channel, tmp, len,
+                      NULL, NULL, NULL, NULL);
+    }
+
+    mk_stream_set(&r->relay_stream, MK_STREAM_PIPE, channel,
+                  NULL, n, r,
+                  cb_relay_finished, NULL, cb_relay_exception);
+    r->relay_stream.fd = r->relay[0];
+    r->relay_pending = MK_TRUE;
+
+    if (r->chunked) {
+        mk_stream_set(NULL, MK_STREAM_COPYBUF, channel, MK_CRLF, 2,
+                      NULL, NULL, NULL, NULL);
+    }
+
+    /* Paused until the relay is drained, the flush may do it right away */
+    mk_api->ev_del(mk_api->sched_loop(), &r->event);
+    mk_api->channel_flush(channel);
+    return 0;
+}
+
 int cb_cgi_read(void *data)
 {
     int n;
@@ -151,6 +239,10 @@ int cb_cgi_read(void *data)
         return -1;
     }
 
+    if (r->relay[0] != -1) {
+        return cgi_relay_read(r);
+    }
+
     if ((BUFLEN - r->in_len) < 1) {
         PLUGIN_TRACE("CLOSE BY SIZE");
         cgi_finish(r);
@@ -0,0 +1,562 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "cgi.h"
+
+#include <pwd.h>
+#include <grp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/*
+ * CGI executors
+ * =============
+ * Forking from a worker duplicates the whole server address space (page
+ * tables, file descriptors) for every request. The executors are forked
+ * when the plugin starts, while the server is still small and single
+ * threaded, and do nothing but fork and exec the CGI programs on behalf
+ * of the workers.
+ *
+ * Every worker has its own SOCK_SEQPACKET socket to every executor, so the
+ * workers never share one. A spawn request is a single message: the
+ * program, the interpreter (empty if none) and the environment as NUL
+ * terminated strings, with the stdin and stdout pipe ends attached as
+ * SCM_RIGHTS. The executor answers on the same socket with the pid of the
+ * child, or -1, in the order the requests came.
+ *
+ * On the worker side the socket is non-blocking and registered in the
+ * worker event loop: the request goes on reading its pipe meanwhile and
+ * the pid is set when the answer arrives.
+ */
+
+static int cgi_exec_count;
+static int cgi_exec_workers;
+static int cgi_exec_slots;
+static struct cgi_executor *cgi_executors;
+static pthread_key_t cgi_exec_key;     /* struct cgi_exec_worker */
+
+/* Runs in the child process, it never returns */
+void cgi_exec_child(const char *file, const char *interpreter,
+                    char **env, int fd_in, int fd_out)
+{
+    int devnull;
+    char dir[PATHLEN];
+    char name[PATHLEN];
+    char *argv[3] = { NULL };
+
+    /* Our stdin is the read end of monkey's writing */
+    if (dup2(fd_in, 0) < 0) {
+        _exit(1);
+    }
+    close(fd_in);
+
+    /* Our stdout is the write end of monkey's reading */
+    if (dup2(fd_out, 1) < 0) {
+        _exit(1);
+    }
+    close(fd_out);
+
+    /* Our stderr goes to /dev/null */
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull == -1 || dup2(devnull, 2) < 0) {
+        _exit(1);
+    }
+    close(devnull);
+
+    snprintf(dir, sizeof(dir), "%s", file);
+    if (chdir(dirname(dir))) {
+        _exit(1);
+    }
+
+    /* Restore signals for the child */
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+
+    if (!interpreter) {
+        snprintf(name, sizeof(name), "%s", file);
+        argv[0] = basename(name);
+        execve(file, argv, env);
+    }
+    else {
+        snprintf(name, sizeof(name), "%s", interpreter);
+        argv[0] = basename(name);
+        argv[1] = (char *) file;
+        execve(interpreter, argv, env);
+    }
+
+    /* Exec failed, return */
+    _exit(1);
+}
+
+/* The CGI programs must not run with more privileges than the server */
+static void cgi_exec_set_user()
+{
+    struct passwd *usr;
+
+    if (geteuid() != 0 || !mk_api->config->user) {
+        return;
+    }
+
+    usr = getpwnam(mk_api->config->user);
+    if (!usr) {
+        mk_err("[cgi] Invalid user '%s'", mk_api->config->user);
+        _exit(1);
+    }
+
+    if (initgroups(mk_api->config->user, usr->pw_gid) != 0 ||
+        setgid(usr->pw_gid) == -1 || setuid(usr->pw_uid) == -1) {
+        mk_err("[cgi] executor cannot change to user '%s'",
+               mk_api->config->user);
+        _exit(1);
+    }
+}
+
+/* Serve one spawn request of a worker, -1 if the worker is gone */
+static int cgi_exec_serve(int fd)
+{
+    int i;
+    int fds[2];
+    ssize_t n;
+    pid_t pid;
+    char *p;
+    char *end;
+    char *str[CGI_ENV_MAX + 3];
+    struct iovec io;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } ctl;
+    static char buf[CGI_EXEC_MSG_MAX + 1];
+
+    memset(&msg, '\0', sizeof(msg));
+    io.iov_base        = buf;
+    io.iov_len         = CGI_EXEC_MSG_MAX;
+    msg.msg_iov        = &io;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    n = recvmsg(fd, &msg, 0);
+    if (n == -1 && errno == EINTR) {
+        return 0;
+    }
+    else if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    fds[0] = -1;
+    fds[1] = -1;
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    /* Program, interpreter and the environment */
+    i = 0;
+    p = buf;
+    end = buf + n;
+    while (p < end && i < CGI_ENV_MAX + 2) {
+        str[i++] = p;
+        p += strlen(p) + 1;
+    }
+    str[i] = NULL;
+
+    /* The sockets are close-on-exec, the child keeps the pipes only */
+    pid = -1;
+    if (fds[0] >= 0 && fds[1] >= 0 && i >= 2) {
+        pid = fork();
+        if (pid == 0) {
+            cgi_exec_child(str[0], *str[1] ? str[1] : NULL, str + 2,
+                           fds[0], fds[1]);
+        }
+    }
+
+    if (fds[0] >= 0) {
+        close(fds[0]);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+
+    send(fd, &pid, sizeof(pid), MSG_NOSIGNAL);
+    return 0;
+}
+
+/* Executor main loop, it serves the sockets of all the workers */
+static void cgi_exec_loop(struct pollfd *pfds, int n)
+{
+    int i;
+    int ret;
+    int alive = n;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+
+    cgi_exec_set_user();
+
+    while (alive > 0) {
+        ret = poll(pfds, n, -1);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (ret == -1) {
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (pfds[i].fd == -1 || pfds[i].revents == 0) {
+                continue;
+            }
+
+            if (cgi_exec_serve(pfds[i].fd) == -1) {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+                alive--;
+            }
+        }
+    }
+
+    /* The server is gone */
+    _exit(0);
+}
+
+/* Fork the executors, it must be called before any thread is created */
+int cgi_exec_init(int n)
+{
+    int i;
+    int j;
+    int w;
+    int sv[2];
+    int workers;
+    pid_t pid;
+    struct pollfd *pfds;
+
+    if (n <= 0) {
+        return 0;
+    }
+
+    pthread_key_create(&cgi_exec_key, NULL);
+
+    workers = mk_api->config->workers;
+    cgi_executors = mk_api->mem_alloc_z(sizeof(struct cgi_executor) * n);
+    pfds = mk_api->mem_alloc_z(sizeof(struct pollfd) * workers);
+    if (!cgi_executors || !pfds) {
+        mk_api->mem_free(cgi_executors);
+        mk_api->mem_free(pfds);
+        cgi_executors = NULL;
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        cgi_executors[i].fds = mk_api->mem_alloc(sizeof(int) * workers);
+        if (!cgi_executors[i].fds) {
+            break;
+        }
+
+        /* One socket per worker */
+        for (w = 0; w < workers; w++) {
+            if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+                           sv) == -1) {
+                mk_libc_error("socketpair");
+                break;
+            }
+            cgi_executors[i].fds[w] = sv[0];
+            pfds[w].fd = sv[1];
+            pfds[w].events = POLLIN;
+        }
+
+        if (w == workers) {
+            pid = fork();
+        }
+        else {
+            pid = -1;
+        }
+
+        if (pid == -1) {
+            if (w == workers) {
+                mk_libc_error("fork");
+            }
+            while (w-- > 0) {
+                close(cgi_executors[i].fds[w]);
+                close(pfds[w].fd);
+            }
+            mk_api->mem_free(cgi_executors[i].fds);
+            break;
+        }
+        else if (pid == 0) {
+            for (j = 0; j <= i; j++) {
+                for (w = 0; w < workers; w++) {
+                    close(cgi_executors[j].fds[w]);
+                }
+            }
+            cgi_exec_loop(pfds, workers);
+        }
+
+        for (w = 0; w < workers; w++) {
+            close(pfds[w].fd);
+        }
+        cgi_executors[i].pid = pid;
+        PLUGIN_TRACE("executor %i started, pid=%i", i, pid);
+    }
+    mk_api->mem_free(pfds);
+
+    cgi_exec_count = i;
+    cgi_exec_slots = workers;
+    return (i == n) ? 0 : -1;
+}
+
+/* The executor is gone: the requests waiting for it get no pid */
+static void cgi_exec_conn_drop(struct cgi_exec_conn *conn)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct cgi_spawn *spawn;
+
+    mk_warn("[cgi] executor %i is gone", conn->pid);
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    close(conn->fd);
+    conn->fd = -1;
+
+    mk_list_foreach_safe(head, tmp, &conn->spawns) {
+        spawn = mk_list_entry(head, struct cgi_spawn, _head);
+        mk_list_del(&spawn->_head);
+        cgi_spawn_done(spawn, -1);
+    }
+}
+
+/* Event handler: pid replies of an executor */
+static int cgi_exec_reply(void *data)
+{
+    ssize_t n;
+    pid_t pid;
+    struct cgi_spawn *spawn;
+    struct cgi_exec_conn *conn = data;
+
+    while (1) {
+        n = recv(conn->fd, &pid, sizeof(pid), 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        else if (n == -1 && errno == EAGAIN) {
+            return 0;
+        }
+        else if (n != sizeof(pid) || mk_list_is_empty(&conn->spawns) == 0) {
+            cgi_exec_conn_drop(conn);
+            return 0;
+        }
+
+        spawn = mk_list_entry_first(&conn->spawns, struct cgi_spawn, _head);
+        mk_list_del(&spawn->_head);
+        cgi_spawn_done(spawn, pid);
+    }
+
+    return 0;
+}
+
+/* Connect the worker with the executors */
+void cgi_exec_worker_init()
+{
+    int i;
+    int slot;
+    struct mk_event *event;
+    struct cgi_exec_conn *conn;
+    struct cgi_exec_worker *wk;
+
+    if (cgi_exec_count == 0) {
+        return;
+    }
+
+    slot = __atomic_fetch_add(&cgi_exec_workers, 1, __ATOMIC_RELAXED);
+    if (slot >= cgi_exec_slots) {
+        return;
+    }
+
+    wk = mk_api->mem_alloc_z(sizeof(struct cgi_exec_worker) +
+                             sizeof(struct cgi_exec_conn) * cgi_exec_count);
+    if (!wk) {
+        return;
+    }
+
+    for (i = 0; i < cgi_exec_count; i++) {
+        conn = &wk->conns[i];
+        conn->pid = cgi_executors[i].pid;
+        conn->fd  = cgi_executors[i].fds[slot];
+        mk_list_init(&conn->spawns);
+        mk_api->socket_set_nonblocking(conn->fd);
+
+        event = &conn->event;
+        event->fd      = conn->fd;
+        event->type    = MK_EVENT_CUSTOM;
+        event->mask    = MK_EVENT_EMPTY;
+        event->data    = conn;
+        event->handler = cgi_exec_reply;
+
+        if (mk_api->ev_add(mk_api->sched_loop(), conn->fd,
+                           MK_EVENT_CUSTOM, MK_EVENT_READ, conn) != 0) {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+
+    pthread_setspecific(cgi_exec_key, wk);
+}
+
+/* Is there any executor left for this worker ? */
+int cgi_exec_available()
+{
+    int i;
+    struct cgi_exec_worker *wk;
+
+    if (cgi_exec_count == 0) {
+        return MK_FALSE;
+    }
+
+    wk = pthread_getspecific(cgi_exec_key);
+    if (!wk) {
+        return MK_FALSE;
+    }
+
+    for (i = 0; i < cgi_exec_count; i++) {
+        if (wk->conns[i].fd != -1) {
+            return MK_TRUE;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/*
+ * Ask an executor to run the CGI program for the request, the pid comes
+ * later through cgi_spawn_done(). It returns -1 with errno EAGAIN if the
+ * executors do not take more requests right now.
+ */
+int cgi_exec_spawn(struct cgi_request *r,
+                   const char *file, const char *interpreter,
+                   char **env, int fd_in, int fd_out)
+{
+    int i;
+    int err = EPIPE;
+    int fds[2];
+    size_t len = 0;
+    size_t s_len;
+    ssize_t n;
+    char buf[CGI_EXEC_MSG_MAX];
+    const char *str;
+    struct iovec io;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct cgi_spawn *spawn;
+    struct cgi_exec_conn *conn;
+    struct cgi_exec_worker *wk;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * 2)];
+        struct cmsghdr align;
+    } ctl;
+
+    wk = pthread_getspecific(cgi_exec_key);
+    if (!wk) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    /* Pack the strings */
+    for (i = -2; i < CGI_ENV_MAX; i++) {
+        if (i == -2) {
+            str = file;
+        }
+        else if (i == -1) {
+            str = interpreter ? interpreter : "";
+        }
+        else if (env[i]) {
+            str = env[i];
+        }
+        else {
+            break;
+        }
+
+        s_len = strlen(str) + 1;
+        if (len + s_len > sizeof(buf)) {
+            errno = E2BIG;
+            return -1;
+        }
+        memcpy(buf + len, str, s_len);
+        len += s_len;
+    }
+
+    spawn = mk_api->mem_alloc(sizeof(struct cgi_spawn));
+    if (!spawn) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    fds[0] = fd_in;
+    fds[1] = fd_out;
+
+    memset(&msg, '\0', sizeof(msg));
+    memset(&ctl, '\0', sizeof(ctl));
+    io.iov_base        = buf;
+    io.iov_len         = len;
+    msg.msg_iov        = &io;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* Round robin, skipping the executors that died or are full */
+    for (i = 0; i < cgi_exec_count; i++) {
+        conn = &wk->conns[wk->next++ % cgi_exec_count];
+        if (conn->fd == -1) {
+            continue;
+        }
+
+        do {
+            n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == (ssize_t) len) {
+            spawn->r = r;
+            mk_list_add(&spawn->_head, &conn->spawns);
+            r->spawn = spawn;
+            return 0;
+        }
+        else if (n == -1 && errno == EAGAIN) {
+            err = EAGAIN;
+            continue;
+        }
+
+        cgi_exec_conn_drop(conn);
+    }
+
+    mk_api->mem_free(spawn);
+    errno = err;
+    return -1;
+}
@@ -38,6 +38,8 @@ struct cgi_request *cgi_req_create(int fd, int socket,
     cgi->hangup = MK_TRUE;
     cgi->active = MK_TRUE;
     cgi->in_len = 0;
+    cgi->relay[0] = -1;
+    cgi->relay[1] = -1;
 
     return cgi;
 }
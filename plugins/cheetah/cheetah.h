@@ -59,6 +59,9 @@
 #define MK_CHEETAH_WORKERS "workers"
 #define MK_CHEETAH_WORKERS_SC "\\w"
 
+#define MK_CHEETAH_LATENCY "latency"
+#define MK_CHEETAH_LATENCY_SC "\\l"
+
 #define MK_CHEETAH_QUIT "quit"
 #define MK_CHEETAH_QUIT_SC "\\q"
 
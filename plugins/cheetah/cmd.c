@@ -69,6 +69,10 @@ int mk_cheetah_cmd(char *raw_cmd)
              strcmp(cmd, MK_CHEETAH_WORKERS_SC) == 0) {
         mk_cheetah_cmd_workers();
     }
+    else if (strcmp(cmd, MK_CHEETAH_LATENCY) == 0 ||
+             strcmp(cmd, MK_CHEETAH_LATENCY_SC) == 0) {
+        mk_cheetah_cmd_latency();
+    }
     else if (strcmp(cmd, MK_CHEETAH_VHOSTS) == 0 ||
              strcmp(cmd, MK_CHEETAH_VHOSTS_SC) == 0) {
         mk_cheetah_cmd_vhosts();
@@ -248,14 +252,15 @@ void mk_cheetah_cmd_vhosts()
     struct host_alias *entry_alias;
     struct mk_rconf_section *section;
     struct mk_rconf_entry *entry;
-    struct mk_list *hosts = &mk_api->config->hosts;
+    struct mk_config_gen *gen;
     struct mk_list *aliases;
     struct mk_list *head_host;
     struct mk_list *head_alias;
     struct mk_list *head_sections;
     struct mk_list *head_entries;
 
-    mk_list_foreach(head_host, hosts) {
+    gen = mk_api->config_gen_acquire();
+    mk_list_foreach(head_host, &gen->hosts) {
         entry_host = mk_list_entry(head_host, struct host, _head);
 
         aliases = &entry_host->server_names;
@@ -289,6 +294,7 @@ void mk_cheetah_cmd_vhosts()
             }
         }
     }
+    mk_api->config_gen_release(gen);
 
     CHEETAH_WRITE("\n");
 }
@@ -301,7 +307,7 @@ void mk_cheetah_cmd_workers()
 
     node = mk_api->sched_list;
     for (i=0; i < mk_api->config->workers; i++) {
-        active_connections = (node[i].accepted_connections - node[i].closed_connections);
+        active_connections = mk_sched_active(&node[i]);
 
         CHEETAH_WRITE("* Worker %i\n", node[i].idx);
         CHEETAH_WRITE("      - Task ID           : %i\n", node[i].pid);
@@ -311,6 +317,53 @@ void mk_cheetah_cmd_workers()
     CHEETAH_WRITE("\n");
 }
 
+/* Print a latency value in a human readable unit */
+static void mk_cheetah_print_ns(uint64_t ns)
+{
+    if (ns < 1000) {
+        CHEETAH_WRITE("%8lu ns", (unsigned long) ns);
+    }
+    else if (ns < 1000000) {
+        CHEETAH_WRITE("%8.2f us", ns / 1000.0);
+    }
+    else if (ns < 1000000000) {
+        CHEETAH_WRITE("%8.2f ms", ns / 1000000.0);
+    }
+    else {
+        CHEETAH_WRITE("%8.2f s ", ns / 1000000000.0);
+    }
+}
+
+void mk_cheetah_cmd_latency()
+{
+    int i;
+    struct mk_latency_summary s;
+
+    CHEETAH_WRITE("%-11s %10s %11s %11s %11s %11s %11s\n",
+                  "interval", "requests", "p50", "p90", "p99", "p999", "max");
+
+    for (i = 0; i < MK_LATENCY_TYPES; i++) {
+        if (mk_api->latency_summary(i, &s) != 0) {
+            continue;
+        }
+
+        CHEETAH_WRITE("%-11s %10lu ", mk_api->latency_name(i),
+                      (unsigned long) s.count);
+        mk_cheetah_print_ns(s.p50);
+        CHEETAH_WRITE(" ");
+        mk_cheetah_print_ns(s.p90);
+        CHEETAH_WRITE(" ");
+        mk_cheetah_print_ns(s.p99);
+        CHEETAH_WRITE(" ");
+        mk_cheetah_print_ns(s.p999);
+        CHEETAH_WRITE(" ");
+        mk_cheetah_print_ns(s.max);
+        CHEETAH_WRITE("\n");
+    }
+
+    CHEETAH_WRITE("\n");
+}
+
 int mk_cheetah_cmd_quit()
 {
     CHEETAH_WRITE("Cheeta says: Good Bye!\n");
@@ -330,6 +383,7 @@ void mk_cheetah_cmd_help()
     CHEETAH_WRITE("\n----------------------------------------------------");
     CHEETAH_WRITE("\n?          (\\?)    Synonym for 'help'");
     CHEETAH_WRITE("\nconfig     (\\f)    Display global configuration");
+    CHEETAH_WRITE("\nlatency    (\\l)    Show request latency percentiles");
     CHEETAH_WRITE("\nplugins    (\\g)    List loaded plugins and associated stages");
     CHEETAH_WRITE("\nstatus     (\\s)    Display general web server information");
     CHEETAH_WRITE("\nuptime     (\\u)    Display how long the web server has been running");
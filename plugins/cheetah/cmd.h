@@ -34,6 +34,7 @@ void mk_cheetah_cmd_plugins();
 
 void mk_cheetah_cmd_vhosts();
 void mk_cheetah_cmd_workers();
+void mk_cheetah_cmd_latency();
 
 int  mk_cheetah_cmd_quit();
 void mk_cheetah_cmd_help();
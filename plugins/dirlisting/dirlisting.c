@@ -30,10 +30,14 @@
 #include "dirlisting.h"
 
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
 
 const mk_ptr_t mk_dirhtml_default_mime = mk_ptr_init(MK_DIRHTML_DEFAULT_MIME);
+const mk_ptr_t mk_dirhtml_json_mime = mk_ptr_init(MK_DIRHTML_JSON_MIME);
 const mk_ptr_t mk_dir_iov_dash  = mk_ptr_init("-");
 const mk_ptr_t mk_dir_iov_none  = mk_ptr_init("");
 const mk_ptr_t mk_dir_iov_slash = mk_ptr_init("/");
@@ -69,8 +73,6 @@ static struct mk_f_list *mk_dirhtml_create_element(char *file,
                                                    char *full_path,
                                                    unsigned long *list_len)
 {
-    int n;
-    struct tm *st_time;
     struct mk_f_list *entry;
 
     entry = mk_api->mem_alloc_z(sizeof(struct mk_f_list));
@@ -83,23 +85,6 @@ static struct mk_f_list *mk_dirhtml_create_element(char *file,
     strcpy(entry->name, file);
     entry->type = type;
 
-    st_time = localtime((time_t *) & entry->info.last_modification);
-    n = strftime(entry->ft_modif, MK_DIRHTML_FMOD_LEN, "%d-%b-%G %H:%M", st_time);
-    if (n == 0) {
-        mk_mem_free(entry);
-        return NULL;
-    }
-
-    if (type != DT_DIR) {
-        mk_dirhtml_human_readable_size(entry->size,
-                                       sizeof(entry->size),
-                                       entry->info.size);
-    }
-    else {
-        entry->size[0] = '-';
-        entry->size[1] = '\0';
-    }
-
     *list_len = *list_len + 1;
 
     return entry;
@@ -168,6 +153,8 @@ int mk_dirhtml_conf(char *confdir)
 */
 int mk_dirhtml_read_config(char *path)
 {
+    long num;
+    char *tmp;
     unsigned long len;
     char *default_file = NULL;
     struct mk_rconf *conf;
@@ -192,6 +179,29 @@ int mk_dirhtml_read_config(char *path)
                                                          MK_RCONF_STR);
     dirhtml_conf->theme_path = NULL;
 
+    /* Cache of rendered listings */
+    dirhtml_conf->cache_size = MK_DIRHTML_CACHE_SIZE * 1024;
+    dirhtml_conf->cache_ttl  = MK_DIRHTML_CACHE_TTL;
+
+    tmp = mk_api->config_section_get_key(section, "CacheSize", MK_RCONF_STR);
+    if (tmp) {
+        mk_api->mem_free(tmp);
+        num = (long) mk_api->config_section_get_key(section, "CacheSize",
+                                                    MK_RCONF_NUM);
+        if (num < 0) {
+            mk_warn("Dirlisting: invalid CacheSize value");
+        }
+        else {
+            dirhtml_conf->cache_size = (size_t) num * 1024;
+        }
+    }
+
+    num = (long) mk_api->config_section_get_key(section, "CacheTTL",
+                                                MK_RCONF_NUM);
+    if (num > 0) {
+        dirhtml_conf->cache_ttl = num;
+    }
+
     mk_api->str_build(&dirhtml_conf->theme_path, &len,
                       "%sthemes/%s/", path, dirhtml_conf->theme);
     mk_api->mem_free(default_file);
@@ -527,64 +537,392 @@ static int mk_dirhtml_entry_cmp(const void *a, const void *b)
     return strcasecmp((*f_a)->name, (*f_b)->name);
 }
 
-static void mk_dirhtml_free_list(struct mk_dirhtml_request *request)
+static void mk_dirhtml_free_list(struct mk_list *file_list)
 {
     struct mk_list *tmp;
     struct mk_list *head;
     struct mk_f_list *entry;
 
-    mk_list_foreach_safe(head, tmp, request->file_list) {
+    mk_list_foreach_safe(head, tmp, file_list) {
         entry = mk_list_entry(head, struct mk_f_list, _head);
         mk_list_del(&entry->_head);
         mk_api->mem_free(entry);
     }
 
-    mk_api->mem_free(request->file_list);
-    mk_api->mem_free(request->toc);
+    mk_api->mem_free(file_list);
+}
+
+static int mk_dirhtml_buf_add(struct dirhtml_buf *buf, const void *data,
+                              size_t len)
+{
+    char *tmp;
+    size_t size;
+
+    if (buf->len + len > buf->size) {
+        size = buf->size ? buf->size : MK_DIRHTML_CHUNK_SIZE;
+        while (size < buf->len + len) {
+            size *= 2;
+        }
+
+        tmp = mk_api->mem_realloc(buf->data, size);
+        if (!tmp) {
+            return -1;
+        }
+        buf->data = tmp;
+        buf->size = size;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return 0;
+}
+
+/* Like mk_dirhtml_theme_compose() but it renders into a buffer */
+static int mk_dirhtml_theme_render(struct dirhtml_template *template,
+                                   struct mk_list *list,
+                                   struct dirhtml_buf *html)
+{
+    int ret = 0;
+    struct dirhtml_template *tpl;
+    struct dirhtml_value *val;
+    struct mk_list *head;
+
+    for (tpl = template; tpl; tpl = tpl->next) {
+        /* static */
+        if (tpl->buf || tpl->tag_id < 0) {
+            ret |= mk_dirhtml_buf_add(html, tpl->buf, tpl->len);
+            continue;
+        }
+
+        /* dynamic value */
+        mk_list_foreach(head, list) {
+            val = mk_list_entry(head, struct dirhtml_value, _head);
+            if (val->tags == tpl->tags && val->tag_id == tpl->tag_id) {
+                ret |= mk_dirhtml_buf_add(html, val->value, val->len);
+                ret |= mk_dirhtml_buf_add(html, val->sep.data, val->sep.len);
+                break;
+            }
+        }
+    }
+
+    return ret;
 }
 
-static inline struct mk_iov *enqueue_row(int i, struct mk_dirhtml_request *request)
+static int mk_dirhtml_render_row(struct dirhtml_entry *entry,
+                                 struct dirhtml_buf *html)
 {
+    int ret;
+    char size[16];
+    char ft_modif[MK_DIRHTML_FMOD_LEN];
+    struct tm st_time;
     mk_ptr_t sep;
     struct mk_list list;
-    struct mk_iov *iov_entry;
+
+    /* It runs in the scanner thread, see mk_dirhtml_scanner_loop() */
+    localtime_r(&entry->mtime, &st_time);
+    if (strftime(ft_modif, MK_DIRHTML_FMOD_LEN, "%d-%b-%G %H:%M",
+                 &st_time) == 0) {
+        ft_modif[0] = '\0';
+    }
 
     /* %_target_title_% */
-    if (request->toc[i]->type == DT_DIR) {
+    if (entry->is_dir) {
         sep = mk_dir_iov_slash;
+        size[0] = '-';
+        size[1] = '\0';
     }
     else {
         sep = mk_dir_iov_none;
+        mk_dirhtml_human_readable_size(size, sizeof(size), entry->size);
     }
 
     mk_list_init(&list);
 
     /* target title */
-    mk_dirhtml_tag_assign(&list, 0, sep,
-                          request->toc[i]->name,
-                          (char **) _tags_entry);
+    mk_dirhtml_tag_assign(&list, 0, sep, entry->name, (char **) _tags_entry);
 
     /* target url */
-    mk_dirhtml_tag_assign(&list, 1, sep,
-                          request->toc[i]->name, (char **) _tags_entry);
+    mk_dirhtml_tag_assign(&list, 1, sep, entry->name, (char **) _tags_entry);
 
     /* target name */
-    mk_dirhtml_tag_assign(&list, 2, sep,
-                          request->toc[i]->name, (char **) _tags_entry);
+    mk_dirhtml_tag_assign(&list, 2, sep, entry->name, (char **) _tags_entry);
 
     /* target modification time */
     mk_dirhtml_tag_assign(&list, 3, mk_dir_iov_none,
-                          request->toc[i]->ft_modif, (char **) _tags_entry);
+                          ft_modif, (char **) _tags_entry);
 
     /* target size */
     mk_dirhtml_tag_assign(&list, 4, mk_dir_iov_none,
-                          request->toc[i]->size, (char **) _tags_entry);
+                          size, (char **) _tags_entry);
 
-    iov_entry = mk_dirhtml_theme_compose(mk_dirhtml_tpl_entry, &list);
+    ret = mk_dirhtml_theme_render(mk_dirhtml_tpl_entry, &list, html);
 
     /* free entry list */
     mk_dirhtml_tag_free_list(&list);
-    return iov_entry;
+    return ret;
+}
+
+/*
+ * Render the rows of the listing entries. Only the entries are read, so
+ * the rows of a cached listing can be rendered again by the scanner while
+ * the worker uses it.
+ */
+static int mk_dirhtml_listing_render(struct dirhtml_listing *listing,
+                                     struct dirhtml_buf *html)
+{
+    int ret = 0;
+    char *tmp;
+    unsigned int i;
+
+    for (i = 0; i < listing->n_entries && ret == 0; i++) {
+        ret = mk_dirhtml_render_row(&listing->entries[i], html);
+    }
+
+    if (ret != 0) {
+        mk_api->mem_free(html->data);
+        html->data = NULL;
+        html->len  = 0;
+        html->size = 0;
+        return -1;
+    }
+
+    /* It may stay in the cache for a while, don't waste the slack */
+    if (html->len > 0 && html->len < html->size) {
+        tmp = mk_api->mem_realloc(html->data, html->len);
+        if (tmp) {
+            html->data = tmp;
+            html->size = html->len;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Rows the cache could not keep are released once no request streams
+ * them, the index of the listing stays.
+ */
+static void mk_dirhtml_listing_trim(struct dirhtml_listing *listing)
+{
+    if (listing->html_refs > 0 || listing->html_kept == MK_TRUE ||
+        listing->rendered == MK_FALSE) {
+        return;
+    }
+
+    mk_api->mem_free(listing->html.data);
+    listing->html.data = NULL;
+    listing->html.len  = 0;
+    listing->html.size = 0;
+    listing->rendered  = MK_FALSE;
+}
+
+static void mk_dirhtml_listing_release(struct dirhtml_listing *listing)
+{
+    if (--listing->refs > 0) {
+        return;
+    }
+
+    mk_api->mem_free(listing->html.data);
+    mk_api->mem_free(listing->entries);
+    mk_api->mem_free(listing->names);
+    mk_api->mem_free(listing->by_size);
+    mk_api->mem_free(listing->by_mtime);
+    mk_api->mem_free(listing);
+}
+
+static void mk_dirhtml_cache_drop(struct dirhtml_cache *cache,
+                                  struct dirhtml_listing *listing)
+{
+    PLUGIN_TRACE("drop listing ino=%lu", (unsigned long) listing->ino);
+
+    mk_list_del(&listing->_head);
+    cache->size -= listing->mem;
+    if (listing->html_kept == MK_TRUE) {
+        cache->size -= listing->html.size;
+        listing->html_kept = MK_FALSE;
+    }
+    listing->cached = MK_FALSE;
+    mk_dirhtml_listing_trim(listing);
+    mk_dirhtml_listing_release(listing);
+}
+
+/* Read, sort and render the entries of a directory */
+static struct dirhtml_listing *mk_dirhtml_listing_create(char *path,
+                                                         struct stat *st)
+{
+    int ret = 0;
+    DIR *dir;
+    unsigned int i;
+    unsigned long toc_len = 0;
+    size_t len;
+    size_t names_len = 0;
+    struct mk_list *head;
+    struct mk_list *file_list;
+    struct mk_f_list **toc;
+    struct mk_f_list *entry;
+    struct dirhtml_listing *listing;
+
+    if (!(dir = opendir(path))) {
+        return NULL;
+    }
+
+    file_list = mk_dirhtml_create_list(dir, path, &toc_len);
+    closedir(dir);
+
+    listing = mk_api->mem_alloc_z(sizeof(struct dirhtml_listing));
+    toc = mk_api->mem_alloc(sizeof(struct mk_f_list *) * (toc_len + 1));
+    if (!listing || !toc) {
+        mk_api->mem_free(listing);
+        mk_api->mem_free(toc);
+        mk_dirhtml_free_list(file_list);
+        return NULL;
+    }
+
+    listing->dev        = st->st_dev;
+    listing->ino        = st->st_ino;
+    listing->mtime      = st->st_mtime;
+    listing->mtime_nsec = MK_DIRHTML_MTIME_NSEC(st);
+    listing->expire     = mk_api->time_unix() + dirhtml_conf->cache_ttl;
+    listing->refs       = 1;
+
+    /* Creating table of contents and sorting */
+    i = 0;
+    mk_list_foreach(head, file_list) {
+        entry = mk_list_entry(head, struct mk_f_list, _head);
+        toc[i] = entry;
+        names_len += strlen(entry->name) + 1;
+        i++;
+    }
+
+    qsort(toc, toc_len, sizeof(*toc), mk_dirhtml_entry_cmp);
+
+    /* Entries index */
+    listing->n_entries = toc_len;
+    listing->entries = mk_api->mem_alloc(sizeof(struct dirhtml_entry) *
+                                         (toc_len + 1));
+    listing->names = mk_api->mem_alloc(names_len + 1);
+    if (!listing->entries || !listing->names) {
+        ret = -1;
+    }
+
+    names_len = 0;
+    for (i = 0; i < toc_len && ret == 0; i++) {
+        len = strlen(toc[i]->name) + 1;
+        memcpy(listing->names + names_len, toc[i]->name, len);
+
+        listing->entries[i].name   = listing->names + names_len;
+        listing->entries[i].size   = toc[i]->info.size;
+        listing->entries[i].mtime  = toc[i]->info.last_modification;
+        listing->entries[i].is_dir = toc[i]->info.is_directory;
+        names_len += len;
+    }
+
+    mk_api->mem_free(toc);
+    mk_dirhtml_free_list(file_list);
+
+    if (ret == 0) {
+        ret = mk_dirhtml_listing_render(listing, &listing->html);
+    }
+    if (ret != 0) {
+        mk_dirhtml_listing_release(listing);
+        return NULL;
+    }
+    listing->rendered = MK_TRUE;
+
+    /* The index, the rendered rows are accounted apart */
+    listing->mem = names_len + sizeof(struct dirhtml_entry) * toc_len;
+
+    return listing;
+}
+
+/*
+ * Get the rendered listing of a directory from the worker cache. Listings
+ * are cached while the directory keeps the same inode and modification
+ * time; the TTL bounds how long changes in the entries sizes and times go
+ * unnoticed, as they do not touch the directory itself.
+ */
+static struct dirhtml_listing *mk_dirhtml_cache_get(struct stat *st)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct dirhtml_cache *cache;
+    struct dirhtml_listing *listing;
+
+    cache = pthread_getspecific(dirhtml_cache_key);
+    if (!cache) {
+        return NULL;
+    }
+
+    mk_list_foreach_safe(head, tmp, &cache->listings) {
+        listing = mk_list_entry(head, struct dirhtml_listing, _head);
+        if (listing->ino != st->st_ino || listing->dev != st->st_dev) {
+            continue;
+        }
+
+        if (listing->mtime == st->st_mtime &&
+            listing->mtime_nsec == MK_DIRHTML_MTIME_NSEC(st) &&
+            listing->expire > mk_api->time_unix()) {
+            PLUGIN_TRACE("cache hit ino=%lu", (unsigned long) st->st_ino);
+            mk_list_del(&listing->_head);
+            mk_list_add(&listing->_head, &cache->listings);
+            listing->refs++;
+            return listing;
+        }
+
+        /* Outdated */
+        mk_dirhtml_cache_drop(cache, listing);
+        break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Keep a new listing in the worker cache if it fits. When the rendered
+ * rows do not fit, the index is kept alone: the JSON listing pages and
+ * sorts from it, and the HTML page renders the rows again without reading
+ * the directory.
+ */
+static void mk_dirhtml_cache_add(struct dirhtml_listing *listing)
+{
+    size_t size;
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct dirhtml_cache *cache;
+    struct dirhtml_listing *entry;
+
+    cache = pthread_getspecific(dirhtml_cache_key);
+    if (!cache || listing->mem > dirhtml_conf->cache_size) {
+        return;
+    }
+
+    size = listing->mem;
+    if (size + listing->html.size <= dirhtml_conf->cache_size) {
+        size += listing->html.size;
+        listing->html_kept = MK_TRUE;
+    }
+
+    /* Two requests may have read the directory at the same time */
+    mk_list_foreach_safe(head, tmp, &cache->listings) {
+        entry = mk_list_entry(head, struct dirhtml_listing, _head);
+        if (entry->ino == listing->ino && entry->dev == listing->dev) {
+            mk_dirhtml_cache_drop(cache, entry);
+            break;
+        }
+    }
+
+    /* Make room, least recently used first */
+    while (cache->size + size > dirhtml_conf->cache_size) {
+        mk_dirhtml_cache_drop(cache,
+                              mk_list_entry_first(&cache->listings,
+                                                  struct dirhtml_listing,
+                                                  _head));
+    }
+
+    mk_list_add(&listing->_head, &cache->listings);
+    cache->size += size;
+    listing->cached = MK_TRUE;
+    listing->refs++;
 }
 
 /* Release all resources for a given Request context */
@@ -596,16 +934,19 @@ void mk_dirhtml_cleanup(struct mk_dirhtml_request *req)
         mk_api->iov_free(req->iov_header);
         req->iov_header = NULL;
     }
-    if (req->iov_entry) {
-        mk_api->iov_free(req->iov_entry);
-        req->iov_entry = NULL;
+    if (req->iov_body) {
+        mk_api->iov_free(req->iov_body);
+        req->iov_body = NULL;
     }
     if (req->iov_footer) {
         mk_api->iov_free(req->iov_footer);
         req->iov_footer = NULL;
     }
-    mk_dirhtml_free_list(req);
-    closedir(req->dir);
+    if (req->listing) {
+        req->listing->html_refs--;
+        mk_dirhtml_listing_trim(req->listing);
+        mk_dirhtml_listing_release(req->listing);
+    }
 
     req->sr->handler_data = NULL;
     mk_api->mem_free(req);
@@ -635,136 +976,443 @@ void mk_dirhtml_cb_error(struct mk_stream *stream, int status)
     }
 }
 
-void mk_dirhtml_cb_body_rows(struct mk_stream *stream)
+/*
+ * Queue the next piece of the page: the theme header, a slice of the
+ * rendered rows or the theme footer. Only the last stream of a piece
+ * references the request, it queues the next one once it's sent.
+ */
+static void mk_dirhtml_send(struct mk_dirhtml_request *req,
+                            struct mk_channel *channel)
 {
     int len;
-    char tmp[16];
-    struct mk_dirhtml_request *req = stream->data;
-    struct mk_channel *channel = stream->channel;
-    void (*cb_ok)(struct mk_stream* ) = NULL;
+    size_t size;
+    struct mk_iov *iov;
+    struct dirhtml_listing *listing = req->listing;
+    void (*cb_ok)(struct mk_stream *) = mk_dirhtml_send_next;
 
-    if (req->iov_entry) {
-        mk_api->iov_free(req->iov_entry);
-        req->iov_entry = NULL;
+    if (req->state == MK_DIRHTML_STATE_BODY &&
+        req->offset >= listing->html.len) {
+        req->state = MK_DIRHTML_STATE_FOOTER;
     }
 
-    if (req->toc_idx >= req->toc_len) {
-        if (req->chunked) {
-            len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                           (int) req->iov_footer->total_len);
-            mk_api->stream_set(NULL,
-                               MK_STREAM_COPYBUF,
-                               channel,
-                               tmp, len, req, NULL, NULL, mk_dirhtml_cb_error);
-            cb_ok  = NULL;
-        }
-        else {
-            cb_ok  = mk_dirhtml_cb_complete;
+    if (req->state == MK_DIRHTML_STATE_TPL_HEADER) {
+        iov = req->iov_header;
+        req->state = MK_DIRHTML_STATE_BODY;
+    }
+    else if (req->state == MK_DIRHTML_STATE_BODY) {
+        size = listing->html.len - req->offset;
+        if (size > MK_DIRHTML_CHUNK_SIZE) {
+            size = MK_DIRHTML_CHUNK_SIZE;
         }
 
-        /* No more rows to add, just link the page footer */
-        mk_api->stream_set(NULL,                   /* stream            */
-                           MK_STREAM_IOV,          /* type              */
-                           channel,                /* channel           */
-                           req->iov_footer,        /* buffer            */
-                           -1,                     /* buffer size       */
-                           req,                    /* custom data       */
-                           cb_ok,                  /* on_finish         */
-                           NULL,                   /* on_bytes_consumed */
-                           mk_dirhtml_cb_error);   /* on_error          */
+        iov = req->iov_body;
+        iov->iov_idx   = 0;
+        iov->total_len = 0;
+        mk_api->iov_add(iov, listing->html.data + req->offset, size,
+                        MK_FALSE);
+        req->offset += size;
+    }
+    else {
+        iov = req->iov_footer;
+        req->state = MK_DIRHTML_STATE_END;
+        cb_ok = mk_dirhtml_cb_complete;
+    }
+
+    if (!req->chunked) {
+        mk_api->stream_set(NULL, MK_STREAM_IOV, channel, iov, -1,
+                           req, cb_ok, NULL, mk_dirhtml_cb_error);
+        return;
+    }
+
+    len = snprintf(req->chunk_size, sizeof(req->chunk_size), "%x\r\n",
+                   (int) iov->total_len);
+    mk_api->stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                       req->chunk_size, len, NULL, NULL, NULL, NULL);
+    mk_api->stream_set(NULL, MK_STREAM_IOV, channel, iov, -1,
+                       NULL, NULL, NULL, NULL);
+
+    if (req->state == MK_DIRHTML_STATE_END) {
+        mk_api->stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                           "\r\n0\r\n\r\n", 7,
+                           req, cb_ok, NULL, mk_dirhtml_cb_error);
+    }
+    else {
+        mk_api->stream_set(NULL, MK_STREAM_COPYBUF, channel,
+                           "\r\n", 2,
+                           req, cb_ok, NULL, mk_dirhtml_cb_error);
+    }
+}
+
+void mk_dirhtml_send_next(struct mk_stream *stream)
+{
+    mk_dirhtml_send(stream->data, stream->channel);
+}
+
+static int mk_dirhtml_query_is(char *p, int len, const char *str)
+{
+    return (len == (int) strlen(str) && strncmp(p, str, len) == 0);
+}
+
+/*
+ * The JSON listing is served when the client accepts application/json or
+ * the query string has format=json. Paging and sorting:
+ *
+ *   offset=N, limit=N, sort=name|size|mtime, order=asc|desc
+ */
+static void mk_dirhtml_query_parse(struct mk_http_request *sr,
+                                   struct dirhtml_query *q)
+{
+    int k_len;
+    int v_len;
+    char *p;
+    char *end;
+    char *key;
+    char *val;
+    char num[24];
+    struct mk_http_header *header;
+
+    q->json    = MK_FALSE;
+    q->sort    = MK_DIRHTML_SORT_NAME;
+    q->reverse = MK_FALSE;
+    q->offset  = 0;
+    q->limit   = MK_DIRHTML_JSON_LIMIT;
+
+    header = mk_api->header_get(MK_HEADER_ACCEPT, sr, NULL, 0);
+    if (header && header->val.len > 0 &&
+        mk_api->str_search_n(header->val.data, "application/json",
+                             MK_STR_INSENSITIVE, header->val.len) >= 0) {
+        q->json = MK_TRUE;
+    }
+
+    p   = sr->query_string.data;
+    end = p + sr->query_string.len;
+    while (p && p < end) {
+        key = p;
+        while (p < end && *p != '&') {
+            p++;
+        }
 
-        if (req->chunked) {
-            mk_api->stream_set(NULL,
-                               MK_STREAM_COPYBUF,
-                               channel,
-                               "\r\n0\r\n\r\n", 7, req,
-                               mk_dirhtml_cb_complete, NULL, mk_dirhtml_cb_error);
+        val = memchr(key, '=', p - key);
+        if (!val) {
+            p++;
+            continue;
+        }
+        k_len = val - key;
+        val++;
+        v_len = p - val;
+        p++;
+
+        if (mk_dirhtml_query_is(key, k_len, "format")) {
+            if (mk_dirhtml_query_is(val, v_len, "json")) {
+                q->json = MK_TRUE;
+            }
+        }
+        else if (mk_dirhtml_query_is(key, k_len, "sort")) {
+            if (mk_dirhtml_query_is(val, v_len, "size")) {
+                q->sort = MK_DIRHTML_SORT_SIZE;
+            }
+            else if (mk_dirhtml_query_is(val, v_len, "mtime")) {
+                q->sort = MK_DIRHTML_SORT_MTIME;
+            }
+        }
+        else if (mk_dirhtml_query_is(key, k_len, "order")) {
+            q->reverse = mk_dirhtml_query_is(val, v_len, "desc");
         }
+        else if (v_len > 0 && v_len < (int) sizeof(num)) {
+            memcpy(num, val, v_len);
+            num[v_len] = '\0';
+            if (mk_dirhtml_query_is(key, k_len, "offset")) {
+                q->offset = strtoul(num, NULL, 10);
+            }
+            else if (mk_dirhtml_query_is(key, k_len, "limit")) {
+                q->limit = strtoul(num, NULL, 10);
+            }
+        }
+    }
 
-        return;
+    if (q->limit > MK_DIRHTML_JSON_LIMIT_MAX) {
+        q->limit = MK_DIRHTML_JSON_LIMIT_MAX;
     }
+}
 
-    req->iov_entry = enqueue_row(req->toc_idx, req);
-    if (req->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) req->iov_entry->total_len);
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           channel,
-                           tmp, len, req, NULL, NULL, mk_dirhtml_cb_error);
-        cb_ok = NULL;
+/* Ties keep the name order, the entries array is sorted by name */
+static int mk_dirhtml_entry_cmp_pos(struct dirhtml_entry *a,
+                                    struct dirhtml_entry *b)
+{
+    return (a > b) - (a < b);
+}
+
+static int mk_dirhtml_entry_cmp_size(const void *a, const void *b)
+{
+    struct dirhtml_entry *const *e_a = a;
+    struct dirhtml_entry *const *e_b = b;
+
+    if ((*e_a)->size != (*e_b)->size) {
+        return ((*e_a)->size < (*e_b)->size) ? -1 : 1;
+    }
+    return mk_dirhtml_entry_cmp_pos(*e_a, *e_b);
+}
+
+static int mk_dirhtml_entry_cmp_mtime(const void *a, const void *b)
+{
+    struct dirhtml_entry *const *e_a = a;
+    struct dirhtml_entry *const *e_b = b;
+
+    if ((*e_a)->mtime != (*e_b)->mtime) {
+        return ((*e_a)->mtime < (*e_b)->mtime) ? -1 : 1;
+    }
+    return mk_dirhtml_entry_cmp_pos(*e_a, *e_b);
+}
+
+/*
+ * Entries sorted by size or modification time. They are created once per
+ * listing, cached listings keep them and account them in the cache size.
+ */
+static struct dirhtml_entry **mk_dirhtml_listing_order(struct dirhtml_listing *listing,
+                                                       int sort)
+{
+    size_t size;
+    unsigned int i;
+    struct dirhtml_cache *cache;
+    struct dirhtml_entry **order;
+    struct dirhtml_entry ***slot;
+    int (*cmp) (const void *, const void *);
+
+    if (sort == MK_DIRHTML_SORT_SIZE) {
+        slot = &listing->by_size;
+        cmp  = mk_dirhtml_entry_cmp_size;
     }
     else {
-        cb_ok = mk_dirhtml_cb_body_rows;
+        slot = &listing->by_mtime;
+        cmp  = mk_dirhtml_entry_cmp_mtime;
     }
 
-    mk_api->stream_set(NULL,
-                       MK_STREAM_IOV,
-                       channel,
-                       req->iov_entry,
-                       -1,
-                       req,
-                       cb_ok,
-                       NULL,
-                       mk_dirhtml_cb_error);
+    if (*slot) {
+        return *slot;
+    }
 
-    if (req->chunked) {
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           channel,
-                           "\r\n", 2, (void *) req,
-                           mk_dirhtml_cb_body_rows, NULL, mk_dirhtml_cb_error);
+    size = sizeof(struct dirhtml_entry *) * listing->n_entries;
+    order = mk_api->mem_alloc(size + sizeof(struct dirhtml_entry *));
+    if (!order) {
+        return NULL;
     }
-    req->toc_idx++;
+
+    for (i = 0; i < listing->n_entries; i++) {
+        order[i] = &listing->entries[i];
+    }
+    qsort(order, listing->n_entries, sizeof(*order), cmp);
+
+    *slot = order;
+    listing->mem += size;
+    if (listing->cached == MK_TRUE) {
+        cache = pthread_getspecific(dirhtml_cache_key);
+        cache->size += size;
+    }
+
+    return order;
 }
 
 /*
- * The HTTP Headers were sent, now start registering the
- * rows for each directory entry.
+ * Length of the UTF-8 sequence starting at 'p', 0 if it's not a valid one:
+ * truncated, overlong, a surrogate or past U+10FFFF.
  */
-void cb_header_finish(struct mk_stream *stream)
+static int mk_dirhtml_utf8_len(const unsigned char *p)
 {
-    struct mk_dirhtml_request *req;
+    int i;
+    int n;
+    unsigned int cp;
 
-    req = stream->data;
-    if (req->iov_header) {
-        mk_api->iov_free(req->iov_header);
-        req->iov_header = NULL;
+    if (p[0] < 0x80) {
+        return 1;
+    }
+    else if ((p[0] & 0xe0) == 0xc0) {
+        n = 2;
+        cp = p[0] & 0x1f;
+    }
+    else if ((p[0] & 0xf0) == 0xe0) {
+        n = 3;
+        cp = p[0] & 0x0f;
+    }
+    else if ((p[0] & 0xf8) == 0xf0) {
+        n = 4;
+        cp = p[0] & 0x07;
+    }
+    else {
+        return 0;
+    }
+
+    /* The string terminator is not a continuation byte */
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (p[i] & 0x3f);
     }
-    mk_dirhtml_cb_body_rows(stream);
+
+    if ((n == 2 && cp < 0x80) || (n == 3 && cp < 0x800) ||
+        (n == 4 && cp < 0x10000) || cp > 0x10ffff ||
+        (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 0;
+    }
+
+    return n;
 }
 
-int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
+/*
+ * File names are just bytes: a sequence that is not UTF-8 is replaced
+ * by U+FFFD so the document stays valid JSON.
+ */
+static int mk_dirhtml_json_string(struct dirhtml_buf *buf, const char *str)
 {
-    DIR *dir;
+    int ret = 0;
     int len;
-    char tmp[16];
-    unsigned int i = 0;
-    struct mk_list *head;
-    struct mk_list list;
-    struct mk_f_list *entry;
-    struct mk_dirhtml_request *request;
+    char esc[8];
+    unsigned char c;
+    const char *p;
+    const char *run = str;
+
+    ret |= mk_dirhtml_buf_add(buf, "\"", 1);
+    for (p = str; *p; p++) {
+        c = *p;
+        if (c >= 0x80) {
+            len = mk_dirhtml_utf8_len((const unsigned char *) p);
+            if (len > 0) {
+                p += len - 1;
+                continue;
+            }
+        }
+        else if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+
+        ret |= mk_dirhtml_buf_add(buf, run, p - run);
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            len = 2;
+        }
+        else if (c >= 0x80) {
+            memcpy(esc, "\\ufffd", 6);
+            len = 6;
+        }
+        else {
+            len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        }
+        ret |= mk_dirhtml_buf_add(buf, esc, len);
+        run = p + 1;
+    }
+    ret |= mk_dirhtml_buf_add(buf, run, p - run);
+    ret |= mk_dirhtml_buf_add(buf, "\"", 1);
+
+    return ret;
+}
 
-    if (!(dir = opendir(sr->real_path.data))) {
+/* Compose and queue one page of the JSON listing */
+static int mk_dirhtml_json(struct mk_http_session *cs,
+                           struct mk_http_request *sr,
+                           struct dirhtml_listing *listing,
+                           struct dirhtml_query *q)
+{
+    int ret = 0;
+    int len;
+    char tmp[128];
+    unsigned long i;
+    unsigned long idx;
+    unsigned long last;
+    struct dirhtml_buf buf = { NULL, 0, 0 };
+    struct dirhtml_entry *entry;
+    struct dirhtml_entry **order = NULL;
+    static const char *sort_names[] = { "name", "size", "mtime" };
+
+    if (q->sort != MK_DIRHTML_SORT_NAME) {
+        order = mk_dirhtml_listing_order(listing, q->sort);
+        if (!order) {
+            return -1;
+        }
+    }
+
+    last = listing->n_entries;
+    if (q->offset > last) {
+        q->offset = last;
+    }
+    if (last - q->offset > q->limit) {
+        last = q->offset + q->limit;
+    }
+
+    ret |= mk_dirhtml_buf_add(&buf, "{\"path\":", 8);
+    ret |= mk_dirhtml_json_string(&buf, sr->uri_processed.data);
+    len = snprintf(tmp, sizeof(tmp),
+                   ",\"total\":%u,\"offset\":%lu,\"limit\":%lu,"
+                   "\"sort\":\"%s\",\"order\":\"%s\",\"entries\":[",
+                   listing->n_entries, q->offset, q->limit,
+                   sort_names[q->sort], q->reverse ? "desc" : "asc");
+    ret |= mk_dirhtml_buf_add(&buf, tmp, len);
+
+    for (i = q->offset; i < last && ret == 0; i++) {
+        idx = q->reverse ? listing->n_entries - 1 - i : i;
+        entry = order ? order[idx] : &listing->entries[idx];
+
+        if (i > q->offset) {
+            ret |= mk_dirhtml_buf_add(&buf, ",", 1);
+        }
+        ret |= mk_dirhtml_buf_add(&buf, "{\"name\":", 8);
+        ret |= mk_dirhtml_json_string(&buf, entry->name);
+        len = snprintf(tmp, sizeof(tmp),
+                       ",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+                       entry->is_dir ? "dir" : "file",
+                       (long long) entry->size, (long long) entry->mtime);
+        ret |= mk_dirhtml_buf_add(&buf, tmp, len);
+    }
+    ret |= mk_dirhtml_buf_add(&buf, "]}", 2);
+
+    if (ret != 0) {
+        mk_api->mem_free(buf.data);
         return -1;
     }
 
-    /* Create the main context */
-    request = mk_api->mem_alloc(sizeof(struct mk_dirhtml_request));
-    request->state   = MK_DIRHTML_STATE_HTTP_HEADER;
-    request->dir     = dir;
-    request->toc_idx = 0;
-    request->cs      = cs;
-    request->sr      = sr;
-    request->toc_len = 0;
-    request->chunked = MK_FALSE;
-    request->iov_header = NULL;
-    request->iov_entry = NULL;
-    request->iov_footer = NULL;
-    sr->handler_data = request;
-
-    request->file_list = mk_dirhtml_create_list(dir, sr->real_path.data,
-                                                &request->toc_len);
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_type = mk_dirhtml_json_mime;
+    sr->headers.content_length = buf.len;
+    mk_api->header_add(sr, "Vary: Accept", 12);
+    mk_api->header_prepare(cs, sr);
+
+    mk_api->stream_set(NULL, MK_STREAM_COPYBUF, cs->channel,
+                       buf.data, buf.len, NULL, NULL, NULL, NULL);
+    mk_api->mem_free(buf.data);
+    return 0;
+}
+
+/*
+ * Answer the request with the listing, the request takes the reference.
+ * The JSON listing is composed at once and the request context released,
+ * the HTML page is streamed piece by piece and the context goes with its
+ * last stream.
+ */
+static int mk_dirhtml_respond(struct mk_dirhtml_request *request,
+                              struct dirhtml_listing *listing)
+{
+    int ret;
+    struct mk_list list;
+    struct mk_http_session *cs = request->cs;
+    struct mk_http_request *sr = request->sr;
+
+    if (request->query.json == MK_TRUE) {
+        ret = mk_dirhtml_json(cs, sr, listing, &request->query);
+        if (ret != 0) {
+            mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        }
+
+        mk_dirhtml_listing_trim(listing);
+        mk_dirhtml_listing_release(listing);
+        sr->handler_data = NULL;
+        mk_api->mem_free(request);
+        return ret;
+    }
+
+    request->state    = MK_DIRHTML_STATE_TPL_HEADER;
+    request->listing  = listing;
+    request->iov_body = mk_api->iov_create(1, 0);
+    listing->html_refs++;
 
     /* Building headers */
     mk_api->header_set_http_status(sr, MK_HTTP_OK);
@@ -772,6 +1420,7 @@ int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
     sr->headers.breakline = MK_HEADER_BREAKLINE;
     sr->headers.content_type = mk_dirhtml_default_mime;
     sr->headers.content_length = -1;
+    mk_api->header_add(sr, "Vary: Accept", 12);
 
     if (sr->protocol >= MK_HTTP_PROTOCOL_11) {
         sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
@@ -802,55 +1451,308 @@ int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
                                                    &list);
     mk_dirhtml_tag_free_list(&list);
 
-    /* Creating table of contents and sorting */
-    request->toc = mk_api->mem_alloc(sizeof(struct mk_f_list *) * request->toc_len);
+    /* Prepare HTTP response headers */
+    mk_api->header_prepare(cs, sr);
 
-    i = 0;
-    mk_list_foreach(head, request->file_list) {
-        entry = mk_list_entry(head, struct mk_f_list, _head);
-        request->toc[i] = entry;
-        i++;
+    mk_dirhtml_send(request, cs->channel);
+    return 0;
+}
+
+static void mk_dirhtml_scan_queue(struct dirhtml_scanner *scanner,
+                                  struct dirhtml_job *job)
+{
+    pthread_mutex_lock(&scanner->lock);
+    mk_list_add(&job->_head, &scanner->jobs);
+    pthread_cond_signal(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+/*
+ * Pass the directory of the request to the scanner thread, or wait for
+ * the job already reading it. With a cached 'listing' only its rows are
+ * rendered.
+ */
+static int mk_dirhtml_scan(struct mk_dirhtml_request *request,
+                           struct stat *st, struct dirhtml_listing *listing)
+{
+    struct mk_list *head;
+    struct dirhtml_job *job;
+    struct dirhtml_scanner *scanner;
+
+    scanner = pthread_getspecific(dirhtml_scanner_key);
+    if (!scanner) {
+        return -1;
     }
 
-    qsort(request->toc,
-          request->toc_len,
-          sizeof(*request->toc),
-          mk_dirhtml_entry_cmp);
+    mk_list_foreach(head, &scanner->active) {
+        job = mk_list_entry(head, struct dirhtml_job, _active);
+        if (job->st.st_ino == st->st_ino && job->st.st_dev == st->st_dev &&
+            job->st.st_mtime == st->st_mtime &&
+            MK_DIRHTML_MTIME_NSEC(&job->st) == MK_DIRHTML_MTIME_NSEC(st)) {
+            goto wait;
+        }
+    }
 
-    /* Prepare HTTP response headers */
-    mk_api->header_prepare(cs, sr);
+    job = mk_api->mem_alloc_z(sizeof(struct dirhtml_job));
+    if (!job) {
+        return -1;
+    }
+    job->path = mk_api->str_dup(request->sr->real_path.data);
+    job->st   = *st;
+    if (listing) {
+        job->render  = MK_TRUE;
+        job->listing = listing;
+        listing->refs++;
+    }
+    mk_list_init(&job->requests);
+    mk_list_add(&job->_active, &scanner->active);
+    mk_dirhtml_scan_queue(scanner, job);
+
+ wait:
+    PLUGIN_TRACE("[FD %i] waiting for '%s'", request->cs->socket, job->path);
+    request->job   = job;
+    request->state = MK_DIRHTML_STATE_SCAN;
+    mk_list_add(&request->_head, &job->requests);
+    __atomic_add_fetch(&job->waiting, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* Read the directories of a worker, one at a time */
+static void mk_dirhtml_scanner_loop(void *data)
+{
+    ssize_t bytes;
+    struct dirhtml_job *job;
+    struct dirhtml_scanner *scanner = data;
+
+    while (1) {
+        pthread_mutex_lock(&scanner->lock);
+        while (mk_list_is_empty(&scanner->jobs) == 0) {
+            pthread_cond_wait(&scanner->cond, &scanner->lock);
+        }
+        job = mk_list_entry_first(&scanner->jobs, struct dirhtml_job, _head);
+        mk_list_del(&job->_head);
+        pthread_mutex_unlock(&scanner->lock);
+
+        /* The clients may have left while it was queued */
+        if (__atomic_load_n(&job->waiting, __ATOMIC_RELAXED) == 0) {
+            job->skipped = MK_TRUE;
+        }
+        else if (job->render == MK_TRUE) {
+            PLUGIN_TRACE("rendering '%s'", job->path);
+            job->ret = mk_dirhtml_listing_render(job->listing, &job->html);
+        }
+        else {
+            PLUGIN_TRACE("scanning '%s'", job->path);
+            job->listing = mk_dirhtml_listing_create(job->path, &job->st);
+            job->ret = job->listing ? 0 : -1;
+        }
+
+        /* Hand it back to the worker */
+        do {
+            bytes = write(scanner->fd[1], &job, sizeof(job));
+        } while (bytes == -1 && errno == EINTR);
+    }
+}
+
+/* The job is done, resume the requests waiting for it */
+static void mk_dirhtml_scan_done(struct dirhtml_scanner *scanner,
+                                 struct dirhtml_job *job)
+{
+    int ret;
+    struct mk_http_session *cs;
+    struct mk_http_request *sr;
+    struct dirhtml_listing *listing = job->listing;
+    struct mk_dirhtml_request *request;
+
+    if (job->skipped == MK_TRUE) {
+        /* A request came for it on the way back */
+        if (mk_list_is_empty(&job->requests) != 0) {
+            job->skipped = MK_FALSE;
+            mk_dirhtml_scan_queue(scanner, job);
+            return;
+        }
+        job->ret = -1;
+    }
+    mk_list_del(&job->_active);
 
-    if (request->chunked) {
-        len = snprintf(tmp, sizeof(tmp), "%x\r\n",
-                       (int) request->iov_header->total_len);
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           cs->channel,
-                           tmp, len, request, NULL, NULL, mk_dirhtml_cb_error);
-    }
-
-    mk_api->stream_set(NULL,                 /* stream            */
-                       MK_STREAM_IOV,        /* type              */
-                       cs->channel,          /* channel           */
-                       request->iov_header,  /* buffer            */
-                       -1,                   /* buffer size       */
-                       request,              /* custom data       */
-                       cb_header_finish,     /* on_finish         */
-                       NULL,                 /* on_bytes_consumed */
-                       mk_dirhtml_cb_error); /* on_error          */
-
-    if (request->chunked) {
-        mk_api->stream_set(NULL,
-                           MK_STREAM_COPYBUF,
-                           cs->channel,
-                           "\r\n", 2, request, NULL, NULL, mk_dirhtml_cb_error);
+    if (job->render == MK_FALSE) {
+        if (listing) {
+            mk_dirhtml_cache_add(listing);
+        }
+    }
+    else if (job->ret == 0 && listing->rendered == MK_FALSE) {
+        listing->html = job->html;
+        listing->rendered = MK_TRUE;
     }
+    else {
+        mk_api->mem_free(job->html.data);
+    }
+
+    /* Responding may end a connection, take them one by one */
+    while (mk_list_is_empty(&job->requests) != 0) {
+        request = mk_list_entry_first(&job->requests,
+                                      struct mk_dirhtml_request, _head);
+        mk_list_del(&request->_head);
+        request->job = NULL;
+        cs = request->cs;
+        sr = request->sr;
+
+        if (job->ret == 0) {
+            listing->refs++;
+            ret = mk_dirhtml_respond(request, listing);
+        }
+        else {
+            mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+            sr->handler_data = NULL;
+            mk_api->mem_free(request);
+            ret = -1;
+        }
+
+        if (ret != 0) {
+            mk_api->http_request_error(sr->headers.status, cs, sr);
+            mk_api->http_request_end(cs, MK_TRUE);
+            continue;
+        }
+        mk_api->http_request_end(cs, MK_FALSE);
+    }
+
+    if (listing) {
+        mk_dirhtml_listing_trim(listing);
+        mk_dirhtml_listing_release(listing);
+    }
+    mk_api->mem_free(job->path);
+    mk_api->mem_free(job);
+}
+
+static int mk_dirhtml_scanner_event(void *data)
+{
+    struct dirhtml_job *job;
+    struct dirhtml_scanner *scanner = data;
+
+    while (read(scanner->fd[0], &job, sizeof(job)) == sizeof(job)) {
+        mk_dirhtml_scan_done(scanner, job);
+    }
+
     return 0;
 }
 
+/*
+ * Start answering the request. A cached listing is served right away,
+ * otherwise the request waits for the scanner thread.
+ */
+int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr)
+{
+    struct stat st;
+    struct dirhtml_listing *listing;
+    struct mk_dirhtml_request *request;
+
+    if (stat(sr->real_path.data, &st) == -1) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    /* Create the main context */
+    request = mk_api->mem_alloc_z(sizeof(struct mk_dirhtml_request));
+    if (!request) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+    request->cs       = cs;
+    request->sr       = sr;
+    request->chunked  = MK_FALSE;
+    sr->handler_data  = request;
+    mk_dirhtml_query_parse(sr, &request->query);
+
+    listing = mk_dirhtml_cache_get(&st);
+    if (!listing) {
+        if (mk_dirhtml_scan(request, &st, NULL) == 0) {
+            return MK_PLUGIN_RET_CONTINUE;
+        }
+
+        /* No scanner thread, read it here */
+        listing = mk_dirhtml_listing_create(sr->real_path.data, &st);
+        if (!listing) {
+            goto error;
+        }
+        mk_dirhtml_cache_add(listing);
+    }
+    else if (request->query.json == MK_FALSE &&
+             listing->rendered == MK_FALSE) {
+        /* Only the index was cached */
+        if (mk_dirhtml_scan(request, &st, listing) == 0) {
+            mk_dirhtml_listing_release(listing);
+            return MK_PLUGIN_RET_CONTINUE;
+        }
+
+        if (mk_dirhtml_listing_render(listing, &listing->html) != 0) {
+            mk_dirhtml_listing_release(listing);
+            goto error;
+        }
+        listing->rendered = MK_TRUE;
+    }
+
+    if (mk_dirhtml_respond(request, listing) != 0) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    return MK_PLUGIN_RET_END;
+
+ error:
+    sr->handler_data = NULL;
+    mk_api->mem_free(request);
+    return MK_PLUGIN_RET_CLOSE_CONX;
+}
+
+/* Listings cache and scanner thread of the worker */
+void mk_dirlisting_worker_init()
+{
+    struct dirhtml_cache *cache;
+    struct dirhtml_scanner *scanner;
+
+    if (dirhtml_conf->cache_size > 0) {
+        cache = mk_api->mem_alloc_z(sizeof(struct dirhtml_cache));
+        mk_list_init(&cache->listings);
+        pthread_setspecific(dirhtml_cache_key, (void *) cache);
+    }
+
+    scanner = mk_api->mem_alloc_z(sizeof(struct dirhtml_scanner));
+    if (!scanner) {
+        return;
+    }
+
+    if (pipe2(scanner->fd, O_CLOEXEC) == -1) {
+        mk_warn("Dirlisting: cannot create the scanner pipe");
+        mk_api->mem_free(scanner);
+        return;
+    }
+
+    /* Only the worker side does not block */
+    fcntl(scanner->fd[0], F_SETFL, fcntl(scanner->fd[0], F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_init(&scanner->lock, NULL);
+    pthread_cond_init(&scanner->cond, NULL);
+    mk_list_init(&scanner->jobs);
+    mk_list_init(&scanner->active);
+
+    MK_EVENT_INIT(&scanner->event, scanner->fd[0], scanner,
+                  mk_dirhtml_scanner_event);
+    if (mk_api->ev_add(mk_api->sched_loop(), scanner->fd[0],
+                       MK_EVENT_CUSTOM, MK_EVENT_READ, scanner) != 0) {
+        mk_warn("Dirlisting: cannot register the scanner pipe");
+        close(scanner->fd[0]);
+        close(scanner->fd[1]);
+        mk_api->mem_free(scanner);
+        return;
+    }
+
+    mk_api->worker_spawn(mk_dirhtml_scanner_loop, scanner);
+    pthread_setspecific(dirhtml_scanner_key, (void *) scanner);
+}
+
 int mk_dirlisting_plugin_init(struct plugin_api **api, char *confdir)
 {
     mk_api = *api;
+    pthread_key_create(&dirhtml_cache_key, NULL);
+    pthread_key_create(&dirhtml_scanner_key, NULL);
 
     return mk_dirhtml_conf(confdir);
 }
@@ -884,28 +1786,37 @@ int mk_dirlisting_stage30(struct mk_plugin *plugin,
     }
 
     PLUGIN_TRACE("Dirlisting attending socket %i", cs->socket);
-    if (mk_dirhtml_init(cs, sr)) {
-        /*
-         * If we failed here, we cannot return RET_END - that causes a mk_bug.
-         * dirhtml_init only fails if opendir fails. Usually we're at full
-         * capacity then and can't open new files.
-         */
-        return MK_PLUGIN_RET_CLOSE_CONX;
-    }
 
-    return MK_PLUGIN_RET_END;
+    /*
+     * If we fail here, we cannot return RET_END - that causes a mk_bug.
+     * Reading the directory usually fails when we're at full capacity
+     * and can't open new files.
+     */
+    return mk_dirhtml_init(cs, sr);
 }
 
 int mk_dirlisting_stage30_hangup(struct mk_plugin *plugin,
                                  struct mk_http_session *cs,
                                  struct mk_http_request *sr)
 {
+    struct mk_dirhtml_request *request = sr->handler_data;
     (void) cs;
     (void) plugin;
 
-    if (sr->handler_data) {
-        mk_dirhtml_cleanup(sr->handler_data);
+    if (!request) {
+        return 0;
     }
+
+    /* The job goes on, the scanner skips it if nobody else waits */
+    if (request->state == MK_DIRHTML_STATE_SCAN) {
+        mk_list_del(&request->_head);
+        __atomic_sub_fetch(&request->job->waiting, 1, __ATOMIC_RELAXED);
+        sr->handler_data = NULL;
+        mk_api->mem_free(request);
+        return 0;
+    }
+
+    mk_dirhtml_cleanup(request);
     return 0;
 }
 
@@ -927,7 +1838,7 @@ struct mk_plugin mk_plugin_dirlisting = {
 
     /* Init Levels */
     .master_init   = NULL,
-    .worker_init   = NULL,
+    .worker_init   = mk_dirlisting_worker_init,
 
     /* Type */
     .stage         = &mk_plugin_stage_dirlisting
@@ -23,6 +23,7 @@
 
 #include <dirent.h>
 #include <limits.h>
+#include <sys/stat.h>
 
 #define MK_DIRHTML_URL "/_mktheme"
 #define MK_DIRHTML_DEFAULT_MIME "Content-Type: text/html\r\n"
@@ -33,6 +34,29 @@
 #define MK_DIRHTML_BUFFER_LIMIT 30
 #define MK_DIRHTML_BUFFER_GROW 5
 
+/* Rendered listings cache per worker, defaults */
+#define MK_DIRHTML_CACHE_SIZE   16384   /* KB      */
+#define MK_DIRHTML_CACHE_TTL    10      /* seconds */
+
+/* Largest piece of the rendered listing queued at once */
+#define MK_DIRHTML_CHUNK_SIZE   32768
+
+/* JSON listing, entries per page */
+#define MK_DIRHTML_JSON_MIME        "Content-Type: application/json\r\n"
+#define MK_DIRHTML_JSON_LIMIT       1000
+#define MK_DIRHTML_JSON_LIMIT_MAX   10000
+
+/* Sort keys */
+#define MK_DIRHTML_SORT_NAME    0
+#define MK_DIRHTML_SORT_SIZE    1
+#define MK_DIRHTML_SORT_MTIME   2
+
+#if defined(__APPLE__)
+#define MK_DIRHTML_MTIME_NSEC(st)  (st)->st_mtimespec.tv_nsec
+#else
+#define MK_DIRHTML_MTIME_NSEC(st)  (st)->st_mtim.tv_nsec
+#endif
+
 #define MK_HEADER_CHUNKED "Transfer-Encoding: Chunked\r\n\r\n"
 #define MK_DIRHTML_FMOD_LEN 24
 
@@ -50,6 +74,8 @@
 #define MK_DIRHTML_STATE_TPL_HEADER    1
 #define MK_DIRHTML_STATE_BODY          2
 #define MK_DIRHTML_STATE_FOOTER        3
+#define MK_DIRHTML_STATE_END           4
+#define MK_DIRHTML_STATE_SCAN          5
 
 char *_tags_global[] = { "%_html_title_%",
                          "%_theme_path_%",
@@ -68,10 +94,8 @@ struct plugin_api *mk_api;
 
 struct mk_f_list
 {
-    char ft_modif[MK_DIRHTML_FMOD_LEN];
     struct file_info info;
     char name[NAME_MAX + 1]; /* The name can be up to NAME_MAX long; include NULL. */
-    char size[16];
     unsigned char type;
 
     struct mk_list _head;
@@ -82,6 +106,113 @@ struct dirhtml_config
 {
     char *theme;
     char *theme_path;
+
+    size_t cache_size;          /* bytes, zero disables the cache */
+    int cache_ttl;
+};
+
+/* Growing buffer */
+struct dirhtml_buf
+{
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+/* Directory entry as exposed by the JSON listing */
+struct dirhtml_entry
+{
+    char *name;
+    off_t size;
+    time_t mtime;
+    int is_dir;
+};
+
+/*
+ * The entries of a directory sorted by name and their rows rendered with
+ * the entry template. Requests hold a reference while they use it, a
+ * listing dropped from the cache is released by the last one. The cache
+ * may keep the index without the rows, see mk_dirhtml_cache_add().
+ */
+struct dirhtml_listing
+{
+    /* Directory identity and version */
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    time_t expire;
+
+    /* Rendered rows */
+    struct dirhtml_buf html;
+    int rendered;
+    int html_kept;              /* accounted in the cache */
+    int html_refs;              /* requests sending them */
+
+    /* Entries index, other orders are created when first requested */
+    unsigned int n_entries;
+    struct dirhtml_entry *entries;
+    char *names;
+    struct dirhtml_entry **by_size;
+    struct dirhtml_entry **by_mtime;
+
+    size_t mem;                 /* index memory, rows apart */
+    int cached;
+    int refs;
+    struct mk_list _head;
+};
+
+/* JSON listing parameters, from the query string */
+struct dirhtml_query
+{
+    int json;
+    int sort;
+    int reverse;
+    unsigned long offset;
+    unsigned long limit;
+};
+
+/* Per worker cache of listings, least recently used first */
+struct dirhtml_cache
+{
+    size_t size;
+    struct mk_list listings;
+};
+
+/*
+ * Reading a directory is left to a thread of the worker, so a big one does
+ * not stall the other connections. The job comes back through the worker
+ * event loop once the listing is created, and every request that asked
+ * for the directory meanwhile gets it.
+ */
+struct dirhtml_job
+{
+    char *path;
+    struct stat st;
+    struct dirhtml_listing *listing;    /* result, or the one to render */
+    int ret;
+
+    /* Render the rows of a cached index, the worker keeps using it */
+    int render;
+    struct dirhtml_buf html;
+
+    int waiting;                /* requests, a job nobody waits for is skipped */
+    int skipped;
+    struct mk_list requests;    /* struct mk_dirhtml_request, worker side */
+
+    struct mk_list _head;       /* scanner queue */
+    struct mk_list _active;     /* jobs of the worker not done yet */
+};
+
+struct dirhtml_scanner
+{
+    struct mk_event event;      /* must be first, results are ready */
+    int fd[2];                  /* job pointers back to the worker */
+    struct mk_list active;      /* worker side */
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mk_list jobs;        /* pending */
 };
 
 /* Represent a request context */
@@ -90,19 +221,18 @@ struct mk_dirhtml_request
     /* State */
     int state;
     int chunked;
+    struct dirhtml_query query;
+    struct dirhtml_job *job;    /* while the directory is read */
+    struct mk_list _head;
 
-    /* Target directory */
-    DIR *dir;
-
-    /* Table of Content */
-    unsigned int toc_idx;
-    unsigned long toc_len;
-    struct mk_f_list **toc;
-    struct mk_list *file_list;
+    /* Rendered rows and how much of them were queued */
+    struct dirhtml_listing *listing;
+    size_t offset;
+    char chunk_size[16];
 
     /* Reference IOV stuff */
     struct mk_iov *iov_header;
-    struct mk_iov *iov_entry;
+    struct mk_iov *iov_body;
     struct mk_iov *iov_footer;
 
     /* Session data */
@@ -117,6 +247,10 @@ extern const mk_ptr_t mk_iov_dash;
 /* Global config */
 struct dirhtml_config *dirhtml_conf;
 
+/* struct dirhtml_cache and struct dirhtml_scanner of every worker */
+pthread_key_t dirhtml_cache_key;
+pthread_key_t dirhtml_scanner_key;
+
 /* Used to keep splitted content of every template */
 struct dirhtml_template
 {
@@ -165,6 +299,7 @@ struct dirhtml_template
                                   char *buf, int len, char **tpl, int tag);
 
 int mk_dirhtml_init(struct mk_http_session *cs, struct mk_http_request *sr);
+void mk_dirhtml_send_next(struct mk_stream *stream);
 int mk_dirhtml_read_config(char *path);
 int mk_dirhtml_theme_load();
 int mk_dirhtml_theme_debug(struct dirhtml_template **st_tpl);
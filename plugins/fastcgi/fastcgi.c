@@ -21,30 +21,157 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_conn.h"
+#include "fcgi_upstream.h"
 
-static int mk_fastcgi_config(char *path)
+/* Read an optional boolean key, 'def' if it is not set */
+static int fcgi_config_bool(struct mk_rconf_section *section, char *key,
+                            int def)
+{
+    char *tmp;
+
+    tmp = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!tmp) {
+        return def;
+    }
+    mk_api->mem_free(tmp);
+
+    return (long) mk_api->config_section_get_key(section, key, MK_RCONF_BOOL);
+}
+
+static struct fcgi_upstream *fcgi_config_upstream_new(char *name)
+{
+    struct fcgi_upstream *up;
+
+    up = mk_api->mem_alloc_z(sizeof(struct fcgi_upstream));
+    if (!up) {
+        return NULL;
+    }
+
+    up->id           = fcgi_conf.n_upstreams++;
+    up->name         = name;
+    up->policy       = FCGI_POLICY_LEAST;
+    up->hash_key     = FCGI_HASH_URI;
+    up->max_fails    = FCGI_DEF_MAX_FAILS;
+    up->fail_timeout = FCGI_DEF_FAIL_TIMEOUT;
+    mk_list_add(&up->_head, &fcgi_conf.upstreams);
+
+    return up;
+}
+
+/* [FASTCGI_UPSTREAM] section */
+static int fcgi_config_upstream(struct mk_rconf_section *section)
+{
+    long num;
+    char *name;
+    char *tmp;
+    struct fcgi_upstream *up;
+
+    name = mk_api->config_section_get_key(section, "Name", MK_RCONF_STR);
+    if (!name) {
+        mk_warn("[fastcgi] Missing Name in [FASTCGI_UPSTREAM]");
+        return -1;
+    }
+
+    if (fcgi_upstream_get(name, strlen(name))) {
+        mk_warn("[fastcgi] Duplicated upstream '%s'", name);
+        return -1;
+    }
+
+    up = fcgi_config_upstream_new(name);
+    if (!up) {
+        return -1;
+    }
+
+    /* Policy */
+    tmp = mk_api->config_section_get_key(section, "Policy", MK_RCONF_STR);
+    if (tmp) {
+        if (strcasecmp(tmp, "least_outstanding") == 0) {
+            up->policy = FCGI_POLICY_LEAST;
+        }
+        else if (strcasecmp(tmp, "round_robin") == 0) {
+            up->policy = FCGI_POLICY_ROUND_ROBIN;
+        }
+        else if (strcasecmp(tmp, "hash") == 0) {
+            up->policy = FCGI_POLICY_HASH;
+        }
+        else {
+            mk_warn("[fastcgi] Invalid Policy '%s' in upstream '%s'",
+                    tmp, name);
+            mk_api->mem_free(tmp);
+            return -1;
+        }
+        mk_api->mem_free(tmp);
+    }
+
+    /* HashKey */
+    tmp = mk_api->config_section_get_key(section, "HashKey", MK_RCONF_STR);
+    if (tmp) {
+        if (strcasecmp(tmp, "uri") == 0) {
+            up->hash_key = FCGI_HASH_URI;
+        }
+        else if (strcasecmp(tmp, "remote_addr") == 0) {
+            up->hash_key = FCGI_HASH_REMOTE_ADDR;
+        }
+        else {
+            mk_warn("[fastcgi] Invalid HashKey '%s' in upstream '%s'",
+                    tmp, name);
+            mk_api->mem_free(tmp);
+            return -1;
+        }
+        mk_api->mem_free(tmp);
+    }
+
+    /* MaxFails, zero disables the passive ejection */
+    tmp = mk_api->config_section_get_key(section, "MaxFails", MK_RCONF_STR);
+    if (tmp) {
+        mk_api->mem_free(tmp);
+        num = (long) mk_api->config_section_get_key(section, "MaxFails",
+                                                    MK_RCONF_NUM);
+        if (num < 0) {
+            mk_warn("[fastcgi] Invalid MaxFails value");
+            return -1;
+        }
+        up->max_fails = num;
+    }
+
+    /* FailTimeout */
+    num = (long) mk_api->config_section_get_key(section, "FailTimeout",
+                                                MK_RCONF_NUM);
+    if (num < 0) {
+        mk_warn("[fastcgi] Invalid FailTimeout value");
+        return -1;
+    }
+    else if (num > 0) {
+        up->fail_timeout = num;
+    }
+
+    /* HealthCheck */
+    num = (long) mk_api->config_section_get_key(section, "HealthCheck",
+                                                MK_RCONF_NUM);
+    if (num < 0) {
+        mk_warn("[fastcgi] Invalid HealthCheck value");
+        return -1;
+    }
+    up->health_check = num;
+
+    return 0;
+}
+
+/* [FASTCGI_SERVER] section */
+static int fcgi_config_server(struct mk_rconf_section *section)
 {
     int ret;
     int sep;
-    char *file = NULL;
+    long num;
     char *cnf_srv_name = NULL;
     char *cnf_srv_addr = NULL;
     char *cnf_srv_port = NULL;
     char *cnf_srv_path = NULL;
-    unsigned long len;
+    char *cnf_upstream = NULL;
     struct file_info finfo;
-    struct mk_rconf *conf;
-    struct mk_rconf_section *section;
-
-    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
-    conf = mk_api->config_create(file);
-    if (!conf) {
-        return -1;
-    }
-    section = mk_api->config_section_get(conf, "FASTCGI_SERVER");
-    if (!section) {
-        return -1;
-    }
+    struct fcgi_server *server;
+    struct fcgi_upstream *up;
 
     /* Get section values */
     cnf_srv_name = mk_api->config_section_get_key(section,
@@ -56,6 +183,9 @@ static int mk_fastcgi_config(char *path)
     cnf_srv_path = mk_api->config_section_get_key(section,
                                                   "ServerPath",
                                                   MK_RCONF_STR);
+    cnf_upstream = mk_api->config_section_get_key(section,
+                                                  "Upstream",
+                                                  MK_RCONF_STR);
 
     /* Validations */
     if (!cnf_srv_name) {
@@ -80,6 +210,11 @@ static int mk_fastcgi_config(char *path)
         mk_warn("[fastcgi] Use ServerAddr or ServerPath, not both");
         return -1;
     }
+    else if (!cnf_srv_path && !cnf_srv_addr) {
+        mk_warn("[fastcgi] Server %s needs ServerAddr or ServerPath",
+                cnf_srv_name);
+        return -1;
+    }
 
     /* Unix socket path */
     if (cnf_srv_path) {
@@ -90,21 +225,185 @@ static int mk_fastcgi_config(char *path)
         }
     }
 
-    /* Set the global configuration */
-    fcgi_conf.server_name = cnf_srv_name;
-    fcgi_conf.server_addr = cnf_srv_addr;
-    fcgi_conf.server_port = cnf_srv_port;
-    fcgi_conf.server_path = cnf_srv_path;
+    /* Upstream, declared or implicit */
+    if (!cnf_upstream) {
+        cnf_upstream = mk_api->str_dup(FCGI_UPSTREAM_DEFAULT);
+    }
+    up = fcgi_upstream_get(cnf_upstream, strlen(cnf_upstream));
+    if (up) {
+        mk_api->mem_free(cnf_upstream);
+    }
+    else {
+        up = fcgi_config_upstream_new(cnf_upstream);
+        if (!up) {
+            return -1;
+        }
+    }
+
+    if (up->n_servers == FCGI_MAX_SERVERS) {
+        mk_warn("[fastcgi] Upstream '%s' exceeds %i servers",
+                up->name, FCGI_MAX_SERVERS);
+        return -1;
+    }
+
+    server = mk_api->mem_alloc_z(sizeof(struct fcgi_server));
+    if (!server) {
+        return -1;
+    }
+    server->name     = cnf_srv_name;
+    server->addr     = cnf_srv_addr;
+    server->port     = cnf_srv_port;
+    server->path     = cnf_srv_path;
+    server->probe_ok = MK_TRUE;
+    server->upstream = up;
+
+    /* KeepAlive (optional, default on) */
+    server->keep_alive = fcgi_config_bool(section, "KeepAlive",
+                                          FCGI_DEF_KEEP_ALIVE);
+    if (server->keep_alive == -1) {
+        mk_warn("[fastcgi] Invalid KeepAlive value");
+        return -1;
+    }
+
+    /* MaxConnections (optional) */
+    num = (long) mk_api->config_section_get_key(section, "MaxConnections",
+                                                MK_RCONF_NUM);
+    if (num < 0) {
+        mk_warn("[fastcgi] Invalid MaxConnections value");
+        return -1;
+    }
+    server->max_connections = num;
+
+    /* Multiplex (optional) */
+    num = (long) mk_api->config_section_get_key(section, "Multiplex",
+                                                MK_RCONF_NUM);
+    if (num == 0) {
+        num = FCGI_DEF_MULTIPLEX;
+    }
+    else if (num < 0 || num > FCGI_MAX_MULTIPLEX) {
+        mk_warn("[fastcgi] Multiplex must be between 1 and %i",
+                FCGI_MAX_MULTIPLEX);
+        return -1;
+    }
+    else if (num > 1 && server->keep_alive == MK_FALSE) {
+        mk_warn("[fastcgi] Multiplex requires KeepAlive, disabled");
+        num = 1;
+    }
+    server->multiplex = num;
+
+    /* Register the server */
+    server->id    = fcgi_conf.n_servers;
+    server->index = up->n_servers;
+    up->servers[up->n_servers++] = server;
+
+    fcgi_conf.servers = mk_api->mem_realloc(fcgi_conf.servers,
+                                            sizeof(struct fcgi_server *) *
+                                            (fcgi_conf.n_servers + 1));
+    if (!fcgi_conf.servers) {
+        return -1;
+    }
+    fcgi_conf.servers[fcgi_conf.n_servers++] = server;
 
     return 0;
 }
 
+static int mk_fastcgi_config(char *path)
+{
+    int ret;
+    char *file = NULL;
+    unsigned long len;
+    struct mk_rconf *conf;
+    struct mk_rconf_section *section;
+    struct mk_list *head;
+    struct fcgi_upstream *up;
+
+    mk_list_init(&fcgi_conf.upstreams);
+
+    mk_api->str_build(&file, &len, "%sfastcgi.conf", path);
+    conf = mk_api->config_create(file);
+    mk_api->mem_free(file);
+    if (!conf) {
+        return -1;
+    }
+
+    /*
+     * Upstreams go first so the servers can refer to them, we don't use
+     * config_section_get() because the sections can be repeated.
+     */
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FASTCGI_UPSTREAM") == 0) {
+            ret = fcgi_config_upstream(section);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+
+    mk_list_foreach(head, &conf->sections) {
+        section = mk_list_entry(head, struct mk_rconf_section, _head);
+        if (strcasecmp(section->name, "FASTCGI_SERVER") == 0) {
+            ret = fcgi_config_server(section);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+
+    if (fcgi_conf.n_servers == 0) {
+        return -1;
+    }
+
+    mk_list_foreach(head, &fcgi_conf.upstreams) {
+        up = mk_list_entry(head, struct fcgi_upstream, _head);
+        if (up->n_servers == 0) {
+            mk_warn("[fastcgi] Upstream '%s' has no servers", up->name);
+            return -1;
+        }
+
+        if (up->policy == FCGI_POLICY_HASH) {
+            ret = fcgi_upstream_ring_build(up);
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The handler parameter names the upstream, without it the requests go to
+ * the 'default' upstream or to the first one defined.
+ */
+static struct fcgi_upstream *mk_fastcgi_upstream(int n_params,
+                                                 struct mk_list *params)
+{
+    struct fcgi_upstream *up;
+    struct mk_handler_param *param;
+
+    if (n_params > 0) {
+        param = mk_api->handler_param_get(0, params);
+        return fcgi_upstream_get(param->p.data, param->p.len);
+    }
+
+    up = fcgi_upstream_get(FCGI_UPSTREAM_DEFAULT,
+                           sizeof(FCGI_UPSTREAM_DEFAULT) - 1);
+    if (up) {
+        return up;
+    }
+
+    return mk_list_entry_first(&fcgi_conf.upstreams,
+                               struct fcgi_upstream, _head);
+}
+
 static int mk_fastcgi_start_processing(struct mk_http_session *cs,
-                                       struct mk_http_request *sr)
+                                       struct mk_http_request *sr,
+                                       struct fcgi_upstream *upstream)
 {
     struct fcgi_handler *handler;
 
-    handler = fcgi_handler_new(cs, sr);
+    handler = fcgi_handler_new(cs, sr, upstream);
     if (!handler) {
         return -1;
     }
@@ -121,16 +420,27 @@ int mk_fastcgi_stage30(struct mk_plugin *plugin,
                        struct mk_list *params)
 {
     int ret;
+    struct fcgi_upstream *upstream;
     (void) plugin;
-    (void) n_params;
-    (void) params;
 
-    ret = mk_fastcgi_start_processing(cs, sr);
+    upstream = mk_fastcgi_upstream(n_params, params);
+    if (!upstream) {
+        mk_warn("[fastcgi] Unknown upstream in handler for %s",
+                sr->uri_processed.data);
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    ret = mk_fastcgi_start_processing(cs, sr, upstream);
     if (ret == 0) {
         return MK_PLUGIN_RET_CONTINUE;
     }
 
-    return MK_PLUGIN_RET_NOT_ME;
+    /* No server could take the request, never fall back to the file */
+    if (sr->headers.status == 0) {
+        mk_api->header_set_http_status(sr, MK_SERVER_INTERNAL_ERROR);
+    }
+    return MK_PLUGIN_RET_CLOSE_CONX;
 }
 
 int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
@@ -147,7 +457,8 @@ int mk_fastcgi_stage30_hangup(struct mk_plugin *plugin,
     }
 
     handler->active = MK_FALSE;
-    fcgi_exit(sr->handler_data);
+    sr->handler_data = NULL;
+    fcgi_exit(handler);
 
     return 0;
 }
@@ -158,6 +469,8 @@ int mk_fastcgi_plugin_init(struct plugin_api **api, char *confdir)
 
     mk_api = *api;
 
+    pthread_key_create(&fcgi_local_worker, NULL);
+
     /* read global configuration */
     ret = mk_fastcgi_config(confdir);
     if (ret == -1) {
@@ -174,11 +487,17 @@ int mk_fastcgi_plugin_exit()
 int mk_fastcgi_master_init(struct mk_server_config *config)
 {
     (void) config;
+
+    fcgi_health_start();
     return 0;
 }
 
 void mk_fastcgi_worker_init()
 {
+    /* Every worker owns its pools of backend connections */
+    if (fcgi_worker_init() != 0) {
+        mk_err("[fastcgi] could not initialize the connection pools");
+    }
 }
 
 struct mk_plugin_stage mk_plugin_stage_fastcgi = {
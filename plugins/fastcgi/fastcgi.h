@@ -20,17 +20,102 @@
 #ifndef MK_FASTCGI_H
 #define MK_FASTCGI_H
 
-struct mk_fcgi_conf {
-    char *server_name;
+#include <monkey/mk_api.h>
+
+/*
+ * Every [FASTCGI_SERVER] belongs to an upstream (the 'default' one if the
+ * Upstream key is not set). Requests are mapped to an upstream through the
+ * handler parameter and the upstream policy picks the server:
+ *
+ *   Match /.*\.php fastcgi php
+ */
+#define FCGI_UPSTREAM_DEFAULT    "default"
+
+/* Server selection policies */
+#define FCGI_POLICY_LEAST        0   /* least outstanding requests */
+#define FCGI_POLICY_ROUND_ROBIN  1
+#define FCGI_POLICY_HASH         2   /* consistent hashing         */
+
+/* Consistent hashing keys */
+#define FCGI_HASH_URI            0
+#define FCGI_HASH_REMOTE_ADDR    1
+
+/* A request tries every server once, tracked with a bitmask */
+#define FCGI_MAX_SERVERS         32
+
+/* Points on the hash ring per server */
+#define FCGI_RING_POINTS         160
+
+struct fcgi_upstream;
+
+struct fcgi_server {
+    int id;                     /* index in the per worker pools      */
+    int index;                  /* position in the upstream           */
+    char *name;
 
     /* Unix Socket */
-    char *server_path;
+    char *path;
 
     /* TCP Server */
-    char *server_addr;
-    char *server_port;
+    char *addr;
+    char *port;
+
+    /* Connection pool */
+    int keep_alive;             /* use FCGI_KEEP_CONN                 */
+    int max_connections;        /* per worker, zero means no limit    */
+    int multiplex;              /* concurrent requests per connection */
+
+    /* Health state shared by the workers (atomic access) */
+    int fails;                  /* consecutive failures               */
+    int probe_ok;               /* last health probe succeeded        */
+    time_t down_until;          /* ejected until this time            */
+
+    struct fcgi_upstream *upstream;
 };
 
+struct fcgi_ring_point {
+    uint32_t hash;
+    struct fcgi_server *server;
+};
+
+struct fcgi_upstream {
+    int id;                     /* index in the per worker state      */
+    char *name;
+    int policy;
+    int hash_key;
+
+    /* Passive failure detection */
+    int max_fails;              /* failures before ejection, 0 = off  */
+    int fail_timeout;           /* seconds out of the rotation        */
+
+    /* Active probes, interval in seconds (0 = off) */
+    int health_check;
+    time_t next_probe;
+
+    int n_servers;
+    struct fcgi_server *servers[FCGI_MAX_SERVERS];
+
+    /* Consistent hashing ring, sorted by hash */
+    int ring_size;
+    struct fcgi_ring_point *ring;
+
+    struct mk_list _head;
+};
+
+struct mk_fcgi_conf {
+    int n_upstreams;
+    int n_servers;
+    struct fcgi_server **servers;   /* indexed by server id */
+    struct mk_list upstreams;
+};
+
+#define FCGI_DEF_KEEP_ALIVE      MK_TRUE
+#define FCGI_DEF_MAX_CONNECTIONS 0
+#define FCGI_DEF_MULTIPLEX       1
+#define FCGI_MAX_MULTIPLEX       256
+#define FCGI_DEF_MAX_FAILS       3
+#define FCGI_DEF_FAIL_TIMEOUT    10
+
 struct mk_fcgi_conf fcgi_conf;
 
 #endif
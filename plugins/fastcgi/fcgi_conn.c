@@ -0,0 +1,798 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_conn.h"
+#include "fcgi_upstream.h"
+
+static int cb_fcgi_conn_event(void *data);
+static void fcgi_pool_drain(struct fcgi_pool *pool);
+
+/* Is the request still (or partially) in the connection write queue ? */
+static inline int fcgi_handler_pending(struct fcgi_handler *handler)
+{
+    return (handler->iov_pos < handler->iov->iov_idx);
+}
+
+int fcgi_pool_init(struct fcgi_pool *pool, struct fcgi_server *server)
+{
+    pool->count  = 0;
+    pool->queued = 0;
+    pool->server = server;
+    mk_list_init(&pool->conns);
+    mk_list_init(&pool->queue);
+
+    return 0;
+}
+
+/* Requests sent or waiting to be sent to the server by this worker */
+int fcgi_pool_outstanding(struct fcgi_pool *pool)
+{
+    int n = pool->queued;
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+
+    mk_list_foreach(head, &pool->conns) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        n += conn->busy;
+    }
+
+    return n;
+}
+
+/* Register the events the connection is interested in */
+static int fcgi_conn_events(struct fcgi_conn *conn)
+{
+    uint32_t mask = MK_EVENT_READ;
+
+    /* A slow client holds the reads, see fcgi_conn_throttle() */
+    if (conn->throttled > 0) {
+        mask = MK_EVENT_SLEEP;
+    }
+
+    if (conn->status == FCGI_CONN_CONNECTING ||
+        mk_list_is_empty(&conn->write_queue) != 0) {
+        mask |= MK_EVENT_WRITE;
+    }
+
+    if (conn->event.mask == mask) {
+        return 0;
+    }
+
+    return mk_api->ev_add(mk_api->sched_loop(), conn->fd,
+                          MK_EVENT_CUSTOM, mask, conn);
+}
+
+static struct fcgi_conn *fcgi_conn_new(struct fcgi_pool *pool)
+{
+    int fd = -1;
+    int ret;
+    struct fcgi_conn *conn;
+    struct fcgi_server *server = pool->server;
+
+    conn = mk_api->mem_alloc_z(sizeof(struct fcgi_conn));
+    if (!conn) {
+        return NULL;
+    }
+
+    conn->max_requests = server->multiplex;
+    conn->n_slots      = server->multiplex;
+    conn->slots = mk_api->mem_alloc_z(sizeof(struct fcgi_conn_slot) *
+                                      conn->n_slots);
+    if (!conn->slots) {
+        mk_api->mem_free(conn);
+        return NULL;
+    }
+
+    /* Request and async connection to the server */
+    if (server->addr) {
+        fd = mk_api->socket_connect(server->addr, atoi(server->port),
+                                    MK_TRUE);
+    }
+    else if (server->path) {
+        fd = mk_api->socket_open(server->path, MK_TRUE);
+    }
+
+    if (fd == -1) {
+        goto error;
+    }
+
+    conn->fd     = fd;
+    conn->status = FCGI_CONN_CONNECTING;
+    conn->pool   = pool;
+    mk_list_init(&conn->write_queue);
+
+    /* Let the event loop notify us once the connection is ready */
+    MK_EVENT_INIT(&conn->event, fd, conn, cb_fcgi_conn_event);
+    ret = fcgi_conn_events(conn);
+    if (ret == -1) {
+        close(fd);
+        goto error;
+    }
+
+    mk_list_add(&conn->_head, &pool->conns);
+    pool->count++;
+
+    MK_TRACE("[fastcgi=%i] new connection to %s (%i open)",
+             fd, server->name, pool->count);
+    return conn;
+
+ error:
+    mk_api->mem_free(conn->slots);
+    mk_api->mem_free(conn);
+    return NULL;
+}
+
+/*
+ * Stop or resume reading from the server while the client of the handler
+ * has too much data pending. On a multiplexed connection the other
+ * requests wait as well.
+ */
+void fcgi_conn_throttle(struct fcgi_handler *handler, int on)
+{
+    struct fcgi_conn *conn = handler->conn;
+
+    if (!conn || handler->throttled == on) {
+        return;
+    }
+
+    MK_TRACE("[fastcgi=%i] request id=%i %s", conn->fd, handler->request_id,
+             on ? "throttled" : "resumed");
+
+    handler->throttled = on;
+    if (on == MK_TRUE) {
+        conn->throttled++;
+    }
+    else {
+        conn->throttled--;
+    }
+    fcgi_conn_events(conn);
+}
+
+/* Assign a request id on the connection and queue the encoded request */
+static int fcgi_conn_attach(struct fcgi_conn *conn,
+                            struct fcgi_handler *handler)
+{
+    int i;
+    int ret;
+
+    for (i = 0; i < conn->max_requests; i++) {
+        if (conn->slots[i].busy == MK_FALSE) {
+            break;
+        }
+    }
+
+    if (i == conn->max_requests) {
+        return -1;
+    }
+
+    handler->request_id = i + 1;
+    handler->server     = conn->pool->server;
+    ret = fcgi_encode_request(handler);
+    if (ret == -1) {
+        return -1;
+    }
+
+    conn->slots[i].busy    = MK_TRUE;
+    conn->slots[i].handler = handler;
+    conn->busy++;
+
+    handler->conn    = conn;
+    handler->started = MK_FALSE;
+    mk_list_add(&handler->_head, &conn->write_queue);
+
+    /* The request is flushed by the event loop once writable */
+    fcgi_conn_events(conn);
+    return 0;
+}
+
+/* Return a connection with a free request id, if any */
+static struct fcgi_conn *fcgi_pool_conn_available(struct fcgi_pool *pool)
+{
+    struct mk_list *head;
+    struct fcgi_conn *conn;
+
+    mk_list_foreach(head, &pool->conns) {
+        conn = mk_list_entry(head, struct fcgi_conn, _head);
+        if (conn->status != FCGI_CONN_CLOSING &&
+            conn->busy < conn->max_requests) {
+            return conn;
+        }
+    }
+
+    return NULL;
+}
+
+static inline int fcgi_pool_full(struct fcgi_pool *pool)
+{
+    return (pool->server->max_connections > 0 &&
+            pool->count >= pool->server->max_connections);
+}
+
+/*
+ * Send the request over a pooled connection. If every connection is busy
+ * and the pool reached MaxConnections, the handler waits in the pool
+ * queue until a request id is released.
+ */
+int fcgi_pool_dispatch(struct fcgi_pool *pool, struct fcgi_handler *handler)
+{
+    struct fcgi_conn *conn;
+
+    conn = fcgi_pool_conn_available(pool);
+    if (!conn) {
+        if (fcgi_pool_full(pool)) {
+            MK_TRACE("[fastcgi] %s pool full, request queued",
+                     pool->server->name);
+            handler->server = pool->server;
+            handler->queued = MK_TRUE;
+            mk_list_add(&handler->_head, &pool->queue);
+            pool->queued++;
+            return 0;
+        }
+
+        conn = fcgi_conn_new(pool);
+        if (!conn) {
+            fcgi_server_fail(pool->server);
+            return -1;
+        }
+    }
+
+    return fcgi_conn_attach(conn, handler);
+}
+
+/* Dispatch the queued handlers while there are free request ids */
+static void fcgi_pool_drain(struct fcgi_pool *pool)
+{
+    struct fcgi_conn *conn;
+    struct fcgi_handler *handler;
+
+    while (mk_list_is_empty(&pool->queue) != 0) {
+        conn = fcgi_pool_conn_available(pool);
+        if (!conn) {
+            if (fcgi_pool_full(pool)) {
+                return;
+            }
+            conn = fcgi_conn_new(pool);
+        }
+
+        handler = mk_list_entry_first(&pool->queue,
+                                      struct fcgi_handler, _head);
+        mk_list_del(&handler->_head);
+        handler->queued = MK_FALSE;
+        pool->queued--;
+
+        if (conn && fcgi_conn_attach(conn, handler) == 0) {
+            continue;
+        }
+
+        /* The server is unreachable, try another one of the upstream */
+        if (!conn) {
+            fcgi_server_fail(pool->server);
+        }
+        if (fcgi_upstream_dispatch(handler) == -1) {
+            fcgi_error(handler, MK_SERVER_BAD_GATEWAY);
+        }
+    }
+}
+
+/*
+ * A request can be sent again only if the server did not reply at all.
+ * If the connection never got established the request goes to another
+ * server of the upstream. A kept-alive connection may be closed by the
+ * server at any time, so a request sent over a reused connection is
+ * retried once, on the same server if it is still the best choice.
+ */
+static inline int fcgi_conn_retry(struct fcgi_conn *conn,
+                                  struct fcgi_handler *handler)
+{
+    if (handler->write_rounds > 0 || handler->headers_set == MK_TRUE) {
+        return MK_FALSE;
+    }
+
+    if (conn->status == FCGI_CONN_CONNECTING) {
+        return MK_TRUE;
+    }
+
+    if (conn->served == 0 || handler->retries >= FCGI_CONN_RETRIES) {
+        return MK_FALSE;
+    }
+
+    handler->retries++;
+    handler->tried &= ~(1U << conn->pool->server->index);
+    return MK_TRUE;
+}
+
+/* Close the connection, pending requests are retried or aborted */
+static void fcgi_conn_close(struct fcgi_conn *conn)
+{
+    int i;
+    struct fcgi_pool *pool = conn->pool;
+    struct fcgi_handler *handler;
+
+    if (conn->status == FCGI_CONN_CLOSED) {
+        return;
+    }
+
+    MK_TRACE("[fastcgi=%i] close backend connection", conn->fd);
+
+    mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+    close(conn->fd);
+    mk_list_del(&conn->_head);
+    pool->count--;
+
+    if (conn->buf) {
+        fcgi_buf_put(conn->buf);
+        conn->buf = NULL;
+    }
+
+    /*
+     * Passive failure detection: the server refused the connection or
+     * dropped it while serving its first requests. An idle kept-alive
+     * connection closed by the server is not a failure.
+     */
+    if (conn->status == FCGI_CONN_CONNECTING ||
+        (conn->busy > 0 && conn->served == 0)) {
+        fcgi_server_fail(pool->server);
+    }
+
+    for (i = 0; i < conn->n_slots; i++) {
+        handler = conn->slots[i].handler;
+        conn->slots[i].busy    = MK_FALSE;
+        conn->slots[i].handler = NULL;
+        if (!handler) {
+            continue;
+        }
+
+        if (fcgi_handler_pending(handler)) {
+            mk_list_del(&handler->_head);
+        }
+        handler->conn = NULL;
+        handler->throttled = MK_FALSE;
+
+        if (fcgi_conn_retry(conn, handler) == MK_TRUE &&
+            fcgi_upstream_dispatch(handler) == 0) {
+            continue;
+        }
+
+        if (handler->headers_set == MK_TRUE) {
+            /* Truncated response, the client must not keep waiting */
+            handler->hangup = MK_TRUE;
+            fcgi_exit(handler);
+        }
+        else {
+            fcgi_error(handler, MK_SERVER_BAD_GATEWAY);
+        }
+    }
+
+    conn->status = FCGI_CONN_CLOSED;
+    mk_api->mem_free(conn->slots);
+    conn->slots = NULL;
+    mk_api->sched_event_free(&conn->event);
+
+    fcgi_pool_drain(pool);
+}
+
+/*
+ * The handler is going away before the server ended the request (client
+ * hangup or error). A request never sent just releases its id, one fully
+ * sent keeps the id busy until FCGI_END_REQUEST arrives, and a request
+ * partially written leaves the stream unusable.
+ */
+void fcgi_conn_detach(struct fcgi_handler *handler)
+{
+    struct fcgi_conn *conn = handler->conn;
+    struct fcgi_conn_slot *slot;
+
+    if (handler->queued == MK_TRUE) {
+        mk_list_del(&handler->_head);
+        handler->queued = MK_FALSE;
+        fcgi_pool_get(handler->server)->queued--;
+        return;
+    }
+
+    if (!conn) {
+        return;
+    }
+
+    fcgi_conn_throttle(handler, MK_FALSE);
+
+    slot = &conn->slots[handler->request_id - 1];
+    slot->handler = NULL;
+    handler->conn = NULL;
+
+    if (!fcgi_handler_pending(handler)) {
+        return;
+    }
+
+    mk_list_del(&handler->_head);
+    if (handler->started == MK_TRUE) {
+        fcgi_conn_close(conn);
+        return;
+    }
+
+    slot->busy = MK_FALSE;
+    conn->busy--;
+    fcgi_conn_events(conn);
+}
+
+/* Write the pending part of the request: 0 done, 1 try again, -1 error */
+static int fcgi_conn_write(struct fcgi_conn *conn,
+                           struct fcgi_handler *handler)
+{
+    ssize_t n;
+    struct iovec *io;
+    struct mk_iov *iov = handler->iov;
+
+    while (handler->iov_pos < iov->iov_idx) {
+        n = writev(conn->fd, iov->io + handler->iov_pos,
+                   iov->iov_idx - handler->iov_pos);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 1;
+            }
+            return -1;
+        }
+
+        if (n > 0) {
+            handler->started = MK_TRUE;
+        }
+
+        /* Skip the entries fully written */
+        for (; handler->iov_pos < iov->iov_idx; handler->iov_pos++) {
+            io = &iov->io[handler->iov_pos];
+            if ((size_t) n < io->iov_len) {
+                io->iov_base = (char *) io->iov_base + n;
+                io->iov_len -= n;
+                break;
+            }
+            n -= io->iov_len;
+        }
+    }
+
+    return 0;
+}
+
+static int fcgi_conn_flush(struct fcgi_conn *conn)
+{
+    int ret;
+    struct fcgi_handler *handler;
+
+    while (mk_list_is_empty(&conn->write_queue) != 0) {
+        handler = mk_list_entry_first(&conn->write_queue,
+                                      struct fcgi_handler, _head);
+        ret = fcgi_conn_write(conn, handler);
+        if (ret == -1) {
+            return -1;
+        }
+        else if (ret == 1) {
+            break;
+        }
+
+        MK_TRACE("[fastcgi=%i] request id=%i sent",
+                 conn->fd, handler->request_id);
+        mk_list_del(&handler->_head);
+    }
+
+    return fcgi_conn_events(conn);
+}
+
+/* The server ended a request */
+static int fcgi_conn_end_request(struct fcgi_conn *conn,
+                                 struct fcgi_conn_slot *slot, char *body)
+{
+    int status;
+    struct fcgi_handler *handler = slot->handler;
+    struct fcgi_end_request_body *end = (struct fcgi_end_request_body *) body;
+
+    status = end->protocol_status;
+
+    slot->busy    = MK_FALSE;
+    slot->handler = NULL;
+    conn->busy--;
+
+    if (handler) {
+        fcgi_conn_throttle(handler, MK_FALSE);
+        handler->conn = NULL;
+    }
+
+    switch (status) {
+    case FCGI_REQUEST_COMPLETE:
+        conn->served++;
+        fcgi_server_ok(conn->pool->server);
+        if (handler) {
+            fcgi_handler_end(handler);
+        }
+        break;
+    case FCGI_CANT_MPX_CONN:
+        /* The request was not processed, send it alone */
+        conn->max_requests = 1;
+        if (handler && fcgi_pool_dispatch(conn->pool, handler) == -1) {
+            fcgi_error(handler, MK_SERVER_INTERNAL_ERROR);
+        }
+        break;
+    case FCGI_OVERLOADED:
+        /* Not processed either, another server may take it */
+        fcgi_server_fail(conn->pool->server);
+        if (handler && handler->write_rounds == 0 &&
+            handler->headers_set == MK_FALSE &&
+            fcgi_upstream_dispatch(handler) == 0) {
+            break;
+        }
+        if (handler) {
+            fcgi_error(handler, MK_SERVER_SERVICE_UNAV);
+        }
+        break;
+    default:
+        if (handler) {
+            fcgi_error(handler, MK_SERVER_INTERNAL_ERROR);
+        }
+    }
+
+    /* Without FCGI_KEEP_CONN the server closes the connection */
+    if (conn->busy == 0 &&
+        (conn->pool->server->keep_alive == MK_FALSE ||
+         conn->status == FCGI_CONN_CLOSING)) {
+        fcgi_conn_close(conn);
+        return -1;
+    }
+
+    fcgi_pool_drain(conn->pool);
+    return 0;
+}
+
+/* Dispatch a complete record to the request it belongs to */
+static int fcgi_conn_record(struct fcgi_conn *conn,
+                            struct fcgi_record_header *header,
+                            struct fcgi_buf *buf, char *body)
+{
+    int ret;
+    struct fcgi_conn_slot *slot;
+    struct fcgi_handler *handler;
+
+    /* Management records are not used */
+    if (header->request_id == 0) {
+        return 0;
+    }
+
+    if (header->request_id > conn->n_slots ||
+        conn->slots[header->request_id - 1].busy == MK_FALSE) {
+        mk_warn("[fastcgi] unexpected request id %i", header->request_id);
+        fcgi_conn_close(conn);
+        return -1;
+    }
+
+    slot = &conn->slots[header->request_id - 1];
+    handler = slot->handler;
+
+    switch (header->type) {
+    case FCGI_STDOUT:
+        MK_TRACE("[fastcgi=%i] FCGI_STDOUT id=%i content_length=%i",
+                 conn->fd, header->request_id, header->content_length);
+
+        /* An empty record just closes the stream, aborted requests are
+         * drained silently */
+        if (!handler || header->content_length == 0) {
+            break;
+        }
+
+        ret = fcgi_handler_stdout(handler, buf, body,
+                                  header->content_length);
+        if (ret == -1) {
+            fcgi_error(handler, MK_SERVER_INTERNAL_ERROR);
+
+            /* Aborting a request partially sent closes the connection */
+            if (conn->status == FCGI_CONN_CLOSED) {
+                return -1;
+            }
+        }
+        break;
+    case FCGI_STDERR:
+        MK_TRACE("[fastcgi=%i] FCGI_STDERR id=%i content_length=%i",
+                 conn->fd, header->request_id, header->content_length);
+        break;
+    case FCGI_END_REQUEST:
+        MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST id=%i",
+                 conn->fd, header->request_id);
+        if (header->content_length < sizeof(struct fcgi_end_request_body)) {
+            fcgi_conn_close(conn);
+            return -1;
+        }
+        return fcgi_conn_end_request(conn, slot, body);
+    default:
+        mk_warn("[fastcgi] unexpected record type %i", header->type);
+        fcgi_conn_close(conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Make room for the next record. A buffer referenced by the client streams
+ * is never modified: if the partial record left does not fit in the space
+ * after it, it's copied to a new buffer.
+ */
+static int fcgi_conn_buf_next(struct fcgi_conn *conn)
+{
+    size_t left;
+    size_t needed;
+    struct fcgi_buf *buf = conn->buf;
+    struct fcgi_record_header header;
+
+    left = conn->buf_len - conn->buf_off;
+    if (left == 0) {
+        /* Idle connections do not hold a buffer */
+        fcgi_buf_put(buf);
+        conn->buf = NULL;
+        conn->buf_off = 0;
+        conn->buf_len = 0;
+        return 0;
+    }
+
+    if (buf->refs == 1) {
+        if (conn->buf_off > 0) {
+            memmove(buf->data, buf->data + conn->buf_off, left);
+            conn->buf_off = 0;
+            conn->buf_len = left;
+        }
+        return 0;
+    }
+
+    needed = FCGI_RECORD_HEADER_SIZE;
+    if (left >= FCGI_RECORD_HEADER_SIZE) {
+        fcgi_read_header(buf->data + conn->buf_off, &header);
+        needed += header.content_length + header.padding_length;
+    }
+
+    if (conn->buf_off + needed <= FCGI_CONN_BUF_SIZE) {
+        return 0;
+    }
+
+    conn->buf = fcgi_buf_get();
+    if (!conn->buf) {
+        conn->buf = buf;
+        fcgi_conn_close(conn);
+        return -1;
+    }
+
+    memcpy(conn->buf->data, buf->data + conn->buf_off, left);
+    fcgi_buf_put(buf);
+    conn->buf_off = 0;
+    conn->buf_len = left;
+
+    return 0;
+}
+
+static int fcgi_conn_read(struct fcgi_conn *conn)
+{
+    int ret;
+    ssize_t n;
+    size_t size;
+    struct fcgi_buf *buf;
+    struct fcgi_record_header header;
+
+    if (!conn->buf) {
+        conn->buf = fcgi_buf_get();
+        if (!conn->buf) {
+            fcgi_conn_close(conn);
+            return -1;
+        }
+    }
+    buf = conn->buf;
+
+    n = read(conn->fd, buf->data + conn->buf_len,
+             FCGI_CONN_BUF_SIZE - conn->buf_len);
+    MK_TRACE("[fastcgi=%i] read=%zi", conn->fd, n);
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        fcgi_conn_close(conn);
+        return -1;
+    }
+    else if (n == 0) {
+        fcgi_conn_close(conn);
+        return -1;
+    }
+    conn->buf_len += n;
+
+    while (conn->buf_len - conn->buf_off >= FCGI_RECORD_HEADER_SIZE) {
+        fcgi_read_header(buf->data + conn->buf_off, &header);
+
+        size = FCGI_RECORD_HEADER_SIZE +
+            header.content_length + header.padding_length;
+        if (conn->buf_len - conn->buf_off < size) {
+            /* we need more data */
+            break;
+        }
+
+        ret = fcgi_conn_record(conn, &header, buf,
+                               buf->data + conn->buf_off +
+                               FCGI_RECORD_HEADER_SIZE);
+        if (ret == -1) {
+            /* the connection was closed */
+            return -1;
+        }
+        conn->buf_off += size;
+    }
+
+    return fcgi_conn_buf_next(conn);
+}
+
+/* Callback: backend connection events */
+static int cb_fcgi_conn_event(void *data)
+{
+    int ret;
+    int s_err;
+    socklen_t s_len = sizeof(s_err);
+    struct fcgi_conn *conn = data;
+
+    if (conn->status == FCGI_CONN_CONNECTING) {
+        /* We connect in async mode, check if the connection was OK */
+        ret = getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len);
+        if (ret == -1 || s_err) {
+            /* FastCGI server unavailable */
+            MK_TRACE("[fastcgi=%i] connection failed", conn->fd);
+            fcgi_conn_close(conn);
+            return 0;
+        }
+        conn->status = FCGI_CONN_READY;
+    }
+
+    if (mk_list_is_empty(&conn->write_queue) != 0) {
+        ret = fcgi_conn_flush(conn);
+        if (ret == -1) {
+            fcgi_conn_close(conn);
+            return 0;
+        }
+    }
+
+    /*
+     * While throttled the reads are not registered, this is a write (or
+     * error) event: leave the responses in the socket so the server
+     * feels the slow client too. Once resumed, the read event fires for
+     * the data already waiting.
+     */
+    if (conn->throttled > 0) {
+        if (mk_list_is_empty(&conn->write_queue) != 0) {
+            return 0;
+        }
+
+        /*
+         * Nothing to write: the loop reports a hangup or an error, and
+         * keeps reporting it while the fd stays registered. An error
+         * closes the connection, after a hangup the responses already
+         * received are still readable, so the fd just leaves the loop
+         * until fcgi_conn_events() registers it again.
+         */
+        ret = getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len);
+        if (ret == -1 || s_err) {
+            fcgi_conn_close(conn);
+            return 0;
+        }
+        mk_api->ev_del(mk_api->sched_loop(), &conn->event);
+        return 0;
+    }
+
+    fcgi_conn_read(conn);
+    return 0;
+}
@@ -0,0 +1,117 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_CONN_H
+#define MK_FASTCGI_CONN_H
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+
+/*
+ * Backend connections
+ * ===================
+ * Every worker keeps a pool of connections to each FastCGI server. When
+ * KeepAlive is enabled the requests are sent with FCGI_KEEP_CONN, so the
+ * server leaves the connection open once the request ends and the next
+ * request reuses it. If Multiplex is greater than one, the connection
+ * carries that many concurrent requests, each one with its own request
+ * id.
+ *
+ * Records are read into reference counted buffers. The content of the
+ * FCGI_STDOUT records is not copied, the client channel points to the
+ * receive buffer until the data is written, then the buffer goes back to
+ * the worker free list. If a client cannot keep up, the connection stops
+ * reading from the server until the pending data drops below the low
+ * watermark.
+ */
+
+/* A record may carry up to 255 bytes of padding */
+#define FCGI_CONN_BUF_SIZE       (FCGI_BUF_SIZE + 256)
+
+/* Receive buffers kept by every worker for reuse */
+#define FCGI_BUF_POOL            16
+
+/* Response bytes queued on the client channel */
+#define FCGI_PENDING_HIGH        (256 * 1024)  /* stop reading the server */
+#define FCGI_PENDING_LOW         (64 * 1024)   /* resume reading          */
+
+/* A request sent over a reused connection is retried once */
+#define FCGI_CONN_RETRIES        1
+
+#define FCGI_CONN_CONNECTING     0   /* async connect in progress       */
+#define FCGI_CONN_READY          1   /* connected                       */
+#define FCGI_CONN_CLOSING        2   /* no new requests, close when idle */
+#define FCGI_CONN_CLOSED         3   /* released by the event loop      */
+
+/* Receive buffer, shared by the connection and the client streams */
+struct fcgi_buf {
+    int refs;
+    struct mk_list _head;
+    char data[FCGI_CONN_BUF_SIZE];
+};
+
+/* Request id slot, it stays busy until the server ends the request */
+struct fcgi_conn_slot {
+    int busy;
+    struct fcgi_handler *handler;
+};
+
+struct fcgi_conn {
+    struct mk_event event;           /* built-in event-loop data      */
+
+    int fd;
+    int status;
+    int busy;                        /* request ids in use            */
+    int max_requests;                /* concurrent requests allowed   */
+    int throttled;                   /* handlers waiting for a client */
+    int n_slots;                     /* request ids allocated         */
+    uint64_t served;                 /* requests completed            */
+
+    struct fcgi_conn_slot *slots;    /* indexed by request id - 1     */
+    struct mk_list write_queue;      /* handlers being sent           */
+
+    struct fcgi_buf *buf;            /* receive buffer                */
+    unsigned int buf_off;            /* first byte not yet parsed     */
+    unsigned int buf_len;
+
+    struct fcgi_pool *pool;
+    struct mk_list _head;
+};
+
+/* Per worker pool of connections to a server */
+struct fcgi_pool {
+    int count;                       /* open connections              */
+    int queued;                      /* handlers in the wait queue    */
+    struct fcgi_server *server;
+    struct mk_list conns;
+    struct mk_list queue;            /* handlers waiting for a slot   */
+};
+
+int fcgi_pool_init(struct fcgi_pool *pool, struct fcgi_server *server);
+int fcgi_pool_outstanding(struct fcgi_pool *pool);
+int fcgi_pool_dispatch(struct fcgi_pool *pool, struct fcgi_handler *handler);
+void fcgi_conn_detach(struct fcgi_handler *handler);
+void fcgi_conn_throttle(struct fcgi_handler *handler, int on);
+
+struct fcgi_buf *fcgi_buf_get();
+void fcgi_buf_put(struct fcgi_buf *buf);
+
+#endif
@@ -21,6 +21,8 @@
 
 #include "fastcgi.h"
 #include "fcgi_handler.h"
+#include "fcgi_conn.h"
+#include "fcgi_upstream.h"
 
 #define FCGI_BUF(h)           (char *) h->buf_data + h->buf_len
 #define FCGI_PARAM_DYN(str)   str, strlen(str), MK_FALSE
@@ -28,6 +30,9 @@
 #define FCGI_PARAM_PTR(ptr)   ptr.data, ptr.len, MK_FALSE
 #define FCGI_PARAM_DUP(str)   strdup(str), strlen(str), MK_TRUE
 
+/* iov entries for the fixed params, each HTTP header takes three more */
+#define FCGI_IOV_BASE         64
+
 static inline void fcgi_build_header(struct fcgi_record_header *rec,
                                      uint8_t type, uint16_t request_id,
                                      uint16_t content_length)
@@ -40,10 +45,11 @@ static inline void fcgi_build_header(struct fcgi_record_header *rec,
     rec->reserved        = 0;
 }
 
-static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body)
+static inline void fcgi_build_request_body(struct fcgi_begin_request_body *body,
+                                           int keep_alive)
 {
     fcgi_encode16(&body->role, FCGI_RESPONDER);
-    body->flags       = 0;
+    body->flags       = keep_alive == MK_TRUE ? FCGI_KEEP_CONN : 0;
     memset(body->reserved, '\0', sizeof(body->reserved));
 }
 
@@ -67,7 +73,8 @@ static inline int fcgi_add_param_empty(struct fcgi_handler *handler)
     char *p;
 
     p = FCGI_BUF(handler);
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, 0);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      handler->request_id, 0);
     mk_api->iov_add(handler->iov, p,
                     sizeof(struct fcgi_record_header), MK_FALSE);
     handler->buf_len += sizeof(struct fcgi_record_header);
@@ -89,7 +96,8 @@ static inline int fcgi_add_param(struct fcgi_handler *handler,
 	len += key_len > 127 ? 4 : 1;
 	len += val_len > 127 ? 4 : 1;
 
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS, 1, len);
+    fcgi_build_header((struct fcgi_record_header *) p, FCGI_PARAMS,
+                      handler->request_id, len);
     p += sizeof(struct fcgi_record_header);
 
     p += fcgi_write_length(p, key_len);
@@ -150,8 +158,12 @@ static inline int fcgi_add_param_http_header(struct fcgi_handler *handler,
 static inline int fcgi_add_param_net(struct fcgi_handler *handler)
 {
     int ret;
+    int port;
     const char *p;
+    char *ip;
     char buffer[256];
+    unsigned long len;
+    union mk_socket_addr *peer;
 	struct sockaddr_in addr;
 	socklen_t addr_len = sizeof(struct sockaddr_in);
 
@@ -185,15 +197,11 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
                    FCGI_PARAM_DUP(buffer));
 
 
-    ret = getpeername(handler->cs->socket, (struct sockaddr *)&addr, &addr_len);
+    /* The remote address was captured when the connection was accepted */
+    peer = &handler->cs->conn->peer;
+    ip = buffer;
+    ret = mk_api->socket_addr_str(peer, &ip, sizeof(buffer), &len);
     if (ret == -1) {
-        perror("getpeername");
-        return -1;
-    }
-
-    p = inet_ntop(AF_INET, &addr.sin_addr, buffer, sizeof(buffer));
-    if (!p) {
-        perror("inet_ntop");
         return -1;
     }
 
@@ -203,7 +211,13 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
                    FCGI_PARAM_DUP(buffer));
 
     /* Remote Port */
-    snprintf(buffer, 256, "%d", ntohs(addr.sin_port));
+    if (peer->sa.sa_family == AF_INET6) {
+        port = ntohs(peer->in6.sin6_port);
+    }
+    else {
+        port = ntohs(peer->in4.sin_port);
+    }
+    snprintf(buffer, 256, "%d", port);
     fcgi_add_param(handler,
                    FCGI_PARAM_CONST("REMOTE_PORT"),
                    FCGI_PARAM_DUP(buffer));
@@ -211,37 +225,58 @@ static inline int fcgi_add_param_net(struct fcgi_handler *handler)
     return 0;
 }
 
+/* The body is split in records, an empty record ends the stream */
 static inline int fcgi_add_stdin(struct fcgi_handler *handler)
 {
     char *p;
+    size_t len;
+    size_t offset = 0;
 
-    p = FCGI_BUF(handler);
-    fcgi_build_header((struct fcgi_record_header *) p, FCGI_STDIN, 1,
-                      handler->sr->data.len);
-    mk_api->iov_add(handler->iov, p, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
-    handler->buf_len += FCGI_RECORD_HEADER_SIZE;
-
+    do {
+        len = handler->sr->data.len - offset;
+        if (len > FCGI_RECORD_MAX_SIZE) {
+            len = FCGI_RECORD_MAX_SIZE;
+        }
 
-    if (handler->sr->data.len > 0) {
-        mk_api->iov_add(handler->iov,
-                        handler->sr->data.data,
-                        handler->sr->data.len,
-                        MK_FALSE);
-    }
+        p = FCGI_BUF(handler);
+        fcgi_build_header((struct fcgi_record_header *) p, FCGI_STDIN,
+                          handler->request_id, len);
+        mk_api->iov_add(handler->iov, p, FCGI_RECORD_HEADER_SIZE, MK_FALSE);
+        handler->buf_len += FCGI_RECORD_HEADER_SIZE;
+
+        if (len > 0) {
+            mk_api->iov_add(handler->iov,
+                            handler->sr->data.data + offset,
+                            len,
+                            MK_FALSE);
+            offset += len;
+        }
+    } while (len > 0);
 
     return 0;
 }
 
-static int fcgi_encode_request(struct fcgi_handler *handler)
+/*
+ * Convert the original request to FCGI format using the request id
+ * assigned by the connection. A request sent again is encoded from
+ * scratch, the id may be different.
+ */
+int fcgi_encode_request(struct fcgi_handler *handler)
 {
     int ret;
     struct fcgi_begin_request_record *request;
 
+    mk_api->iov_free_marked(handler->iov);
+    handler->iov_pos = 0;
+
+    /* Params buffer set an offset to include the header */
+    handler->buf_len = FCGI_RECORD_HEADER_SIZE;
+
     request = &handler->header_request;
-    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST, 1,
-                      FCGI_BEGIN_REQUEST_BODY_SIZE);
+    fcgi_build_header(&request->header, FCGI_BEGIN_REQUEST,
+                      handler->request_id, FCGI_BEGIN_REQUEST_BODY_SIZE);
 
-    fcgi_build_request_body(&request->body);
+    fcgi_build_request_body(&request->body, handler->server->keep_alive);
 
     /* BEGIN_REQUEST */
     mk_api->iov_add(handler->iov,
@@ -254,12 +289,21 @@ static int fcgi_encode_request(struct fcgi_handler *handler)
                    FCGI_PARAM_CONST("SERVER_SOFTWARE"),
                    FCGI_PARAM_DYN(mk_api->config->server_signature));
 
-    /* Server Name */
-    fcgi_add_param(handler,
-                   FCGI_PARAM_CONST("SERVER_NAME"),
-                   handler->sr->host_alias->name,
-                   handler->sr->host_alias->len,
-                   MK_FALSE);
+    /* Server Name, the requested one if the host only has patterns */
+    if (handler->sr->host_alias->name[0] == '*' && handler->sr->host.data) {
+        fcgi_add_param(handler,
+                       FCGI_PARAM_CONST("SERVER_NAME"),
+                       handler->sr->host.data,
+                       handler->sr->host.len,
+                       MK_FALSE);
+    }
+    else {
+        fcgi_add_param(handler,
+                       FCGI_PARAM_CONST("SERVER_NAME"),
+                       handler->sr->host_alias->name,
+                       handler->sr->host_alias->len,
+                       MK_FALSE);
+    }
 
     /* Document Root */
     fcgi_add_param(handler,
@@ -333,19 +377,6 @@ size_t fcgi_read_header(void *p, struct fcgi_record_header *h)
 	return sizeof(*h);
 }
 
-static inline int fcgi_buffer_consume(struct fcgi_handler *handler, size_t bytes)
-{
-    if (bytes >= handler->buf_len) {
-        handler->buf_len = 0;
-        return 0;
-    }
-
-    memmove(handler->buf_data, handler->buf_data + bytes,
-            handler->buf_len - bytes);
-    handler->buf_len -= bytes;
-    return 0;
-}
-
 static char *getearliestbreak(const char buf[], const unsigned bufsize,
                               unsigned char * const advance)
 {
@@ -374,303 +405,322 @@ static char *getearliestbreak(const char buf[], const unsigned bufsize,
     return crend;
 }
 
-static int fcgi_write(struct fcgi_handler *handler, char *buf, size_t len)
+/*
+ * Response data queued on the client channel. The data is not copied, it
+ * points to the receive buffer of the backend connection unless the chunk
+ * carries its own copy right after the structure.
+ */
+struct fcgi_chunk {
+    struct mk_iov iov;
+    struct iovec io[3];                /* size line, data and CRLF      */
+    char size_line[16];
+    struct fcgi_buf *buf;              /* referenced receive buffer     */
+    struct fcgi_handler *handler;      /* NULL once the handler is gone */
+    struct mk_list _head;
+};
+
+static void fcgi_chunk_release(struct fcgi_chunk *chunk)
 {
-    mk_stream_set(NULL,
-                  MK_STREAM_COPYBUF,
-                  handler->cs->channel,
-                  buf, len,
-                  NULL, NULL, NULL, NULL);
-
-    if (handler->headers_set == MK_TRUE) {
-        mk_stream_set(NULL,
-                      MK_STREAM_COPYBUF,
-                      handler->cs->channel,
-                      "\r\n", 2,
-                      NULL, NULL, NULL, NULL);
+    if (chunk->handler) {
+        mk_list_del(&chunk->_head);
     }
-    return 0;
+    if (chunk->buf) {
+        fcgi_buf_put(chunk->buf);
+    }
+    mk_api->mem_free(chunk);
 }
 
-int fcgi_exit(struct fcgi_handler *handler)
+/* Callback: the client received part of the chunk */
+static void cb_chunk_consumed(struct mk_stream *stream, long bytes)
 {
-    if (handler->iov) {
-        if (handler->server_fd > 0) {
-            mk_api->ev_del(mk_api->sched_loop(), &handler->event);
-            close(handler->server_fd);
-            handler->server_fd = -1;
-        }
+    struct fcgi_chunk *chunk = stream->data;
+    struct fcgi_handler *handler = chunk->handler;
 
-        mk_api->iov_free(handler->iov);
-        mk_api->sched_event_free((struct mk_event *) handler);
-        handler->iov = NULL;
+    if (!handler) {
+        return;
     }
 
-    if (handler->active == MK_TRUE) {
-        mk_api->http_request_end(handler->cs, handler->hangup);
+    handler->pending -= bytes;
+    if (handler->throttled == MK_TRUE &&
+        handler->pending < FCGI_PENDING_LOW) {
+        fcgi_conn_throttle(handler, MK_FALSE);
     }
+}
 
-    return 0;
+static void cb_chunk_finished(struct mk_stream *stream)
+{
+    fcgi_chunk_release(stream->data);
 }
 
-int fcgi_error(struct fcgi_handler *handler)
+/* Callback: the client connection is gone */
+static void cb_chunk_exception(struct mk_stream *stream, int err)
 {
-    fcgi_exit(handler);
-    mk_api->http_request_error(500, handler->cs, handler->sr);
-    return 0;
+    struct fcgi_chunk *chunk = stream->data;
+
+    (void) err;
+
+    if (chunk->handler) {
+        chunk->handler->pending -= stream->bytes_total;
+    }
+    fcgi_chunk_release(chunk);
 }
 
-static int fcgi_response(struct fcgi_handler *handler, char *buf, size_t len)
+/* Queue response data on the client channel, if buf is NULL it's copied */
+static int fcgi_send(struct fcgi_handler *handler, struct fcgi_buf *buf,
+                     char *data, size_t len)
 {
-    int status;
-    int diff;
+    int n = 0;
     int xlen;
-    char tmp[16];
-    char *p;
-    char *end;
-    size_t p_len;
-    unsigned char advance;
+    size_t size = sizeof(struct fcgi_chunk);
+    struct fcgi_chunk *chunk;
 
-    MK_TRACE("[fastcgi=%i] process response len=%lu",
-             handler->server_fd, len);
+    if (!buf) {
+        size += len;
+    }
 
-    p = buf;
-    p_len = len;
+    chunk = mk_api->mem_alloc(size);
+    if (!chunk) {
+        return -1;
+    }
 
-    if (len == 0 && handler->chunked && handler->headers_set == MK_TRUE) {
-        MK_TRACE("[fastcgi=%i] sending EOF", handler->server_fd);
-        mk_stream_set(NULL,
-                      MK_STREAM_COPYBUF,
-                      handler->cs->channel,
-                      "0\r\n\r\n", 5,
-                      handler,
-                      NULL /*cb_fcgi_eof*/, NULL, NULL);
-        mk_api->channel_flush(handler->cs->channel);
-        return 0;
+    if (buf) {
+        buf->refs++;
     }
+    else {
+        memcpy(chunk + 1, data, len);
+        data = (char *) (chunk + 1);
+    }
+    chunk->buf = buf;
+    chunk->handler = handler;
+    chunk->iov.total_len = len;
 
-    if (handler->headers_set == MK_FALSE) {
-        advance = 4;
-        end = getearliestbreak(buf, len, &advance);
-        if (!end) {
-            /* we need more data */
-            return -1;
-        }
+    if (handler->chunked == MK_TRUE) {
+        xlen = snprintf(chunk->size_line, sizeof(chunk->size_line),
+                        "%x\r\n", (unsigned int) len);
+        chunk->io[n].iov_base = chunk->size_line;
+        chunk->io[n].iov_len  = xlen;
+        chunk->iov.total_len += xlen + 2;
+        n++;
+    }
 
-        handler->sr->headers.cgi = MK_TRUE;
-        if (strncasecmp(buf, "Status: ", 8) == 0) {
-            sscanf(buf + 8, "%d", &status);
-            mk_api->header_set_http_status(handler->sr, status);
-        }
-        else {
-            mk_api->header_set_http_status(handler->sr, 200);
+    chunk->io[n].iov_base = data;
+    chunk->io[n].iov_len  = len;
+    n++;
+
+    if (handler->chunked == MK_TRUE) {
+        chunk->io[n].iov_base = (char *) "\r\n";
+        chunk->io[n].iov_len  = 2;
+        n++;
+    }
+
+    chunk->iov.io          = chunk->io;
+    chunk->iov.iov_idx     = n;
+    chunk->iov.buf_idx     = 0;
+    chunk->iov.size        = n;
+    chunk->iov.buf_to_free = NULL;
+
+    mk_list_add(&chunk->_head, &handler->chunks);
+    handler->pending += chunk->iov.total_len;
+
+    mk_stream_set(NULL,
+                  MK_STREAM_IOV,
+                  handler->cs->channel,
+                  &chunk->iov, chunk->iov.total_len,
+                  chunk,
+                  cb_chunk_finished,
+                  cb_chunk_consumed,
+                  cb_chunk_exception);
+    return 0;
+}
+
+/*
+ * Release the handler. If the HTTP request is still active it's finished,
+ * the handler memory is released once the event loop round ends.
+ */
+int fcgi_exit(struct fcgi_handler *handler)
+{
+    struct mk_list *tmp;
+    struct mk_list *head;
+    struct fcgi_chunk *chunk;
+
+    if (handler->iov) {
+        fcgi_conn_detach(handler);
+
+        /* Queued chunks are released by the channel */
+        mk_list_foreach_safe(head, tmp, &handler->chunks) {
+            chunk = mk_list_entry(head, struct fcgi_chunk, _head);
+            mk_list_del(&chunk->_head);
+            chunk->handler = NULL;
         }
 
-        /* Set transfer encoding */
-        if (handler->sr->protocol >= MK_HTTP_PROTOCOL_11 &&
-            (handler->sr->headers.status < MK_REDIR_MULTIPLE ||
-             handler->sr->headers.status > MK_REDIR_USE_PROXY)) {
-            handler->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
-            handler->chunked = MK_TRUE;
+        if (handler->headers) {
+            mk_api->mem_free(handler->headers);
+            handler->headers = NULL;
         }
 
-        mk_api->header_prepare(handler->cs, handler->sr);
+        mk_api->iov_free(handler->iov);
+        mk_api->sched_event_free((struct mk_event *) handler);
+        handler->iov = NULL;
+    }
 
-        diff = (end - buf) + advance;
-        fcgi_write(handler, buf, diff);
+    if (handler->active == MK_TRUE) {
+        handler->active = MK_FALSE;
+        handler->sr->handler_data = NULL;
+        mk_api->http_request_end(handler->cs, handler->hangup);
+    }
 
-        p = buf + diff;
-        p_len -= diff;
-        handler->write_rounds++;
-        handler->headers_set = MK_TRUE;
+    return 0;
+}
+
+int fcgi_error(struct fcgi_handler *handler, int status)
+{
+    if (handler->active == MK_TRUE) {
+        if (handler->headers_set == MK_FALSE) {
+            mk_api->http_request_error(status, handler->cs, handler->sr);
+            mk_api->channel_flush(handler->cs->channel);
+        }
+        else {
+            /* The response was truncated */
+            handler->hangup = MK_TRUE;
+        }
+    }
+
+    return fcgi_exit(handler);
+}
+
+/* The server ended the request: finish the response */
+int fcgi_handler_end(struct fcgi_handler *handler)
+{
+    if (handler->headers_set == MK_FALSE) {
+        return fcgi_error(handler, MK_SERVER_INTERNAL_ERROR);
     }
 
-    if (p_len > 0) {
-        xlen = snprintf(tmp, 16, "%x\r\n", (unsigned int) p_len);
+    if (handler->chunked) {
+        MK_TRACE("[fastcgi=%i] sending EOF", handler->cs->socket);
         mk_stream_set(NULL,
                       MK_STREAM_COPYBUF,
                       handler->cs->channel,
-                      tmp, xlen,
-                      NULL, NULL, NULL, NULL);
-        fcgi_write(handler, p, p_len);
+                      "0\r\n\r\n", 5,
+                      handler,
+                      NULL, NULL, NULL);
     }
+    mk_api->channel_flush(handler->cs->channel);
 
-    return 0;
+    return fcgi_exit(handler);
 }
 
-int cb_fastcgi_on_read(void *data)
+/* Set the response status and queue the HTTP headers */
+static void fcgi_handler_headers(struct fcgi_handler *handler,
+                                 char *buf, size_t len)
 {
-    int n;
-    int ret = 0;
-    int avail;
-    char *body;
-    size_t offset;
-    struct fcgi_handler *handler = data;
-    struct fcgi_record_header header;
-
-    if (handler->active == MK_FALSE) {
-        fcgi_exit(handler);
-        return -1;
-    }
+    int status;
 
-    avail = FCGI_BUF_SIZE - handler->buf_len;
-    n = read(handler->server_fd, handler->buf_data + handler->buf_len, avail);
-    MK_TRACE("[fastcgi=%i] read=%i", handler->server_fd, n);
-    if (n <= 0) {
-        fcgi_exit(handler);
-        return -1;
+    handler->sr->headers.cgi = MK_TRUE;
+    if (strncasecmp(buf, "Status: ", 8) == 0) {
+        sscanf(buf + 8, "%d", &status);
+        mk_api->header_set_http_status(handler->sr, status);
     }
     else {
-        handler->buf_len += n;
+        mk_api->header_set_http_status(handler->sr, 200);
     }
 
-    if ((unsigned) handler->buf_len < FCGI_RECORD_HEADER_SIZE) {
-        /* wait for more data */
-        return n;
+    /* Set transfer encoding */
+    if (handler->sr->protocol >= MK_HTTP_PROTOCOL_11 &&
+        (handler->sr->headers.status < MK_REDIR_MULTIPLE ||
+         handler->sr->headers.status > MK_REDIR_USE_PROXY)) {
+        handler->sr->headers.transfer_encoding = MK_HEADER_TE_TYPE_CHUNKED;
+        handler->chunked = MK_TRUE;
     }
 
-    while (1) {
-        /* decode the header */
-        fcgi_read_header(&handler->buf_data, &header);
-
-        if (header.type != FCGI_STDOUT && header.type != FCGI_STDERR &&
-            header.type != FCGI_END_REQUEST) {
-            fcgi_exit(handler);
-            return -1;
-        }
-
-        /* Check if the package is complete */
-        if (handler->buf_len < (FCGI_RECORD_HEADER_SIZE + header.content_length)) {
-            /* we need more data */
-            return n;
-        }
-
-        body = handler->buf_data + FCGI_RECORD_HEADER_SIZE;
-        switch (header.type) {
-        case FCGI_STDOUT:
-            MK_TRACE("[fastcgi=%i] FCGI_STDOUT content_length=%i",
-                     handler->server_fd, header.content_length);
-            ret = fcgi_response(handler, body, header.content_length);
-            break;
-        case FCGI_STDERR:
-            MK_TRACE("[fastcgi=%i] FCGI_STDERR content_length=%i",
-                     handler->server_fd, header.content_length);
-            break;
-        case FCGI_END_REQUEST:
-            MK_TRACE("[fastcgi=%i] FCGI_END_REQUEST content_length=%i",
-                     handler->server_fd, header.content_length);
-            ret = fcgi_response(handler, NULL, 0);
-        default:
-            //fcgi_exit(handler);
-            return -1;
-        }
-
-        if (ret == -1) {
-            /* Missing header breaklines ? */
-            return n;
-        }
-
-        mk_api->channel_flush(handler->cs->channel);
+    mk_api->header_prepare(handler->cs, handler->sr);
 
-        /* adjust buffer content */
-        offset = FCGI_RECORD_HEADER_SIZE +
-            header.content_length + header.padding_length;
+    /* The CGI headers complete the response headers */
+    mk_stream_set(NULL,
+                  MK_STREAM_COPYBUF,
+                  handler->cs->channel,
+                  buf, len,
+                  NULL, NULL, NULL, NULL);
 
-        fcgi_buffer_consume(handler, offset);
-    }
-    return n;
+    handler->write_rounds++;
+    handler->headers_set = MK_TRUE;
 }
 
-void cb_fastcgi_request_flush(void *data)
+/*
+ * Process the content of a FCGI_STDOUT record, the body is relayed to the
+ * client straight from the receive buffer.
+ */
+int fcgi_handler_stdout(struct fcgi_handler *handler, struct fcgi_buf *buf,
+                        char *data, size_t len)
 {
     int ret;
-    size_t count = 0;
-    struct fcgi_handler *handler = data;
-
-    ret = mk_api->channel_write(&handler->fcgi_channel, &count);
+    char *end;
+    size_t diff;
+    unsigned char advance;
 
-    MK_TRACE("[fastcgi=%i] %lu bytes, ret=%i",
-                 handler->server_fd, count, ret);
+    MK_TRACE("[fastcgi=%i] process response len=%lu",
+             handler->cs->socket, len);
 
-    if (ret == MK_CHANNEL_DONE || ret == MK_CHANNEL_EMPTY) {
-        /* Request done, switch the event side to receive the FCGI response */
-        handler->buf_len = 0;
-        handler->event.handler = cb_fastcgi_on_read;
-        ret = mk_api->ev_add(mk_api->sched_loop(),
-                             handler->server_fd,
-                             MK_EVENT_CUSTOM, MK_EVENT_READ, handler);
-        if (ret == -1) {
-            goto error;
+    if (handler->headers_set == MK_FALSE) {
+        /* The headers started in a previous record */
+        if (handler->headers) {
+            if (handler->headers_len + len > FCGI_HEADERS_MAX) {
+                return -1;
+            }
+            memcpy(handler->headers + handler->headers_len, data, len);
+            handler->headers_len += len;
+
+            data = handler->headers;
+            len  = handler->headers_len;
+            buf  = NULL;
         }
-    }
-    else if (ret == MK_CHANNEL_ERROR) {
-        fcgi_exit(handler);
-    }
-
- error:
-    return;
-}
 
-/* Callback: on connect to the backend server */
-int cb_fastcgi_on_connect(void *data)
-{
-    int ret;
-    int s_err;
-    size_t count;
-    socklen_t s_len = sizeof(s_err);
-    struct fcgi_handler *handler = data;
-    struct mk_channel *channel;
-
-    if (handler->active == MK_FALSE) {
-        printf("disabled???\n");
-        return -1;
-    }
+        advance = 4;
+        end = getearliestbreak(data, len, &advance);
+        if (!end) {
+            /* Keep what we have until the rest of the headers arrive */
+            if (!handler->headers) {
+                handler->headers = mk_api->mem_alloc(FCGI_HEADERS_MAX);
+                if (!handler->headers) {
+                    return -1;
+                }
+                memcpy(handler->headers, data, len);
+                handler->headers_len = len;
+            }
+            return 0;
+        }
 
-    /* We connect in async mode, we need to check if the connection was OK */
-    ret = getsockopt(handler->server_fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len);
-    if (ret == -1) {
-        goto error;
+        diff = (end - data) + advance;
+        fcgi_handler_headers(handler, data, diff);
+        data += diff;
+        len  -= diff;
     }
 
-    if (s_err) {
-        /* FastCGI server unavailable */
-        goto error;
+    if (len > 0) {
+        ret = fcgi_send(handler, buf, data, len);
+        if (ret == -1) {
+            return -1;
+        }
+        handler->write_rounds++;
     }
 
-    /* Convert the original request to FCGI format */
-    ret = fcgi_encode_request(handler);
-    if (ret == -1) {
-        goto error;
+    if (handler->headers) {
+        mk_api->mem_free(handler->headers);
+        handler->headers = NULL;
     }
 
-    /* Prepare the channel */
-    channel = &handler->fcgi_channel;
-    channel->type = MK_CHANNEL_SOCKET;
-    channel->fd   = handler->server_fd;
-
-    /* FIXME: Need to specify the channel type, raw ? */
-    channel->io   = handler->cs->conn->net;
-    mk_list_init(&channel->streams);
+    mk_api->channel_flush(handler->cs->channel);
 
-    mk_api->stream_set(&handler->fcgi_stream,
-                       MK_STREAM_IOV,
-                       &handler->fcgi_channel,
-                       handler->iov,
-                       -1,
-                       handler,
-                       NULL, NULL, NULL);
-
-    cb_fastcgi_request_flush(handler);
-    return 0;
+    /* Do not read more from the server than the client can take */
+    if (handler->pending > FCGI_PENDING_HIGH) {
+        fcgi_conn_throttle(handler, MK_TRUE);
+    }
 
- error:
-    fcgi_error(handler);
-    mk_api->channel_write(handler->cs->channel, &count);
     return 0;
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
-                                      struct mk_http_request *sr)
+                                      struct mk_http_request *sr,
+                                      struct fcgi_upstream *upstream)
 {
     int ret;
     int entries;
@@ -683,13 +733,19 @@ struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
     }
     h->cs = cs;
     h->sr = sr;
+    h->upstream = upstream;
     h->write_rounds = 0;
     h->active = MK_TRUE;
-    h->server_fd = -1;
+    mk_list_init(&h->chunks);
 
     /* Allocate enough space for our data */
-    entries =  40 + (cs->parser.header_count * 3);
+    entries  = FCGI_IOV_BASE + (cs->parser.header_count * 3);
+    entries += 2 * (sr->data.len / FCGI_RECORD_MAX_SIZE + 1);
     h->iov = mk_api->iov_create(entries, 0);
+    if (!h->iov) {
+        mk_api->mem_free(h);
+        return NULL;
+    }
 
     /* Associate the handler with the Session Request */
     sr->handler_data = h;
@@ -701,43 +757,18 @@ struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
         h->hangup = MK_TRUE;
     }
 
-    /* Params buffer set an offset to include the header */
-    h->buf_len = FCGI_RECORD_HEADER_SIZE;
-
-    /* Request and async connection to the server */
-    if (fcgi_conf.server_addr) {
-        h->server_fd = mk_api->socket_connect(fcgi_conf.server_addr,
-                                              atoi(fcgi_conf.server_port),
-                                              MK_TRUE);
-    }
-    else if (fcgi_conf.server_path) {
-        h->server_fd = mk_api->socket_open(fcgi_conf.server_path, MK_TRUE);
-    }
-
-    if (h->server_fd == -1) {
-        goto error;
-    }
-
-    /* Prepare the built-in event structure */
-    MK_EVENT_INIT(&h->event, h->server_fd, h, cb_fastcgi_on_connect);
-
-    /*
-     * Let the event loop notify us when we can flush data to
-     * the FastCGI server.
-     */
-    ret = mk_api->ev_add(mk_api->sched_loop(),
-                         h->server_fd,
-                         MK_EVENT_CUSTOM, MK_EVENT_WRITE, h);
+    /* Pick a server and send the request through a pooled connection */
+    ret = fcgi_upstream_dispatch(h);
     if (ret == -1) {
-        close(h->server_fd);
         goto error;
     }
 
     return h;
 
  error:
+    sr->handler_data = NULL;
     mk_api->iov_free(h->iov);
     mk_api->mem_free(h);
-    mk_api->http_request_error(500, cs, sr);
+    mk_api->header_set_http_status(sr, MK_SERVER_BAD_GATEWAY);
     return NULL;
 }
@@ -48,6 +48,12 @@ struct fcgi_begin_request_record {
     struct fcgi_begin_request_body body;
 };
 
+struct fcgi_end_request_body {
+    uint32_t app_status;
+    uint8_t  protocol_status;
+    uint8_t  reserved[3];
+};
+
 #define FCGI_VERSION_1               1
 #define FCGI_RECORD_MAX_SIZE         65535
 #define FCGI_RECORD_HEADER_SIZE      sizeof(struct fcgi_record_header)
@@ -57,6 +63,15 @@ struct fcgi_begin_request_record {
 #define FCGI_AUTHORIZER 2
 #define FCGI_FILTER     3
 
+/* Mask for the flags component of FCGI_BeginRequestBody */
+#define FCGI_KEEP_CONN  1
+
+/* Values for the protocol_status component of FCGI_EndRequestBody */
+#define FCGI_REQUEST_COMPLETE   0
+#define FCGI_CANT_MPX_CONN      1
+#define FCGI_OVERLOADED         2
+#define FCGI_UNKNOWN_ROLE       3
+
 /*
  * Values for type component of FCGI_Header
  */
@@ -71,18 +86,34 @@ struct fcgi_begin_request_record {
 #define FCGI_GET_VALUES          9
 #define FCGI_GET_VALUES_RESULT  10
 
+/* Largest CGI header block accepted from the server */
+#define FCGI_HEADERS_MAX        FCGI_BUF_SIZE
+
+struct fcgi_buf;
+struct fcgi_conn;
+struct fcgi_server;
+struct fcgi_upstream;
+
 /*
  * FastCGI Handler context, it keeps information of states and other
  * request/response references.
  */
 struct fcgi_handler {
-    struct mk_event event;       /* built-in event-loop data */
+    struct mk_event event;       /* only used to defer the release */
 
-    int server_fd;               /* backend FastCGI server         */
+    int request_id;              /* FastCGI request id             */
     int chunked;                 /* chunked response ?             */
     int active;                  /* is this handler active ?       */
     int hangup;                  /* hangup connection once ready ? */
     int headers_set;             /* headers set ?                  */
+    int queued;                  /* waiting for a connection ?     */
+    int started;                 /* request partially written ?    */
+    int retries;                 /* times the request was re-sent  */
+    int throttled;               /* server reads paused ?          */
+    uint32_t tried;              /* upstream servers already tried */
+    struct fcgi_upstream *upstream;
+    struct fcgi_server *server;  /* server handling the request    */
+    struct fcgi_conn *conn;      /* backend connection             */
     struct mk_http_session *cs;  /* HTTP session context           */
     struct mk_http_request *sr;  /* HTTP request context           */
 
@@ -93,11 +124,19 @@ struct fcgi_handler {
     unsigned int buf_len;
     char buf_data[FCGI_BUF_SIZE];
 
-    /* Channel to stream request to the FCGI server */
-    struct mk_channel fcgi_channel;
-    struct mk_stream  fcgi_stream;
-
+    /* Encoded request, iov_pos is the first entry not yet written */
     struct mk_iov *iov;
+    int iov_pos;
+
+    /* CGI headers split across FCGI_STDOUT records */
+    char *headers;
+    size_t headers_len;
+
+    /* Response data queued on the client channel */
+    size_t pending;
+    struct mk_list chunks;
+
+    /* Link to the connection write queue or to the pool wait queue */
     struct mk_list _head;
 };
 
@@ -110,8 +149,15 @@ static inline void fcgi_encode16(void *a, unsigned b)
 }
 
 struct fcgi_handler *fcgi_handler_new(struct mk_http_session *cs,
-                                      struct mk_http_request *sr);
-
+                                      struct mk_http_request *sr,
+                                      struct fcgi_upstream *upstream);
+
+size_t fcgi_read_header(void *p, struct fcgi_record_header *h);
+int fcgi_encode_request(struct fcgi_handler *handler);
+int fcgi_handler_stdout(struct fcgi_handler *handler, struct fcgi_buf *buf,
+                        char *data, size_t len);
+int fcgi_handler_end(struct fcgi_handler *handler);
 int fcgi_exit(struct fcgi_handler *handler);
+int fcgi_error(struct fcgi_handler *handler, int status);
 
 #endif
@@ -0,0 +1,560 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+#include <poll.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_conn.h"
+#include "fcgi_upstream.h"
+
+pthread_key_t fcgi_local_worker;
+
+/* FNV-1a */
+static inline uint32_t fcgi_hash(const void *data, size_t len, uint32_t h)
+{
+    size_t i;
+    const unsigned char *p = data;
+
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619;
+    }
+
+    return h;
+}
+
+#define FCGI_HASH_SEED  2166136261U
+
+int fcgi_worker_init()
+{
+    int i;
+    struct fcgi_worker *worker;
+
+    worker = mk_api->mem_alloc_z(sizeof(struct fcgi_worker));
+    if (!worker) {
+        return -1;
+    }
+
+    worker->pools = mk_api->mem_alloc_z(sizeof(struct fcgi_pool) *
+                                        fcgi_conf.n_servers);
+    worker->rr_next = mk_api->mem_alloc_z(sizeof(unsigned int) *
+                                          fcgi_conf.n_upstreams);
+    if (!worker->pools || !worker->rr_next) {
+        mk_api->mem_free(worker->pools);
+        mk_api->mem_free(worker->rr_next);
+        mk_api->mem_free(worker);
+        return -1;
+    }
+
+    for (i = 0; i < fcgi_conf.n_servers; i++) {
+        fcgi_pool_init(&worker->pools[i], fcgi_conf.servers[i]);
+    }
+    mk_list_init(&worker->bufs);
+
+    pthread_setspecific(fcgi_local_worker, worker);
+    return 0;
+}
+
+struct fcgi_pool *fcgi_pool_get(struct fcgi_server *server)
+{
+    struct fcgi_worker *worker;
+
+    worker = pthread_getspecific(fcgi_local_worker);
+    return &worker->pools[server->id];
+}
+
+struct fcgi_buf *fcgi_buf_get()
+{
+    struct fcgi_buf *buf;
+    struct fcgi_worker *worker;
+
+    worker = pthread_getspecific(fcgi_local_worker);
+    if (mk_list_is_empty(&worker->bufs) != 0) {
+        buf = mk_list_entry_first(&worker->bufs, struct fcgi_buf, _head);
+        mk_list_del(&buf->_head);
+        worker->n_bufs--;
+    }
+    else {
+        buf = mk_api->mem_alloc(sizeof(struct fcgi_buf));
+        if (!buf) {
+            return NULL;
+        }
+    }
+
+    buf->refs = 1;
+    return buf;
+}
+
+/* Drop a reference, the last one returns the buffer to the free list */
+void fcgi_buf_put(struct fcgi_buf *buf)
+{
+    struct fcgi_worker *worker;
+
+    if (--buf->refs > 0) {
+        return;
+    }
+
+    worker = pthread_getspecific(fcgi_local_worker);
+    if (worker->n_bufs < FCGI_BUF_POOL) {
+        mk_list_add(&buf->_head, &worker->bufs);
+        worker->n_bufs++;
+    }
+    else {
+        mk_api->mem_free(buf);
+    }
+}
+
+struct fcgi_upstream *fcgi_upstream_get(const char *name, int len)
+{
+    struct mk_list *head;
+    struct fcgi_upstream *up;
+
+    mk_list_foreach(head, &fcgi_conf.upstreams) {
+        up = mk_list_entry(head, struct fcgi_upstream, _head);
+        if ((int) strlen(up->name) == len &&
+            strncasecmp(up->name, name, len) == 0) {
+            return up;
+        }
+    }
+
+    return NULL;
+}
+
+static int fcgi_ring_cmp(const void *a, const void *b)
+{
+    const struct fcgi_ring_point *pa = a;
+    const struct fcgi_ring_point *pb = b;
+
+    if (pa->hash < pb->hash) {
+        return -1;
+    }
+    return (pa->hash > pb->hash);
+}
+
+/*
+ * Every server takes FCGI_RING_POINTS points on the ring, so adding or
+ * removing a server only remaps the keys around its own points.
+ */
+int fcgi_upstream_ring_build(struct fcgi_upstream *up)
+{
+    int i;
+    int j;
+    int n = 0;
+    uint32_t h;
+    struct fcgi_server *server;
+
+    up->ring_size = up->n_servers * FCGI_RING_POINTS;
+    up->ring = mk_api->mem_alloc(sizeof(struct fcgi_ring_point) *
+                                 up->ring_size);
+    if (!up->ring) {
+        return -1;
+    }
+
+    for (i = 0; i < up->n_servers; i++) {
+        server = up->servers[i];
+        h = fcgi_hash(server->name, strlen(server->name), FCGI_HASH_SEED);
+        for (j = 0; j < FCGI_RING_POINTS; j++) {
+            up->ring[n].hash   = fcgi_hash(&j, sizeof(j), h);
+            up->ring[n].server = server;
+            n++;
+        }
+    }
+
+    qsort(up->ring, up->ring_size, sizeof(struct fcgi_ring_point),
+          fcgi_ring_cmp);
+    return 0;
+}
+
+/* Failure counters and ejection */
+void fcgi_server_fail(struct fcgi_server *server)
+{
+    int fails;
+    int max_fails = server->upstream->max_fails;
+
+    fails = __atomic_add_fetch(&server->fails, 1, __ATOMIC_RELAXED);
+    if (max_fails == 0 || fails < max_fails) {
+        return;
+    }
+
+    __atomic_store_n(&server->down_until,
+                     mk_api->time_unix() + server->upstream->fail_timeout,
+                     __ATOMIC_RELAXED);
+    if (fails == max_fails) {
+        mk_warn("[fastcgi] server %s ejected for %i seconds after "
+                "%i failures", server->name,
+                server->upstream->fail_timeout, fails);
+    }
+}
+
+void fcgi_server_ok(struct fcgi_server *server)
+{
+    if (__atomic_load_n(&server->fails, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+
+    __atomic_store_n(&server->fails, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&server->down_until, 0, __ATOMIC_RELAXED);
+}
+
+static inline int fcgi_server_available(struct fcgi_server *server,
+                                        time_t now)
+{
+    if (__atomic_load_n(&server->probe_ok, __ATOMIC_RELAXED) == MK_FALSE) {
+        return MK_FALSE;
+    }
+
+    return (now >= __atomic_load_n(&server->down_until, __ATOMIC_RELAXED));
+}
+
+static inline int fcgi_server_tried(struct fcgi_handler *handler,
+                                    struct fcgi_server *server)
+{
+    return (handler->tried & (1U << server->index));
+}
+
+/* Hash key of the request: the URI or the client address */
+static uint32_t fcgi_request_hash(struct fcgi_upstream *up,
+                                  struct fcgi_handler *handler)
+{
+    union mk_socket_addr *peer = &handler->cs->conn->peer;
+    struct mk_http_request *sr = handler->sr;
+
+    if (up->hash_key == FCGI_HASH_REMOTE_ADDR) {
+        if (peer->sa.sa_family == AF_INET) {
+            return fcgi_hash(&peer->in4.sin_addr,
+                             sizeof(struct in_addr), FCGI_HASH_SEED);
+        }
+        else if (peer->sa.sa_family == AF_INET6) {
+            return fcgi_hash(&peer->in6.sin6_addr,
+                             sizeof(struct in6_addr), FCGI_HASH_SEED);
+        }
+    }
+
+    return fcgi_hash(sr->uri_processed.data, sr->uri_processed.len,
+                     FCGI_HASH_SEED);
+}
+
+/* First point on the ring at or after the hash */
+static int fcgi_ring_lookup(struct fcgi_upstream *up, uint32_t hash)
+{
+    int low = 0;
+    int high = up->ring_size;
+    int mid;
+
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (up->ring[mid].hash < hash) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+
+    return (low == up->ring_size) ? 0 : low;
+}
+
+static struct fcgi_server *fcgi_select_hash(struct fcgi_upstream *up,
+                                            struct fcgi_handler *handler,
+                                            time_t now)
+{
+    int i;
+    int pos;
+    struct fcgi_server *server;
+
+    pos = fcgi_ring_lookup(up, fcgi_request_hash(up, handler));
+    for (i = 0; i < up->ring_size; i++) {
+        server = up->ring[(pos + i) % up->ring_size].server;
+        if (!fcgi_server_tried(handler, server) &&
+            fcgi_server_available(server, now)) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Least outstanding requests, as seen by this worker. The scan starts at
+ * a rotating position so ties are spread among the servers.
+ */
+static struct fcgi_server *fcgi_select_least(struct fcgi_upstream *up,
+                                             struct fcgi_handler *handler,
+                                             unsigned int start,
+                                             time_t now)
+{
+    int i;
+    int load;
+    int best_load = -1;
+    struct fcgi_server *server;
+    struct fcgi_server *best = NULL;
+
+    for (i = 0; i < up->n_servers; i++) {
+        server = up->servers[(start + i) % up->n_servers];
+        if (fcgi_server_tried(handler, server) ||
+            !fcgi_server_available(server, now)) {
+            continue;
+        }
+
+        load = fcgi_pool_outstanding(fcgi_pool_get(server));
+        if (!best || load < best_load) {
+            best = server;
+            best_load = load;
+            if (load == 0) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* Next server not tried yet, a zero 'now' ignores the health state */
+static struct fcgi_server *fcgi_select_next(struct fcgi_upstream *up,
+                                            struct fcgi_handler *handler,
+                                            unsigned int start,
+                                            time_t now)
+{
+    int i;
+    struct fcgi_server *server;
+
+    for (i = 0; i < up->n_servers; i++) {
+        server = up->servers[(start + i) % up->n_servers];
+        if (fcgi_server_tried(handler, server)) {
+            continue;
+        }
+        if (now == 0 || fcgi_server_available(server, now)) {
+            return server;
+        }
+    }
+
+    return NULL;
+}
+
+static struct fcgi_server *fcgi_upstream_select(struct fcgi_upstream *up,
+                                                struct fcgi_handler *handler)
+{
+    time_t now = mk_api->time_unix();
+    unsigned int start;
+    struct fcgi_worker *worker;
+    struct fcgi_server *server;
+
+    worker = pthread_getspecific(fcgi_local_worker);
+    start = worker->rr_next[up->id]++;
+
+    switch (up->policy) {
+    case FCGI_POLICY_HASH:
+        server = fcgi_select_hash(up, handler, now);
+        break;
+    case FCGI_POLICY_ROUND_ROBIN:
+        server = fcgi_select_next(up, handler, start, now);
+        if (server) {
+            /* Skipped servers don't give an extra turn to the next one */
+            worker->rr_next[up->id] = server->index + 1;
+        }
+        break;
+    default:
+        server = fcgi_select_least(up, handler, start, now);
+    }
+
+    /*
+     * Every server left is ejected or failing its probes, still give them
+     * a chance instead of failing the request right away.
+     */
+    if (!server) {
+        server = fcgi_select_next(up, handler, start, 0);
+    }
+
+    return server;
+}
+
+/* Send the request to the next suitable server of its upstream */
+int fcgi_upstream_dispatch(struct fcgi_handler *handler)
+{
+    int ret;
+    struct fcgi_server *server;
+
+    while ((server = fcgi_upstream_select(handler->upstream, handler))) {
+        handler->tried |= (1U << server->index);
+        handler->server = server;
+
+        MK_TRACE("[fastcgi] upstream %s: request sent to %s",
+                 handler->upstream->name, server->name);
+
+        ret = fcgi_pool_dispatch(fcgi_pool_get(server), handler);
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Active health probe: connect and ask for FCGI_MPXS_CONNS through a
+ * FCGI_GET_VALUES management record, any FCGI_GET_VALUES_RESULT reply
+ * means the server is alive.
+ */
+static int fcgi_probe_wait(int fd, short events)
+{
+    int ret;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = events;
+
+    do {
+        ret = poll(&pfd, 1, FCGI_PROBE_TIMEOUT * 1000);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret <= 0 || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int fcgi_probe(struct fcgi_server *server)
+{
+    int fd = -1;
+    int s_err;
+    ssize_t n;
+    socklen_t s_len = sizeof(s_err);
+    char buf[256];
+    struct fcgi_record_header header;
+    static const char request[] = {
+        FCGI_VERSION_1, FCGI_GET_VALUES, 0, 0,  /* version, type, id  */
+        0, 17, 0, 0,                            /* length, padding    */
+        15, 0,                                  /* name/value lengths */
+        'F', 'C', 'G', 'I', '_', 'M', 'P', 'X', 'S', '_',
+        'C', 'O', 'N', 'N', 'S'
+    };
+
+    if (server->addr) {
+        fd = mk_api->socket_connect(server->addr, atoi(server->port),
+                                    MK_TRUE);
+    }
+    else if (server->path) {
+        fd = mk_api->socket_open(server->path, MK_TRUE);
+    }
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fcgi_probe_wait(fd, POLLOUT) == -1 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &s_err, &s_len) == -1 ||
+        s_err != 0) {
+        goto error;
+    }
+
+    n = write(fd, request, sizeof(request));
+    if (n != sizeof(request)) {
+        goto error;
+    }
+
+    if (fcgi_probe_wait(fd, POLLIN) == -1) {
+        goto error;
+    }
+
+    n = read(fd, buf, sizeof(buf));
+    if (n < (ssize_t) FCGI_RECORD_HEADER_SIZE) {
+        goto error;
+    }
+
+    fcgi_read_header(buf, &header);
+    if (header.type != FCGI_GET_VALUES_RESULT) {
+        goto error;
+    }
+
+    close(fd);
+    return 0;
+
+ error:
+    close(fd);
+    return -1;
+}
+
+static void fcgi_probe_server(struct fcgi_server *server)
+{
+    int ret;
+    int prev;
+
+    ret = fcgi_probe(server);
+    prev = __atomic_load_n(&server->probe_ok, __ATOMIC_RELAXED);
+
+    if (ret == 0) {
+        if (prev == MK_FALSE) {
+            mk_info("[fastcgi] server %s is back online", server->name);
+        }
+        __atomic_store_n(&server->probe_ok, MK_TRUE, __ATOMIC_RELAXED);
+        fcgi_server_ok(server);
+    }
+    else {
+        if (prev == MK_TRUE) {
+            mk_warn("[fastcgi] server %s failed the health probe",
+                    server->name);
+        }
+        __atomic_store_n(&server->probe_ok, MK_FALSE, __ATOMIC_RELAXED);
+    }
+}
+
+static void fcgi_health_worker(void *data)
+{
+    int i;
+    time_t now;
+    struct mk_list *head;
+    struct fcgi_upstream *up;
+    (void) data;
+
+    mk_api->worker_rename("monkey: fcgi-health");
+
+    while (1) {
+        now = time(NULL);
+        mk_list_foreach(head, &fcgi_conf.upstreams) {
+            up = mk_list_entry(head, struct fcgi_upstream, _head);
+            if (up->health_check == 0 || now < up->next_probe) {
+                continue;
+            }
+            up->next_probe = now + up->health_check;
+
+            for (i = 0; i < up->n_servers; i++) {
+                fcgi_probe_server(up->servers[i]);
+            }
+        }
+        sleep(1);
+    }
+}
+
+/* Spawn the probes thread if any upstream asks for it */
+void fcgi_health_start()
+{
+    struct mk_list *head;
+    struct fcgi_upstream *up;
+
+    mk_list_foreach(head, &fcgi_conf.upstreams) {
+        up = mk_list_entry(head, struct fcgi_upstream, _head);
+        if (up->health_check > 0) {
+            mk_api->worker_spawn(fcgi_health_worker, NULL);
+            return;
+        }
+    }
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_FASTCGI_UPSTREAM_H
+#define MK_FASTCGI_UPSTREAM_H
+
+#include <monkey/mk_api.h>
+
+#include "fastcgi.h"
+#include "fcgi_handler.h"
+#include "fcgi_conn.h"
+
+/* Seconds to wait for a health probe reply */
+#define FCGI_PROBE_TIMEOUT   2
+
+/* Per worker state: one connection pool per server */
+struct fcgi_worker {
+    struct fcgi_pool *pools;        /* indexed by server id   */
+    unsigned int *rr_next;          /* indexed by upstream id */
+    int n_bufs;
+    struct mk_list bufs;            /* free receive buffers   */
+};
+
+extern pthread_key_t fcgi_local_worker;
+
+int fcgi_worker_init();
+struct fcgi_pool *fcgi_pool_get(struct fcgi_server *server);
+
+struct fcgi_upstream *fcgi_upstream_get(const char *name, int len);
+int fcgi_upstream_ring_build(struct fcgi_upstream *up);
+int fcgi_upstream_dispatch(struct fcgi_handler *handler);
+
+void fcgi_server_fail(struct fcgi_server *server);
+void fcgi_server_ok(struct fcgi_server *server);
+
+void fcgi_health_start();
+
+#endif
@@ -166,6 +166,15 @@ int mk_liana_send_file(int socket_fd, int file_fd, off_t *file_offset,
 #endif
 }
 
+#if defined (__linux__)
+/* Move data waiting in a pipe to the socket without copying it */
+int mk_liana_splice(int socket_fd, int pipe_fd, size_t count)
+{
+    return splice(pipe_fd, NULL, socket_fd, NULL, count,
+                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+#endif
+
 /* Network Layer plugin Callbacks */
 struct mk_plugin_network mk_plugin_network_liana = {
     .read          = mk_liana_read,
@@ -173,6 +182,9 @@ struct mk_plugin_network mk_plugin_network_liana = {
     .writev        = mk_liana_writev,
     .close         = mk_liana_close,
     .send_file     = mk_liana_send_file,
+#if defined (__linux__)
+    .splice        = mk_liana_splice,
+#endif
     .buffer_size   = MK_REQUEST_CHUNK
 };
 
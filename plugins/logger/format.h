@@ -0,0 +1,57 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_LOGGER_FORMAT_H
+#define MK_LOGGER_FORMAT_H
+
+#include <stdint.h>
+
+/* Output formats for the log targets */
+#define MK_LOGGER_FORMAT_TEXT     0     /* classic text lines (default) */
+#define MK_LOGGER_FORMAT_JSON     1     /* one JSON object per line     */
+#define MK_LOGGER_FORMAT_BINARY   2     /* packed log_bin_record        */
+
+/* "MKL1" */
+#define MK_LOGGER_BIN_MAGIC       0x314c4b4d
+
+/*
+ * Binary log record, shared with the mk_logconv tool. Fields are stored
+ * in host byte order, the strings (method, protocol and URI, in that
+ * order and not NULL terminated) follow the fixed header, 'size' is the
+ * total length of the record including them.
+ */
+struct log_bin_record
+{
+    uint32_t magic;
+    uint16_t size;
+    uint16_t status;
+    int64_t  time;              /* unix time                     */
+    int64_t  bytes;             /* content length, -1 for HEAD   */
+    uint64_t latency;           /* request latency in nsec       */
+    int32_t  fd;                /* client socket                 */
+    uint16_t port;              /* peer port                     */
+    uint8_t  family;            /* 4, 6 or 0 if unknown          */
+    uint8_t  method_len;
+    uint8_t  protocol_len;
+    uint8_t  pad;
+    uint16_t uri_len;
+    uint8_t  addr[16];          /* peer address, network order   */
+} __attribute__ ((packed));
+
+#endif
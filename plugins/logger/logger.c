@@ -21,9 +21,9 @@
 
 /* System Headers */
 #include <time.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <arpa/inet.h>
 
 /* Local Headers */
 #include "logger.h"
@@ -51,177 +51,493 @@ static struct status_response response_codes[] = {
     {505, "505"},
 };
 
-static struct log_target *mk_logger_match_by_host(struct host *host, int is_ok)
+static inline struct log_target *mk_logger_match_by_host(struct host *host,
+                                                         int is_ok)
 {
-    struct mk_list *head;
-    struct log_target *entry;
+    struct log_vhost *lv = host->data[logger_vhost_key];
 
-    mk_list_foreach(head, &targets_list) {
-        entry = mk_list_entry(head, struct log_target, _head);
-        if (entry->host == host && entry->is_ok == is_ok) {
-            return entry;
+    if (!lv) {
+        return NULL;
+    }
+
+    return is_ok ? lv->access : lv->error;
+}
+
+/* Append 'len' bytes to the line buffer, truncating if required */
+static inline void mk_logger_line_add(char *line, size_t *off,
+                                      const char *data, size_t len)
+{
+    if (!data) {
+        return;
+    }
+
+    if (*off + len > MK_LOGGER_LINE_MAX - 1) {
+        len = (MK_LOGGER_LINE_MAX - 1) - *off;
+    }
+    memcpy(line + *off, data, len);
+    *off += len;
+}
+
+#define mk_logger_line_ptr(line, off, p)                \
+    mk_logger_line_add(line, off, p.data, p.len)
+
+/*
+ * The writer thread format dates by itself as the records may have been
+ * queued a few clock ticks ago. The last formatted second is cached.
+ */
+static size_t mk_logger_format_date(time_t t, char **out)
+{
+    struct tm result;
+    static time_t last = 0;
+    static size_t last_len = 0;
+    static char date[LOG_TIME_BUFFER_SIZE];
+
+    if (t != last) {
+        last_len = strftime(date, sizeof(date), "[%d/%b/%G %T %z]",
+                            localtime_r(&t, &result));
+        last = t;
+    }
+
+    *out = date;
+    return last_len;
+}
+
+static size_t mk_logger_format_status(int http_status, char *buf, size_t size)
+{
+    int i;
+    int array_len = ARRAY_SIZE(response_codes);
+
+    for (i = 0; i < array_len; i++) {
+        if (response_codes[i].i_status == http_status) {
+            memcpy(buf, response_codes[i].s_status, 3);
+            return 3;
         }
     }
 
-    return NULL;
+    return snprintf(buf, size, "%i", http_status);
 }
 
-static struct iov *mk_logger_get_cache()
+/* Peer address in text form, a dash if it is unknown */
+static size_t mk_logger_format_ip(struct log_record *r, char *buf, int size)
 {
-    return pthread_getspecific(cache_iov);
+    int ret;
+    unsigned long len;
+
+    ret = mk_api->socket_addr_str(&r->peer, &buf, size, &len);
+    if (ret != 0) {
+        buf[0] = '-';
+        return 1;
+    }
+
+    return len;
 }
 
-static ssize_t _mk_logger_append(int pipe_fd_in,
-        int file_fd_out,
-        size_t bytes)
+/* Compose the text log line for a record, returns the line length */
+static size_t mk_logger_format_text(struct log_record *r, char *line)
 {
-    ssize_t ret;
-#if defined(__linux__)
-    ret = splice(pipe_fd_in, NULL, file_fd_out,
-            NULL, bytes, SPLICE_F_MOVE);
-    return ret;
-#else
-    unsigned char buffer[4096];
-    ssize_t buffer_used;
-    size_t bytes_written = 0;
-
-    while (bytes_written < bytes) {
-        ret = read(pipe_fd_in, buffer, sizeof(buffer));
-        if (ret < 0) {
-            break;
+    int len;
+    size_t off = 0;
+    size_t date_len;
+    char *date;
+    char tmp[80];
+
+    /* IP and date/time when the object was requested */
+    len = mk_logger_format_ip(r, tmp, INET6_ADDRSTRLEN);
+    mk_logger_line_add(line, &off, tmp, len);
+    mk_logger_line_ptr(line, &off, mk_logger_iov_dash);
+    date_len = mk_logger_format_date(r->time, &date);
+    mk_logger_line_add(line, &off, date, date_len);
+    mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+
+    /* Access Log */
+    if (r->status < 400) {
+        mk_logger_line_add(line, &off, r->method_str, r->method_len);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->uri, r->uri_len);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->protocol, r->protocol_len);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+
+        /* HTTP Status code response */
+        len = mk_logger_format_status(r->status, tmp, sizeof(tmp));
+        mk_logger_line_add(line, &off, tmp, len);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+
+        /* Content Length */
+        if (r->content_length >= 0) {
+            len = snprintf(tmp, sizeof(tmp), "%ld", r->content_length);
+            mk_logger_line_add(line, &off, tmp, len);
         }
-        buffer_used = ret;
-        ret = write(file_fd_out, buffer, buffer_used);
-        if (ret < 0) {
-            break;
+        else {
+            mk_logger_line_ptr(line, &off, mk_logger_iov_empty);
         }
-        bytes_written += ret;
+        line[off++] = '\n';
+        return off;
     }
-    if (ret < 0 && bytes_written == 0)
-        return -1;
-    else
-        return bytes_written;
-#endif
+
+    /* Error Log */
+    switch (r->status) {
+    case MK_CLIENT_BAD_REQUEST:
+        mk_logger_line_ptr(line, &off, error_msg_400);
+        break;
+    case MK_CLIENT_FORBIDDEN:
+        mk_logger_line_ptr(line, &off, error_msg_403);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->uri, r->uri_len);
+        break;
+    case MK_CLIENT_NOT_FOUND:
+        mk_logger_line_ptr(line, &off, error_msg_404);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->uri, r->uri_len);
+        break;
+    case MK_CLIENT_METHOD_NOT_ALLOWED:
+        mk_logger_line_ptr(line, &off, error_msg_405);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->method_str, r->method_len);
+        break;
+    case MK_CLIENT_REQUEST_TIMEOUT:
+        mk_logger_line_ptr(line, &off, error_msg_408);
+        break;
+    case MK_CLIENT_LENGTH_REQUIRED:
+        mk_logger_line_ptr(line, &off, error_msg_411);
+        break;
+    case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
+        mk_logger_line_ptr(line, &off, error_msg_413);
+        break;
+    case MK_SERVER_NOT_IMPLEMENTED:
+        mk_logger_line_ptr(line, &off, error_msg_501);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->method_str, r->method_len);
+        break;
+    case MK_SERVER_INTERNAL_ERROR:
+        mk_logger_line_ptr(line, &off, error_msg_500);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->uri, r->uri_len);
+        break;
+    case MK_SERVER_HTTP_VERSION_UNSUP:
+        mk_logger_line_ptr(line, &off, error_msg_505);
+        break;
+    default:
+        len = snprintf(tmp, sizeof(tmp), "[error %u] (no description)",
+                       r->status);
+        if (len > (int) sizeof(tmp) - 1) {
+            len = sizeof(tmp) - 1;
+        }
+        mk_logger_line_add(line, &off, tmp, len);
+        mk_logger_line_ptr(line, &off, mk_logger_iov_space);
+        mk_logger_line_add(line, &off, r->uri, r->uri_len);
+        break;
+    }
+    line[off++] = '\n';
+
+    return off;
 }
 
-static void mk_logger_start_worker(void *args)
+/*
+ * Length of the UTF-8 sequence at 'p' (at most 'len' bytes available), 0
+ * if it's not a valid one: truncated, overlong, a surrogate or past
+ * U+10FFFF.
+ */
+static int mk_logger_utf8_len(const unsigned char *p, size_t len)
+{
+    size_t i;
+    size_t n;
+    unsigned int cp;
+
+    if ((p[0] & 0xe0) == 0xc0) {
+        n = 2;
+        cp = p[0] & 0x1f;
+    }
+    else if ((p[0] & 0xf0) == 0xe0) {
+        n = 3;
+        cp = p[0] & 0x0f;
+    }
+    else if ((p[0] & 0xf8) == 0xf0) {
+        n = 4;
+        cp = p[0] & 0x07;
+    }
+    else {
+        return 0;
+    }
+
+    if (n > len) {
+        return 0;
+    }
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+
+    if ((n == 2 && cp < 0x80) || (n == 3 && cp < 0x800) ||
+        (n == 4 && cp < 0x10000) || cp > 0x10ffff ||
+        (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 0;
+    }
+
+    return n;
+}
+
+/*
+ * Append a JSON string value escaping quotes, backslashes and controls. A
+ * byte that is not part of a valid UTF-8 sequence is written as \u00XX,
+ * mk_logconv turns it back into the original byte.
+ */
+static void mk_logger_json_str(char *line, size_t *off,
+                               const char *str, size_t len)
+{
+    size_t i;
+    int n;
+    char esc[8];
+    unsigned char c;
+
+    mk_logger_line_add(line, off, "\"", 1);
+    for (i = 0; i < len; i++) {
+        c = str[i];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            mk_logger_line_add(line, off, esc, 2);
+        }
+        else if (c < 0x20 || c == 0x7f) {
+            n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+            mk_logger_line_add(line, off, esc, n);
+        }
+        else if (c >= 0x80) {
+            n = mk_logger_utf8_len((const unsigned char *) str + i, len - i);
+            if (n > 0) {
+                mk_logger_line_add(line, off, (char *) str + i, n);
+                i += n - 1;
+            }
+            else {
+                n = snprintf(esc, sizeof(esc), "\\u%04x", c);
+                mk_logger_line_add(line, off, esc, n);
+            }
+        }
+        else {
+            mk_logger_line_add(line, off, (char *) &c, 1);
+        }
+    }
+    mk_logger_line_add(line, off, "\"", 1);
+}
+
+/* Get the peer port in host byte order */
+static inline int mk_logger_peer_port(struct log_record *r)
+{
+    if (r->peer.sa.sa_family == AF_INET) {
+        return ntohs(r->peer.in4.sin_port);
+    }
+    else if (r->peer.sa.sa_family == AF_INET6) {
+        return ntohs(r->peer.in6.sin6_port);
+    }
+    return 0;
+}
+
+/* Compose a JSON line for a record, raw fields only */
+static size_t mk_logger_format_json(struct log_record *r, char *line)
+{
+    int len;
+    size_t off = 0;
+    char tmp[128];
+
+    len = snprintf(tmp, sizeof(tmp), "{\"time\":%lu,\"remote\":",
+                   (unsigned long) r->time);
+    mk_logger_line_add(line, &off, tmp, len);
+
+    len = mk_logger_format_ip(r, tmp, INET6_ADDRSTRLEN);
+    mk_logger_json_str(line, &off, tmp, len);
+
+    len = snprintf(tmp, sizeof(tmp), ",\"port\":%i,\"fd\":%i,\"method\":",
+                   mk_logger_peer_port(r), r->fd);
+    mk_logger_line_add(line, &off, tmp, len);
+    mk_logger_json_str(line, &off, r->method_str, r->method_len);
+
+    mk_logger_line_add(line, &off, ",\"uri\":", 7);
+    mk_logger_json_str(line, &off, r->uri, r->uri_len);
+
+    mk_logger_line_add(line, &off, ",\"protocol\":", 12);
+    mk_logger_json_str(line, &off, r->protocol, r->protocol_len);
+
+    len = snprintf(tmp, sizeof(tmp),
+                   ",\"status\":%i,\"bytes\":%ld,\"latency_ns\":%lu}",
+                   r->status, r->content_length, (unsigned long) r->latency);
+    mk_logger_line_add(line, &off, tmp, len);
+
+    /* the line buffer always keeps room for the line feed */
+    line[off++] = '\n';
+    return off;
+}
+
+/* Pack a record in the binary format described in format.h */
+static size_t mk_logger_format_binary(struct log_record *r, char *line)
+{
+    size_t off;
+    struct log_bin_record *bin = (struct log_bin_record *) line;
+
+    memset(bin, '\0', sizeof(struct log_bin_record));
+    bin->magic        = MK_LOGGER_BIN_MAGIC;
+    bin->status       = r->status;
+    bin->time         = r->time;
+    bin->bytes        = r->content_length;
+    bin->latency      = r->latency;
+    bin->fd           = r->fd;
+    bin->port         = mk_logger_peer_port(r);
+    bin->method_len   = r->method_len;
+    bin->protocol_len = r->protocol_len;
+    bin->uri_len      = r->uri_len;
+
+    if (r->peer.sa.sa_family == AF_INET) {
+        bin->family = 4;
+        memcpy(bin->addr, &r->peer.in4.sin_addr, 4);
+    }
+    else if (r->peer.sa.sa_family == AF_INET6) {
+        bin->family = 6;
+        memcpy(bin->addr, &r->peer.in6.sin6_addr, 16);
+    }
+
+    off = sizeof(struct log_bin_record);
+    memcpy(line + off, r->method_str, r->method_len);
+    off += r->method_len;
+    memcpy(line + off, r->protocol, r->protocol_len);
+    off += r->protocol_len;
+    memcpy(line + off, r->uri, r->uri_len);
+    off += r->uri_len;
+
+    bin->size = off;
+    return off;
+}
+
+static inline size_t mk_logger_format(struct log_record *r, char *line)
+{
+    if (mk_logger_format_type == MK_LOGGER_FORMAT_JSON) {
+        return mk_logger_format_json(r, line);
+    }
+    else if (mk_logger_format_type == MK_LOGGER_FORMAT_BINARY) {
+        return mk_logger_format_binary(r, line);
+    }
+
+    return mk_logger_format_text(r, line);
+}
+
+/* Write the target buffer content to the log file */
+static void mk_logger_target_flush(struct log_target *target)
 {
-    int fd;
-    int bytes, err;
-    int max_events = mk_api->config->nhosts;
     int flog;
-    int clk;
-    long slen;
-    int timeout;
-    char *target;
-    (void) args;
-    struct mk_list *head;
-    struct log_target *entry;
-    struct mk_event *event;
-    struct mk_event_loop *evl;
-
-    /* pipe_size:
-     * ----------
-     * Linux set a pipe size usingto the PAGE_SIZE,
-     * check linux/include/pipe_fs_i.h for details:
-     *
-     *       #define PIPE_SIZE               PAGE_SIZE
-     *
-     * In the same header file we can found that every
-     * pipe has 16 pages, so our real memory allocation
-     * is: (PAGE_SIZE*PIPE_BUFFERS)
-     */
-    long pipe_size;
+    ssize_t bytes;
 
-    /* buffer_limit:
-     * -------------
-     * it means the maximum data that a monkey log pipe can contain.
-     */
-    long buffer_limit;
+    if (target->buf_len == 0) {
+        return;
+    }
 
-    mk_api->worker_rename("monkey: logger");
+    flog = open(target->file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (mk_unlikely(flog == -1)) {
+        mk_warn("Could not open logfile '%s' (%s)", target->file, strerror(errno));
+        target->buf_len = 0;
+        return;
+    }
+
+    bytes = write(flog, target->buf, target->buf_len);
+    if (mk_unlikely(bytes == -1)) {
+        mk_warn("Could not write to log file: write() = %ld", bytes);
+    }
 
-    /* Monkey allow just 75% of a pipe capacity */
-    pipe_size = sysconf(_SC_PAGESIZE) * 16;
-    buffer_limit = (pipe_size * MK_LOGGER_PIPE_LIMIT);
+    MK_TRACE("written %lu bytes", target->buf_len);
+    target->buf_len = 0;
+    close(flog);
+}
 
-    /* Creating poll */
-    evl = mk_api->ev_loop_create(max_events);
+static void mk_logger_flush_all()
+{
+    struct mk_list *head;
+    struct log_target *entry;
 
-    /* Registering targets for virtualhosts */
+    pthread_mutex_lock(&targets_lock);
     mk_list_foreach(head, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
-        event = &entry->event;
-        event->mask  = MK_EVENT_EMPTY;
-        event->data  = entry;
-        event->handler = NULL;
-        event->status = MK_EVENT_NONE;
-
-        /* Add access log file */
-        if (entry->pipe[0] > 0) {
-            event->fd = entry->pipe[0];
-            mk_api->ev_add(evl, entry->pipe[0],
-                           MK_EVENT_CONNECTION, MK_EVENT_READ, entry);
-        }
+        mk_logger_target_flush(entry);
     }
+    pthread_mutex_unlock(&targets_lock);
+}
 
-    /* Set initial timeout */
-    timeout = time(NULL) + mk_logger_timeout;
+/* Let the admin know if some worker ring overflowed since last check */
+static void mk_logger_ring_report(struct log_ring *ring)
+{
+    uint64_t dropped;
 
-    /* Reading pipe buffer */
-    while (1) {
-        usleep(1200);
+    dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped == ring->dropped_reported) {
+        return;
+    }
 
-        /* wait for events */
-        mk_api->ev_wait(evl);
+    mk_warn("[logger] worker %i dropped %lu records (total %lu)",
+            ring->worker_id,
+            (unsigned long) (dropped - ring->dropped_reported),
+            (unsigned long) dropped);
+    ring->dropped_reported = dropped;
+}
 
-        /* get current time */
-        clk = mk_api->time_unix();
+/* Consume all pending records from a worker ring */
+static int mk_logger_ring_drain(struct log_ring *ring)
+{
+    int n = 0;
+    size_t len;
+    char line[MK_LOGGER_LINE_MAX];
+    struct log_record *r;
+    struct log_target *target;
 
-        /* translate the backend events triggered */
-        mk_event_foreach(event, evl) {
-            entry = (struct log_target *) event;
-            target = entry->file;
-            fd = entry->pipe[0];
+    while ((r = mk_logger_ring_peek(ring))) {
+        target = r->target;
+        len = mk_logger_format(r, line);
+        mk_logger_ring_release(ring);
 
-            err = ioctl(fd, FIONREAD, &bytes);
-            if (mk_unlikely(err == -1)){
-                perror("ioctl");
-            }
+        if (target->buf_len + len > MK_LOGGER_BUFFER_SIZE) {
+            mk_logger_target_flush(target);
+        }
+        memcpy(target->buf + target->buf_len, line, len);
+        target->buf_len += len;
+        n++;
+    }
 
-            if (bytes < buffer_limit && clk <= timeout) {
-                continue;
-            }
+    return n;
+}
 
-            timeout = clk + mk_logger_timeout;
+static void mk_logger_start_worker(void *args)
+{
+    int i;
+    int n;
+    int workers = mk_api->config->workers;
+    time_t clk;
+    time_t timeout;
+    (void) args;
+    struct log_ring *ring;
 
-            flog = open(target, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
-            if (mk_unlikely(flog == -1)) {
-                mk_warn("Could not open logfile '%s' (%s)", target, strerror(errno));
-
-                int consumed = 0;
-                char buf[255];
-                do {
-                    slen = read(fd, buf, 255);
-                    if (slen > 0) {
-                        consumed += slen;
-                    }
-                    else {
-                        break;
-                    }
-                } while (consumed < bytes);
+    mk_api->worker_rename("monkey: logger");
+
+    /* Set initial timeout */
+    timeout = time(NULL) + mk_logger_timeout;
 
+    while (1) {
+        n = 0;
+        for (i = 0; i < workers; i++) {
+            ring = __atomic_load_n(&mk_logger_rings[i], __ATOMIC_ACQUIRE);
+            if (!ring) {
                 continue;
             }
+            n += mk_logger_ring_drain(ring);
+            mk_logger_ring_report(ring);
+        }
 
-            lseek(flog, 0, SEEK_END);
-            slen = _mk_logger_append(fd, flog, bytes);
-            if (mk_unlikely(slen == -1)) {
-                mk_warn("Could not write to log file: splice() = %ld", slen);
-            }
+        /* get current time */
+        clk = mk_api->time_unix();
+        if (clk >= timeout) {
+            mk_logger_flush_all();
+            timeout = clk + mk_logger_timeout;
+        }
 
-            MK_TRACE("written %i bytes", bytes);
-            close(flog);
+        /* nothing to do, do not spin */
+        if (n == 0) {
+            usleep(MK_LOGGER_WRITER_SLEEP);
         }
     }
 }
@@ -229,6 +545,8 @@ static void mk_logger_start_worker(void *args)
 static int mk_logger_read_config(char *path)
 {
     int timeout;
+    int ring_size;
+    char *format;
     char *logfilename = NULL;
     unsigned long len;
     char *default_file = NULL;
@@ -266,6 +584,37 @@ static int mk_logger_read_config(char *path)
 
         mk_logger_master_path = logfilename;
         MK_TRACE("MasterLog '%s'", mk_logger_master_path);
+
+        /* RingSize (optional) */
+        ring_size = (size_t) mk_api->config_section_get_key(section,
+                                                            "RingSize",
+                                                            MK_RCONF_NUM);
+        if (ring_size > 0) {
+            mk_logger_ring_size = ring_size;
+        }
+        MK_TRACE("RingSize %i records", mk_logger_ring_size);
+
+        /* Format (optional) */
+        format = mk_api->config_section_get_key(section, "Format",
+                                                MK_RCONF_STR);
+        if (format) {
+            if (strcasecmp(format, "text") == 0) {
+                mk_logger_format_type = MK_LOGGER_FORMAT_TEXT;
+            }
+            else if (strcasecmp(format, "json") == 0) {
+                mk_logger_format_type = MK_LOGGER_FORMAT_JSON;
+            }
+            else if (strcasecmp(format, "binary") == 0) {
+                mk_logger_format_type = MK_LOGGER_FORMAT_BINARY;
+            }
+            else {
+                mk_err("Format '%s' is not valid (text, json or binary)",
+                       format);
+                exit(EXIT_FAILURE);
+            }
+            mk_api->mem_free(format);
+        }
+        MK_TRACE("Format %i", mk_logger_format_type);
     }
 
     mk_api->mem_free(default_file);
@@ -313,13 +662,20 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
     mk_api = *api;
 
     /* Specific thread key */
-    pthread_key_create(&cache_iov, NULL);
-    pthread_key_create(&cache_content_length, NULL);
-    pthread_key_create(&cache_status, NULL);
-    pthread_key_create(&cache_ip_str, NULL);
+    pthread_key_create(&cache_ring, NULL);
+
+    logger_vhost_key = mk_api->vhost_data_key();
+    if (logger_vhost_key < 0) {
+        mk_err("[logger] no room for the virtual hosts data");
+        return -1;
+    }
+    mk_list_init(&targets_list);
+    pthread_mutex_init(&targets_lock, NULL);
 
     /* Global configuration */
     mk_logger_timeout = MK_LOGGER_TIMEOUT_DEFAULT;
+    mk_logger_ring_size = MK_LOGGER_RING_SIZE_DEFAULT;
+    mk_logger_format_type = MK_LOGGER_FORMAT_TEXT;
     mk_logger_master_path = NULL;
     mk_logger_read_config(confdir);
 
@@ -342,107 +698,134 @@ int mk_logger_plugin_init(struct plugin_api **api, char *confdir)
 
 int mk_logger_plugin_exit()
 {
+    int i;
     struct mk_list *head, *tmp;
     struct log_target *entry;
 
     mk_list_foreach_safe(head, tmp, &targets_list) {
         entry = mk_list_entry(head, struct log_target, _head);
         mk_list_del(&entry->_head);
-        if (entry->pipe[0] > 0) close(entry->pipe[0]);
-        if (entry->pipe[1] > 0) close(entry->pipe[1]);
+        mk_api->mem_free(entry->buf);
         mk_api->mem_free(entry->file);
         mk_api->mem_free(entry);
     }
 
+    if (mk_logger_rings) {
+        for (i = 0; i < mk_api->config->workers; i++) {
+            mk_logger_ring_destroy(mk_logger_rings[i]);
+        }
+        mk_api->mem_free(mk_logger_rings);
+    }
+
     mk_api->mem_free(mk_logger_master_path);
 
     return 0;
 }
 
-int mk_logger_master_init(struct mk_server_config *config)
+/* Get the target writing to 'file', the name is released if it exists */
+static struct log_target *mk_logger_target_get(char *file, int is_ok)
 {
-    (void) config;
+    struct mk_list *head;
     struct log_target *new;
+
+    mk_list_foreach(head, &targets_list) {
+        new = mk_list_entry(head, struct log_target, _head);
+        if (new->is_ok == is_ok && strcmp(new->file, file) == 0) {
+            mk_api->mem_free(file);
+            return new;
+        }
+    }
+
+    new = mk_api->mem_alloc(sizeof(struct log_target));
+    new->is_ok   = is_ok;
+    new->file    = file;
+    new->buf     = mk_api->mem_alloc(MK_LOGGER_BUFFER_SIZE);
+    new->buf_len = 0;
+    mk_list_add(&new->_head, &targets_list);
+
+    return new;
+}
+
+/* Set the targets of the virtual hosts, on startup and on reloads */
+static int mk_logger_vhost_init(struct mk_list *hosts)
+{
     struct host *entry_host;
-    struct mk_list *hosts = &mk_api->config->hosts;
     struct mk_list *head_host;
     struct mk_rconf_section *section;
+    struct log_vhost *lv;
     char *access_file_name = NULL;
     char *error_file_name = NULL;
 
-    /* Restore STDOUT if we are in background mode */
-    if (mk_logger_master_path != NULL && mk_api->config->is_daemon == MK_TRUE) {
-        mk_logger_master_stdout = freopen(mk_logger_master_path, "ae", stdout);
-        mk_logger_master_stderr = freopen(mk_logger_master_path, "ae", stderr);
-        mk_logger_print_details();
-    }
-
     MK_TRACE("Reading virtual hosts");
 
-    mk_list_init(&targets_list);
-
+    pthread_mutex_lock(&targets_lock);
     mk_list_foreach(head_host, hosts) {
         entry_host = mk_list_entry(head_host, struct host, _head);
 
         /* Read logger section from virtual host configuration */
         section = mk_api->config_section_get(entry_host->config, "LOGGER");
-        if (section) {
-            /* Read configuration entries */
-            access_file_name = (char *) mk_api->config_section_get_key(section,
-                                                                       "AccessLog",
-                                                                       MK_RCONF_STR);
-            error_file_name = (char *) mk_api->config_section_get_key(section,
-                                                                      "ErrorLog",
-                                                                      MK_RCONF_STR);
-
-            if (access_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_TRUE;
-
-                /* Set access pipe */
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                new->file = access_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
-            }
+        if (!section) {
+            continue;
+        }
 
-            /* Set error pipe */
-            if (error_file_name) {
-                new = mk_api->mem_alloc(sizeof(struct log_target));
-                new->is_ok = MK_FALSE;
-
-                if (pipe(new->pipe) < 0) {
-                    mk_err("Could not create pipe");
-                    exit(EXIT_FAILURE);
-                }
-                if (fcntl(new->pipe[1], F_SETFL, O_NONBLOCK) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[0], F_SETFD, FD_CLOEXEC) == -1) {
-                    perror("fcntl");
-                }
-                if (fcntl(new->pipe[1], F_SETFD, FD_CLOEXEC) == -1 ){
-                    perror("fcntl");
-                }
-                new->file = error_file_name;
-                new->host = entry_host;
-                mk_list_add(&new->_head, &targets_list);
+        /* Read configuration entries */
+        access_file_name = (char *) mk_api->config_section_get_key(section,
+                                                                   "AccessLog",
+                                                                   MK_RCONF_STR);
+        error_file_name = (char *) mk_api->config_section_get_key(section,
+                                                                  "ErrorLog",
+                                                                  MK_RCONF_STR);
 
-            }
+        lv = mk_api->mem_alloc_z(sizeof(struct log_vhost));
+
+        /* Set access target */
+        if (access_file_name) {
+            lv->access = mk_logger_target_get(access_file_name, MK_TRUE);
         }
+
+        /* Set error target */
+        if (error_file_name) {
+            lv->error = mk_logger_target_get(error_file_name, MK_FALSE);
+        }
+
+        entry_host->data[logger_vhost_key] = lv;
     }
+    pthread_mutex_unlock(&targets_lock);
+
+    return 0;
+}
+
+static void mk_logger_vhost_exit(struct mk_list *hosts)
+{
+    struct host *entry_host;
+    struct mk_list *head_host;
+
+    mk_list_foreach(head_host, hosts) {
+        entry_host = mk_list_entry(head_host, struct host, _head);
+        mk_api->mem_free(entry_host->data[logger_vhost_key]);
+        entry_host->data[logger_vhost_key] = NULL;
+    }
+}
+
+int mk_logger_master_init(struct mk_server_config *config)
+{
+    (void) config;
+
+    /* Restore STDOUT if we are in background mode */
+    if (mk_logger_master_path != NULL && mk_api->config->is_daemon == MK_TRUE) {
+        mk_logger_master_stdout = freopen(mk_logger_master_path, "ae", stdout);
+        mk_logger_master_stderr = freopen(mk_logger_master_path, "ae", stderr);
+        mk_logger_print_details();
+    }
+
+    mk_logger_vhost_init(&mk_api->config->gen->hosts);
+
+    /*
+     * Workers register their own ring on worker_init(), the writer thread
+     * just skips the slots not yet populated.
+     */
+    mk_logger_rings = mk_api->mem_alloc_z(sizeof(struct log_ring *) *
+                                          mk_api->config->workers);
 
     mk_api->worker_spawn((void *) mk_logger_start_worker, NULL);
     return 0;
@@ -450,53 +833,49 @@ int mk_logger_master_init(struct mk_server_config *config)
 
 void mk_logger_worker_init()
 {
-    struct mk_iov *iov_log;
-    mk_ptr_t *content_length;
-    mk_ptr_t *status;
-    mk_ptr_t *ip_str;
-
-
-    MK_TRACE("Creating thread cache");
-
-    /* Cache iov log struct */
-    iov_log = mk_api->iov_create(15, 0);
-    pthread_setspecific(cache_iov, (void *) iov_log);
-
-    /* Cache content length */
-    content_length = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    content_length->data = mk_api->mem_alloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    content_length->len = -1;
-    pthread_setspecific(cache_content_length, (void *) content_length);
-
-    /* Cahe status */
-    status = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    status->data = mk_api->mem_alloc_z(MK_UTILS_INT2MKP_BUFFER_LEN);
-    status->len = -1;
-    pthread_setspecific(cache_status, (void *) status);
-
-    /* Cache IP address */
-    ip_str = mk_api->mem_alloc_z(sizeof(mk_ptr_t));
-    ip_str->data = mk_api->mem_alloc_z(INET6_ADDRSTRLEN + 1);
-    ip_str->len  = -1;
-    pthread_setspecific(cache_ip_str, (void *) ip_str);
+    struct log_ring *ring;
+    struct mk_sched_worker *sched;
+
+    MK_TRACE("Creating thread ring");
+
+    sched = mk_api->sched_worker_info();
+    ring = mk_logger_ring_create(mk_logger_ring_size, sched->idx);
+    if (!ring) {
+        mk_err("[logger] could not allocate ring for worker %i", sched->idx);
+        return;
+    }
+
+    pthread_setspecific(cache_ring, (void *) ring);
+    __atomic_store_n(&mk_logger_rings[sched->idx], ring, __ATOMIC_RELEASE);
+}
+
+/* Copy a request field into a fixed size record slot */
+static inline unsigned short mk_logger_record_set(char *dst, size_t size,
+                                                  mk_ptr_t *src)
+{
+    size_t len;
+
+    if (!src->data || src->len == 0 || src->len == (unsigned long) -1) {
+        return 0;
+    }
+
+    len = src->len;
+    if (len > size) {
+        len = size;
+    }
+    memcpy(dst, src->data, len);
+
+    return len;
 }
 
 int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
 {
-    int i, http_status, ret, tmp;
-    int array_len = ARRAY_SIZE(response_codes);
     int access;
+    struct log_ring *ring;
+    struct log_record *r;
     struct log_target *target;
-    struct mk_iov *iov;
-    mk_ptr_t *date;
-    mk_ptr_t *content_length;
-    mk_ptr_t *ip_str;
-    mk_ptr_t status;
-
-    /* Set response status */
-    http_status = sr->headers.status;
 
-    if (http_status < 400) {
+    if (sr->headers.status < 400) {
         access = MK_TRUE;
     }
     else {
@@ -510,313 +889,53 @@ int mk_logger_stage40(struct mk_http_session *cs, struct mk_http_request *sr)
         return 0;
     }
 
-    /* Get iov cache struct and reset indexes */
-    iov = (struct mk_iov *) mk_logger_get_cache();
-    iov->iov_idx = 0;
-    iov->buf_idx = 0;
-    iov->total_len = 0;
-
-    /* Format IP string */
-    ip_str = pthread_getspecific(cache_ip_str);
-    ret = mk_api->socket_ip_str(cs->socket,
-                                &ip_str->data,
-                                INET6_ADDRSTRLEN + 1,
-                                &ip_str->len);
-    /*
-     * If the socket is not longer available ip_str can be null,
-     * so we must check this condition and return
-     */
-    if (mk_unlikely(ret < 0)) {
+    ring = pthread_getspecific(cache_ring);
+    if (mk_unlikely(!ring)) {
         return 0;
     }
 
-    /* Add IP to IOV */
-    mk_api->iov_add(iov,
-                    ip_str->data, ip_str->len,
-                    MK_FALSE);
-    mk_api->iov_add(iov,
-                    mk_logger_iov_dash.data,
-                    mk_logger_iov_dash.len,
-                    MK_FALSE);
-
-    /* Date/time when object was requested */
-    date = mk_api->time_human();
-    mk_api->iov_add(iov,
-                    date->data, date->len,
-                    MK_FALSE);
-    mk_api->iov_add(iov,
-                    mk_logger_iov_space.data,
-                    mk_logger_iov_space.len,
-                    MK_FALSE);
-
-    /* Access Log */
-    if (http_status < 400) {
-        /* No access file defined */
-        if (!target->file) {
-            return 0;
-        }
-
-        /* HTTP Method */
-        mk_api->iov_add(iov,
-                        sr->method_p.data,
-                        sr->method_p.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP URI required */
-        mk_api->iov_add(iov,
-                        sr->uri.data, sr->uri.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP Protocol */
-        mk_api->iov_add(iov,
-                        sr->protocol_p.data, sr->protocol_p.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* HTTP Status code response */
-        for (i=0; i < array_len; i++) {
-            if (response_codes[i].i_status == http_status) {
-                break;
-            }
-        }
-
-        if (array_len == i) {
-            mk_api->str_itop(http_status, &status);
-            status.len -= 2;
-        }
-        else {
-            status.data = response_codes[i].s_status;
-            status.len  = 3;
-        }
-        mk_api->iov_add(iov,
-                        status.data,
-                        status.len,
-                        MK_FALSE);
-        mk_api->iov_add(iov,
-                        mk_logger_iov_space.data,
-                        mk_logger_iov_space.len,
-                        MK_FALSE);
-
-        /* Content Length */
-        if (sr->method != MK_METHOD_HEAD) {
-            /* Int to mk_ptr_t */
-            content_length = pthread_getspecific(cache_content_length);
-
-            tmp = sr->headers.content_length;
-            if (tmp < 0) {
-                tmp = 0;
-            }
-
-            mk_api->str_itop(tmp, content_length);
+    /* Ring full: the record is counted as dropped */
+    r = mk_logger_ring_reserve(ring);
+    if (mk_unlikely(!r)) {
+        return 0;
+    }
 
-            mk_api->iov_add(iov,
-                            content_length->data, content_length->len - 2,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-        }
-        else {
-            mk_api->iov_add(iov,
-                            mk_logger_iov_empty.data,
-                            mk_logger_iov_empty.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-        }
+    /* Raw fields only, the peer address comes from accept(2) */
+    r->target = target;
+    r->time   = mk_api->time_unix();
+    r->fd     = cs->socket;
+    r->status = sr->headers.status;
+    r->method = sr->method;
+    r->peer   = cs->conn->peer;
 
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+    if (sr->init_ns > 0) {
+        r->latency = mk_clock_ns() - sr->init_ns;
     }
     else {
-        if (mk_unlikely(!target->file)) {
-            return 0;
-        }
+        r->latency = 0;
+    }
 
-        /* For unknown errors. Needs to exist until iov_send. */
-        char err_str[80];
-
-        switch (http_status) {
-        case MK_CLIENT_BAD_REQUEST:
-            mk_api->iov_add(iov,
-                            error_msg_400.data,
-                            error_msg_400.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_FORBIDDEN:
-            mk_api->iov_add(iov,
-                            error_msg_403.data,
-                            error_msg_403.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-
-            break;
-        case MK_CLIENT_NOT_FOUND:
-            mk_api->iov_add(iov,
-                            error_msg_404.data,
-                            error_msg_404.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-
-            break;
-        case MK_CLIENT_METHOD_NOT_ALLOWED:
-            mk_api->iov_add(iov,
-                            error_msg_405.data,
-                            error_msg_405.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->method_p.data,
-                            sr->method_p.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_REQUEST_TIMEOUT:
-            mk_api->iov_add(iov,
-                            error_msg_408.data,
-                            error_msg_408.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_LENGTH_REQUIRED:
-            mk_api->iov_add(iov,
-                            error_msg_411.data,
-                            error_msg_411.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_CLIENT_REQUEST_ENTITY_TOO_LARGE:
-            mk_api->iov_add(iov,
-                            error_msg_413.data,
-                            error_msg_413.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_NOT_IMPLEMENTED:
-            mk_api->iov_add(iov,
-                            error_msg_501.data,
-                            error_msg_501.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->method_p.data,
-                            sr->method_p.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_INTERNAL_ERROR:
-            mk_api->iov_add(iov,
-                            error_msg_500.data,
-                            error_msg_500.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            break;
-        case MK_SERVER_HTTP_VERSION_UNSUP:
-            mk_api->iov_add(iov,
-                            error_msg_505.data,
-                            error_msg_505.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            break;
-        default:
-            {
-            int len = snprintf(err_str, 80, "[error %u] (no description)", http_status);
-            err_str[79] = '\0';
-            if (len > 79) len = 79;
-
-            mk_api->iov_add(iov,
-                            err_str,
-                            len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_space.data,
-                            mk_logger_iov_space.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            sr->uri.data,
-                            sr->uri.len,
-                            MK_FALSE);
-            mk_api->iov_add(iov,
-                            mk_logger_iov_lf.data,
-                            mk_logger_iov_lf.len,
-                            MK_FALSE);
-            }
-            break;
+    if (sr->method != MK_METHOD_HEAD) {
+        r->content_length = sr->headers.content_length;
+        if (r->content_length < 0) {
+            r->content_length = 0;
         }
-
-
-        /* Write iov array to pipe */
-        mk_api->iov_send(target->pipe[1], iov);
+    }
+    else {
+        r->content_length = -1;
     }
 
+    r->method_len   = mk_logger_record_set(r->method_str,
+                                           sizeof(r->method_str),
+                                           &sr->method_p);
+    r->protocol_len = mk_logger_record_set(r->protocol,
+                                           sizeof(r->protocol),
+                                           &sr->protocol_p);
+    r->uri_len      = mk_logger_record_set(r->uri,
+                                           sizeof(r->uri),
+                                           &sr->uri);
+
+    mk_logger_ring_commit(ring);
     return 0;
 }
 
@@ -839,6 +958,10 @@ struct mk_plugin mk_plugin_logger = {
     .master_init   = mk_logger_master_init,
     .worker_init   = mk_logger_worker_init,
 
+    /* Configuration reload */
+    .vhost_init    = mk_logger_vhost_init,
+    .vhost_exit    = mk_logger_vhost_exit,
+
     /* Type */
     .stage         = &mk_plugin_stage_logger
 };
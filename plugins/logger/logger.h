@@ -24,35 +24,60 @@
 #include <stdio.h>
 #include <monkey/mk_api.h>
 
-#define MK_LOGGER_PIPE_LIMIT 0.75
+#include "ring.h"
+#include "format.h"
+
 #define MK_LOGGER_TIMEOUT_DEFAULT 3
 
+/* Writer thread: idle wait and per target output buffer */
+#define MK_LOGGER_WRITER_SLEEP    1000     /* usecs */
+#define MK_LOGGER_BUFFER_SIZE     65536
+#define MK_LOGGER_LINE_MAX        2048
+
 int mk_logger_timeout;
+int mk_logger_ring_size;
+int mk_logger_format_type;
 
 /* MasterLog variables */
 char *mk_logger_master_path;
 FILE *mk_logger_master_stdout;
 FILE *mk_logger_master_stderr;
 
-pthread_key_t cache_content_length;
-pthread_key_t cache_status;
-pthread_key_t cache_ip_str;
-pthread_key_t cache_iov;
+pthread_key_t cache_ring;
 
 struct log_target
 {
-    struct mk_event event;
-
-    /* Pipes */
     int is_ok;
-    int pipe[2];
     char *file;
 
-    struct host *host;
+    /*
+     * Output buffer, only touched by the writer thread. Formatted lines
+     * are appended here and flushed in a single write(2) when the buffer
+     * gets full or the FlushTimeout expires.
+     */
+    char *buf;
+    size_t buf_len;
+
     struct mk_list _head;
 };
 
+/* Targets of a virtual host, kept in host->data[logger_vhost_key] */
+struct log_vhost
+{
+    struct log_target *access;
+    struct log_target *error;
+};
+
+/*
+ * The targets live until the plugin exits: the records in the rings point
+ * to them, and a configuration reload reuses the ones already opened.
+ */
 struct mk_list targets_list;
+pthread_mutex_t targets_lock;
+
+int logger_vhost_key;
 
+/* One ring per worker, indexed by the scheduler worker id */
+struct log_ring **mk_logger_rings;
 
 #endif
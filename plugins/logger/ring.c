@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <monkey/mk_api.h>
+
+#include "ring.h"
+
+/* Round up to the next power of two so we can mask the indexes */
+static uint32_t ring_size_align(int size)
+{
+    uint32_t n = 1;
+
+    if (size <= 0) {
+        size = MK_LOGGER_RING_SIZE_DEFAULT;
+    }
+
+    while (n < (uint32_t) size) {
+        n <<= 1;
+    }
+
+    return n;
+}
+
+struct log_ring *mk_logger_ring_create(int size, int worker_id)
+{
+    int ret;
+    void *mem = NULL;
+    struct log_ring *ring;
+
+    /* The ring indexes are cache line aligned, so must be the struct */
+    ret = posix_memalign(&mem, MK_LOGGER_CACHE_LINE, sizeof(struct log_ring));
+    if (ret != 0) {
+        return NULL;
+    }
+    ring = mem;
+    memset(ring, '\0', sizeof(struct log_ring));
+
+    ring->size = ring_size_align(size);
+    ring->mask = ring->size - 1;
+    ring->worker_id = worker_id;
+    ring->records = mk_api->mem_alloc_z(sizeof(struct log_record) * ring->size);
+    if (!ring->records) {
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+void mk_logger_ring_destroy(struct log_ring *ring)
+{
+    if (!ring) {
+        return;
+    }
+
+    mk_api->mem_free(ring->records);
+    free(ring);
+}
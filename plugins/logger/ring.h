@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_LOGGER_RING_H
+#define MK_LOGGER_RING_H
+
+#include <time.h>
+#include <stdint.h>
+#include <monkey/mk_socket.h>
+
+#define MK_LOGGER_RING_SIZE_DEFAULT  1024
+#define MK_LOGGER_RECORD_URI         256
+#define MK_LOGGER_RECORD_METHOD      16
+#define MK_LOGGER_CACHE_LINE         64
+
+struct log_target;
+
+/*
+ * A log record is a fixed layout snapshot of the fields required to
+ * compose a log line. The worker only copies raw values (the peer
+ * address was captured by the scheduler at accept time), all the
+ * formatting happens later on the writer thread.
+ */
+struct log_record
+{
+    struct log_target *target;
+    time_t time;
+    int fd;
+    int status;
+    int method;
+    long content_length;
+    uint64_t latency;
+
+    unsigned short uri_len;
+    unsigned short method_len;
+    unsigned short protocol_len;
+
+    union mk_socket_addr peer;
+    char method_str[MK_LOGGER_RECORD_METHOD];
+    char protocol[MK_LOGGER_RECORD_METHOD];
+    char uri[MK_LOGGER_RECORD_URI];
+};
+
+/*
+ * Single producer / single consumer ring: the worker thread owning the
+ * ring is the only producer and the logger thread is the only consumer,
+ * so head and tail just need acquire/release ordering. Each index lives
+ * on its own cache line to avoid false sharing between both threads.
+ */
+struct log_ring
+{
+    /* written by the producer (worker) */
+    uint64_t head __attribute__ ((aligned (MK_LOGGER_CACHE_LINE)));
+    uint64_t dropped;
+
+    /* written by the consumer (logger thread) */
+    uint64_t tail __attribute__ ((aligned (MK_LOGGER_CACHE_LINE)));
+    uint64_t dropped_reported;
+
+    /* read only after creation */
+    uint32_t size __attribute__ ((aligned (MK_LOGGER_CACHE_LINE)));
+    uint32_t mask;
+    int worker_id;
+    struct log_record *records;
+};
+
+struct log_ring *mk_logger_ring_create(int size, int worker_id);
+void mk_logger_ring_destroy(struct log_ring *ring);
+
+/*
+ * Reserve the next free slot for the producer, returns NULL if the ring
+ * is full. The record becomes visible to the consumer after calling
+ * mk_logger_ring_commit().
+ */
+static inline struct log_record *mk_logger_ring_reserve(struct log_ring *ring)
+{
+    uint64_t head;
+    uint64_t tail;
+
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= ring->size) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return &ring->records[head & ring->mask];
+}
+
+static inline void mk_logger_ring_commit(struct log_ring *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side: peek the oldest record, NULL if the ring is empty */
+static inline struct log_record *mk_logger_ring_peek(struct log_ring *ring)
+{
+    uint64_t head;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail == head) {
+        return NULL;
+    }
+
+    return &ring->records[ring->tail & ring->mask];
+}
+
+static inline void mk_logger_ring_release(struct log_ring *ring)
+{
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,324 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * mk_logconv: convert the binary or JSON lines log files written by the
+ * logger plugin into the Combined Log Format:
+ *
+ *   host ident user [date] "request" status bytes "referer" "user-agent"
+ *
+ * Monkey does not record ident, user, referer or user-agent, these
+ * fields are always written as a dash.
+ */
+
+#ifdef MALLOC_JEMALLOC
+#undef MALLOC_JEMALLOC
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+
+#include "format.h"
+
+#define MAX_LINE_LEN   4096
+#define MAX_FIELD_LEN  1024
+
+struct log_entry {
+    long time;
+    long status;
+    long bytes;
+    unsigned long latency;
+    char remote[INET6_ADDRSTRLEN];
+    char method[MAX_FIELD_LEN];
+    char uri[MAX_FIELD_LEN];
+    char protocol[MAX_FIELD_LEN];
+};
+
+static int show_latency = 0;
+
+static void print_entry(FILE *out, struct log_entry *e)
+{
+    time_t t = e->time;
+    struct tm tm;
+    char date[64];
+
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z",
+             localtime_r(&t, &tm));
+
+    fprintf(out, "%s - - [%s] \"%s %s %s\" %li ",
+            e->remote[0] ? e->remote : "-", date,
+            e->method, e->uri, e->protocol, e->status);
+
+    if (e->bytes > 0) {
+        fprintf(out, "%li", e->bytes);
+    }
+    else {
+        fprintf(out, "-");
+    }
+    fprintf(out, " \"-\" \"-\"");
+
+    if (show_latency) {
+        fprintf(out, " %lu", e->latency / 1000);
+    }
+    fprintf(out, "\n");
+}
+
+/* Copy a non NULL terminated string from a binary record */
+static void bin_str(char *dst, char *src, size_t len)
+{
+    if (len >= MAX_FIELD_LEN) {
+        len = MAX_FIELD_LEN - 1;
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+static int convert_binary(FILE *in, FILE *out)
+{
+    size_t len;
+    size_t off;
+    char buf[sizeof(struct log_bin_record) + 65536];
+    struct log_bin_record *bin = (struct log_bin_record *) buf;
+    struct log_entry e;
+
+    while (fread(bin, sizeof(struct log_bin_record), 1, in) == 1) {
+        if (bin->magic != MK_LOGGER_BIN_MAGIC ||
+            bin->size < sizeof(struct log_bin_record)) {
+            fprintf(stderr, "Invalid binary record at offset %li\n",
+                    ftell(in) - (long) sizeof(struct log_bin_record));
+            return -1;
+        }
+
+        len = bin->size - sizeof(struct log_bin_record);
+        if (len != (size_t) bin->method_len + bin->protocol_len + bin->uri_len) {
+            fprintf(stderr, "Invalid binary record length\n");
+            return -1;
+        }
+
+        if (len > 0 &&
+            fread(buf + sizeof(struct log_bin_record), len, 1, in) != 1) {
+            fprintf(stderr, "Truncated binary record\n");
+            return -1;
+        }
+
+        memset(&e, '\0', sizeof(e));
+        e.time    = bin->time;
+        e.status  = bin->status;
+        e.bytes   = bin->bytes;
+        e.latency = bin->latency;
+
+        if (bin->family == 4) {
+            inet_ntop(AF_INET, bin->addr, e.remote, sizeof(e.remote));
+        }
+        else if (bin->family == 6) {
+            inet_ntop(AF_INET6, bin->addr, e.remote, sizeof(e.remote));
+        }
+
+        off = sizeof(struct log_bin_record);
+        bin_str(e.method, buf + off, bin->method_len);
+        off += bin->method_len;
+        bin_str(e.protocol, buf + off, bin->protocol_len);
+        off += bin->protocol_len;
+        bin_str(e.uri, buf + off, bin->uri_len);
+
+        print_entry(out, &e);
+    }
+
+    return 0;
+}
+
+/* Locate the value of 'key' in a flat JSON object */
+static char *json_value(char *line, const char *key)
+{
+    char pattern[64];
+    char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+    if (!p) {
+        return NULL;
+    }
+
+    return p + strlen(pattern);
+}
+
+static long json_num(char *line, const char *key)
+{
+    char *p;
+
+    p = json_value(line, key);
+    if (!p) {
+        return 0;
+    }
+
+    return strtol(p, NULL, 10);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return 0;
+}
+
+/* Read and unescape a JSON string value, \u escapes are 8 bits only */
+static void json_str(char *line, const char *key, char *dst, size_t size)
+{
+    size_t i = 0;
+    char *p;
+
+    dst[0] = '\0';
+    p = json_value(line, key);
+    if (!p || *p != '"') {
+        return;
+    }
+    p++;
+
+    while (*p && *p != '"' && i < size - 1) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            if (*p == 'u' && strlen(p) >= 5) {
+                dst[i++] = (hex_value(p[3]) << 4) | hex_value(p[4]);
+                p += 5;
+                continue;
+            }
+        }
+        dst[i++] = *p++;
+    }
+    dst[i] = '\0';
+}
+
+static int convert_json(FILE *in, FILE *out)
+{
+    char line[MAX_LINE_LEN];
+    struct log_entry e;
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] != '{') {
+            continue;
+        }
+
+        memset(&e, '\0', sizeof(e));
+        e.time    = json_num(line, "time");
+        e.status  = json_num(line, "status");
+        e.bytes   = json_num(line, "bytes");
+        e.latency = json_num(line, "latency_ns");
+        json_str(line, "remote", e.remote, sizeof(e.remote));
+        json_str(line, "method", e.method, sizeof(e.method));
+        json_str(line, "uri", e.uri, sizeof(e.uri));
+        json_str(line, "protocol", e.protocol, sizeof(e.protocol));
+
+        print_entry(out, &e);
+    }
+
+    return 0;
+}
+
+static void print_help(int full_help)
+{
+    printf("Usage: mk_logconv [-l] [-o output] [logfile]\n");
+    if (full_help) {
+        printf("\nConvert binary or JSON logger files to Combined Log Format."
+               "\nThe input format is detected automatically, if no file is"
+               "\ngiven the log is read from the standard input.\n");
+        printf("\nOptions:\n");
+        printf("  -h, --help\tshow this help message and exit\n");
+        printf("  -l, --latency\tappend the request latency (usecs)\n");
+        printf("  -o, --output\twrite the result to a file\n");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    int c;
+    int ret;
+    FILE *in = stdin;
+    FILE *out = stdout;
+
+    static const struct option long_opts[] = {
+        {"latency", no_argument, NULL, 'l'},
+        {"output", required_argument, NULL, 'o'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "hlo:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'l':
+            show_latency = 1;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (!out) {
+                printf("Error opening: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'h':
+            print_help(1);
+            exit(EXIT_SUCCESS);
+        default:
+            print_help(0);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) {
+        in = fopen(argv[optind], "r");
+        if (!in) {
+            printf("Error opening file %s\n", argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Detect the input format from the first byte, JSON lines start with '{' */
+    c = getc(in);
+    if (c == EOF) {
+        return EXIT_SUCCESS;
+    }
+    ungetc(c, in);
+
+    if (c == '{') {
+        ret = convert_json(in, out);
+    }
+    else {
+        ret = convert_binary(in, out);
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
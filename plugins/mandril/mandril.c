@@ -27,23 +27,380 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <ctype.h>
 
 #include "mandril.h"
+#include "ratelimit.h"
 
 static struct mk_rconf *conf;
 
+static inline int mk_security_ip_bit(unsigned char *ip, int i)
+{
+    return (ip[i >> 3] >> (7 - (i & 7))) & 1;
+}
+
+static int mk_security_ip_node(struct mk_secure_ip_trie *trie)
+{
+    unsigned int size;
+    struct mk_secure_ip_node *nodes;
+
+    if (trie->n_nodes == trie->size) {
+        size = trie->size ? trie->size * 2 : 64;
+        nodes = mk_api->mem_realloc(trie->nodes, sizeof(*nodes) * size);
+        if (!nodes) {
+            return -1;
+        }
+        trie->nodes = nodes;
+        trie->size  = size;
+    }
+
+    memset(&trie->nodes[trie->n_nodes], '\0', sizeof(*trie->nodes));
+    return trie->n_nodes++;
+}
+
+/* Insert the first 'prefix' bits of 'ip' as a deny rule */
+static int mk_security_ip_insert(struct mk_secure_ip_trie *trie,
+                                 unsigned char *ip, int prefix)
+{
+    int i;
+    int bit;
+    int child;
+    uint32_t node = 0;
+
+    if (trie->n_nodes == 0 && mk_security_ip_node(trie) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < prefix; i++) {
+        /* A shorter rule already covers this one */
+        if (trie->nodes[node].deny) {
+            break;
+        }
+
+        bit = mk_security_ip_bit(ip, i);
+        if (trie->nodes[node].child[bit] == 0) {
+            child = mk_security_ip_node(trie);
+            if (child < 0) {
+                return -1;
+            }
+            trie->nodes[node].child[bit] = child;
+        }
+        node = trie->nodes[node].child[bit];
+    }
+
+    trie->nodes[node].deny = 1;
+    trie->rules++;
+    return 0;
+}
+
+/* Returns -1 if the address matches a rule */
+static int mk_security_ip_lookup(struct mk_secure_ip_trie *trie,
+                                 unsigned char *ip)
+{
+    int i;
+    uint32_t node = 0;
+
+    for (i = 0; i < trie->bits; i++) {
+        if (trie->nodes[node].deny) {
+            return -1;
+        }
+
+        node = trie->nodes[node].child[mk_security_ip_bit(ip, i)];
+        if (node == 0) {
+            return 0;
+        }
+    }
+
+    return trie->nodes[node].deny ? -1 : 0;
+}
+
+/* Release the unused slots once all the rules are loaded */
+static void mk_security_ip_compact(struct mk_secure_ip_trie *trie)
+{
+    struct mk_secure_ip_node *nodes;
+
+    if (trie->n_nodes == 0 || trie->n_nodes == trie->size) {
+        return;
+    }
+
+    nodes = mk_api->mem_realloc(trie->nodes, sizeof(*nodes) * trie->n_nodes);
+    if (nodes) {
+        trie->nodes = nodes;
+        trie->size  = trie->n_nodes;
+    }
+
+    PLUGIN_TRACE("IPv%i rules: %u, trie nodes: %u",
+                 trie->bits == 32 ? 4 : 6, trie->rules, trie->n_nodes);
+}
+
+/* Parse an 'IP' rule: an IPv4 or IPv6 address with an optional /prefix */
+static int mk_security_ip_add(char *rule)
+{
+    int max;
+    long prefix;
+    char *end;
+    char *slash;
+    char addr[INET6_ADDRSTRLEN];
+    unsigned char ip[sizeof(struct in6_addr)];
+    struct mk_secure_ip_trie *trie;
+
+    slash = strchr(rule, '/');
+    if (slash) {
+        if (slash - rule >= (int) sizeof(addr)) {
+            return -1;
+        }
+        memcpy(addr, rule, slash - rule);
+        addr[slash - rule] = '\0';
+    }
+    else {
+        snprintf(addr, sizeof(addr), "%s", rule);
+    }
+
+    if (inet_pton(AF_INET, addr, ip) == 1) {
+        trie = &mk_secure_ip4;
+    }
+    else if (inet_pton(AF_INET6, addr, ip) == 1) {
+        trie = &mk_secure_ip6;
+    }
+    else {
+        return -1;
+    }
+
+    max = trie->bits;
+    prefix = max;
+    if (slash) {
+        errno = 0;
+        prefix = strtol(slash + 1, &end, 10);
+        if (errno != 0 || end == slash + 1 || *end != '\0' ||
+            prefix < 0 || prefix > max) {
+            return -1;
+        }
+    }
+
+    return mk_security_ip_insert(trie, ip, prefix);
+}
+
+/* Queue a URL rule, the rules are compiled once all of them are read */
+static int mk_security_rules_add(struct mk_secure_rules *set, char *rule)
+{
+    int size;
+    char **rules;
+
+    if (*rule == '\0' || (*rule == '^' && rule[1] == '\0')) {
+        mk_warn("Mandril: empty URL rule ignored");
+        return -1;
+    }
+
+    if (set->n_rules == set->size) {
+        size = set->size ? set->size * 2 : 16;
+        rules = mk_api->mem_realloc(set->rules, sizeof(char *) * size);
+        if (!rules) {
+            return -1;
+        }
+        set->rules = rules;
+        set->size  = size;
+    }
+
+    set->rules[set->n_rules++] = rule;
+    return 0;
+}
+
+/*
+ * Build the automaton for the rules that are anchored (starting with '^')
+ * or not. Missing transitions of an anchored automaton lead back to the
+ * root, which is never a valid target, so the scan stops there; for the
+ * others they are resolved through the failure links so the scan never
+ * has to backtrack.
+ */
+static int mk_security_ac_build(struct mk_secure_ac *ac,
+                                struct mk_secure_rules *set, int anchored)
+{
+    int i;
+    int head;
+    int tail;
+    unsigned int c;
+    unsigned int s;
+    unsigned int u;
+    unsigned int max_states = 1;
+    unsigned char *p;
+    uint32_t *fail;
+    uint32_t *queue;
+    uint32_t *next;
+
+    ac->anchored  = anchored;
+    ac->n_classes = 1;
+    ac->n_states  = 0;
+
+    /* Byte classes, case insensitive */
+    for (i = 0; i < set->n_rules; i++) {
+        p = (unsigned char *) set->rules[i];
+        if ((*p == '^') != anchored) {
+            continue;
+        }
+        if (anchored) {
+            p++;
+        }
+
+        for (; *p; p++, max_states++) {
+            c = tolower(*p);
+            if (ac->classes[c] == 0) {
+                ac->classes[c] = ac->n_classes++;
+                ac->classes[toupper(c)] = ac->classes[c];
+            }
+        }
+    }
+
+    if (max_states == 1) {
+        return 0;
+    }
+
+    ac->next = mk_api->mem_alloc_z(sizeof(uint32_t) * max_states *
+                                   ac->n_classes);
+    ac->out  = mk_api->mem_alloc_z(max_states);
+    if (!ac->next || !ac->out) {
+        return -1;
+    }
+
+    /* Goto function: a plain trie of the rules */
+    ac->n_states = 1;
+    for (i = 0; i < set->n_rules; i++) {
+        p = (unsigned char *) set->rules[i];
+        if ((*p == '^') != anchored) {
+            continue;
+        }
+        if (anchored) {
+            p++;
+        }
+
+        for (s = 0; *p; p++) {
+            next = &ac->next[s * ac->n_classes + ac->classes[*p]];
+            if (*next == 0) {
+                *next = ac->n_states++;
+            }
+            s = *next;
+        }
+        ac->out[s] = 1;
+    }
+
+    if (!anchored) {
+        fail  = mk_api->mem_alloc_z(sizeof(uint32_t) * ac->n_states);
+        queue = mk_api->mem_alloc(sizeof(uint32_t) * ac->n_states);
+        if (!fail || !queue) {
+            mk_api->mem_free(fail);
+            mk_api->mem_free(queue);
+            return -1;
+        }
+
+        /* Breadth first, a state fails to a shallower one */
+        head = tail = 0;
+        for (c = 0; c < ac->n_classes; c++) {
+            u = ac->next[c];
+            if (u) {
+                queue[tail++] = u;
+            }
+        }
+
+        while (head < tail) {
+            s = queue[head++];
+            next = &ac->next[s * ac->n_classes];
+
+            for (c = 0; c < ac->n_classes; c++) {
+                u = next[c];
+                if (u) {
+                    fail[u] = ac->next[fail[s] * ac->n_classes + c];
+                    ac->out[u] |= ac->out[fail[u]];
+                    queue[tail++] = u;
+                }
+                else {
+                    next[c] = ac->next[fail[s] * ac->n_classes + c];
+                }
+            }
+        }
+
+        mk_api->mem_free(fail);
+        mk_api->mem_free(queue);
+    }
+
+    /* Release the slots of the rules sharing a prefix */
+    next = mk_api->mem_realloc(ac->next, sizeof(uint32_t) * ac->n_states *
+                               ac->n_classes);
+    if (next) {
+        ac->next = next;
+    }
+
+    PLUGIN_TRACE("%s automaton: %u states, %u classes",
+                 anchored ? "prefix" : "substring",
+                 ac->n_states, ac->n_classes);
+    return 0;
+}
+
+static int mk_security_rules_compile(struct mk_secure_rules *set)
+{
+    int ret;
+
+    if (set->n_rules == 0) {
+        return 0;
+    }
+
+    ret = mk_security_ac_build(&set->any, set, MK_FALSE);
+    if (ret == 0) {
+        ret = mk_security_ac_build(&set->prefix, set, MK_TRUE);
+    }
+
+    /* The rules point to the configuration values, just drop the index */
+    mk_api->mem_free(set->rules);
+    set->rules = NULL;
+    set->size  = 0;
+
+    return ret;
+}
+
+static void mk_security_rules_free(struct mk_secure_rules *set)
+{
+    mk_api->mem_free(set->any.next);
+    mk_api->mem_free(set->any.out);
+    mk_api->mem_free(set->prefix.next);
+    mk_api->mem_free(set->prefix.out);
+}
+
+static int mk_security_ac_match(struct mk_secure_ac *ac,
+                                unsigned char *data, size_t len)
+{
+    size_t i;
+    uint32_t s = 0;
+
+    if (ac->n_states == 0) {
+        return MK_FALSE;
+    }
+
+    for (i = 0; i < len; i++) {
+        s = ac->next[s * ac->n_classes + ac->classes[data[i]]];
+        if (ac->out[s]) {
+            return MK_TRUE;
+        }
+        else if (s == 0 && ac->anchored) {
+            break;
+        }
+    }
+
+    return MK_FALSE;
+}
+
+/* Does the URI match any rule of the set ? */
+static int mk_security_rules_match(struct mk_secure_rules *set, mk_ptr_t url)
+{
+    return (mk_security_ac_match(&set->prefix,
+                                 (unsigned char *) url.data, url.len) ||
+            mk_security_ac_match(&set->any,
+                                 (unsigned char *) url.data, url.len));
+}
+
 /* Read database configuration parameters */
 static int mk_security_conf(char *confdir)
 {
-    int n;
     int ret = 0;
     unsigned long len;
     char *conf_path = NULL;
-    char *_net, *_mask;
-
-    struct mk_secure_ip_t *new_ip;
-    struct mk_secure_url_t *new_url;
-    struct mk_secure_deny_hotlink_t *new_deny_hotlink;
 
     struct mk_rconf_section *section;
     struct mk_rconf_entry *entry;
@@ -56,6 +413,8 @@ static int mk_security_conf(char *confdir)
         return -1;
     }
 
+    mk_rate_conf_read(conf);
+
     section = mk_api->config_section_get(conf, "RULES");
     if (!section) {
         return -1;
@@ -66,148 +425,77 @@ static int mk_security_conf(char *confdir)
 
         /* Passing to internal struct */
         if (strcasecmp(entry->key, "IP") == 0) {
-            new_ip = mk_api->mem_alloc(sizeof(struct mk_secure_ip_t));
-            n = mk_api->str_search(entry->val, "/", 1);
-
-            /* subnet */
-            if (n > 0) {
-                /* split network addr and netmask */
-                _net  = mk_api->str_copy_substr(entry->val, 0, n);
-                _mask = mk_api->str_copy_substr(entry->val,
-                                                n + 1,
-                                                strlen(entry->val));
-
-                /* validations... */
-                if (!_net ||  !_mask) {
-                    mk_warn("Mandril: cannot parse entry '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* convert ip string to network address */
-                if (inet_aton(_net, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* parse mask */
-                new_ip->netmask = strtol(_mask, (char **) NULL, 10);
-                if (new_ip->netmask <= 0 || new_ip->netmask >= 32) {
-                    mk_warn("Mandril: invalid mask value '%s' in RULES section",
-                            entry->val);
-                    goto ip_next;
-                }
-
-                /* complete struct data */
-                new_ip->is_subnet = MK_TRUE;
-                new_ip->network = MK_NET_NETWORK(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmin = MK_NET_HOSTMIN(new_ip->ip.s_addr, new_ip->netmask);
-                new_ip->hostmax = MK_NET_HOSTMAX(new_ip->ip.s_addr, new_ip->netmask);
-
-                /* link node with main list */
-                mk_list_add(&new_ip->_head, &mk_secure_ip);
-
-            /*
-             * I know, you were instructed to hate 'goto' statements!, ok, show this
-             * code to your teacher and let him blame :P
-             */
-            ip_next:
-                if (_net) {
-                    mk_api->mem_free(_net);
-                }
-                if (_mask) {
-                    mk_api->mem_free(_mask);
-                }
-            }
-            else { /* normal IP address */
-
-                /* convert ip string to network address */
-                if (inet_aton(entry->val, &new_ip->ip) == 0) {
-                    mk_warn("Mandril: invalid ip address '%s' in RULES section",
-                            entry->val);
-                }
-                else {
-                    new_ip->is_subnet = MK_FALSE;
-                    mk_list_add(&new_ip->_head, &mk_secure_ip);
-                }
+            if (mk_security_ip_add(entry->val) != 0) {
+                mk_warn("Mandril: invalid IP rule '%s' in RULES section",
+                        entry->val);
             }
         }
         else if (strcasecmp(entry->key, "URL") == 0) {
-            /* simple allcotion and data association */
-            new_url = mk_api->mem_alloc(sizeof(struct mk_secure_url_t));
-            new_url->criteria = entry->val;
-
-            /* link node with main list */
-            mk_list_add(&new_url->_head, &mk_secure_url);
+            mk_security_rules_add(&mk_secure_url, entry->val);
         }
         else if (strcasecmp(entry->key, "deny_hotlink") == 0) {
-            new_deny_hotlink = mk_api->mem_alloc(sizeof(*new_deny_hotlink));
-            new_deny_hotlink->criteria = entry->val;
-
-            mk_list_add(&new_deny_hotlink->_head, &mk_secure_deny_hotlink);
+            mk_security_rules_add(&mk_secure_deny_hotlink, entry->val);
         }
     }
 
+    mk_security_ip_compact(&mk_secure_ip4);
+    mk_security_ip_compact(&mk_secure_ip6);
+
+    if (mk_security_rules_compile(&mk_secure_url) != 0 ||
+        mk_security_rules_compile(&mk_secure_deny_hotlink) != 0) {
+        mk_err("Mandril: cannot compile the URL rules");
+        ret = -1;
+    }
+
     mk_api->mem_free(conf_path);
     return ret;
 }
 
-static int mk_security_check_ip(int socket)
+static int mk_security_check_ip(int socket, union mk_socket_addr *addr)
 {
-    int network;
-    struct mk_secure_ip_t *entry;
-    struct mk_list *head;
-    struct in_addr *addr;
-    struct sockaddr_in addr_t;
-    socklen_t len = sizeof(addr_t);
+    int ret;
+    unsigned char *ip;
+    struct mk_secure_ip_trie *trie;
 
-    if (getpeername(socket, (struct sockaddr *) &addr_t, &len) != 0) {
-        perror("getpeername");
-        return -1;
-    }
+    (void) socket;
 
-    addr = &(addr_t).sin_addr;
+    if (addr->sa.sa_family == AF_INET) {
+        trie = &mk_secure_ip4;
+        ip = (unsigned char *) &addr->in4.sin_addr;
+    }
+    else if (addr->sa.sa_family == AF_INET6) {
+        ip = addr->in6.sin6_addr.s6_addr;
 
-    PLUGIN_TRACE("[FD %i] Mandril validating IP address", socket);
-    mk_list_foreach(head, &mk_secure_ip) {
-        entry = mk_list_entry(head, struct mk_secure_ip_t, _head);
-
-        if (entry->is_subnet == MK_TRUE) {
-            /* Validate network */
-            network = MK_NET_NETWORK(addr->s_addr, entry->netmask);
-            if (network != entry->network) {
-                continue;
-            }
-            /* Validate host range */
-            if (addr->s_addr <= entry->hostmax && addr->s_addr >= entry->hostmin) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in ranges", socket);
-                return -1;
-            }
+        /* IPv4 clients on a dual stack listener: ::ffff:a.b.c.d */
+        if (IN6_IS_ADDR_V4MAPPED(&addr->in6.sin6_addr)) {
+            trie = &mk_secure_ip4;
+            ip += 12;
         }
         else {
-            if (addr->s_addr == entry->ip.s_addr) {
-                PLUGIN_TRACE("[FD %i] Mandril closing by rule in IP match", socket);
-                return -1;
-            }
+            trie = &mk_secure_ip6;
         }
     }
-    return 0;
+    else {
+        return 0;
+    }
+
+    if (trie->rules == 0) {
+        return 0;
+    }
+
+    PLUGIN_TRACE("[FD %i] Mandril validating IP address", socket);
+    ret = mk_security_ip_lookup(trie, ip);
+    if (ret != 0) {
+        PLUGIN_TRACE("[FD %i] Mandril closing by IP rule", socket);
+    }
+    return ret;
 }
 
 /* Check if the incoming URL is restricted for some rule */
 static int mk_security_check_url(mk_ptr_t url)
 {
-    int n;
-    struct mk_list *head;
-    struct mk_secure_url_t *entry;
-
-    mk_list_foreach(head, &mk_secure_url) {
-        entry = mk_list_entry(head, struct mk_secure_url_t, _head);
-        n = mk_api->str_search_n(url.data, entry->criteria, MK_STR_INSENSITIVE, url.len);
-        if (n >= 0) {
-            return -1;
-        }
+    if (mk_security_rules_match(&mk_secure_url, url) == MK_TRUE) {
+        return -1;
     }
 
     return 0;
@@ -254,8 +542,6 @@ static int mk_security_check_hotlink(mk_ptr_t url, mk_ptr_t host,
     unsigned int domains_matched = 0;
     int i = 0;
     const char *curA, *curB;
-    struct mk_list *head;
-    struct mk_secure_deny_hotlink_t *entry;
 
     if (ref_host.data == NULL) {
         return 0;
@@ -265,14 +551,7 @@ static int mk_security_check_hotlink(mk_ptr_t url, mk_ptr_t host,
         return -1;
     }
 
-    mk_list_foreach(head, &mk_secure_url) {
-        entry = mk_list_entry(head, struct mk_secure_deny_hotlink_t, _head);
-        i = mk_api->str_search_n(url.data, entry->criteria, MK_STR_INSENSITIVE, url.len);
-        if (i >= 0) {
-            break;
-        }
-    }
-    if (i < 0) {
+    if (mk_security_rules_match(&mk_secure_deny_hotlink, url) == MK_FALSE) {
         return 0;
     }
 
@@ -314,10 +593,13 @@ int mk_mandril_plugin_init(struct plugin_api **api, char *confdir)
 {
     mk_api = *api;
 
-    /* Init security lists */
-    mk_list_init(&mk_secure_ip);
-    mk_list_init(&mk_secure_url);
-    mk_list_init(&mk_secure_deny_hotlink);
+    /* Init security rules */
+    memset(&mk_secure_ip4, '\0', sizeof(mk_secure_ip4));
+    memset(&mk_secure_ip6, '\0', sizeof(mk_secure_ip6));
+    mk_secure_ip4.bits = 32;
+    mk_secure_ip6.bits = 128;
+    memset(&mk_secure_url, '\0', sizeof(mk_secure_url));
+    memset(&mk_secure_deny_hotlink, '\0', sizeof(mk_secure_deny_hotlink));
 
     /* Read configuration */
     mk_security_conf(confdir);
@@ -326,17 +608,34 @@ int mk_mandril_plugin_init(struct plugin_api **api, char *confdir)
 
 int mk_mandril_plugin_exit()
 {
+    mk_api->mem_free(mk_secure_ip4.nodes);
+    mk_api->mem_free(mk_secure_ip6.nodes);
+    mk_security_rules_free(&mk_secure_url);
+    mk_security_rules_free(&mk_secure_deny_hotlink);
+    mk_rate_exit();
     return 0;
 }
 
-int mk_mandril_stage10(int socket)
+void mk_mandril_worker_init()
+{
+    mk_rate_worker_init();
+}
+
+int mk_mandril_stage10(int socket, union mk_socket_addr *addr)
 {
     /* Validate ip address with Mandril rules */
-    if (mk_security_check_ip(socket) != 0) {
+    if (mk_security_check_ip(socket, addr) != 0) {
         PLUGIN_TRACE("[FD %i] Mandril close connection", socket);
         return MK_PLUGIN_RET_CLOSE_CONX;
     }
 
+    /* New connections per second from this client */
+    if (mk_rate_enabled(MK_RATE_CONNECTION) &&
+        mk_rate_check(addr, MK_RATE_CONNECTION) != 0) {
+        PLUGIN_TRACE("[FD %i] Mandril connection rate exceeded", socket);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
     return MK_PLUGIN_RET_CONTINUE;
 }
 
@@ -353,6 +652,14 @@ int mk_mandril_stage30(struct mk_plugin *p,
 
     struct mk_http_header *header;
 
+    if (mk_rate_enabled(MK_RATE_REQUEST) &&
+        mk_rate_check(&cs->conn->peer, MK_RATE_REQUEST) != 0) {
+        PLUGIN_TRACE("[FD %i] Mandril request rate exceeded", cs->socket);
+        mk_api->header_add(sr, "Retry-After: 1", 14);
+        mk_api->header_set_http_status(sr, MK_CLIENT_TOO_MANY_REQUESTS);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
     PLUGIN_TRACE("[FD %i] Mandril validating URL", cs->socket);
 
     if (mk_security_check_url(sr->uri_processed) < 0) {
@@ -391,7 +698,7 @@ struct mk_plugin mk_plugin_mandril = {
 
     /* Init Levels */
     .master_init   = NULL,
-    .worker_init   = NULL,
+    .worker_init   = mk_mandril_worker_init,
 
     /* Type */
     .stage         = &mk_plugin_stage_mandril
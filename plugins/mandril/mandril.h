@@ -22,36 +22,55 @@
 #ifndef MK_SECURITY_H
 #define MK_SECURITY_H
 
-struct mk_secure_ip_t
+/*
+ * IP rules are compiled into a binary trie per address family, one bit
+ * per level, so a lookup costs at most 32 (IPv4) or 128 (IPv6) steps no
+ * matter how many rules are loaded. Nodes live in a flat array and link
+ * by index, the root is node 0 so a zero child means 'no child'.
+ */
+struct mk_secure_ip_node
 {
-    struct in_addr ip;
-
-    /* if subnet is true, next fields are populated */
-    int is_subnet;
-
-    int network;
-    int netmask;
-    unsigned int hostmin;
-    unsigned int hostmax;
+    uint32_t child[2];
+    uint32_t deny;
+};
 
-    /* list head linker */
-    struct mk_list _head;
+struct mk_secure_ip_trie
+{
+    int bits;                           /* address length in bits */
+    unsigned int rules;                 /* number of rules loaded */
+    unsigned int n_nodes;
+    unsigned int size;
+    struct mk_secure_ip_node *nodes;
 };
 
-struct mk_secure_url_t
+/*
+ * URL rules are compiled into an Aho-Corasick automaton, the URI is
+ * scanned once whatever the number of rules. The transitions are stored
+ * as a full table of n_states x n_classes, where a class is a (case
+ * folded) byte used by some rule and class 0 stands for any other byte.
+ */
+struct mk_secure_ac
 {
-    char *criteria;
-    struct mk_list _head;
+    int anchored;                       /* match at the start only      */
+    unsigned int n_states;
+    unsigned int n_classes;
+    unsigned char classes[256];         /* byte -> class                */
+    uint32_t *next;                     /* transitions                  */
+    unsigned char *out;                 /* a rule ends on this state    */
 };
 
-struct mk_secure_deny_hotlink_t
+struct mk_secure_rules
 {
-    char *criteria;
-    struct mk_list _head;
+    int n_rules;
+    int size;
+    char **rules;                       /* only used while loading      */
+    struct mk_secure_ac any;            /* rules matching anywhere      */
+    struct mk_secure_ac prefix;         /* '^' rules, URI prefixes      */
 };
 
-struct mk_list mk_secure_ip;
-struct mk_list mk_secure_url;
-struct mk_list mk_secure_deny_hotlink;
+struct mk_secure_ip_trie mk_secure_ip4;
+struct mk_secure_ip_trie mk_secure_ip6;
+struct mk_secure_rules mk_secure_url;
+struct mk_secure_rules mk_secure_deny_hotlink;
 
 #endif
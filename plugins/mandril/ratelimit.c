@@ -0,0 +1,349 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "ratelimit.h"
+
+#include <time.h>
+#include <netinet/in.h>
+
+/*
+ * Rate limiting
+ * =============
+ * Every client IP owns two token buckets: one for new connections (checked
+ * at stage 10, the connection is dropped) and one for requests (checked at
+ * stage 30, the client gets a 429). The buckets live in a set associative
+ * table of fixed size: by default each worker owns one, so there are no
+ * locks at all, which means a client spreading its connections across the
+ * workers can get up to 'workers' times the configured rate. With 'Shared'
+ * enabled all the workers use the same table and every set is protected by
+ * a spinlock.
+ */
+
+struct mk_rate_config mk_rate_conf;
+
+static pthread_key_t rate_key;
+static struct mk_rate_table *rate_shared;
+
+static inline uint64_t mk_rate_now()
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    /* Never 0, it flags an unused entry */
+    return (ts.tv_sec * 1000) + (ts.tv_nsec / 1000000) + 1;
+}
+
+static inline unsigned int mk_rate_hash(unsigned char *ip)
+{
+    uint64_t a;
+    uint64_t b;
+
+    memcpy(&a, ip, sizeof(a));
+    memcpy(&b, ip + 8, sizeof(b));
+
+    a ^= b * 0x9e3779b97f4a7c15ULL;
+    a ^= a >> 29;
+    a *= 0xbf58476d1ce4e5b9ULL;
+    a ^= a >> 32;
+
+    return (unsigned int) a;
+}
+
+static struct mk_rate_table *mk_rate_table_create(int shared)
+{
+    unsigned int i;
+    unsigned int sets;
+    struct mk_rate_table *table;
+
+    table = mk_api->mem_alloc_z(sizeof(struct mk_rate_table));
+    if (!table) {
+        return NULL;
+    }
+
+    sets = mk_rate_conf.clients / MK_RATE_WAYS;
+    table->mask = sets - 1;
+    table->entries = mk_api->mem_alloc_z(sizeof(struct mk_rate_entry) *
+                                         mk_rate_conf.clients);
+    if (!table->entries) {
+        mk_api->mem_free(table);
+        return NULL;
+    }
+
+    if (shared) {
+        table->locks = mk_api->mem_alloc(sizeof(pthread_spinlock_t) * sets);
+        if (!table->locks) {
+            mk_api->mem_free(table->entries);
+            mk_api->mem_free(table);
+            return NULL;
+        }
+        for (i = 0; i < sets; i++) {
+            pthread_spin_init(&table->locks[i], PTHREAD_PROCESS_PRIVATE);
+        }
+    }
+
+    return table;
+}
+
+static void mk_rate_table_destroy(struct mk_rate_table *table)
+{
+    mk_api->mem_free((void *) table->locks);
+    mk_api->mem_free(table->entries);
+    mk_api->mem_free(table);
+}
+
+/* Read an optional numeric key, 'def' if it is not set */
+static long mk_rate_conf_num(struct mk_rconf_section *section, char *key,
+                             long def)
+{
+    char *tmp;
+
+    tmp = mk_api->config_section_get_key(section, key, MK_RCONF_STR);
+    if (!tmp) {
+        return def;
+    }
+    mk_api->mem_free(tmp);
+
+    return (long) mk_api->config_section_get_key(section, key, MK_RCONF_NUM);
+}
+
+static int mk_rate_conf_limit(struct mk_rconf_section *section,
+                              struct mk_rate_limit *limit,
+                              char *key_rate, char *key_burst)
+{
+    long rate;
+    long burst;
+
+    rate = mk_rate_conf_num(section, key_rate, 0);
+    burst = mk_rate_conf_num(section, key_burst, rate);
+
+    if (rate < 0 || rate > 1000000 || burst < rate || burst > 1000000) {
+        mk_warn("Mandril: invalid %s/%s values in LIMITS section",
+                key_rate, key_burst);
+        return -1;
+    }
+
+    limit->rate  = rate;
+    limit->burst = burst;
+    return 0;
+}
+
+int mk_rate_conf_read(struct mk_rconf *conf)
+{
+    long clients;
+    unsigned int n;
+    char *tmp;
+    struct mk_rconf_section *section;
+
+    memset(&mk_rate_conf, '\0', sizeof(mk_rate_conf));
+    pthread_key_create(&rate_key, NULL);
+
+    section = mk_api->config_section_get(conf, "LIMITS");
+    if (!section) {
+        return 0;
+    }
+
+    if (mk_rate_conf_limit(section, &mk_rate_conf.limits[MK_RATE_CONNECTION],
+                           "Connections", "ConnectionsBurst") != 0 ||
+        mk_rate_conf_limit(section, &mk_rate_conf.limits[MK_RATE_REQUEST],
+                           "Requests", "RequestsBurst") != 0) {
+        memset(&mk_rate_conf, '\0', sizeof(mk_rate_conf));
+        return -1;
+    }
+
+    /* A power of two number of sets */
+    clients = mk_rate_conf_num(section, "Clients", MK_RATE_CLIENTS);
+    if (clients < MK_RATE_WAYS) {
+        clients = MK_RATE_WAYS;
+    }
+    for (n = MK_RATE_WAYS; n < clients && n < (1U << 30); n <<= 1);
+    mk_rate_conf.clients = n;
+
+    tmp = mk_api->config_section_get_key(section, "Shared", MK_RCONF_STR);
+    if (tmp) {
+        mk_api->mem_free(tmp);
+        mk_rate_conf.shared = (long) mk_api->config_section_get_key(section,
+                                                                    "Shared",
+                                                                    MK_RCONF_BOOL);
+    }
+
+    if (!mk_rate_enabled(MK_RATE_CONNECTION) &&
+        !mk_rate_enabled(MK_RATE_REQUEST)) {
+        return 0;
+    }
+
+    if (mk_rate_conf.shared == MK_TRUE) {
+        rate_shared = mk_rate_table_create(MK_TRUE);
+        if (!rate_shared) {
+            return -1;
+        }
+    }
+
+    PLUGIN_TRACE("rate limits: %u conn/s (burst %u), %u req/s (burst %u), "
+                 "%u clients, shared=%i",
+                 mk_rate_conf.limits[0].rate, mk_rate_conf.limits[0].burst,
+                 mk_rate_conf.limits[1].rate, mk_rate_conf.limits[1].burst,
+                 mk_rate_conf.clients, mk_rate_conf.shared);
+    return 0;
+}
+
+int mk_rate_worker_init()
+{
+    struct mk_rate_table *table;
+
+    if (!mk_rate_enabled(MK_RATE_CONNECTION) &&
+        !mk_rate_enabled(MK_RATE_REQUEST)) {
+        return 0;
+    }
+
+    if (rate_shared) {
+        table = rate_shared;
+    }
+    else {
+        table = mk_rate_table_create(MK_FALSE);
+        if (!table) {
+            mk_err("Mandril: cannot allocate the rate limit table");
+            return -1;
+        }
+    }
+
+    pthread_setspecific(rate_key, table);
+    return 0;
+}
+
+void mk_rate_exit()
+{
+    if (rate_shared) {
+        mk_rate_table_destroy(rate_shared);
+        rate_shared = NULL;
+    }
+}
+
+/* Refill the buckets of the entry */
+static inline void mk_rate_refill(struct mk_rate_entry *e, uint64_t now)
+{
+    int i;
+    uint64_t tokens;
+    uint64_t elapsed;
+    struct mk_rate_limit *limit;
+
+    elapsed = now - e->last;
+    if (elapsed == 0) {
+        return;
+    }
+
+    for (i = 0; i < 2; i++) {
+        limit = &mk_rate_conf.limits[i];
+        if (limit->rate == 0) {
+            continue;
+        }
+
+        /* rate per second = rate thousandths per msec */
+        tokens = e->tokens[i] + (elapsed * limit->rate);
+        if (tokens > (uint64_t) limit->burst * MK_RATE_UNIT) {
+            tokens = (uint64_t) limit->burst * MK_RATE_UNIT;
+        }
+        e->tokens[i] = tokens;
+    }
+    e->last = now;
+}
+
+/* Take one token of the client bucket, returns -1 if it is empty */
+int mk_rate_check(union mk_socket_addr *addr, int type)
+{
+    int i;
+    int ret;
+    unsigned int set;
+    unsigned char ip[16];
+    uint64_t now;
+    struct mk_rate_entry *e;
+    struct mk_rate_entry *entries;
+    struct mk_rate_entry *victim;
+    struct mk_rate_table *table;
+
+    table = pthread_getspecific(rate_key);
+    if (!table) {
+        return 0;
+    }
+
+    if (addr->sa.sa_family == AF_INET) {
+        memset(ip, '\0', 10);
+        ip[10] = 0xff;
+        ip[11] = 0xff;
+        memcpy(ip + 12, &addr->in4.sin_addr, 4);
+    }
+    else if (addr->sa.sa_family == AF_INET6) {
+        memcpy(ip, &addr->in6.sin6_addr, 16);
+    }
+    else {
+        return 0;
+    }
+
+    now = mk_rate_now();
+    set = mk_rate_hash(ip) & table->mask;
+    entries = &table->entries[set * MK_RATE_WAYS];
+
+    if (table->locks) {
+        pthread_spin_lock(&table->locks[set]);
+    }
+
+    e = NULL;
+    victim = &entries[0];
+    for (i = 0; i < MK_RATE_WAYS; i++) {
+        if (entries[i].last != 0 && memcmp(entries[i].ip, ip, 16) == 0) {
+            e = &entries[i];
+            break;
+        }
+        if (entries[i].last < victim->last) {
+            victim = &entries[i];
+        }
+    }
+
+    if (e) {
+        mk_rate_refill(e, now);
+    }
+    else {
+        /* New client, or seen so long ago that it was recycled */
+        e = victim;
+        memcpy(e->ip, ip, 16);
+        e->last = now;
+        e->tokens[MK_RATE_CONNECTION] =
+            mk_rate_conf.limits[MK_RATE_CONNECTION].burst * MK_RATE_UNIT;
+        e->tokens[MK_RATE_REQUEST] =
+            mk_rate_conf.limits[MK_RATE_REQUEST].burst * MK_RATE_UNIT;
+    }
+
+    if (e->tokens[type] >= MK_RATE_UNIT) {
+        e->tokens[type] -= MK_RATE_UNIT;
+        ret = 0;
+    }
+    else {
+        ret = -1;
+    }
+
+    if (table->locks) {
+        pthread_spin_unlock(&table->locks[set]);
+    }
+
+    return ret;
+}
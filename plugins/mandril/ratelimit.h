@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_MANDRIL_RATELIMIT_H
+#define MK_MANDRIL_RATELIMIT_H
+
+#include <monkey/mk_api.h>
+
+/* Default number of clients tracked by each table */
+#define MK_RATE_CLIENTS       4096
+
+/* Entries per bucket set, the oldest one is recycled */
+#define MK_RATE_WAYS          4
+
+/* Tokens are accounted in thousandths */
+#define MK_RATE_UNIT          1000
+
+/* Which limit to apply */
+#define MK_RATE_CONNECTION    0
+#define MK_RATE_REQUEST       1
+
+struct mk_rate_limit {
+    unsigned int rate;                  /* tokens per second, 0 = off  */
+    unsigned int burst;                 /* bucket size                 */
+};
+
+struct mk_rate_config {
+    struct mk_rate_limit limits[2];     /* indexed by MK_RATE_*        */
+    unsigned int clients;               /* entries per table           */
+    int shared;                         /* one table for all workers   */
+};
+
+/*
+ * A client: the two token buckets are refilled together every time any
+ * of them is used, 'last' is the time of the last refill. An entry that
+ * has been idle long enough to refill both buckets is as good as a new
+ * one, so there is no need to expire them; when a set is full the least
+ * recently seen entry is recycled.
+ */
+struct mk_rate_entry {
+    unsigned char ip[16];               /* IPv4 as IPv4-mapped IPv6    */
+    uint64_t last;                      /* msec, 0 = unused            */
+    uint32_t tokens[2];                 /* indexed by MK_RATE_*        */
+};
+
+struct mk_rate_table {
+    unsigned int mask;                  /* number of sets - 1          */
+    struct mk_rate_entry *entries;
+    pthread_spinlock_t *locks;          /* one per set, shared only    */
+};
+
+extern struct mk_rate_config mk_rate_conf;
+
+int mk_rate_conf_read(struct mk_rconf *conf);
+int mk_rate_worker_init();
+void mk_rate_exit();
+int mk_rate_check(union mk_socket_addr *addr, int type);
+
+static inline int mk_rate_enabled(int type)
+{
+    return (mk_rate_conf.limits[type].rate > 0);
+}
+
+#endif
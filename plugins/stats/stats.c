@@ -0,0 +1,457 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Stats plugin
+ * ============
+ * This is a stage30 handler. It must be mapped on the virtual host
+ * [HANDLERS] section, e.g:
+ *
+ *   [HANDLERS]
+ *       Match ^/stats$ stats
+ *
+ * Like any other handler it only runs when the path exists on the document
+ * root, an empty file named 'stats' is enough.
+ *
+ * The worker counters and latency histograms are read lock-free and
+ * merged at request time, so a scrape never blocks the workers.
+ *
+ * If the handler gets the 'prometheus' parameter the output uses the
+ * Prometheus text exposition format instead of JSON:
+ *
+ *   [HANDLERS]
+ *       Match ^/metrics$ stats prometheus
+ */
+
+#include <monkey/mk_api.h>
+
+#include <stdarg.h>
+
+#include "stats.h"
+
+static time_t mk_stats_init_time;
+static const mk_ptr_t mk_stats_json_mime = mk_ptr_init(MK_STATS_JSON_MIME);
+static const mk_ptr_t mk_stats_prom_mime = mk_ptr_init(MK_STATS_PROM_MIME);
+
+static void mk_stats_buf_add(struct mk_stats_buf *buf, const char *fmt, ...)
+{
+    int len;
+    size_t avail;
+    va_list ap;
+
+    avail = buf->size - buf->len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf->data + buf->len, avail, fmt, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        return;
+    }
+
+    if ((size_t) len >= avail) {
+        len = avail - 1;
+    }
+    buf->len += len;
+}
+
+static void mk_stats_json_workers(struct mk_stats_buf *buf)
+{
+    int i;
+    unsigned long long accepted;
+    unsigned long long closed;
+    struct mk_sched_worker *node;
+
+    node = mk_api->sched_list;
+
+    mk_stats_buf_add(buf, "\"workers\":[");
+    for (i = 0; i < mk_api->config->workers; i++) {
+        closed   = mk_sched_counter_get(&node[i].closed_connections);
+        accepted = mk_sched_counter_get(&node[i].accepted_connections);
+
+        mk_stats_buf_add(buf,
+                         "%s{\"id\":%i,\"accepted\":%llu,\"closed\":%llu,"
+                         "\"active\":%llu,\"over_capacity\":%llu}",
+                         i > 0 ? "," : "",
+                         node[i].idx, accepted, closed, accepted - closed,
+                         mk_sched_counter_get(&node[i].over_capacity));
+    }
+    mk_stats_buf_add(buf, "]");
+}
+
+static void mk_stats_json_counters(struct mk_stats_buf *buf)
+{
+    int i;
+
+    mk_stats_buf_add(buf, "\"counters\":{");
+    for (i = 0; i < MK_METRICS_COUNTERS; i++) {
+        mk_stats_buf_add(buf, "%s\"%s\":%llu",
+                         i > 0 ? "," : "",
+                         mk_api->metrics_name(i),
+                         (unsigned long long) mk_api->metrics_total(i));
+    }
+    mk_stats_buf_add(buf, "}");
+}
+
+static void mk_stats_json_latency(struct mk_stats_buf *buf)
+{
+    int i;
+    struct mk_latency_summary s;
+
+    mk_stats_buf_add(buf, "\"latency_ns\":{");
+    for (i = 0; i < MK_LATENCY_TYPES; i++) {
+        if (mk_api->latency_summary(i, &s) != 0) {
+            memset(&s, '\0', sizeof(s));
+        }
+
+        mk_stats_buf_add(buf,
+                         "%s\"%s\":{\"count\":%lu,\"min\":%lu,\"mean\":%lu,"
+                         "\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"p999\":%lu,"
+                         "\"max\":%lu}",
+                         i > 0 ? "," : "",
+                         mk_api->latency_name(i),
+                         (unsigned long) s.count, (unsigned long) s.min,
+                         (unsigned long) s.mean, (unsigned long) s.p50,
+                         (unsigned long) s.p90, (unsigned long) s.p99,
+                         (unsigned long) s.p999, (unsigned long) s.max);
+    }
+    mk_stats_buf_add(buf, "}");
+}
+
+static int mk_stats_json(struct mk_stats_buf *buf)
+{
+    mk_stats_buf_add(buf, "{\"uptime\":%lu,",
+                     (unsigned long) (time(NULL) - mk_stats_init_time));
+    mk_stats_json_workers(buf);
+    mk_stats_buf_add(buf, ",");
+    mk_stats_json_counters(buf);
+    mk_stats_buf_add(buf, ",");
+    mk_stats_json_latency(buf);
+    mk_stats_buf_add(buf, "}\n");
+
+    return 0;
+}
+
+static void mk_stats_prom_header(struct mk_stats_buf *buf,
+                                 const char *name, const char *type,
+                                 const char *help)
+{
+    mk_stats_buf_add(buf, "# HELP monkey_%s %s\n# TYPE monkey_%s %s\n",
+                     name, help, name, type);
+}
+
+/* One sample per worker for the given core metric */
+static void mk_stats_prom_counter(struct mk_stats_buf *buf, const char *name,
+                                  const char *labels, int id)
+{
+    int i;
+
+    for (i = 0; i < mk_api->config->workers; i++) {
+        mk_stats_buf_add(buf, "monkey_%s{worker=\"%i\"%s} %llu\n",
+                         name, i, labels,
+                         (unsigned long long) mk_api->metrics_worker(i, id));
+    }
+}
+
+static void mk_stats_prom_ratio(struct mk_stats_buf *buf, const char *name,
+                                const char *help, int hits_id, int misses_id)
+{
+    double ratio = 0.0;
+    uint64_t hits;
+    uint64_t misses;
+
+    hits   = mk_api->metrics_total(hits_id);
+    misses = mk_api->metrics_total(misses_id);
+    if (hits + misses > 0) {
+        ratio = (double) hits / (double) (hits + misses);
+    }
+
+    mk_stats_prom_header(buf, name, "gauge", help);
+    mk_stats_buf_add(buf, "monkey_%s %.6f\n", name, ratio);
+}
+
+static void mk_stats_prom_workers(struct mk_stats_buf *buf)
+{
+    int i;
+    unsigned long long accepted;
+    unsigned long long closed;
+    struct mk_sched_worker *node;
+
+    node = mk_api->sched_list;
+
+    mk_stats_prom_header(buf, "connections_accepted_total", "counter",
+                         "Connections accepted by the worker.");
+    for (i = 0; i < mk_api->config->workers; i++) {
+        accepted = mk_sched_counter_get(&node[i].accepted_connections);
+        mk_stats_buf_add(buf,
+                         "monkey_connections_accepted_total{worker=\"%i\"} "
+                         "%llu\n", i, accepted);
+    }
+
+    mk_stats_prom_header(buf, "connections_closed_total", "counter",
+                         "Connections closed by the worker.");
+    for (i = 0; i < mk_api->config->workers; i++) {
+        closed = mk_sched_counter_get(&node[i].closed_connections);
+        mk_stats_buf_add(buf,
+                         "monkey_connections_closed_total{worker=\"%i\"} "
+                         "%llu\n", i, closed);
+    }
+
+    mk_stats_prom_header(buf, "connections_active", "gauge",
+                         "Connections currently handled by the worker.");
+    for (i = 0; i < mk_api->config->workers; i++) {
+        mk_stats_buf_add(buf,
+                         "monkey_connections_active{worker=\"%i\"} %llu\n",
+                         i, mk_sched_active(&node[i]));
+    }
+
+    mk_stats_prom_header(buf, "connections_over_capacity_total", "counter",
+                         "Connections dropped due to worker capacity.");
+    for (i = 0; i < mk_api->config->workers; i++) {
+        mk_stats_buf_add(buf,
+                         "monkey_connections_over_capacity_total"
+                         "{worker=\"%i\"} %llu\n", i,
+                         mk_sched_counter_get(&node[i].over_capacity));
+    }
+}
+
+static void mk_stats_prom_counters(struct mk_stats_buf *buf)
+{
+    int i;
+    char labels[32];
+
+    mk_stats_prom_header(buf, "requests_total", "counter",
+                         "Finished requests by HTTP status class.");
+    for (i = MK_METRICS_STATUS_1XX; i <= MK_METRICS_STATUS_5XX; i++) {
+        snprintf(labels, sizeof(labels), ",class=\"%ixx\"",
+                 i - MK_METRICS_STATUS_1XX + 1);
+        mk_stats_prom_counter(buf, "requests_total", labels, i);
+    }
+
+    mk_stats_prom_header(buf, "bytes_sent_total", "counter",
+                         "Bytes written to the clients.");
+    mk_stats_prom_counter(buf, "bytes_sent_total", "", MK_METRICS_BYTES_SENT);
+
+    mk_stats_prom_header(buf, "parser_errors_total", "counter",
+                         "Requests rejected by the HTTP parser.");
+    mk_stats_prom_counter(buf, "parser_errors_total", "",
+                          MK_METRICS_PARSER_ERRORS);
+
+    mk_stats_prom_header(buf, "timeouts_total", "counter",
+                         "Connections closed due to timeout.");
+    mk_stats_prom_counter(buf, "timeouts_total", "", MK_METRICS_TIMEOUTS);
+
+    mk_stats_prom_header(buf, "fdt_lookups_total", "counter",
+                         "File descriptor table lookups.");
+    mk_stats_prom_counter(buf, "fdt_lookups_total", ",result=\"hit\"",
+                          MK_METRICS_FDT_HITS);
+    mk_stats_prom_counter(buf, "fdt_lookups_total", ",result=\"miss\"",
+                          MK_METRICS_FDT_MISSES);
+    mk_stats_prom_ratio(buf, "fdt_hit_ratio",
+                        "File descriptor table hit ratio.",
+                        MK_METRICS_FDT_HITS, MK_METRICS_FDT_MISSES);
+
+    mk_stats_prom_header(buf, "cache_lookups_total", "counter",
+                         "Date text cache lookups.");
+    mk_stats_prom_counter(buf, "cache_lookups_total", ",result=\"hit\"",
+                          MK_METRICS_CACHE_HITS);
+    mk_stats_prom_counter(buf, "cache_lookups_total", ",result=\"miss\"",
+                          MK_METRICS_CACHE_MISSES);
+    mk_stats_prom_ratio(buf, "cache_hit_ratio", "Date text cache hit ratio.",
+                        MK_METRICS_CACHE_HITS, MK_METRICS_CACHE_MISSES);
+
+    mk_stats_prom_header(buf, "tls_handshakes_total", "counter",
+                         "Completed TLS handshakes.");
+    mk_stats_prom_counter(buf, "tls_handshakes_total", "",
+                          MK_METRICS_TLS_HANDSHAKES);
+}
+
+static void mk_stats_prom_latency(struct mk_stats_buf *buf)
+{
+    int i;
+    int q;
+    const char *name;
+    struct mk_latency_histogram *h;
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    h = mk_api->mem_alloc(sizeof(struct mk_latency_histogram));
+    if (!h) {
+        return;
+    }
+
+    mk_stats_prom_header(buf, "request_latency_seconds", "summary",
+                         "Request latency by phase.");
+    for (i = 0; i < MK_LATENCY_TYPES; i++) {
+        if (mk_api->latency_merge(i, h) != 0) {
+            continue;
+        }
+
+        name = mk_api->latency_name(i);
+        for (q = 0; q < (int) (sizeof(quantiles) / sizeof(double)); q++) {
+            mk_stats_buf_add(buf,
+                             "monkey_request_latency_seconds"
+                             "{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                             name, quantiles[q],
+                             mk_api->latency_percentile(h, quantiles[q] * 100)
+                             / 1e9);
+        }
+        mk_stats_buf_add(buf,
+                         "monkey_request_latency_seconds_sum{phase=\"%s\"} "
+                         "%.9f\n", name, h->sum / 1e9);
+        mk_stats_buf_add(buf,
+                         "monkey_request_latency_seconds_count{phase=\"%s\"} "
+                         "%llu\n", name, (unsigned long long) h->count);
+    }
+
+    mk_api->mem_free(h);
+}
+
+static int mk_stats_prometheus(struct mk_stats_buf *buf)
+{
+    mk_stats_prom_header(buf, "uptime_seconds", "gauge",
+                         "Seconds since the server started.");
+    mk_stats_buf_add(buf, "monkey_uptime_seconds %lu\n",
+                     (unsigned long) (time(NULL) - mk_stats_init_time));
+
+    mk_stats_prom_workers(buf);
+    mk_stats_prom_counters(buf);
+    mk_stats_prom_latency(buf);
+
+    return 0;
+}
+
+/* Check if the handler was mapped with the 'prometheus' parameter */
+static int mk_stats_is_prometheus(int n_params, struct mk_list *params)
+{
+    struct mk_handler_param *param;
+
+    if (n_params < 1) {
+        return MK_FALSE;
+    }
+
+    param = mk_list_entry_first(params, struct mk_handler_param, _head);
+    if (param->p.len == sizeof(MK_STATS_PROM_PARAM) - 1 &&
+        strncasecmp(param->p.data, MK_STATS_PROM_PARAM, param->p.len) == 0) {
+        return MK_TRUE;
+    }
+
+    return MK_FALSE;
+}
+
+int mk_stats_stage30(struct mk_plugin *plugin,
+                     struct mk_http_session *cs,
+                     struct mk_http_request *sr,
+                     int n_params,
+                     struct mk_list *params)
+{
+    int prometheus;
+    struct mk_stats_buf buf;
+    (void) plugin;
+
+    if (sr->method != MK_METHOD_GET && sr->method != MK_METHOD_HEAD) {
+        mk_api->header_set_http_status(sr, MK_CLIENT_METHOD_NOT_ALLOWED);
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    prometheus = mk_stats_is_prometheus(n_params, params);
+    if (prometheus == MK_TRUE) {
+        buf.size = MK_STATS_PROM_BASE +
+            (MK_STATS_PROM_WORKER * mk_api->config->workers);
+    }
+    else {
+        buf.size = MK_STATS_BUF_BASE +
+            (MK_STATS_BUF_WORKER * mk_api->config->workers);
+    }
+    buf.data = mk_api->mem_alloc(buf.size);
+    buf.len  = 0;
+    if (!buf.data) {
+        return MK_PLUGIN_RET_CLOSE_CONX;
+    }
+
+    if (prometheus == MK_TRUE) {
+        mk_stats_prometheus(&buf);
+        sr->headers.content_type = mk_stats_prom_mime;
+    }
+    else {
+        mk_stats_json(&buf);
+        sr->headers.content_type = mk_stats_json_mime;
+    }
+
+    mk_api->header_set_http_status(sr, MK_HTTP_OK);
+    sr->headers.content_length = buf.len;
+    mk_api->header_prepare(cs, sr);
+
+    if (sr->method == MK_METHOD_GET) {
+        mk_api->stream_set(NULL, MK_STREAM_COPYBUF, cs->channel,
+                           buf.data, buf.len, NULL, NULL, NULL, NULL);
+    }
+    mk_api->mem_free(buf.data);
+
+    return MK_PLUGIN_RET_END;
+}
+
+int mk_stats_stage30_hangup(struct mk_plugin *plugin,
+                            struct mk_http_session *cs,
+                            struct mk_http_request *sr)
+{
+    (void) plugin;
+    (void) cs;
+    (void) sr;
+
+    return 0;
+}
+
+int mk_stats_plugin_init(struct plugin_api **api, char *confdir)
+{
+    (void) confdir;
+
+    mk_api = *api;
+    mk_stats_init_time = time(NULL);
+
+    return 0;
+}
+
+int mk_stats_plugin_exit()
+{
+    return 0;
+}
+
+struct mk_plugin_stage mk_plugin_stage_stats = {
+    .stage30        = &mk_stats_stage30,
+    .stage30_hangup = &mk_stats_stage30_hangup
+};
+
+struct mk_plugin mk_plugin_stats = {
+    /* Identification */
+    .shortname     = "stats",
+    .name          = "Server Statistics",
+    .version       = MK_VERSION_STR,
+    .hooks         = MK_PLUGIN_STAGE,
+
+    /* Init / Exit */
+    .init_plugin   = mk_stats_plugin_init,
+    .exit_plugin   = mk_stats_plugin_exit,
+
+    /* Init Levels */
+    .master_init   = NULL,
+    .worker_init   = NULL,
+
+    /* Type */
+    .stage         = &mk_plugin_stage_stats
+};
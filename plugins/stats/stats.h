@@ -0,0 +1,42 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+
+/*  Monkey HTTP Server
+ *  ==================
+ *  Copyright 2001-2015 Monkey Software LLC <eduardo@monkey.io>
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef MK_STATS_H
+#define MK_STATS_H
+
+#define MK_STATS_JSON_MIME     "Content-Type: application/json\r\n"
+#define MK_STATS_PROM_MIME     "Content-Type: text/plain; version=0.0.4\r\n"
+
+/* Handler parameter to switch to the Prometheus text format */
+#define MK_STATS_PROM_PARAM    "prometheus"
+
+/* Response buffer: fixed part plus the space required per worker */
+#define MK_STATS_BUF_BASE      2048
+#define MK_STATS_BUF_WORKER    192
+#define MK_STATS_PROM_BASE     8192
+#define MK_STATS_PROM_WORKER   2048
+
+/* Response body being composed */
+struct mk_stats_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+#endif
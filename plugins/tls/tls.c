@@ -518,6 +518,7 @@ static int context_unset(int fd, mbedtls_ssl_context *ssl)
 
 int mk_tls_read(int fd, void *buf, int count)
 {
+    int handshake;
     size_t avail;
     mbedtls_ssl_context *ssl = context_get(fd);
 
@@ -525,7 +526,13 @@ int mk_tls_read(int fd, void *buf, int count)
         ssl = context_new(fd);
     }
 
+    /* The handshake is driven by the first reads on the connection */
+    handshake = (ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER);
+
     int ret = handle_return(mbedtls_ssl_read(ssl, buf, count));
+    if (handshake && ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER) {
+        mk_api->metrics_add(MK_METRICS_TLS_HANDSHAKES, 1);
+    }
     PLUGIN_TRACE("IN: %i SSL READ: %i ; CORE COUNT: %i",
                  ssl->in_msglen,
                  ret, count);
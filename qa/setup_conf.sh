@@ -0,0 +1,40 @@
+#!/bin/sh
+# Some cases need plugins and rules that the default configuration does
+# not enable. This script adds them to a configuration directory created
+# by the build, e.g:
+#
+#   ./setup_conf.sh ../build/conf
+#
+# Run it once on a fresh configuration and restart Monkey before running
+# the tests.
+
+CONF_DIR=$1
+SITE="$CONF_DIR/sites/default"
+
+if [ -z "$CONF_DIR" ] || [ ! -f "$SITE" ]; then
+    echo "usage: $0 <monkey configuration directory>" >&2
+    exit 1
+fi
+
+if grep -q "# qa: setup_conf.sh" "$SITE"; then
+    echo "$CONF_DIR is already set up" >&2
+    exit 0
+fi
+
+# Plugins built as shared objects are listed but commented out
+sed -i -e 's/^\( *\)# *\(Load .*monkey-mandril\.so\)$/\1\2/' \
+       -e 's/^\( *\)# *\(Load .*monkey-dirlisting\.so\)$/\1\2/' \
+    "$CONF_DIR/plugins.load"
+
+# mandril_*.htt, router_priority.htt
+sed -i -e '/^\[HANDLERS\]/a\
+    # qa: setup_conf.sh\
+    Match /.* mandril\
+    Match ^/qa_route/ dirlisting' "$SITE"
+
+sed -i -e '/^\[RULES\]/a\
+    URL /qa_denied\
+    URL ^/qa_anchored\
+    IP 127.0.0.0/32\
+    IP 127.0.0.2/31\
+    deny_hotlink /qa_hotlink' "$CONF_DIR/plugins/mandril/mandril.conf"